@@ -6,16 +6,636 @@
 #include <time.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <fcntl.h>
 #if defined _WIN32
     #include "win.h"
 #else
     #include <unistd.h>
     #include <sys/mman.h>
+    #include <sys/resource.h>
+    #include <poll.h>
 #endif
+#if defined _OPENMP
+    #include <omp.h>
+#endif
+#include "tokenizer.h"
+// ----------------------------------------------------------------------------
+// SIMD kernels. the inner loops of the neural net blocks below come in scalar,
+// AVX2/FMA, AVX-512 and NEON versions; init_kernels() picks the best one the cpu
+// supports at startup, so the same binary runs everywhere without -march=native
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define KERNELS_X86
+    #include <immintrin.h>
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #include <intrin.h>
+        #define TARGET_AVX2
+        #define TARGET_AVX512
+    #else
+        #define TARGET_AVX2 __attribute__((target("avx2,fma")))
+        #define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx2,fma")))
+    #endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define KERNELS_NEON
+    #include <arm_neon.h>
+    #if defined(__linux__)
+        #include <sys/auxv.h>
+    #endif
+#endif
+
+typedef struct {
+    const char* name;
+    float (*dot)(const float* a, const float* b, int n);
+    void (*axpy)(float* y, float a, const float* x, int n); // y += a * x
+    float (*sum_exp)(float* x, float max_val, int n); // x = exp(x - max_val), returns the sum
+    // Q8_0 dot product of two rows of n values with their group scales
+    float (*dot_q8)(const int8_t* xq, const float* xs, const int8_t* wq, const float* ws, int n, int group_size);
+    void (*axpy_q8)(float* y, float a, const int8_t* x, int n); // y += a * x, x int8
+    // out (PANEL_ROWS,) = panel (PANEL_ROWS interleaved rows of n) @ x (n,), see repack_weights
+    void (*dot_panel)(float* out, const float* panel, const float* x, int n);
+    // rotate the n / 2 pairs of x by the (cos, sin) pairs in cs, see rope_row
+    void (*rope)(float* x, const float* cs, int n);
+} Kernels;
+
+#define PANEL_ROWS 8 // rows of W interleaved per panel, one AVX2 register of outputs
+
+float dot_scalar(const float* a, const float* b, int n) {
+    float val = 0.0f;
+    for (int i = 0; i < n; i++) {
+        val += a[i] * b[i];
+    }
+    return val;
+}
+
+void axpy_scalar(float* y, float a, const float* x, int n) {
+    for (int i = 0; i < n; i++) {
+        y[i] += a * x[i];
+    }
+}
+
+float sum_exp_scalar(float* x, float max_val, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        x[i] = expf(x[i] - max_val);
+        sum += x[i];
+    }
+    return sum;
+}
+
+float dot_q8_scalar(const int8_t* xq, const float* xs, const int8_t* wq, const float* ws, int n, int group_size) {
+    // the products run in int32 over each group, then get scaled once per group
+    float val = 0.0f;
+    for (int j = 0; j < n; j += group_size) {
+        int32_t ival = 0;
+        for (int k = 0; k < group_size; k++) {
+            ival += (int32_t) xq[j + k] * (int32_t) wq[j + k];
+        }
+        val += (float) ival * ws[j / group_size] * xs[j / group_size];
+    }
+    return val;
+}
+
+void axpy_q8_scalar(float* y, float a, const int8_t* x, int n) {
+    for (int i = 0; i < n; i++) {
+        y[i] += a * (float) x[i];
+    }
+}
+
+void dot_panel_scalar(float* out, const float* panel, const float* x, int n) {
+    float acc[PANEL_ROWS] = { 0.0f };
+    for (int j = 0; j < n; j++) {
+        for (int r = 0; r < PANEL_ROWS; r++) {
+            acc[r] += panel[j * PANEL_ROWS + r] * x[j];
+        }
+    }
+    memcpy(out, acc, sizeof(acc));
+}
+
+void rope_scalar(float* x, const float* cs, int n) {
+    for (int i = 0; i < n; i += 2) {
+        float v0 = x[i];
+        float v1 = x[i+1];
+        x[i]   = v0 * cs[i] - v1 * cs[i+1];
+        x[i+1] = v0 * cs[i+1] + v1 * cs[i];
+    }
+}
+
+static const Kernels kernels_scalar = { "scalar", dot_scalar, axpy_scalar, sum_exp_scalar, dot_q8_scalar, axpy_q8_scalar, dot_panel_scalar, rope_scalar };
+
+// the vector exp of the sum_exp kernels: exp(x) = 2^n * exp(r) with n = round(x / ln2)
+// and |r| <= ln2/2, exp(r) from the Cephes expf polynomial. inputs are clamped to the
+// range where 2^n stays a normal float
+#define EXP_HI 88.3762626647949f
+#define EXP_LO -87.3365478515625f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_C1 0.693359375f
+#define EXP_C2 -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+#if defined(KERNELS_X86)
+
+TARGET_AVX2 static inline float hsum_avx2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+TARGET_AVX2 float dot_avx2(const float* a, const float* b, int n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    float val = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        val += a[i] * b[i];
+    }
+    return val;
+}
+
+TARGET_AVX2 void axpy_avx2(float* y, float a, const float* x, int n) {
+    __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += a * x[i];
+    }
+}
+
+TARGET_AVX2 static inline __m256 exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_LO)), _mm256_set1_ps(EXP_HI));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(EXP_C1), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(EXP_C2), r);
+    __m256 p = _mm256_set1_ps(EXP_P0);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P1));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P2));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P3));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P4));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P5));
+    __m256 y = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+TARGET_AVX2 float sum_exp_avx2(float* x, float max_val, int n) {
+    __m256 vmax = _mm256_set1_ps(max_val);
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 e = exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x + i), vmax));
+        _mm256_storeu_ps(x + i, e);
+        acc = _mm256_add_ps(acc, e);
+    }
+    float sum = hsum_avx2(acc);
+    for (; i < n; i++) {
+        x[i] = expf(x[i] - max_val);
+        sum += x[i];
+    }
+    return sum;
+}
+
+TARGET_AVX2 float dot_q8_avx2(const int8_t* xq, const float* xs, const int8_t* wq, const float* ws, int n, int group_size) {
+    // int8 -> int16, then madd sums adjacent int16 products into int32 lanes
+    __m256 acc = _mm256_setzero_ps();
+    float tail = 0.0f;
+    for (int j = 0; j < n; j += group_size) {
+        __m256i iacc = _mm256_setzero_si256();
+        int k = 0;
+        for (; k + 16 <= group_size; k += 16) {
+            __m256i xv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(xq + j + k)));
+            __m256i wv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(wq + j + k)));
+            iacc = _mm256_add_epi32(iacc, _mm256_madd_epi16(xv, wv));
+        }
+        int32_t itail = 0;
+        for (; k < group_size; k++) {
+            itail += (int32_t) xq[j + k] * (int32_t) wq[j + k];
+        }
+        float scale = ws[j / group_size] * xs[j / group_size];
+        acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(iacc), _mm256_set1_ps(scale), acc);
+        tail += (float) itail * scale;
+    }
+    return hsum_avx2(acc) + tail;
+}
+
+TARGET_AVX2 void axpy_q8_avx2(float* y, float a, const int8_t* x, int n) {
+    // int8 -> int32 -> float, 8 lanes at a time
+    __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 xv = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(x + i))));
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, xv, _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += a * (float) x[i];
+    }
+}
+
+TARGET_AVX2 void dot_panel_avx2(float* out, const float* panel, const float* x, int n) {
+    // one lane per row: every x[j] is broadcast once and feeds all the rows of the panel
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const float* c = panel + j * PANEL_ROWS;
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(c), _mm256_set1_ps(x[j]), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(c + 8), _mm256_set1_ps(x[j + 1]), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(c + 16), _mm256_set1_ps(x[j + 2]), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(c + 24), _mm256_set1_ps(x[j + 3]), acc3);
+    }
+    for (; j < n; j++) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(panel + j * PANEL_ROWS), _mm256_set1_ps(x[j]), acc0);
+    }
+    _mm256_storeu_ps(out, _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+}
+
+TARGET_AVX512 float dot_avx512(const float* a, const float* b, int n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < n) {
+        // masked loads for the tail, the missing lanes read as zero
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+TARGET_AVX512 void axpy_avx512(float* y, float a, const float* x, int n) {
+    __m512 va = _mm512_set1_ps(a);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(y + i, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+    }
+}
+
+TARGET_AVX512 static inline __m512 exp_avx512(__m512 x) {
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_LO)), _mm512_set1_ps(EXP_HI));
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(EXP_C1), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(EXP_C2), r);
+    __m512 p = _mm512_set1_ps(EXP_P0);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P1));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P2));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P3));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P4));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P5));
+    __m512 y = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+    __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(y, _mm512_castsi512_ps(e));
+}
+
+TARGET_AVX512 float sum_exp_avx512(float* x, float max_val, int n) {
+    __m512 vmax = _mm512_set1_ps(max_val);
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 e = exp_avx512(_mm512_sub_ps(_mm512_loadu_ps(x + i), vmax));
+        _mm512_storeu_ps(x + i, e);
+        acc = _mm512_add_ps(acc, e);
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        __m512 e = exp_avx512(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, x + i), vmax));
+        _mm512_mask_storeu_ps(x + i, m, e);
+        acc = _mm512_mask_add_ps(acc, m, acc, e);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+TARGET_AVX512 float dot_q8_avx512(const int8_t* xq, const float* xs, const int8_t* wq, const float* ws, int n, int group_size) {
+    __m512 acc = _mm512_setzero_ps();
+    float tail = 0.0f;
+    for (int j = 0; j < n; j += group_size) {
+        __m512i iacc = _mm512_setzero_si512();
+        int k = 0;
+        for (; k + 32 <= group_size; k += 32) {
+            __m512i xv = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(xq + j + k)));
+            __m512i wv = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(wq + j + k)));
+            iacc = _mm512_add_epi32(iacc, _mm512_madd_epi16(xv, wv));
+        }
+        for (; k + 16 <= group_size; k += 16) {
+            __m512i xv = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(xq + j + k)));
+            __m512i wv = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(wq + j + k)));
+            iacc = _mm512_add_epi32(iacc, _mm512_mullo_epi32(xv, wv));
+        }
+        int32_t itail = 0;
+        for (; k < group_size; k++) {
+            itail += (int32_t) xq[j + k] * (int32_t) wq[j + k];
+        }
+        float scale = ws[j / group_size] * xs[j / group_size];
+        acc = _mm512_fmadd_ps(_mm512_cvtepi32_ps(iacc), _mm512_set1_ps(scale), acc);
+        tail += (float) itail * scale;
+    }
+    return _mm512_reduce_add_ps(acc) + tail;
+}
+
+TARGET_AVX512 void axpy_q8_avx512(float* y, float a, const int8_t* x, int n) {
+    __m512 va = _mm512_set1_ps(a);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 xv = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(x + i))));
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, xv, _mm512_loadu_ps(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += a * (float) x[i];
+    }
+}
+
+TARGET_AVX512 void dot_panel_avx512(float* out, const float* panel, const float* x, int n) {
+    // two columns of the panel per register, x[j] in the low and x[j + 1] in the high half
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const float* c = panel + j * PANEL_ROWS;
+        __m512 x01 = _mm512_mask_blend_ps(0xFF00, _mm512_set1_ps(x[j]), _mm512_set1_ps(x[j + 1]));
+        __m512 x23 = _mm512_mask_blend_ps(0xFF00, _mm512_set1_ps(x[j + 2]), _mm512_set1_ps(x[j + 3]));
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(c), x01, acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(c + 16), x23, acc1);
+    }
+    __m512 acc = _mm512_add_ps(acc0, acc1);
+    __m256 sum = _mm256_add_ps(_mm512_castps512_ps256(acc), _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(acc), 1)));
+    for (; j < n; j++) {
+        sum = _mm256_fmadd_ps(_mm256_loadu_ps(panel + j * PANEL_ROWS), _mm256_set1_ps(x[j]), sum);
+    }
+    _mm256_storeu_ps(out, sum);
+}
+
+TARGET_AVX2 void rope_avx2(float* x, const float* cs, int n) {
+    // 4 pairs per register: x * cos, minus (even) or plus (odd) the swapped pairs * sin
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        __m256 t = _mm256_loadu_ps(cs + i);
+        __m256 vc = _mm256_mul_ps(v, _mm256_moveldup_ps(t));
+        __m256 vs = _mm256_mul_ps(_mm256_permute_ps(v, 0xB1), _mm256_movehdup_ps(t));
+        _mm256_storeu_ps(x + i, _mm256_addsub_ps(vc, vs));
+    }
+    rope_scalar(x + i, cs + i, n - i);
+}
+
+TARGET_AVX512 void rope_avx512(float* x, const float* cs, int n) {
+    // rope_avx2 with 8 pairs per register, the subtraction goes to the even lanes
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_loadu_ps(x + i);
+        __m512 t = _mm512_loadu_ps(cs + i);
+        __m512 vc = _mm512_mul_ps(v, _mm512_moveldup_ps(t));
+        __m512 vs = _mm512_mul_ps(_mm512_permute_ps(v, 0xB1), _mm512_movehdup_ps(t));
+        _mm512_storeu_ps(x + i, _mm512_mask_sub_ps(_mm512_add_ps(vc, vs), 0x5555, vc, vs));
+    }
+    rope_scalar(x + i, cs + i, n - i);
+}
+
+static const Kernels kernels_avx2 = { "avx2", dot_avx2, axpy_avx2, sum_exp_avx2, dot_q8_avx2, axpy_q8_avx2, dot_panel_avx2, rope_avx2 };
+static const Kernels kernels_avx512 = { "avx512", dot_avx512, axpy_avx512, sum_exp_avx512, dot_q8_avx512, axpy_q8_avx512, dot_panel_avx512, rope_avx512 };
+
+#if defined(_MSC_VER) && !defined(__clang__)
+int cpu_has(int avx512) {
+    // cpuid for the instruction sets, xgetbv for the OS saving the vector registers
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7) { return 0; }
+    __cpuid(regs, 1);
+    int fma = (regs[2] >> 12) & 1;
+    int osxsave = (regs[2] >> 27) & 1;
+    if (!fma || !osxsave) { return 0; }
+    unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(regs, 7, 0);
+    if (avx512) {
+        // AVX-512F + AVX-512BW, and the opmask/zmm state enabled
+        return ((regs[1] >> 16) & 1) && ((regs[1] >> 30) & 1) && (xcr0 & 0xe6) == 0xe6;
+    }
+    return ((regs[1] >> 5) & 1) && (xcr0 & 0x6) == 0x6;
+}
+#else
+int cpu_has(int avx512) {
+    __builtin_cpu_init();
+    if (avx512) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    }
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+#elif defined(KERNELS_NEON)
+
+float dot_neon(const float* a, const float* b, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float val = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < n; i++) {
+        val += a[i] * b[i];
+    }
+    return val;
+}
+
+void axpy_neon(float* y, float a, const float* x, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(y + i, vfmaq_n_f32(vld1q_f32(y + i), vld1q_f32(x + i), a));
+    }
+    for (; i < n; i++) {
+        y[i] += a * x[i];
+    }
+}
+
+static inline float32x4_t exp_neon(float32x4_t x) {
+    x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(EXP_LO)), vdupq_n_f32(EXP_HI));
+    float32x4_t n = vrndnq_f32(vmulq_n_f32(x, EXP_LOG2E));
+    float32x4_t r = vfmsq_f32(x, n, vdupq_n_f32(EXP_C1));
+    r = vfmsq_f32(r, n, vdupq_n_f32(EXP_C2));
+    float32x4_t p = vdupq_n_f32(EXP_P0);
+    p = vfmaq_f32(vdupq_n_f32(EXP_P1), p, r);
+    p = vfmaq_f32(vdupq_n_f32(EXP_P2), p, r);
+    p = vfmaq_f32(vdupq_n_f32(EXP_P3), p, r);
+    p = vfmaq_f32(vdupq_n_f32(EXP_P4), p, r);
+    p = vfmaq_f32(vdupq_n_f32(EXP_P5), p, r);
+    float32x4_t y = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), p, vmulq_f32(r, r));
+    int32x4_t e = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+    return vmulq_f32(y, vreinterpretq_f32_s32(e));
+}
+
+float sum_exp_neon(float* x, float max_val, int n) {
+    float32x4_t vmax = vdupq_n_f32(max_val);
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t e = exp_neon(vsubq_f32(vld1q_f32(x + i), vmax));
+        vst1q_f32(x + i, e);
+        acc = vaddq_f32(acc, e);
+    }
+    float sum = vaddvq_f32(acc);
+    for (; i < n; i++) {
+        x[i] = expf(x[i] - max_val);
+        sum += x[i];
+    }
+    return sum;
+}
+
+float dot_q8_neon(const int8_t* xq, const float* xs, const int8_t* wq, const float* ws, int n, int group_size) {
+    // widening int8 multiplies into int16, pairwise accumulated into int32 lanes
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    float tail = 0.0f;
+    for (int j = 0; j < n; j += group_size) {
+        int32x4_t iacc = vdupq_n_s32(0);
+        int k = 0;
+        for (; k + 16 <= group_size; k += 16) {
+            int8x16_t xv = vld1q_s8(xq + j + k);
+            int8x16_t wv = vld1q_s8(wq + j + k);
+            iacc = vpadalq_s16(iacc, vmull_s8(vget_low_s8(xv), vget_low_s8(wv)));
+            iacc = vpadalq_s16(iacc, vmull_high_s8(xv, wv));
+        }
+        int32_t itail = 0;
+        for (; k < group_size; k++) {
+            itail += (int32_t) xq[j + k] * (int32_t) wq[j + k];
+        }
+        float scale = ws[j / group_size] * xs[j / group_size];
+        acc = vfmaq_n_f32(acc, vcvtq_f32_s32(iacc), scale);
+        tail += (float) itail * scale;
+    }
+    return vaddvq_f32(acc) + tail;
+}
+
+void axpy_q8_neon(float* y, float a, const int8_t* x, int n) {
+    // int8 -> int16 -> two int32 quads -> float
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t xv = vmovl_s8(vld1_s8(x + i));
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(xv)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_high_s16(xv));
+        vst1q_f32(y + i, vfmaq_n_f32(vld1q_f32(y + i), lo, a));
+        vst1q_f32(y + i + 4, vfmaq_n_f32(vld1q_f32(y + i + 4), hi, a));
+    }
+    for (; i < n; i++) {
+        y[i] += a * (float) x[i];
+    }
+}
+
+void dot_panel_neon(float* out, const float* panel, const float* x, int n) {
+    // two registers per column of the panel, two columns per step
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f);
+    float32x4_t acc3 = vdupq_n_f32(0.0f);
+    int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        const float* c = panel + j * PANEL_ROWS;
+        acc0 = vfmaq_n_f32(acc0, vld1q_f32(c), x[j]);
+        acc1 = vfmaq_n_f32(acc1, vld1q_f32(c + 4), x[j]);
+        acc2 = vfmaq_n_f32(acc2, vld1q_f32(c + 8), x[j + 1]);
+        acc3 = vfmaq_n_f32(acc3, vld1q_f32(c + 12), x[j + 1]);
+    }
+    for (; j < n; j++) {
+        acc0 = vfmaq_n_f32(acc0, vld1q_f32(panel + j * PANEL_ROWS), x[j]);
+        acc1 = vfmaq_n_f32(acc1, vld1q_f32(panel + j * PANEL_ROWS + 4), x[j]);
+    }
+    vst1q_f32(out, vaddq_f32(acc0, acc2));
+    vst1q_f32(out + 4, vaddq_f32(acc1, acc3));
+}
+
+void rope_neon(float* x, const float* cs, int n) {
+    // 4 pairs at a time, deinterleaved into the first and second value of every pair
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4x2_t v = vld2q_f32(x + i);
+        float32x4x2_t t = vld2q_f32(cs + i); // cos and sin
+        float32x4x2_t r;
+        r.val[0] = vsubq_f32(vmulq_f32(v.val[0], t.val[0]), vmulq_f32(v.val[1], t.val[1]));
+        r.val[1] = vaddq_f32(vmulq_f32(v.val[0], t.val[1]), vmulq_f32(v.val[1], t.val[0]));
+        vst2q_f32(x + i, r);
+    }
+    rope_scalar(x + i, cs + i, n - i);
+}
+
+static const Kernels kernels_neon = { "neon", dot_neon, axpy_neon, sum_exp_neon, dot_q8_neon, axpy_q8_neon, dot_panel_neon, rope_neon };
+
+int cpu_has_neon() {
+    // Advanced SIMD is part of armv8-a, the hwcap check only guards odd linux kernels
+#if defined(__linux__) && defined(HWCAP_ASIMD)
+    return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#else
+    return 1;
+#endif
+}
+
+#endif
+
+static Kernels kernels; // the kernels in use, set by init_kernels()
+
+void init_kernels() {
+    // pick the widest instruction set the cpu supports
+    const Kernels* available[4];
+    int n_available = 0;
+    available[n_available++] = &kernels_scalar;
+#if defined(KERNELS_X86)
+    if (cpu_has(0)) { available[n_available++] = &kernels_avx2; }
+    if (cpu_has(1)) { available[n_available++] = &kernels_avx512; }
+#elif defined(KERNELS_NEON)
+    if (cpu_has_neon()) { available[n_available++] = &kernels_neon; }
+#endif
+    kernels = *available[n_available - 1];
+    // LLAMA2_SIMD=scalar|avx2|avx512|neon forces a narrower set, e.g. to compare them
+    char* forced = getenv("LLAMA2_SIMD");
+    if (forced != NULL && forced[0] != '\0') {
+        int found = 0;
+        for (int i = 0; i < n_available; i++) {
+            if (strcmp(forced, available[i]->name) == 0) {
+                kernels = *available[i];
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "LLAMA2_SIMD=%s is not supported on this cpu\n", forced);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
 // ----------------------------------------------------------------------------
 // Transformer model
 
+#define PREFILL_BATCH 32 // max prompt tokens pushed through forward_prefill at once
+#define KV_PAGE_SIZE 16 // positions per page of the kv cache
+#define ROPE_BLOCK 256 // positions of the RoPE table computed at a time
+
 typedef struct {
     int dim; // transformer dimension
     int hidden_dim; // for ffn layers
@@ -26,25 +646,33 @@ typedef struct {
     int seq_len; // max sequence length
 } Config;
 
+typedef struct {
+    float* f; // fp32 values (version 0 and 1 checkpoints, version 3 widened at load), NULL when quantized
+    int8_t* q; // Q8_0 values (version 2 checkpoints): symmetric int8 in [-127, 127]
+    float* s; // Q8_0 scaling factors, one per group_size values
+    int group_size;
+    float* panels; // optional (layer, ceil(rows / PANEL_ROWS), n, PANEL_ROWS) repack of f, see repack_weights
+} Tensor;
+
 typedef struct {
     // token embedding table
-    float* token_embedding_table;    // (vocab_size, dim)
+    Tensor token_embedding_table;    // (vocab_size, dim)
     // weights for rmsnorms
     float* rms_att_weight; // (layer, dim) rmsnorm weights
     float* rms_ffn_weight; // (layer, dim)
     // weights for matmuls. note dim == n_heads * head_size
-    float* wq; // (layer, dim, n_heads * head_size)
-    float* wk; // (layer, dim, n_kv_heads * head_size)
-    float* wv; // (layer, dim, n_kv_heads * head_size)
-    float* wo; // (layer, n_heads * head_size, dim)
+    Tensor wq; // (layer, dim, n_heads * head_size)
+    Tensor wk; // (layer, dim, n_kv_heads * head_size)
+    Tensor wv; // (layer, dim, n_kv_heads * head_size)
+    Tensor wo; // (layer, n_heads * head_size, dim)
     // weights for ffn
-    float* w1; // (layer, hidden_dim, dim)
-    float* w2; // (layer, dim, hidden_dim)
-    float* w3; // (layer, hidden_dim, dim)
+    Tensor w1; // (layer, hidden_dim, dim)
+    Tensor w2; // (layer, dim, hidden_dim)
+    Tensor w3; // (layer, hidden_dim, dim)
     // final rmsnorm
     float* rms_final_weight; // (dim,)
     // (optional) classifier weights for the logits, on the last layer
-    float* wcls;
+    Tensor wcls;
 } TransformerWeights;
 
 typedef struct {
@@ -53,15 +681,45 @@ typedef struct {
     float *xb; // same, but inside a residual branch (dim,)
     float *xb2; // an additional buffer just for convenience (dim,)
     float *hb; // buffer for hidden dimension in the ffn (hidden_dim,)
-    float *hb2; // buffer for hidden dimension in the ffn (hidden_dim,)
     float *q; // query (dim,)
     float *k; // key (dim,)
     float *v; // value (dim,)
-    float *att; // buffer for scores/attention values (n_heads, seq_len)
-    float *logits; // output logits
-    // kv cache
-    float* key_cache;   // (layer, seq_len, dim)
-    float* value_cache; // (layer, seq_len, dim)
+    float *logits; // output logits, a row per kv slot: forward() uses the first, forward_batch one per sequence
+    // the same buffers with a row per token, used by forward_prefill
+    float *xs; // (PREFILL_BATCH, dim)
+    float *xbs; // (PREFILL_BATCH, dim)
+    float *hbs; // (PREFILL_BATCH, hidden_dim)
+    float *hb2s; // (PREFILL_BATCH, hidden_dim)
+    float *qs; // (PREFILL_BATCH, dim)
+    // activations quantized for the Q8_0 matmuls
+    int8_t *xq; // (PREFILL_BATCH, max(dim, hidden_dim))
+    float *xq_s; // scaling factors of xq
+    // paged kv cache, with a slot for each of the sequences that can be decoded together.
+    // pages are allocated as the sequences grow and recycled when they are released
+    int n_slots;
+    int max_pages; // pages of a full slot, ceil(kv_capacity / KV_PAGE_SIZE)
+    char** kv_pages; // (n_pages,) each (2, layer, KV_PAGE_SIZE, kv_dim): keys then values, see kv_q8
+    int n_pages;
+    int* free_pages; // pages not mapped by any slot
+    int n_free;
+    int* page_table; // (slot, max_pages) page of every KV_PAGE_SIZE positions of a slot
+    int* slot_pages; // (slot,) pages mapped by each slot
+    // with a sliding window (-x), a slot keeps the first kv_sinks positions of its sequence
+    // (attention sinks) and the most recent ones in a ring, so it can run past seq_len
+    int kv_window; // positions a token attends to, sinks included, 0 = off: all of 0..pos
+    int kv_sinks;
+    int kv_capacity; // rows of a slot: seq_len, or with a window see set_kv_window
+    // with -q 8 the keys and values are int8, symmetric with a scale per head and row. the
+    // scales follow the values in a page, (2, layer, KV_PAGE_SIZE, n_kv_heads)
+    int kv_int8;
+    // the RoPE rotations depend only on the position and the pair in the head, so they are
+    // computed once per ROPE_BLOCK positions as the sequences first get there, see rope_row
+    float rope_theta; // base of the rotation frequencies, 10000 in llama 2
+    float rope_scale; // positions are divided by this, linear scaling for long context checkpoints
+    int n_rope_blocks; // ceil(seq_len / ROPE_BLOCK)
+    float** rope_blocks; // (n_rope_blocks,) each (ROPE_BLOCK, head_size / 2) (cos, sin) pairs, NULL until used
+    float* rope_far; // (PREFILL_BATCH, head_size) the pairs of positions past the table, see rope_rows
+    const float* rope_cur[PREFILL_BATCH]; // the pairs of the rows being forwarded
 } RunState;
 
 typedef struct {
@@ -72,85 +730,362 @@ typedef struct {
     int fd; // file descriptor for memory mapping
     float* data; // memory mapped data pointer
     ssize_t file_size; // size of the checkpoint file in bytes
+    float* widened; // fp32 copy of the matmul weights of a version 3 (fp16) checkpoint, NULL otherwise
+    // the (optional) repacked weight panels, mapped from the .panels cache or malloced
+    int panels_fd;
+    float* panels;
+    ssize_t panels_size;
 } Transformer;
 
-void malloc_run_state(RunState* s, Config* p) {
+void malloc_run_state(RunState* s, Config* p, int n_slots) {
     // we calloc instead of malloc to keep valgrind happy
     int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
     s->x = calloc(p->dim, sizeof(float));
     s->xb = calloc(p->dim, sizeof(float));
     s->xb2 = calloc(p->dim, sizeof(float));
     s->hb = calloc(p->hidden_dim, sizeof(float));
-    s->hb2 = calloc(p->hidden_dim, sizeof(float));
     s->q = calloc(p->dim, sizeof(float));
     s->k = calloc(kv_dim, sizeof(float));
     s->v = calloc(kv_dim, sizeof(float));
-    s->att = calloc(p->n_heads * p->seq_len, sizeof(float));
-    s->logits = calloc(p->vocab_size, sizeof(float));
-    s->key_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
-    s->value_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
+    s->logits = calloc((size_t)n_slots * p->vocab_size, sizeof(float));
+    s->xs = calloc(PREFILL_BATCH * p->dim, sizeof(float));
+    s->xbs = calloc(PREFILL_BATCH * p->dim, sizeof(float));
+    s->hbs = calloc(PREFILL_BATCH * p->hidden_dim, sizeof(float));
+    s->hb2s = calloc(PREFILL_BATCH * p->hidden_dim, sizeof(float));
+    s->qs = calloc(PREFILL_BATCH * p->dim, sizeof(float));
+    int max_dim = p->hidden_dim > p->dim ? p->hidden_dim : p->dim;
+    s->xq = calloc(PREFILL_BATCH * max_dim, sizeof(int8_t));
+    s->xq_s = calloc(PREFILL_BATCH * max_dim, sizeof(float)); // enough for any group size
+    // the kv cache starts out empty, see kv_reserve
+    s->n_slots = n_slots;
+    s->max_pages = (p->seq_len + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE;
+    s->kv_pages = calloc((size_t)n_slots * s->max_pages, sizeof(char*));
+    s->n_pages = 0;
+    s->free_pages = calloc((size_t)n_slots * s->max_pages, sizeof(int));
+    s->n_free = 0;
+    s->page_table = calloc((size_t)n_slots * s->max_pages, sizeof(int));
+    s->slot_pages = calloc(n_slots, sizeof(int));
+    s->kv_window = 0;
+    s->kv_sinks = 0;
+    s->kv_capacity = p->seq_len;
+    s->kv_int8 = 0;
+    s->rope_theta = 10000.0f;
+    s->rope_scale = 1.0f;
+    s->n_rope_blocks = (p->seq_len + ROPE_BLOCK - 1) / ROPE_BLOCK;
+    s->rope_blocks = calloc(s->n_rope_blocks, sizeof(float*));
+    s->rope_far = calloc(PREFILL_BATCH * (p->dim / p->n_heads), sizeof(float));
     // ensure all mallocs went fine
-    if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q
-     || !s->k || !s->v || !s->att || !s->logits || !s->key_cache
-     || !s->value_cache) {
+    if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->q
+     || !s->k || !s->v || !s->logits || !s->kv_pages
+     || !s->free_pages || !s->page_table || !s->slot_pages || !s->xs || !s->xbs || !s->hbs || !s->hb2s
+     || !s->qs || !s->xq || !s->xq_s || !s->rope_blocks || !s->rope_far) {
         fprintf(stderr, "malloc failed!\n");
         exit(EXIT_FAILURE);
     }
 }
 
+size_t kv_page_bytes(RunState* s, Config* p) {
+    // bytes in one page of the kv cache, keys and values (and their scales when int8)
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t rows = (size_t)2 * p->n_layers * KV_PAGE_SIZE;
+    if (s->kv_int8) { return rows * (kv_dim * sizeof(int8_t) + p->n_kv_heads * sizeof(float)); }
+    return rows * kv_dim * sizeof(float);
+}
+
+void set_kv_window(RunState* s, int window, int sinks) {
+    // give every slot a sliding window of `window` positions, the first `sinks` of them
+    // kept for good. a batch of up to PREFILL_BATCH tokens writes all its rows before they
+    // attend, so the ring has PREFILL_BATCH - 1 rows more than the window: a token never
+    // finds a position it needs overwritten by a later one of its batch. has to be called
+    // before the kv cache is used
+    s->kv_window = window;
+    s->kv_sinks = sinks;
+    s->kv_capacity = window + PREFILL_BATCH - 1;
+    s->max_pages = (s->kv_capacity + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE;
+    size_t n = (size_t)s->n_slots * s->max_pages;
+    free(s->kv_pages);
+    free(s->free_pages);
+    free(s->page_table);
+    s->kv_pages = calloc(n, sizeof(char*));
+    s->free_pages = calloc(n, sizeof(int));
+    s->page_table = calloc(n, sizeof(int));
+    if (!s->kv_pages || !s->free_pages || !s->page_table) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int kv_max_pos(RunState* s, Config* p) {
+    // positions a sequence can reach: seq_len, unless a sliding window lets it go on
+    return s->kv_window > 0 ? INT_MAX : p->seq_len;
+}
+
+int kv_row(RunState* s, int t) {
+    // the row of a slot that holds position t: t itself, or once a sliding window is
+    // full, its place in the ring of rows that follows the sinks
+    if (s->kv_window == 0 || t < s->kv_capacity) { return t; }
+    return s->kv_sinks + (t - s->kv_sinks) % (s->kv_capacity - s->kv_sinks);
+}
+
+int kv_rows_used(RunState* s, int n_pos) {
+    // rows of a slot that positions 0..n_pos take up
+    return s->kv_window > 0 && n_pos > s->kv_capacity ? s->kv_capacity : n_pos;
+}
+
+void kv_reserve(RunState* s, Config* p, int slot, int n_pos) {
+    // map pages to slot until it holds positions 0..n_pos, reusing released pages first
+    int needed = (kv_rows_used(s, n_pos) + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE;
+    if (needed > s->max_pages) {
+        fprintf(stderr, "kv cache: %d positions is more than seq_len %d\n", n_pos, p->seq_len);
+        exit(EXIT_FAILURE);
+    }
+    int* table = s->page_table + (size_t)slot * s->max_pages;
+    while (s->slot_pages[slot] < needed) {
+        int page;
+        if (s->n_free > 0) {
+            page = s->free_pages[--s->n_free];
+        } else {
+            page = s->n_pages;
+            s->kv_pages[page] = calloc(kv_page_bytes(s, p), 1);
+            if (!s->kv_pages[page]) {
+                fprintf(stderr, "malloc failed!\n");
+                exit(EXIT_FAILURE);
+            }
+            s->n_pages++;
+        }
+        table[s->slot_pages[slot]++] = page;
+    }
+}
+
+void kv_release(RunState* s, int slot) {
+    // give the pages of slot back to the pool, the sequence in it is done
+    int* table = s->page_table + (size_t)slot * s->max_pages;
+    for (int i = 0; i < s->slot_pages[slot]; i++) {
+        s->free_pages[s->n_free++] = table[i];
+    }
+    s->slot_pages[slot] = 0;
+}
+
+char* kv_page(RunState* s, int slot, int t) {
+    // the page of slot that holds position t, it has to be mapped by kv_reserve
+    return s->kv_pages[s->page_table[(size_t)slot * s->max_pages + kv_row(s, t) / KV_PAGE_SIZE]];
+}
+
+float* kv_key(RunState* s, Config* p, int slot, int l, int t) {
+    // fp32 key row of layer l at position t of slot
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t row = (size_t)l * KV_PAGE_SIZE + kv_row(s, t) % KV_PAGE_SIZE;
+    return (float*)kv_page(s, slot, t) + row * kv_dim;
+}
+
+float* kv_value(RunState* s, Config* p, int slot, int l, int t) {
+    // fp32 value row of layer l at position t of slot, the values follow the keys in a page
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    return kv_key(s, p, slot, l, t) + (size_t)p->n_layers * KV_PAGE_SIZE * kv_dim;
+}
+
+int8_t* kv_q8(RunState* s, Config* p, int slot, int l, int t, int value, float** scales) {
+    // int8 key (value = 0) or value row of layer l at position t of slot, and its scales
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t row = ((size_t)value * p->n_layers + l) * KV_PAGE_SIZE + kv_row(s, t) % KV_PAGE_SIZE;
+    int8_t* page = (int8_t*)kv_page(s, slot, t);
+    *scales = (float*)(page + (size_t)2 * p->n_layers * KV_PAGE_SIZE * kv_dim) + row * p->n_kv_heads;
+    return page + row * kv_dim;
+}
+
+void copy_kv_slot(RunState* s, Config* p, int dst, int src, int n_pos) {
+    // copy positions 0..n_pos from one kv slot to another, e.g. to start several
+    // sequences from the same prompt after prefilling it once. whole pages are copied
+    kv_reserve(s, p, dst, n_pos);
+    for (int t = 0; t < kv_rows_used(s, n_pos); t += KV_PAGE_SIZE) {
+        memcpy(kv_page(s, dst, t), kv_page(s, src, t), kv_page_bytes(s, p));
+    }
+}
+
 void free_run_state(RunState* s) {
     free(s->x);
     free(s->xb);
     free(s->xb2);
     free(s->hb);
-    free(s->hb2);
     free(s->q);
     free(s->k);
     free(s->v);
-    free(s->att);
     free(s->logits);
-    free(s->key_cache);
-    free(s->value_cache);
+    free(s->xs);
+    free(s->xbs);
+    free(s->hbs);
+    free(s->hb2s);
+    free(s->qs);
+    free(s->xq);
+    free(s->xq_s);
+    for (int i = 0; i < s->n_pages; i++) { free(s->kv_pages[i]); }
+    free(s->kv_pages);
+    free(s->free_pages);
+    free(s->page_table);
+    free(s->slot_pages);
+    for (int i = 0; i < s->n_rope_blocks; i++) { free(s->rope_blocks[i]); }
+    free(s->rope_blocks);
+    free(s->rope_far);
+}
+
+float* map_fp32(Tensor* t, float* ptr, size_t n) {
+    // point t at the next n fp32 values, returns the pointer past them
+    t->f = ptr;
+    t->q = NULL;
+    t->s = NULL;
+    t->group_size = 0;
+    t->panels = NULL;
+    return ptr + n;
+}
+
+float fp16_to_fp32(uint16_t h) {
+    // IEEE half to float, exact: every half is a float
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13); // inf and nan
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // subnormal, normalize the mantissa
+        exp = 113;
+        while (!(mant & 0x400)) { mant <<= 1; exp--; }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
 }
 
 void memory_map_weights(TransformerWeights *w, Config* p, float* ptr, int shared_weights) {
+    // legacy version 0 layout, everything in fp32
     int head_size = p->dim / p->n_heads;
-    w->token_embedding_table = ptr;
-    ptr += p->vocab_size * p->dim;
+    ptr = map_fp32(&w->token_embedding_table, ptr, (size_t)p->vocab_size * p->dim);
     w->rms_att_weight = ptr;
     ptr += p->n_layers * p->dim;
-    w->wq = ptr;
-    ptr += p->n_layers * p->dim * (p->n_heads * head_size);
-    w->wk = ptr;
-    ptr += p->n_layers * p->dim * (p->n_kv_heads * head_size);
-    w->wv = ptr;
-    ptr += p->n_layers * p->dim * (p->n_kv_heads * head_size);
-    w->wo = ptr;
-    ptr += p->n_layers * (p->n_heads * head_size) * p->dim;
+    ptr = map_fp32(&w->wq, ptr, (size_t)p->n_layers * p->dim * (p->n_heads * head_size));
+    ptr = map_fp32(&w->wk, ptr, (size_t)p->n_layers * p->dim * (p->n_kv_heads * head_size));
+    ptr = map_fp32(&w->wv, ptr, (size_t)p->n_layers * p->dim * (p->n_kv_heads * head_size));
+    ptr = map_fp32(&w->wo, ptr, (size_t)p->n_layers * (p->n_heads * head_size) * p->dim);
     w->rms_ffn_weight = ptr;
     ptr += p->n_layers * p->dim;
-    w->w1 = ptr;
-    ptr += p->n_layers * p->dim * p->hidden_dim;
-    w->w2 = ptr;
-    ptr += p->n_layers * p->hidden_dim * p->dim;
-    w->w3 = ptr;
-    ptr += p->n_layers * p->dim * p->hidden_dim;
+    ptr = map_fp32(&w->w1, ptr, (size_t)p->n_layers * p->dim * p->hidden_dim);
+    ptr = map_fp32(&w->w2, ptr, (size_t)p->n_layers * p->hidden_dim * p->dim);
+    ptr = map_fp32(&w->w3, ptr, (size_t)p->n_layers * p->dim * p->hidden_dim);
     w->rms_final_weight = ptr;
     ptr += p->dim;
     ptr += p->seq_len * head_size / 2; // skip what used to be freq_cis_real (for RoPE)
     ptr += p->seq_len * head_size / 2; // skip what used to be freq_cis_imag (for RoPE)
-    w->wcls = shared_weights ? w->token_embedding_table : ptr;
+    if (shared_weights) { w->wcls = w->token_embedding_table; } else { map_fp32(&w->wcls, ptr, 0); }
+}
+
+void memory_map_weights_v1(TransformerWeights *w, Config* p, void* data, int shared_weights, int group_size,
+                           int f16, float** widened) {
+    // version 1 (fp32), version 2 (Q8_0) and version 3 (fp16) layout, see version1_export,
+    // version2_export and version3_export in export.py: the rmsnorm weights are first and always
+    // fp32, then all the matmul weights. in version 2 those are the int8 values of every tensor,
+    // followed by all of their scales
+    int head_size = p->dim / p->n_heads;
+    float* fptr = (float*) data;
+    w->rms_att_weight = fptr;
+    fptr += p->n_layers * p->dim;
+    w->rms_ffn_weight = fptr;
+    fptr += p->n_layers * p->dim;
+    w->rms_final_weight = fptr;
+    fptr += p->dim;
+    Tensor* tensors[] = { &w->token_embedding_table, &w->wq, &w->wk, &w->wv, &w->wo,
+                          &w->w1, &w->w2, &w->w3, &w->wcls };
+    size_t sizes[] = {
+        (size_t)p->vocab_size * p->dim,
+        (size_t)p->n_layers * p->dim * (p->n_heads * head_size),
+        (size_t)p->n_layers * p->dim * (p->n_kv_heads * head_size),
+        (size_t)p->n_layers * p->dim * (p->n_kv_heads * head_size),
+        (size_t)p->n_layers * (p->n_heads * head_size) * p->dim,
+        (size_t)p->n_layers * p->dim * p->hidden_dim,
+        (size_t)p->n_layers * p->hidden_dim * p->dim,
+        (size_t)p->n_layers * p->dim * p->hidden_dim,
+        (size_t)p->vocab_size * p->dim,
+    };
+    int n_tensors = shared_weights ? 8 : 9; // the classifier is only stored when not shared
+    if (f16) {
+        // the fp16 weights are widened to fp32 once here, every kernel stays fp32. this halves
+        // the checkpoint on disk, not the memory; run_gpu keeps them in fp16 on the GPU
+        size_t total = 0;
+        for (int i = 0; i < n_tensors; i++) { total += sizes[i]; }
+        float* wide = (float*)malloc(total * sizeof(float));
+        if (!wide) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        uint16_t* hptr = (uint16_t*) fptr;
+        long i;
+        #pragma omp parallel for private(i)
+        for (i = 0; i < (long)total; i++) { wide[i] = fp16_to_fp32(hptr[i]); }
+        *widened = wide;
+        fptr = wide;
+    }
+    if (group_size == 0) {
+        for (int i = 0; i < n_tensors; i++) {
+            fptr = map_fp32(tensors[i], fptr, sizes[i]);
+        }
+    } else {
+        int8_t* qptr = (int8_t*) fptr;
+        for (int i = 0; i < n_tensors; i++) {
+            tensors[i]->f = NULL;
+            tensors[i]->q = qptr;
+            tensors[i]->group_size = group_size;
+            tensors[i]->panels = NULL;
+            qptr += sizes[i];
+        }
+        float* sptr = (float*) qptr;
+        for (int i = 0; i < n_tensors; i++) {
+            tensors[i]->s = sptr;
+            sptr += sizes[i] / group_size;
+        }
+    }
+    if (shared_weights) { w->wcls = w->token_embedding_table; }
 }
 
 void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights,
-                     int* fd, float** data, ssize_t* file_size) {
+                     int* fd, float** data, ssize_t* file_size, float** widened) {
     FILE *file = fopen(checkpoint, "rb");
     if (!file) { fprintf(stderr, "Couldn't open file %s\n", checkpoint); exit(EXIT_FAILURE); }
-    // read in the config header
-    if (fread(config, sizeof(Config), 1, file) != 1) { exit(EXIT_FAILURE); }
-    // negative vocab size is hacky way of signaling unshared weights. bit yikes.
-    int shared_weights = config->vocab_size > 0 ? 1 : 0;
-    config->vocab_size = abs(config->vocab_size);
+    // version 1, 2 and 3 checkpoints start with a magic number, "ak42" in ASCII
+    uint32_t magic;
+    if (fread(&magic, sizeof(uint32_t), 1, file) != 1) { exit(EXIT_FAILURE); }
+    int version = 0;
+    int shared_weights;
+    int group_size = 0; // 0 = fp32 weights, otherwise the Q8_0 group size
+    size_t header_size;
+    if (magic == 0x616b3432) {
+        if (fread(&version, sizeof(int), 1, file) != 1) { exit(EXIT_FAILURE); }
+        if (version != 1 && version != 2 && version != 3) {
+            fprintf(stderr, "unsupported checkpoint version %d\n", version);
+            exit(EXIT_FAILURE);
+        }
+        if (fread(config, sizeof(Config), 1, file) != 1) { exit(EXIT_FAILURE); }
+        uint8_t shared_classifier;
+        if (fread(&shared_classifier, sizeof(uint8_t), 1, file) != 1) { exit(EXIT_FAILURE); }
+        shared_weights = shared_classifier;
+        if (version == 2) {
+            if (fread(&group_size, sizeof(int), 1, file) != 1) { exit(EXIT_FAILURE); }
+            // every matmul quantizes its input in groups, so both widths have to divide
+            if (group_size <= 0 || config->dim % group_size != 0 || config->hidden_dim % group_size != 0) {
+                fprintf(stderr, "invalid group size %d\n", group_size);
+                exit(EXIT_FAILURE);
+            }
+        }
+        header_size = 256;
+    } else {
+        // legacy version 0 checkpoint, the header is just the Config
+        rewind(file);
+        if (fread(config, sizeof(Config), 1, file) != 1) { exit(EXIT_FAILURE); }
+        // negative vocab size is hacky way of signaling unshared weights. bit yikes.
+        shared_weights = config->vocab_size > 0 ? 1 : 0;
+        config->vocab_size = abs(config->vocab_size);
+        header_size = sizeof(Config);
+    }
     // figure out the file size
     fseek(file, 0, SEEK_END); // move file pointer to end of file
     *file_size = ftell(file); // get the file size, in bytes
@@ -160,34 +1095,447 @@ void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weigh
     if (*fd == -1) { fprintf(stderr, "open failed!\n"); exit(EXIT_FAILURE); }
     *data = mmap(NULL, *file_size, PROT_READ, MAP_PRIVATE, *fd, 0);
     if (*data == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
-    float* weights_ptr = *data + sizeof(Config)/sizeof(float);
-    memory_map_weights(weights, config, weights_ptr, shared_weights);
+    void* weights_ptr = (char*)*data + header_size;
+    if (version == 0) {
+        memory_map_weights(weights, config, (float*)weights_ptr, shared_weights);
+    } else {
+        memory_map_weights_v1(weights, config, weights_ptr, shared_weights, group_size, version == 3, widened);
+    }
 }
 
-void build_transformer(Transformer *t, char* checkpoint_path) {
+void build_transformer(Transformer *t, char* checkpoint_path, int n_slots) {
     // read in the Config and the Weights from the checkpoint
-    read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->fd, &t->data, &t->file_size);
-    // allocate the RunState buffers
-    malloc_run_state(&t->state, &t->config);
+    t->widened = NULL;
+    read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->fd, &t->data, &t->file_size, &t->widened);
+    // allocate the RunState buffers, with n_slots sequences of kv cache
+    malloc_run_state(&t->state, &t->config, n_slots);
+    // pick the SIMD kernels for this cpu
+    init_kernels();
+    // the weights are used in place, unless repack_weights is called
+    t->panels_fd = -1;
+    t->panels = NULL;
+    t->panels_size = 0;
 }
 
 void free_transformer(Transformer* t) {
     // close the memory mapping
     if (t->data != MAP_FAILED) { munmap(t->data, t->file_size); }
     if (t->fd != -1) { close(t->fd); }
+    free(t->widened);
+    if (t->panels_fd != -1) {
+        munmap(t->panels, t->panels_size);
+        close(t->panels_fd);
+    } else {
+        free(t->panels);
+    }
     // free the RunState buffers
     free_run_state(&t->state);
 }
 
 // ----------------------------------------------------------------------------
-// neural net blocks; the dynamics of the Transformer
+// repacked weights: the fp32 matmul weights can be stored as panels of PANEL_ROWS
+// interleaved rows, (n, PANEL_ROWS) column by column, so that a single pass over x
+// computes PANEL_ROWS outputs and the weights stream through the cache in order.
+// building them reads every weight once, so they are cached in <checkpoint>.panels
+// and mapped from there on the next run
+
+#define PANELS_MAGIC 0x6c6e6170 // "panl" in ASCII
+#define PANELS_VERSION 2
+#define PANELS_HEADER_SIZE 64
+#define HASH_CHUNK (1 << 20) // bytes of the checkpoint hashed by one thread at a time, see checkpoint_hash
+
+typedef struct {
+    uint32_t magic;
+    int version;
+    int panel_rows;
+    int n_tensors;
+    Config config;
+    int64_t checkpoint_size; // the checkpoint the panels were built from
+    uint64_t checkpoint_hash;
+} PanelsHeader;
+
+typedef struct {
+    Tensor* t;
+    int layers;
+    int rows; // d of the matmul
+    int cols; // n of the matmul
+} PanelTensor;
+
+size_t panel_size(int rows, int cols) {
+    // floats in the panels of one (rows, cols) matrix, the last panel is zero padded
+    return (size_t)((rows + PANEL_ROWS - 1) / PANEL_ROWS) * PANEL_ROWS * cols;
+}
+
+void repack_panels(float* out, const float* w, int rows, int cols) {
+    // W (rows, cols) row-major -> panels (ceil(rows / PANEL_ROWS), cols, PANEL_ROWS)
+    int n_panels = (rows + PANEL_ROWS - 1) / PANEL_ROWS;
+    int p;
+    #pragma omp parallel for private(p)
+    for (p = 0; p < n_panels; p++) {
+        float* panel = out + (size_t)p * cols * PANEL_ROWS;
+        for (int r = 0; r < PANEL_ROWS; r++) {
+            int row = p * PANEL_ROWS + r;
+            for (int j = 0; j < cols; j++) {
+                panel[j * PANEL_ROWS + r] = row < rows ? w[(size_t)row * cols + j] : 0.0f;
+            }
+        }
+    }
+}
+
+uint64_t checkpoint_hash(const char* data, size_t size) {
+    // FNV-1a over the whole checkpoint, 8 bytes at a step. the chunks of HASH_CHUNK bytes
+    // are hashed in parallel and their hashes folded in file order, so the result does not
+    // depend on the thread count. every step is a bijection of the running hash, so any
+    // change to a single word of the weights changes the hash
+    int n_chunks = (int)((size + HASH_CHUNK - 1) / HASH_CHUNK);
+    uint64_t* chunks = malloc((n_chunks + 1) * sizeof(uint64_t));
+    if (!chunks) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    int c;
+    #pragma omp parallel for private(c)
+    for (c = 0; c < n_chunks; c++) {
+        const char* chunk = data + (size_t)c * HASH_CHUNK;
+        size_t len = size - (size_t)c * HASH_CHUNK < HASH_CHUNK ? size - (size_t)c * HASH_CHUNK : HASH_CHUNK;
+        uint64_t hash = 14695981039346656037ULL;
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t word;
+            memcpy(&word, chunk + i, 8);
+            hash = (hash ^ word) * 1099511628211ULL;
+        }
+        for (; i < len; i++) { hash = (hash ^ (unsigned char)chunk[i]) * 1099511628211ULL; }
+        chunks[c] = hash;
+    }
+    uint64_t hash = (14695981039346656037ULL ^ size) * 1099511628211ULL;
+    for (c = 0; c < n_chunks; c++) { hash = (hash ^ chunks[c]) * 1099511628211ULL; }
+    free(chunks);
+    return hash;
+}
+
+int collect_panel_tensors(Transformer* t, PanelTensor* list) {
+    // the fp32 matmul weights, in the order they are stored in the .panels file
+    Config* p = &t->config;
+    TransformerWeights* w = &t->weights;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    PanelTensor all[] = {
+        { &w->wq, p->n_layers, p->dim, p->dim },
+        { &w->wk, p->n_layers, kv_dim, p->dim },
+        { &w->wv, p->n_layers, kv_dim, p->dim },
+        { &w->wo, p->n_layers, p->dim, p->dim },
+        { &w->w1, p->n_layers, p->hidden_dim, p->dim },
+        { &w->w2, p->n_layers, p->dim, p->hidden_dim },
+        { &w->w3, p->n_layers, p->hidden_dim, p->dim },
+        { &w->wcls, 1, p->vocab_size, p->dim },
+    };
+    int n = 0;
+    for (int i = 0; i < 8; i++) {
+        if (all[i].t->f != NULL) { list[n++] = all[i]; }
+    }
+    return n;
+}
+
+void repack_weights(Transformer* t, char* checkpoint_path) {
+    // point the fp32 matmul weights at panels, mapped from <checkpoint>.panels if it
+    // matches this checkpoint, otherwise built now and written there for next time
+    PanelTensor list[8];
+    int n_tensors = collect_panel_tensors(t, list);
+    if (n_tensors == 0) { return; } // Q8_0 checkpoint, nothing in fp32
+    size_t total = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        total += list[i].layers * panel_size(list[i].rows, list[i].cols);
+    }
+    PanelsHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PANELS_MAGIC;
+    header.version = PANELS_VERSION;
+    header.panel_rows = PANEL_ROWS;
+    header.n_tensors = n_tensors;
+    header.config = t->config;
+    header.checkpoint_size = t->file_size;
+    header.checkpoint_hash = checkpoint_hash((char*)t->data, t->file_size);
+    size_t file_size = PANELS_HEADER_SIZE + total * sizeof(float);
+
+    char* cache_path = malloc(strlen(checkpoint_path) + 16);
+    sprintf(cache_path, "%s.panels", checkpoint_path);
+    FILE* file = fopen(cache_path, "rb");
+    PanelsHeader cached;
+    int valid = 0;
+    if (file) {
+        valid = fread(&cached, sizeof(cached), 1, file) == 1 && memcmp(&cached, &header, sizeof(header)) == 0;
+        fseek(file, 0, SEEK_END);
+        valid = valid && (size_t)ftell(file) == file_size;
+        fclose(file);
+    }
+    if (!valid) {
+        // build the panels tensor by tensor, straight into a temporary file
+        char* tmp_path = malloc(strlen(cache_path) + 8);
+        sprintf(tmp_path, "%s.tmp", cache_path);
+        file = fopen(tmp_path, "wb");
+        char header_block[PANELS_HEADER_SIZE] = { 0 }; // the header, zero padded
+        memcpy(header_block, &header, sizeof(header));
+        int ok = file != NULL && fwrite(header_block, PANELS_HEADER_SIZE, 1, file) == 1;
+        float* buffer = NULL;
+        if (ok) {
+            // the largest single matrix is the scratch space
+            size_t max_size = 0;
+            for (int i = 0; i < n_tensors; i++) {
+                size_t size = panel_size(list[i].rows, list[i].cols);
+                if (size > max_size) { max_size = size; }
+            }
+            buffer = malloc(max_size * sizeof(float));
+            if (!buffer) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+            for (int i = 0; i < n_tensors && ok; i++) {
+                PanelTensor* pt = &list[i];
+                size_t size = panel_size(pt->rows, pt->cols);
+                for (int l = 0; l < pt->layers && ok; l++) {
+                    repack_panels(buffer, pt->t->f + (size_t)l * pt->rows * pt->cols, pt->rows, pt->cols);
+                    ok = fwrite(buffer, sizeof(float), size, file) == size;
+                }
+            }
+            free(buffer);
+        }
+        if (file) { ok = fclose(file) == 0 && ok; }
+        if (ok) {
+            remove(cache_path); // rename does not replace an existing file on windows
+            ok = rename(tmp_path, cache_path) == 0;
+        }
+        if (!ok) {
+            // could not write next to the checkpoint, keep the panels in memory only
+            fprintf(stderr, "couldn't write %s, repacking the weights in memory\n", cache_path);
+            remove(tmp_path);
+            t->panels = malloc(total * sizeof(float));
+            if (!t->panels) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+            t->panels_size = total * sizeof(float);
+            float* ptr = t->panels;
+            for (int i = 0; i < n_tensors; i++) {
+                PanelTensor* pt = &list[i];
+                size_t size = panel_size(pt->rows, pt->cols);
+                for (int l = 0; l < pt->layers; l++) {
+                    repack_panels(ptr, pt->t->f + (size_t)l * pt->rows * pt->cols, pt->rows, pt->cols);
+                    ptr += size;
+                }
+            }
+        }
+        free(tmp_path);
+    }
+    if (t->panels == NULL) {
+        // memory map the cache, just like the checkpoint
+        t->panels_fd = open(cache_path, O_RDONLY);
+        if (t->panels_fd == -1) { fprintf(stderr, "open failed!\n"); exit(EXIT_FAILURE); }
+        t->panels_size = file_size;
+        t->panels = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, t->panels_fd, 0);
+        if (t->panels == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
+    }
+    free(cache_path);
+    // point every tensor at its panels
+    float* ptr = t->panels_fd != -1 ? t->panels + PANELS_HEADER_SIZE / sizeof(float) : t->panels;
+    for (int i = 0; i < n_tensors; i++) {
+        list[i].t->panels = ptr;
+        ptr += list[i].layers * panel_size(list[i].rows, list[i].cols);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// profiling: opt-in timing of every stage of the forward pass.
+// LLAMA2_PROFILE=<file> writes a summary when the program is done: JSON, or CSV with
+// one row per generated token if the file name ends in .csv. LLAMA2_TRACE=<file>
+// also records every stage of every layer as a Chrome trace (chrome://tracing, Perfetto)
+
+typedef enum {
+    STAGE_RMSNORM, STAGE_QKV, STAGE_ROPE, STAGE_ATTENTION, STAGE_WO, STAGE_FFN, STAGE_CLASSIFIER, N_STAGES
+} Stage;
+
+static const char* stage_names[N_STAGES] = { "rmsnorm", "qkv", "rope", "attention", "wo", "ffn", "classifier" };
+
+typedef struct {
+    double ts; // start, in us since init_profiler
+    double dur; // in us
+    int stage;
+    int layer; // -1 for the stages after the last layer
+    int pos; // position of the (first) token
+    int batch; // tokens processed together, > 1 in prefill
+} ProfileEvent;
+
+typedef struct {
+    int enabled;
+    char* summary_path;
+    char* trace_path;
+    double start; // time_in_us() at init_profiler
+    double total[N_STAGES]; // cumulative us, decode and prefill
+    long calls[N_STAGES];
+    double current[N_STAGES]; // us of the token (or prefill batch) in flight
+    double* steps; // (n_steps, N_STAGES) us of every decode step
+    int n_steps;
+    int cap_steps;
+    int n_tokens; // decoded tokens, more than n_steps when several sequences are batched
+    int n_prefill; // tokens that went through prefill instead
+    ProfileEvent* events; // only recorded for the trace
+    int n_events;
+    int cap_events;
+} Profiler;
+
+static Profiler profiler;
+
+double time_in_us() {
+    // monotonic time in microseconds, fine grained enough for a single stage
+#if defined _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1e6 / (double)freq.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e6 + time.tv_nsec * 1e-3;
+#endif
+}
+
+void init_profiler() {
+    memset(&profiler, 0, sizeof(profiler));
+    char* summary = getenv("LLAMA2_PROFILE");
+    char* trace = getenv("LLAMA2_TRACE");
+    profiler.summary_path = summary != NULL && summary[0] != '\0' ? summary : NULL;
+    profiler.trace_path = trace != NULL && trace[0] != '\0' ? trace : NULL;
+    profiler.enabled = profiler.summary_path != NULL || profiler.trace_path != NULL;
+    profiler.start = time_in_us();
+}
+
+double profile_now() {
+    return profiler.enabled ? time_in_us() : 0.0;
+}
+
+void profile_stage(Stage stage, int layer, int pos, int batch, double* t) {
+    // charge the time since *t to stage, then restart *t for the next stage
+    if (!profiler.enabled) { return; }
+    double now = time_in_us();
+    double dur = now - *t;
+    profiler.total[stage] += dur;
+    profiler.calls[stage]++;
+    profiler.current[stage] += dur;
+    if (profiler.trace_path != NULL) {
+        if (profiler.n_events == profiler.cap_events) {
+            profiler.cap_events = profiler.cap_events ? profiler.cap_events * 2 : 4096;
+            profiler.events = realloc(profiler.events, profiler.cap_events * sizeof(ProfileEvent));
+            if (!profiler.events) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        }
+        ProfileEvent* e = &profiler.events[profiler.n_events++];
+        e->ts = *t - profiler.start;
+        e->dur = dur;
+        e->stage = stage;
+        e->layer = layer;
+        e->pos = pos;
+        e->batch = batch;
+    }
+    *t = now;
+}
+
+void profile_token(int batch, int prefill) {
+    // close the forward pass in flight: every decode step (the next token of each of
+    // the batch sequences) gets a row of its own, prefill batches only count in the totals
+    if (!profiler.enabled) { return; }
+    if (!prefill) {
+        if (profiler.n_steps == profiler.cap_steps) {
+            profiler.cap_steps = profiler.cap_steps ? profiler.cap_steps * 2 : 256;
+            profiler.steps = realloc(profiler.steps, profiler.cap_steps * N_STAGES * sizeof(double));
+            if (!profiler.steps) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        }
+        memcpy(profiler.steps + profiler.n_steps * N_STAGES, profiler.current, sizeof(profiler.current));
+        profiler.n_steps++;
+        profiler.n_tokens += batch;
+    } else {
+        profiler.n_prefill += batch;
+    }
+    memset(profiler.current, 0, sizeof(profiler.current));
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double da = *(const double*)a, db = *(const double*)b;
+    return (da > db) - (da < db);
+}
+
+double percentile(double* sorted, int n, double q) {
+    // nearest rank percentile of n sorted values
+    if (n == 0) { return 0.0; }
+    int i = (int)ceil(q * n) - 1;
+    return sorted[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+void write_profile(const char* backend, const char* variant) {
+    // write the summary and the trace requested by the env vars, see init_profiler
+    if (!profiler.enabled) { return; }
+    int n = profiler.n_steps;
+    if (profiler.summary_path != NULL) {
+        FILE* f = fopen(profiler.summary_path, "w");
+        if (!f) { fprintf(stderr, "couldn't write %s\n", profiler.summary_path); exit(EXIT_FAILURE); }
+        size_t len = strlen(profiler.summary_path);
+        if (len >= 4 && strcmp(profiler.summary_path + len - 4, ".csv") == 0) {
+            // one row per decode step, in ms
+            fprintf(f, "step");
+            for (int s = 0; s < N_STAGES; s++) { fprintf(f, ",%s", stage_names[s]); }
+            fprintf(f, ",total\n");
+            for (int i = 0; i < n; i++) {
+                double sum = 0.0;
+                fprintf(f, "%d", i);
+                for (int s = 0; s < N_STAGES; s++) {
+                    fprintf(f, ",%.4f", profiler.steps[i * N_STAGES + s] / 1000.0);
+                    sum += profiler.steps[i * N_STAGES + s];
+                }
+                fprintf(f, ",%.4f\n", sum / 1000.0);
+            }
+        } else {
+            // cumulative time and the per step distribution of every stage, in ms
+            double* column = malloc((n > 0 ? n : 1) * sizeof(double));
+            fprintf(f, "{\n  \"backend\": \"%s\",\n  \"variant\": \"%s\",\n", backend, variant);
+            fprintf(f, "  \"steps\": %d,\n  \"tokens\": %d,\n  \"prefill_tokens\": %d,\n  \"stages\": [\n",
+                    n, profiler.n_tokens, profiler.n_prefill);
+            for (int s = 0; s < N_STAGES; s++) {
+                double sum = 0.0;
+                for (int i = 0; i < n; i++) {
+                    column[i] = profiler.steps[i * N_STAGES + s];
+                    sum += column[i];
+                }
+                qsort(column, n, sizeof(double), compare_doubles);
+                fprintf(f, "    {\"name\": \"%s\", \"calls\": %ld, \"total_ms\": %.4f, \"token_mean_ms\": %.4f, "
+                        "\"token_p50_ms\": %.4f, \"token_p99_ms\": %.4f, \"token_max_ms\": %.4f}%s\n",
+                        stage_names[s], profiler.calls[s], profiler.total[s] / 1000.0,
+                        n > 0 ? sum / n / 1000.0 : 0.0, percentile(column, n, 0.5) / 1000.0,
+                        percentile(column, n, 0.99) / 1000.0, n > 0 ? column[n - 1] / 1000.0 : 0.0,
+                        s < N_STAGES - 1 ? "," : "");
+            }
+            fprintf(f, "  ]\n}\n");
+            free(column);
+        }
+        fclose(f);
+    }
+    if (profiler.trace_path != NULL) {
+        // chrome trace event format, complete ("X") events with timestamps in us
+        FILE* f = fopen(profiler.trace_path, "w");
+        if (!f) { fprintf(stderr, "couldn't write %s\n", profiler.trace_path); exit(EXIT_FAILURE); }
+        fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for (int i = 0; i < profiler.n_events; i++) {
+            ProfileEvent* e = &profiler.events[i];
+            fprintf(f, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": %d, \"pos\": %d, \"batch\": %d}}%s\n",
+                    stage_names[e->stage], e->batch > 1 ? "prefill" : "decode", e->ts, e->dur,
+                    e->layer, e->pos, e->batch, i < profiler.n_events - 1 ? "," : "");
+        }
+        fprintf(f, "]}\n");
+        fclose(f);
+    }
+    free(profiler.steps);
+    free(profiler.events);
+    profiler.enabled = 0;
+}
+
+// ----------------------------------------------------------------------------
+// neural net blocks; the dynamics of the Transformer. a forward pass runs in a single
+// parallel region (see forward), and the blocks that loop over rows, heads or groups
+// split the loop over its threads with a static `omp for`: every thread calls them with
+// the same arguments, and the barrier at the end of the loop is the only synchronization.
+// outside a parallel region they run on the calling thread alone
 
 void rmsnorm(float* o, float* x, float* weight, int size) {
     // calculate sum of squares
-    float ss = 0.0f;
-    for (int j = 0; j < size; j++) {
-        ss += x[j] * x[j];
-    }
+    float ss = kernels.dot(x, x, size);
     ss /= size;
     ss += 1e-5f;
     ss = 1.0f / sqrtf(ss);
@@ -197,6 +1545,24 @@ void rmsnorm(float* o, float* x, float* weight, int size) {
     }
 }
 
+void rmsnorm_rows(float* o, float* x, float* weight, int size, int batch) {
+    // rmsnorm of the rows of x (batch,size), a row per iteration
+    int b;
+    #pragma omp for schedule(static) private(b)
+    for (b = 0; b < batch; b++) {
+        rmsnorm(o + b * size, x + b * size, weight, size);
+    }
+}
+
+void residual(float* x, float* dx, int n) {
+    // residual connection, x += dx
+    int i;
+    #pragma omp for schedule(static) private(i)
+    for (i = 0; i < n; i++) {
+        x[i] += dx[i];
+    }
+}
+
 void softmax(float* x, int size) {
     // find max value (for numerical stability)
     float max_val = x[0];
@@ -206,11 +1572,7 @@ void softmax(float* x, int size) {
         }
     }
     // exp and sum
-    float sum = 0.0f;
-    for (int i = 0; i < size; i++) {
-        x[i] = expf(x[i] - max_val);
-        sum += x[i];
-    }
+    float sum = kernels.sum_exp(x, max_val, size);
     // normalize
     for (int i = 0; i < size; i++) {
         x[i] /= sum;
@@ -221,14 +1583,387 @@ void matmul(float* xout, float* x, float* w, int n, int d) {
     // W (d,n) @ x (n,) -> xout (d,)
     // by far the most amount of time is spent inside this little function
     int i;
-    #pragma omp parallel for private(i)
+    #pragma omp for schedule(static) private(i)
+    for (i = 0; i < d; i++) {
+        xout[i] = kernels.dot(w + (size_t)i * n, x, n);
+    }
+}
+
+void matmul_batch(float* xout, float* x, float* w, int n, int d, int batch) {
+    // W (d,n) @ X (batch,n) -> xout (batch,d)
+    // each row of W is reused for all the rows of X while it is still in cache,
+    // so the weights are streamed from memory once per batch instead of once per token
+    int i;
+    #pragma omp for schedule(static) private(i)
+    for (i = 0; i < d; i++) {
+        float* wrow = w + (size_t)i * n;
+        for (int b = 0; b < batch; b++) {
+            xout[b * d + i] = kernels.dot(wrow, x + b * n, n);
+        }
+    }
+}
+
+void matmul_panels(float* xout, float* x, float* panels, int n, int d, int batch) {
+    // W (d,n) @ X (batch,n) -> xout (batch,d) with W repacked by repack_panels:
+    // each pass over a row of X produces PANEL_ROWS outputs, and a panel is reused
+    // for all the rows of X while it is still in cache
+    int n_panels = (d + PANEL_ROWS - 1) / PANEL_ROWS;
+    int p;
+    #pragma omp for schedule(static) private(p)
+    for (p = 0; p < n_panels; p++) {
+        float* panel = panels + (size_t)p * n * PANEL_ROWS;
+        int rows = d - p * PANEL_ROWS < PANEL_ROWS ? d - p * PANEL_ROWS : PANEL_ROWS;
+        for (int b = 0; b < batch; b++) {
+            float out[PANEL_ROWS];
+            kernels.dot_panel(out, panel, x + b * n, n);
+            memcpy(xout + b * d + p * PANEL_ROWS, out, rows * sizeof(float));
+        }
+    }
+}
+
+void quantize(int8_t* q, float* s, float* x, int n, int group_size) {
+    // Q8_0: symmetric int8 quantization of x (n,) in groups, float = q * s
+    for (int g = 0; g < n / group_size; g++) {
+        float* xg = x + g * group_size;
+        // find the max absolute value in this group
+        float wmax = 0.0f;
+        for (int i = 0; i < group_size; i++) {
+            float val = fabsf(xg[i]);
+            if (val > wmax) { wmax = val; }
+        }
+        // calculate and write the scaling factor, an all-zero group stays zero
+        float scale = wmax / 127.0f;
+        s[g] = scale;
+        float inv_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+        for (int i = 0; i < group_size; i++) {
+            q[g * group_size + i] = (int8_t) roundf(xg[i] * inv_scale);
+        }
+    }
+}
+
+void quantize_rows(int8_t* q, float* s, float* x, int n, int group_size) {
+    // quantize x (n,) a group per iteration, n is that of all the rows of a batch
+    int g;
+    #pragma omp for schedule(static) private(g)
+    for (g = 0; g < n / group_size; g++) {
+        quantize(q + g * group_size, s + g, x + g * group_size, group_size, group_size);
+    }
+}
+
+void kv_put(RunState* s, Config* p, int slot, int l, int t, int value, float* x) {
+    // write the key (value = 0) or value row x (kv_dim,) at position t, quantized a head
+    // at a time when the kv cache is int8
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    if (s->kv_int8) {
+        float* scales;
+        int8_t* q = kv_q8(s, p, slot, l, t, value, &scales);
+        quantize(q, scales, x, kv_dim, p->dim / p->n_heads);
+    } else {
+        memcpy(value ? kv_value(s, p, slot, l, t) : kv_key(s, p, slot, l, t), x, kv_dim * sizeof(float));
+    }
+}
+
+void kv_get(RunState* s, Config* p, int slot, int l, int t, int value, float* out) {
+    // read the key (value = 0) or value row at position t back as floats
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int head_size = p->dim / p->n_heads;
+    if (s->kv_int8) {
+        float* scales;
+        int8_t* q = kv_q8(s, p, slot, l, t, value, &scales);
+        for (int i = 0; i < kv_dim; i++) { out[i] = q[i] * scales[i / head_size]; }
+    } else {
+        memcpy(out, value ? kv_value(s, p, slot, l, t) : kv_key(s, p, slot, l, t), kv_dim * sizeof(float));
+    }
+}
+
+void matmul_q8(float* xout, int8_t* xq, float* xs, int8_t* wq, float* ws, int n, int d, int group_size, int batch) {
+    // W (d,n) @ X (batch,n) -> xout (batch,d), W and X both Q8_0 quantized
+    int i;
+    #pragma omp for schedule(static) private(i)
+    for (i = 0; i < d; i++) {
+        int8_t* wrow = wq + (size_t)i * n;
+        float* wscale = ws + (size_t)i * n / group_size;
+        for (int b = 0; b < batch; b++) {
+            xout[b * d + i] = kernels.dot_q8(xq + b * n, xs + b * n / group_size, wrow, wscale, n, group_size);
+        }
+    }
+}
+
+void linear(RunState* s, float* xout, float* x, Tensor* w, int l, int n, int d, int batch) {
+    // W (d,n) @ X (batch,n) -> xout (batch,d), where W is layer l of a fp32 or Q8_0 tensor
+    size_t offset = (size_t)l * n * d;
+    if (w->panels != NULL) {
+        matmul_panels(xout, x, w->panels + l * panel_size(d, n), n, d, batch);
+        return;
+    }
+    if (w->q == NULL) {
+        if (batch == 1) {
+            matmul(xout, x, w->f + offset, n, d);
+        } else {
+            matmul_batch(xout, x, w->f + offset, n, d, batch);
+        }
+        return;
+    }
+    // quantize the activations the same way as the weights, then multiply in int8
+    int gs = w->group_size;
+    quantize_rows(s->xq, s->xq_s, x, batch * n, gs);
+    matmul_q8(xout, s->xq, s->xq_s, w->q + offset, w->s + offset / gs, n, d, gs, batch);
+}
+
+typedef struct {
+    Tensor* w; // layer l of it is (d, n)
+    float* xout; // (batch, d)
+    int d;
+} LinearPart;
+
+void linear_fused(RunState* s, LinearPart* parts, int n_parts, float* x, int l, int n, int batch) {
+    // W_k (d_k,n) @ X (batch,n) -> xout_k (batch,d_k) for several layer l matrices of the
+    // same X, e.g. wq, wk and wv: one matmul over all their rows stacked up, so X is
+    // quantized once and a single parallel loop covers them all
+    Tensor* w0 = parts[0].w;
+    int gs = w0->group_size;
+    if (w0->q != NULL) {
+        quantize_rows(s->xq, s->xq_s, x, batch * n, gs);
+    }
+    // the unit of work is a panel of PANEL_ROWS rows with repacked weights, a row otherwise
+    int rows_per_unit = w0->panels != NULL ? PANEL_ROWS : 1;
+    int units[3];
+    int total = 0;
+    for (int k = 0; k < n_parts; k++) {
+        units[k] = (parts[k].d + rows_per_unit - 1) / rows_per_unit;
+        total += units[k];
+    }
+    int u;
+    #pragma omp for schedule(static) private(u)
+    for (u = 0; u < total; u++) {
+        int k = 0;
+        int i = u;
+        while (i >= units[k]) { i -= units[k]; k++; }
+        Tensor* w = parts[k].w;
+        float* xout = parts[k].xout;
+        int d = parts[k].d;
+        size_t offset = (size_t)l * n * d;
+        if (w->panels != NULL) {
+            float* panel = w->panels + l * panel_size(d, n) + (size_t)i * n * PANEL_ROWS;
+            int rows = d - i * PANEL_ROWS < PANEL_ROWS ? d - i * PANEL_ROWS : PANEL_ROWS;
+            for (int b = 0; b < batch; b++) {
+                float out[PANEL_ROWS];
+                kernels.dot_panel(out, panel, x + b * n, n);
+                memcpy(xout + b * d + i * PANEL_ROWS, out, rows * sizeof(float));
+            }
+        } else if (w->q == NULL) {
+            float* wrow = w->f + offset + (size_t)i * n;
+            for (int b = 0; b < batch; b++) {
+                xout[b * d + i] = kernels.dot(wrow, x + b * n, n);
+            }
+        } else {
+            int8_t* wrow = w->q + offset + (size_t)i * n;
+            float* wscale = w->s + (offset + (size_t)i * n) / gs;
+            for (int b = 0; b < batch; b++) {
+                xout[b * d + i] = kernels.dot_q8(s->xq + b * n, s->xq_s + b * n / gs, wrow, wscale, n, gs);
+            }
+        }
+    }
+}
+
+static inline float swiglu(float h1, float h3) {
+    // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid, elementwise multiply with w3(x)
+    return h1 * (1.0f / (1.0f + expf(-h1))) * h3;
+}
+
+void linear_swiglu(RunState* s, float* xout, float* x, Tensor* w1, Tensor* w3, int l, int n, int d, int batch) {
+    // xout (batch,d) = silu(X @ W1) * (X @ W3) for layer l of w1 and w3 (d,n): row i of
+    // both is done by the same thread and goes straight through the SwiGLU non-linearity,
+    // X is quantized once for both
+    size_t offset = (size_t)l * n * d;
+    int gs = w1->group_size;
+    if (w1->panels != NULL) {
+        int n_panels = (d + PANEL_ROWS - 1) / PANEL_ROWS;
+        int p;
+        #pragma omp for schedule(static) private(p)
+        for (p = 0; p < n_panels; p++) {
+            float* panel1 = w1->panels + l * panel_size(d, n) + (size_t)p * n * PANEL_ROWS;
+            float* panel3 = w3->panels + l * panel_size(d, n) + (size_t)p * n * PANEL_ROWS;
+            int rows = d - p * PANEL_ROWS < PANEL_ROWS ? d - p * PANEL_ROWS : PANEL_ROWS;
+            for (int b = 0; b < batch; b++) {
+                float h1[PANEL_ROWS], h3[PANEL_ROWS];
+                kernels.dot_panel(h1, panel1, x + b * n, n);
+                kernels.dot_panel(h3, panel3, x + b * n, n);
+                for (int r = 0; r < rows; r++) {
+                    xout[b * d + p * PANEL_ROWS + r] = swiglu(h1[r], h3[r]);
+                }
+            }
+        }
+        return;
+    }
+    if (w1->q != NULL) {
+        quantize_rows(s->xq, s->xq_s, x, batch * n, gs);
+    }
+    int i;
+    #pragma omp for schedule(static) private(i)
     for (i = 0; i < d; i++) {
-        float val = 0.0f;
-        for (int j = 0; j < n; j++) {
-            val += w[i * n + j] * x[j];
+        size_t row = offset + (size_t)i * n;
+        for (int b = 0; b < batch; b++) {
+            float h1, h3;
+            if (w1->q == NULL) {
+                h1 = kernels.dot(w1->f + row, x + b * n, n);
+                h3 = kernels.dot(w3->f + row, x + b * n, n);
+            } else {
+                int8_t* xq = s->xq + b * n;
+                float* xs = s->xq_s + b * n / gs;
+                h1 = kernels.dot_q8(xq, xs, w1->q + row, w1->s + row / gs, n, gs);
+                h3 = kernels.dot_q8(xq, xs, w3->q + row, w3->s + row / gs, n, gs);
+            }
+            xout[b * d + i] = swiglu(h1, h3);
+        }
+    }
+}
+
+void tensor_row(float* out, Tensor* t, int row, int n) {
+    // fp32 copy of row `row` of the (rows, n) tensor t, e.g. a token embedding
+    if (t->q == NULL) {
+        memcpy(out, t->f + (size_t)row * n, n * sizeof(float));
+        return;
+    }
+    int8_t* q = t->q + (size_t)row * n;
+    float* scale = t->s + (size_t)row * n / t->group_size;
+    for (int i = 0; i < n; i++) {
+        out[i] = q[i] * scale[i / t->group_size];
+    }
+}
+
+void rope_pairs(float* out, RunState* s, int pos, int head_size) {
+    // the (cos, sin) of every pair of a head at position pos. pair i / 2 of the head turns
+    // with frequency theta^(-i / head_size), the same at every layer
+    float scaled_pos = pos / s->rope_scale;
+    for (int i = 0; i < head_size; i += 2) {
+        float freq = 1.0f / powf(s->rope_theta, i / (float)head_size);
+        float val = scaled_pos * freq;
+        out[i] = cosf(val);
+        out[i + 1] = sinf(val);
+    }
+}
+
+const float* rope_row(RunState* s, Config* p, int pos) {
+    // the rope_pairs of position pos < seq_len, its block of the table is computed the
+    // first time a sequence gets there
+    int head_size = p->dim / p->n_heads;
+    int b = pos / ROPE_BLOCK;
+    if (!s->rope_blocks[b]) {
+        float* block = malloc((size_t)ROPE_BLOCK * head_size * sizeof(float));
+        if (!block) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        for (int t = 0; t < ROPE_BLOCK; t++) {
+            rope_pairs(block + t * head_size, s, b * ROPE_BLOCK + t, head_size);
+        }
+        s->rope_blocks[b] = block;
+    }
+    return s->rope_blocks[b] + (size_t)(pos % ROPE_BLOCK) * head_size;
+}
+
+void rope_rows(RunState* s, Config* p, int* pos, int batch) {
+    // point rope_cur at the pairs of the positions of a batch, before the threads read
+    // them. a sliding window goes on past the table, those rows are computed for every
+    // token instead, so the memory stays the same however long a sequence runs
+    int head_size = p->dim / p->n_heads;
+    for (int b = 0; b < batch; b++) {
+        if (pos[b] < s->n_rope_blocks * ROPE_BLOCK) {
+            s->rope_cur[b] = rope_row(s, p, pos[b]);
+        } else {
+            rope_pairs(s->rope_far + b * head_size, s, pos[b], head_size);
+            s->rope_cur[b] = s->rope_far + b * head_size;
+        }
+    }
+}
+
+void rope(RunState* s, Config* p, float* q, float* k, int batch) {
+    // RoPE relative positional encoding: complex-valued rotate q and k in each head, of
+    // the rows of q (batch,dim) and k (batch,kv_dim), row b by rope_cur[b]. a head per
+    // iteration, rope_rows has to have looked up the positions of the rows already
+    int head_size = p->dim / p->n_heads;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int heads = p->n_heads + p->n_kv_heads;
+    int u;
+    #pragma omp for schedule(static) private(u)
+    for (u = 0; u < batch * heads; u++) {
+        int b = u / heads;
+        int h = u % heads;
+        float* x = h < p->n_heads ? q + b * p->dim + h * head_size : k + b * kv_dim + (h - p->n_heads) * head_size;
+        kernels.rope(x, s->rope_cur[b], head_size);
+    }
+}
+
+void attention(float* xb, float* q, int8_t* qq, float* qs, RunState* s, Config* p, int slot, int l,
+               int kv_off, int pos, int kv_dim, int head_size) {
+    // attention of one query head over timesteps 0..pos of layer l of kv slot `slot`,
+    // kv_off is the offset of its key/value head in a row. a single pass over the pages
+    // of the page table with an online softmax: the scores of a page are exponentiated
+    // against the running max, and what xb and the sum hold so far is rescaled whenever
+    // that max grows. so the keys and values are read once, while they are in cache.
+    // with an int8 kv cache the scores are int8 dot products with the query quantized
+    // into qq (head_size,) with the scale qs, and the values are scaled as they are summed
+    float tile[KV_PAGE_SIZE];
+    float max_val = -INFINITY;
+    float sum = 0.0f;
+    memset(xb, 0, head_size * sizeof(float));
+    // the timesteps to attend to: all of them including the current one, or with a full
+    // sliding window the sinks and the last kv_window - kv_sinks. the keys were rotated
+    // at their own positions, so the order of the rows in the ring does not matter
+    int ranges[2][2] = { { 0, pos }, { 0, -1 } };
+    int recent = pos + 1 - (s->kv_window - s->kv_sinks); // the first position of the window
+    if (s->kv_window > 0 && recent > s->kv_sinks) {
+        ranges[0][1] = s->kv_sinks - 1;
+        ranges[1][0] = recent;
+        ranges[1][1] = pos;
+    }
+    for (int r = 0; r < 2; r++) {
+        for (int t0 = ranges[r][0], n; t0 <= ranges[r][1]; t0 += n) {
+            // a tile ends with the range, its page, or where the ring wraps around
+            int row = kv_row(s, t0);
+            n = ranges[r][1] + 1 - t0;
+            if (n > KV_PAGE_SIZE - row % KV_PAGE_SIZE) { n = KV_PAGE_SIZE - row % KV_PAGE_SIZE; }
+            if (n > s->kv_capacity - row) { n = s->kv_capacity - row; }
+            float* k = NULL, *v = NULL, *ks = NULL, *vs = NULL;
+            int8_t* kq = NULL, *vq = NULL;
+            if (s->kv_int8) {
+                kq = kv_q8(s, p, slot, l, t0, 0, &ks) + kv_off;
+                vq = kv_q8(s, p, slot, l, t0, 1, &vs) + kv_off;
+                ks += kv_off / head_size;
+                vs += kv_off / head_size;
+            } else {
+                k = kv_key(s, p, slot, l, t0) + kv_off;
+                v = kv_value(s, p, slot, l, t0) + kv_off;
+            }
+            float tile_max = -INFINITY;
+            for (int t = 0; t < n; t++) {
+                // calculate the attention score as the dot product of q and the key vector
+                if (s->kv_int8) {
+                    tile[t] = kernels.dot_q8(qq, qs, kq + t * kv_dim, ks + t * p->n_kv_heads, head_size, head_size);
+                } else {
+                    tile[t] = kernels.dot(q, k + t * kv_dim, head_size);
+                }
+                tile[t] /= sqrtf(head_size);
+                if (tile[t] > tile_max) { tile_max = tile[t]; }
+            }
+            if (tile_max > max_val) {
+                float correction = expf(max_val - tile_max); // 0 for the first page
+                for (int i = 0; i < head_size; i++) { xb[i] *= correction; }
+                sum *= correction;
+                max_val = tile_max;
+            }
+            sum += kernels.sum_exp(tile, max_val, n);
+            for (int t = 0; t < n; t++) {
+                // accumulate the value vector weighted by its attention weight into xb
+                if (s->kv_int8) {
+                    kernels.axpy_q8(xb, tile[t] * vs[t * p->n_kv_heads], vq + t * kv_dim, head_size);
+                } else {
+                    kernels.axpy(xb, tile[t], v + t * kv_dim, head_size);
+                }
+            }
         }
-        xout[i] = val;
     }
+    // normalize by the softmax denominator, over the timesteps attended to
+    float inv_sum = 1.0f / sum;
+    for (int i = 0; i < head_size; i++) { xb[i] *= inv_sum; }
 }
 
 float* forward(Transformer* transformer, int token, int pos) {
@@ -244,351 +1979,369 @@ float* forward(Transformer* transformer, int token, int pos) {
     int hidden_dim =  p->hidden_dim;
     int head_size = dim / p->n_heads;
 
-    // copy the token embedding into x
-    float* content_row = w->token_embedding_table + token * dim;
-    memcpy(x, content_row, dim*sizeof(*x));
+    // copy the token embedding into x, make room for it in the kv cache, and build the
+    // RoPE table of pos before the threads read it
+    tensor_row(x, &w->token_embedding_table, token, dim);
+    kv_reserve(s, p, 0, pos + 1);
+    rope_rows(s, p, &pos, 1);
+    double t = profile_now(); // start of the stage being timed, when profiling
 
+    // one parallel region for the whole pass: its threads stay around from one block to
+    // the next and only meet at the barriers of the blocks, rather than being forked and
+    // joined for every loop. the stage timings are taken by the master thread
+    #pragma omp parallel
+    {
     // forward all the layers
     for(int l = 0; l < p->n_layers; l++) {
 
         // attention rmsnorm
-        rmsnorm(s->xb, x, w->rms_att_weight + l*dim, dim);
+        rmsnorm_rows(s->xb, x, w->rms_att_weight + l*dim, dim, 1);
+        #pragma omp master
+        profile_stage(STAGE_RMSNORM, l, pos, 1, &t);
 
-        // qkv matmuls for this position
-        matmul(s->q, s->xb, w->wq + l*dim*dim, dim, dim);
-        matmul(s->k, s->xb, w->wk + l*dim*kv_dim, dim, kv_dim);
-        matmul(s->v, s->xb, w->wv + l*dim*kv_dim, dim, kv_dim);
+        // qkv matmuls for this position, in one pass over the rows of wq, wk and wv
+        LinearPart qkv[] = { { &w->wq, s->q, dim }, { &w->wk, s->k, kv_dim }, { &w->wv, s->v, kv_dim } };
+        linear_fused(s, qkv, 3, s->xb, l, dim, 1);
+        #pragma omp master
+        profile_stage(STAGE_QKV, l, pos, 1, &t);
 
         // RoPE relative positional encoding: complex-valued rotate q and k in each head
-        for (int i = 0; i < dim; i+=2) {
-            int head_dim = i % head_size;
-            float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
-            float val = pos * freq;
-            float fcr = cosf(val);
-            float fci = sinf(val);
-            int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
-            for (int v = 0; v < rotn; v++) {
-                float* vec = v == 0 ? s->q : s->k; // the vector to rotate (query or key)
-                float v0 = vec[i];
-                float v1 = vec[i+1];
-                vec[i]   = v0 * fcr - v1 * fci;
-                vec[i+1] = v0 * fci + v1 * fcr;
-            }
-        }
+        rope(s, p, s->q, s->k, 1);
+        #pragma omp master
+        profile_stage(STAGE_ROPE, l, pos, 1, &t);
 
         // save key,value at this time step (pos) to our kv cache
-        int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
-        float* key_cache_row = s->key_cache + loff + pos * kv_dim;
-        float* value_cache_row = s->value_cache + loff + pos * kv_dim;
-        memcpy(key_cache_row, s->k, kv_dim * sizeof(*key_cache_row));
-        memcpy(value_cache_row, s->v, kv_dim * sizeof(*value_cache_row));
+        #pragma omp single
+        {
+            kv_put(s, p, 0, l, pos, 0, s->k);
+            kv_put(s, p, 0, l, pos, 1, s->v);
+        }
+        if (s->kv_int8) { quantize_rows(s->xq, s->xq_s, s->q, dim, head_size); }
 
         // multihead attention. iterate over all heads
         int h;
-        #pragma omp parallel for private(h)
+        #pragma omp for schedule(static) private(h)
         for (h = 0; h < p->n_heads; h++) {
-            // get the query vector for this head
-            float* q = s->q + h * head_size;
-            // attention scores for this head
-            float* att = s->att + h * p->seq_len;
-            // iterate over all timesteps, including the current one
-            for (int t = 0; t <= pos; t++) {
-                // get the key vector for this head and at this timestep
-                float* k = s->key_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // calculate the attention score as the dot product of q and k
-                float score = 0.0f;
-                for (int i = 0; i < head_size; i++) {
-                    score += q[i] * k[i];
-                }
-                score /= sqrtf(head_size);
-                // save the score to the attention buffer
-                att[t] = score;
-            }
-
-            // softmax the scores to get attention weights, from 0..pos inclusively
-            softmax(att, pos + 1);
-
-            // weighted sum of the values, store back into xb
-            float* xb = s->xb + h * head_size;
-            memset(xb, 0, head_size * sizeof(float));
-            for (int t = 0; t <= pos; t++) {
-                // get the value vector for this head and at this timestep
-                float* v = s->value_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // get the attention weight for this timestep
-                float a = att[t];
-                // accumulate the weighted value into xb
-                for (int i = 0; i < head_size; i++) {
-                    xb[i] += a * v[i];
-                }
-            }
+            attention(s->xb + h * head_size, s->q + h * head_size, s->xq + h * head_size, s->xq_s + h,
+                      s, p, 0, l, (h / kv_mul) * head_size, pos, kv_dim, head_size);
         }
+        #pragma omp master
+        profile_stage(STAGE_ATTENTION, l, pos, 1, &t);
 
         // final matmul to get the output of the attention
-        matmul(s->xb2, s->xb, w->wo + l*dim*dim, dim, dim);
+        linear(s, s->xb2, s->xb, &w->wo, l, dim, dim, 1);
 
         // residual connection back into x
-        for (int i = 0; i < dim; i++) {
-            x[i] += s->xb2[i];
-        }
+        residual(x, s->xb2, dim);
+        #pragma omp master
+        profile_stage(STAGE_WO, l, pos, 1, &t);
 
         // ffn rmsnorm
-        rmsnorm(s->xb, x, w->rms_ffn_weight + l*dim, dim);
+        rmsnorm_rows(s->xb, x, w->rms_ffn_weight + l*dim, dim, 1);
+        #pragma omp master
+        profile_stage(STAGE_RMSNORM, l, pos, 1, &t);
 
         // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
-        // first calculate self.w1(x) and self.w3(x)
-        matmul(s->hb, s->xb, w->w1 + l*dim*hidden_dim, dim, hidden_dim);
-        matmul(s->hb2, s->xb, w->w3 + l*dim*hidden_dim, dim, hidden_dim);
-
-        // SwiGLU non-linearity
-        for (int i = 0; i < hidden_dim; i++) {
-            float val = s->hb[i];
-            // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
-            val *= (1.0f / (1.0f + expf(-val)));
-            // elementwise multiply with w3(x)
-            val *= s->hb2[i];
-            s->hb[i] = val;
-        }
+        // self.w1(x) and self.w3(x) together, through the SwiGLU non-linearity
+        linear_swiglu(s, s->hb, s->xb, &w->w1, &w->w3, l, dim, hidden_dim, 1);
 
         // final matmul to get the output of the ffn
-        matmul(s->xb, s->hb, w->w2 + l*dim*hidden_dim, hidden_dim, dim);
+        linear(s, s->xb, s->hb, &w->w2, l, hidden_dim, dim, 1);
 
         // residual connection
-        for (int i = 0; i < dim; i++) {
-            x[i] += s->xb[i];
-        }
+        residual(x, s->xb, dim);
+        #pragma omp master
+        profile_stage(STAGE_FFN, l, pos, 1, &t);
     }
 
     // final rmsnorm
-    rmsnorm(x, x, w->rms_final_weight, dim);
+    rmsnorm_rows(x, x, w->rms_final_weight, dim, 1);
+    #pragma omp master
+    profile_stage(STAGE_RMSNORM, -1, pos, 1, &t);
 
     // classifier into logits
-    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
+    linear(s, s->logits, x, &w->wcls, 0, p->dim, p->vocab_size, 1);
+    #pragma omp master
+    profile_stage(STAGE_CLASSIFIER, -1, pos, 1, &t);
+    }
+    profile_token(1, 0);
     return s->logits;
 }
 
-// ----------------------------------------------------------------------------
-// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
+void forward_tokens(Transformer* transformer, int* tokens, int n_tokens, int pos, int slot, float* logits) {
+    // push tokens[0..n_tokens) at positions pos.. through the model, PREFILL_BATCH at
+    // a time, as matrix-matrix products, into kv cache slot `slot`. with logits, these
+    // get the (n_tokens, vocab_size) logits of all the tokens, e.g. to verify the tokens
+    // of a draft model at once. without, the classifier is skipped as in a prefill
 
-typedef struct {
-    char *str;
-    int id;
-} TokenIndex;
+    // a few convenience variables
+    Config* p = &transformer->config;
+    TransformerWeights* w = &transformer->weights;
+    RunState* s = &transformer->state;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
+    int hidden_dim =  p->hidden_dim;
+    int head_size = dim / p->n_heads;
 
-typedef struct {
-    char** vocab;
-    float* vocab_scores;
-    TokenIndex *sorted_vocab;
-    int vocab_size;
-    unsigned int max_token_length;
-    unsigned char byte_pieces[512]; // stores all single-byte strings
-} Tokenizer;
-
-int compare_tokens(const void *a, const void *b) {
-    return strcmp(((TokenIndex*)a)->str, ((TokenIndex*)b)->str);
-}
-
-void build_tokenizer(Tokenizer* t, char* tokenizer_path, int vocab_size) {
-    // i should have written the vocab_size into the tokenizer file... sigh
-    t->vocab_size = vocab_size;
-    // malloc space to hold the scores and the strings
-    t->vocab = (char**)malloc(vocab_size * sizeof(char*));
-    t->vocab_scores = (float*)malloc(vocab_size * sizeof(float));
-    t->sorted_vocab = NULL; // initialized lazily
-    for (int i = 0; i < 256; i++) {
-        t->byte_pieces[i * 2] = (unsigned char)i;
-        t->byte_pieces[i * 2 + 1] = '\0';
-    }
-    // read in the file
-    FILE *file = fopen(tokenizer_path, "rb");
-    if (!file) { fprintf(stderr, "couldn't load %s\n", tokenizer_path); exit(EXIT_FAILURE); }
-    if (fread(&t->max_token_length, sizeof(int), 1, file) != 1) { fprintf(stderr, "failed read\n"); exit(EXIT_FAILURE); }
-    int len;
-    for (int i = 0; i < vocab_size; i++) {
-        if (fread(t->vocab_scores + i, sizeof(float), 1, file) != 1) { fprintf(stderr, "failed read\n"); exit(EXIT_FAILURE);}
-        if (fread(&len, sizeof(int), 1, file) != 1) { fprintf(stderr, "failed read\n"); exit(EXIT_FAILURE); }
-        t->vocab[i] = (char *)malloc(len + 1);
-        if (fread(t->vocab[i], len, 1, file) != 1) { fprintf(stderr, "failed read\n"); exit(EXIT_FAILURE); }
-        t->vocab[i][len] = '\0'; // add the string terminating token
-    }
-    fclose(file);
-}
+    for (int start = 0; start < n_tokens; start += PREFILL_BATCH) {
+        int batch = n_tokens - start < PREFILL_BATCH ? n_tokens - start : PREFILL_BATCH;
+        int bpos = pos + start; // position of the first token of this batch
+        float* x = s->xs;
 
-void free_tokenizer(Tokenizer* t) {
-    for (int i = 0; i < t->vocab_size; i++) { free(t->vocab[i]); }
-    free(t->vocab);
-    free(t->vocab_scores);
-    free(t->sorted_vocab);
-}
+        // copy the token embeddings into the rows of x, make room for them in the kv cache,
+        // and build the RoPE tables of their positions before the threads read them
+        int positions[PREFILL_BATCH];
+        for (int b = 0; b < batch; b++) {
+            tensor_row(x + b * dim, &w->token_embedding_table, tokens[start + b], dim);
+            positions[b] = bpos + b;
+        }
+        kv_reserve(s, p, slot, bpos + batch);
+        rope_rows(s, p, positions, batch);
+        double t = profile_now(); // start of the stage being timed, when profiling
 
-char* decode(Tokenizer* t, int prev_token, int token) {
-    char *piece = t->vocab[token];
-    // following BOS (1) token, sentencepiece decoder strips any leading whitespace (see PR #89)
-    if (prev_token == 1 && piece[0] == ' ') { piece++; }
-    // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
-    // parse this and convert and return the actual byte
-    unsigned char byte_val;
-    if (sscanf(piece, "<0x%02hhX>", &byte_val) == 1) {
-        piece = (char*)t->byte_pieces + byte_val * 2;
-    }
-    return piece;
-}
+        // one parallel region per batch, as in forward()
+        #pragma omp parallel
+        {
+        // forward all the layers
+        for(int l = 0; l < p->n_layers; l++) {
+
+            // attention rmsnorm
+            rmsnorm_rows(s->xbs, x, w->rms_att_weight + l*dim, dim, batch);
+            #pragma omp master
+            profile_stage(STAGE_RMSNORM, l, bpos, batch, &t);
+
+            // qkv matmuls for the whole batch, k and v into the rows of hbs and hb2s
+            float* k = s->hbs;
+            float* v = s->hb2s;
+            LinearPart qkv[] = { { &w->wq, s->qs, dim }, { &w->wk, k, kv_dim }, { &w->wv, v, kv_dim } };
+            linear_fused(s, qkv, 3, s->xbs, l, dim, batch);
+            #pragma omp master
+            profile_stage(STAGE_QKV, l, bpos, batch, &t);
+
+            // RoPE relative positional encoding: complex-valued rotate q and k in each head
+            rope(s, p, s->qs, k, batch);
+            #pragma omp master
+            profile_stage(STAGE_ROPE, l, bpos, batch, &t);
+
+            // save key,value of the whole batch to our kv cache
+            int b;
+            #pragma omp for schedule(static) private(b)
+            for (b = 0; b < batch; b++) {
+                kv_put(s, p, slot, l, bpos + b, 0, k + b * kv_dim);
+                kv_put(s, p, slot, l, bpos + b, 1, v + b * kv_dim);
+            }
+            if (s->kv_int8) { quantize_rows(s->xq, s->xq_s, s->qs, batch * dim, head_size); }
+
+            // multihead attention. iterate over all heads, every token of the batch
+            // attends to the timesteps up to and including its own (causal)
+            int u;
+            #pragma omp for schedule(static) private(u)
+            for (u = 0; u < p->n_heads * batch; u++) {
+                int h = u / batch;
+                int r = u % batch;
+                int qi = r * dim + h * head_size;
+                attention(s->xbs + qi, s->qs + qi, s->xq + qi, s->xq_s + qi / head_size,
+                          s, p, slot, l, (h / kv_mul) * head_size,
+                          bpos + r, kv_dim, head_size);
+            }
+            #pragma omp master
+            profile_stage(STAGE_ATTENTION, l, bpos, batch, &t);
+
+            // final matmul to get the output of the attention, reuse qs for it
+            linear(s, s->qs, s->xbs, &w->wo, l, dim, dim, batch);
+
+            // residual connection back into x
+            residual(x, s->qs, batch * dim);
+            #pragma omp master
+            profile_stage(STAGE_WO, l, bpos, batch, &t);
+
+            // ffn rmsnorm
+            rmsnorm_rows(s->xbs, x, w->rms_ffn_weight + l*dim, dim, batch);
+            #pragma omp master
+            profile_stage(STAGE_RMSNORM, l, bpos, batch, &t);
+
+            // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+            // self.w1(x) and self.w3(x) together, through the SwiGLU non-linearity
+            linear_swiglu(s, s->hbs, s->xbs, &w->w1, &w->w3, l, dim, hidden_dim, batch);
+
+            // final matmul to get the output of the ffn
+            linear(s, s->xbs, s->hbs, &w->w2, l, hidden_dim, dim, batch);
 
-void safe_printf(char *piece) {
-    // piece might be a raw byte token, and we only want to print printable chars or whitespace
-    // because some of the other bytes can be various control codes, backspace, etc.
-    if (piece == NULL) { return; }
-    if (piece[0] == '\0') { return; }
-    if (piece[1] == '\0') {
-        unsigned char byte_val = piece[0];
-        if (!(isprint(byte_val) || isspace(byte_val))) {
-            return; // bad byte, don't print it
+            // residual connection
+            residual(x, s->xbs, batch * dim);
+            #pragma omp master
+            profile_stage(STAGE_FFN, l, bpos, batch, &t);
         }
+
+        if (logits != NULL) {
+            // final rmsnorm
+            rmsnorm_rows(x, x, w->rms_final_weight, dim, batch);
+            #pragma omp master
+            profile_stage(STAGE_RMSNORM, -1, bpos, batch, &t);
+
+            // classifier into the logits rows of this batch
+            linear(s, logits + (size_t)start * p->vocab_size, x, &w->wcls, 0, p->dim, p->vocab_size, batch);
+            #pragma omp master
+            profile_stage(STAGE_CLASSIFIER, -1, bpos, batch, &t);
+        }
+        }
+        profile_token(batch, logits == NULL);
     }
-    printf("%s", piece);
 }
 
-int str_lookup(char *str, TokenIndex *sorted_vocab, int vocab_size) {
-    // efficiently find the perfect match for str in vocab, return its index or -1 if not found
-    TokenIndex tok = { .str = str }; // acts as the key to search for
-    TokenIndex *res = bsearch(&tok, sorted_vocab, vocab_size, sizeof(TokenIndex), compare_tokens);
-    return res != NULL ? res->id : -1;
+void forward_prefill(Transformer* transformer, int* tokens, int n_tokens, int pos, int slot) {
+    // fill the kv cache with the prompt tokens, their logits are not needed: the last
+    // prompt token still goes through forward() to get those
+    forward_tokens(transformer, tokens, n_tokens, pos, slot, NULL);
 }
 
-void encode(Tokenizer* t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens) {
-    // encode the string text (input) into an upper-bound preallocated tokens[] array
-    // bos != 0 means prepend the BOS token (=1), eos != 0 means append the EOS token (=2)
-    if (text == NULL) { fprintf(stderr, "cannot encode NULL text\n"); exit(EXIT_FAILURE); }
+float* forward_batch(Transformer* transformer, int* tokens, int* pos, int* slots, int n_seqs) {
+    // advance n_seqs independent sequences by one token each: sequence i feeds tokens[i]
+    // at position pos[i] of kv cache slot slots[i], the slots must all be different.
+    // the matmuls of up to PREFILL_BATCH sequences share every load of the weights.
+    // returns the logits, the row of sequence i is i (not its slot)
 
-    if (t->sorted_vocab == NULL) {
-        // lazily malloc and sort the vocabulary
-        t->sorted_vocab = malloc(t->vocab_size * sizeof(TokenIndex));
-        for (int i = 0; i < t->vocab_size; i++) {
-            t->sorted_vocab[i].str = t->vocab[i];
-            t->sorted_vocab[i].id = i;
-        }
-        qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
+    // a few convenience variables
+    Config* p = &transformer->config;
+    TransformerWeights* w = &transformer->weights;
+    RunState* s = &transformer->state;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
+    int hidden_dim =  p->hidden_dim;
+    int head_size = dim / p->n_heads;
+    if (n_seqs > s->n_slots) {
+        fprintf(stderr, "forward_batch: %d sequences but only %d kv slots\n", n_seqs, s->n_slots);
+        exit(EXIT_FAILURE);
     }
 
-    // create a temporary buffer that will store merge candidates of always two consecutive tokens
-    // *2 for concat, +1 for null terminator +2 for UTF8 (in case max_token_length is 1)
-    char* str_buffer = malloc((t->max_token_length*2 +1 +2) * sizeof(char));
-    size_t str_len = 0;
+    for (int start = 0; start < n_seqs; start += PREFILL_BATCH) {
+        int batch = n_seqs - start < PREFILL_BATCH ? n_seqs - start : PREFILL_BATCH;
+        int* bpos = pos + start;
+        int* bslots = slots + start;
+        float* x = s->xs;
+
+        // copy the token embeddings into the rows of x, make room for them in the kv cache,
+        // and build the RoPE tables of their positions before the threads read them
+        for (int b = 0; b < batch; b++) {
+            tensor_row(x + b * dim, &w->token_embedding_table, tokens[start + b], dim);
+            kv_reserve(s, p, bslots[b], bpos[b] + 1);
+        }
+        rope_rows(s, p, bpos, batch);
+        double t = profile_now(); // start of the stage being timed, when profiling
 
-    // start at 0 tokens
-    *n_tokens = 0;
+        // one parallel region per batch, as in forward()
+        #pragma omp parallel
+        {
+        // forward all the layers
+        for(int l = 0; l < p->n_layers; l++) {
 
-    // add optional BOS (=1) token, if desired
-    if (bos) tokens[(*n_tokens)++] = 1;
+            // attention rmsnorm
+            rmsnorm_rows(s->xbs, x, w->rms_att_weight + l*dim, dim, batch);
+            #pragma omp master
+            profile_stage(STAGE_RMSNORM, l, bpos[0], batch, &t);
 
-    // add_dummy_prefix is true by default
-    // so prepend a dummy prefix token to the input string, but only if text != ""
-    // TODO: pretty sure this isn't correct in the general case but I don't have the
-    // energy to read more of the sentencepiece code to figure out what it's doing
-    if (text[0] != '\0') {
-        int dummy_prefix = str_lookup(" ", t->sorted_vocab, t->vocab_size);
-        tokens[(*n_tokens)++] = dummy_prefix;
-    }
+            // qkv matmuls for all the sequences, k and v into the rows of hbs and hb2s
+            // since every sequence has its own place in the kv cache
+            float* k = s->hbs;
+            float* v = s->hb2s;
+            LinearPart qkv[] = { { &w->wq, s->qs, dim }, { &w->wk, k, kv_dim }, { &w->wv, v, kv_dim } };
+            linear_fused(s, qkv, 3, s->xbs, l, dim, batch);
+            #pragma omp master
+            profile_stage(STAGE_QKV, l, bpos[0], batch, &t);
 
-    // Okay UTF-8 time. This will get messy. Here is the reference from Wikipedia:
-    // Code point ↔ UTF-8 conversion
-    // First code point	Last code point	Byte 1	Byte 2	Byte 3	Byte 4
-    // U+0000	U+007F	    0xxxxxxx
-    // U+0080	U+07FF	    110xxxxx	10xxxxxx
-    // U+0800	U+FFFF	    1110xxxx	10xxxxxx	10xxxxxx
-    // U+10000	U+10FFFF    11110xxx	10xxxxxx	10xxxxxx	10xxxxxx
+            // RoPE relative positional encoding: complex-valued rotate q and k in each head
+            rope(s, p, s->qs, k, batch);
+            #pragma omp master
+            profile_stage(STAGE_ROPE, l, bpos[0], batch, &t);
 
-    // process the raw (UTF-8) byte sequence of the input string
-    for (char *c = text; *c != '\0'; c++) {
+            // save key,value of every sequence at its position in its kv slot
+            int b;
+            #pragma omp for schedule(static) private(b)
+            for (b = 0; b < batch; b++) {
+                kv_put(s, p, bslots[b], l, bpos[b], 0, k + b * kv_dim);
+                kv_put(s, p, bslots[b], l, bpos[b], 1, v + b * kv_dim);
+            }
+            if (s->kv_int8) { quantize_rows(s->xq, s->xq_s, s->qs, batch * dim, head_size); }
 
-        // reset buffer if the current byte is ASCII or a leading byte
-        // 0xC0 is 11000000, so (*c & 0xC0) keeps the first 2 bits and zeros the rest
-        // 0x80 is 10000000
-        // in UTF-8, all continuation bytes start with "10" in first two bits
-        // so in English this is: "if this byte is not a continuation byte"
-        if ((*c & 0xC0) != 0x80) {
-            // this byte must be either a leading byte (11...) or an ASCII char (0x...)
-            // => reset our location, as we're starting a new UTF-8 codepoint
-            str_len = 0;
-        }
+            // multihead attention. iterate over all heads, every sequence attends to
+            // its own kv slot only
+            int u;
+            #pragma omp for schedule(static) private(u)
+            for (u = 0; u < p->n_heads * batch; u++) {
+                int h = u / batch;
+                int r = u % batch;
+                int qi = r * dim + h * head_size;
+                attention(s->xbs + qi, s->qs + qi, s->xq + qi, s->xq_s + qi / head_size,
+                          s, p, bslots[r], l, (h / kv_mul) * head_size,
+                          bpos[r], kv_dim, head_size);
+            }
+            #pragma omp master
+            profile_stage(STAGE_ATTENTION, l, bpos[0], batch, &t);
 
-        // append the current byte to the buffer
-        str_buffer[str_len++] = *c; // ++ is post-increment, incremented after this line
-        str_buffer[str_len] = '\0';
-
-        // while the next character is a continuation byte, continue appending
-        // but if there are too many of them, just stop to avoid overruning str_buffer size.
-        if ((*(c+1) & 0xC0) == 0x80 && str_len < 4) {
-            continue;
-        }
+            // final matmul to get the output of the attention, reuse qs for it
+            linear(s, s->qs, s->xbs, &w->wo, l, dim, dim, batch);
 
-        // ok c+1 is not a continuation byte, so we've read in a full codepoint
-        int id = str_lookup(str_buffer, t->sorted_vocab, t->vocab_size);
+            // residual connection back into x
+            residual(x, s->qs, batch * dim);
+            #pragma omp master
+            profile_stage(STAGE_WO, l, bpos[0], batch, &t);
 
-        if (id != -1) {
-            // we found this codepoint in vocab, add it as a token
-            tokens[(*n_tokens)++] = id;
-        } else {
-            // byte_fallback encoding: just encode each byte as a token
-            // +3 is here because the first 3 vocab elements are <unk>, <s>, </s>
-            // so the individual bytes only start at index 3
-            for (int i=0; i < str_len; i++) {
-                tokens[(*n_tokens)++] = (unsigned char)str_buffer[i] + 3;
-            }
-        }
-        str_len = 0; // protect against a sequence of stray UTF8 continuation bytes
-    }
+            // ffn rmsnorm
+            rmsnorm_rows(s->xbs, x, w->rms_ffn_weight + l*dim, dim, batch);
+            #pragma omp master
+            profile_stage(STAGE_RMSNORM, l, bpos[0], batch, &t);
 
-    // merge the best consecutive pair each iteration, according the scores in vocab_scores
-    while (1) {
-        float best_score = -1e10;
-        int best_id = -1;
-        int best_idx = -1;
+            // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+            // self.w1(x) and self.w3(x) together, through the SwiGLU non-linearity
+            linear_swiglu(s, s->hbs, s->xbs, &w->w1, &w->w3, l, dim, hidden_dim, batch);
 
-        for (int i=0; i < (*n_tokens-1); i++) {
-            // check if we can merge the pair (tokens[i], tokens[i+1])
-            sprintf(str_buffer, "%s%s", t->vocab[tokens[i]], t->vocab[tokens[i+1]]);
-            int id = str_lookup(str_buffer, t->sorted_vocab, t->vocab_size);
-            if (id != -1 && t->vocab_scores[id] > best_score) {
-                // this merge pair exists in vocab! record its score and position
-                best_score = t->vocab_scores[id];
-                best_id = id;
-                best_idx = i;
-            }
-        }
+            // final matmul to get the output of the ffn
+            linear(s, s->xbs, s->hbs, &w->w2, l, hidden_dim, dim, batch);
 
-        if (best_idx == -1) {
-            break; // we couldn't find any more pairs to merge, so we're done
+            // residual connection
+            residual(x, s->xbs, batch * dim);
+            #pragma omp master
+            profile_stage(STAGE_FFN, l, bpos[0], batch, &t);
         }
 
-        // merge the consecutive pair (best_idx, best_idx+1) into new token best_id
-        tokens[best_idx] = best_id;
-        // delete token at position best_idx+1, shift the entire sequence back 1
-        for (int i = best_idx+1; i < (*n_tokens-1); i++) {
-            tokens[i] = tokens[i+1];
+        // final rmsnorm
+        rmsnorm_rows(x, x, w->rms_final_weight, dim, batch);
+        #pragma omp master
+        profile_stage(STAGE_RMSNORM, -1, bpos[0], batch, &t);
+
+        // classifier into the logits rows of these sequences
+        linear(s, s->logits + (size_t)start * p->vocab_size, x, &w->wcls, 0, p->dim, p->vocab_size, batch);
+        #pragma omp master
+        profile_stage(STAGE_CLASSIFIER, -1, bpos[0], batch, &t);
         }
-        (*n_tokens)--; // token length decreased
+        profile_token(batch, 0);
     }
-
-    // add optional EOS (=2) token, if desired
-    if (eos) tokens[(*n_tokens)++] = 2;
-
-    free(str_buffer);
+    return s->logits;
 }
 
+// ----------------------------------------------------------------------------
+// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens is in
+// tokenizer.h, shared with run_gpu.c, together with decode and safe_printf
+
 // ----------------------------------------------------------------------------
 // The Sampler, which takes logits and returns a sampled token
-// sampling can be done in a few ways: greedy argmax, sampling, top-p sampling
+// sampling can be done in a few ways: greedy argmax, sampling, top-k, min-p and top-p
+// sampling, the last three can be combined
 
 typedef struct {
     float prob;
     int index;
-} ProbIndex; // struct used when sorting probabilities during top-p sampling
+} ProbIndex; // struct used when selecting and sorting the candidate tokens
 
 typedef struct {
     int vocab_size;
-    ProbIndex* probindex; // buffer used in top-p sampling
+    ProbIndex* probindex; // buffer used in top-k, min-p and top-p sampling
     float temperature;
     float topp;
+    int topk; // keep the k most likely tokens, 0 = off
+    float minp; // keep the tokens at least minp times as likely as the most likely one, 0 = off
     unsigned long long rng_state;
 } Sampler;
 
@@ -623,58 +2376,155 @@ int compare(const void* a, const void* b) {
     ProbIndex* b_ = (ProbIndex*) b;
     if (a_->prob > b_->prob) return -1;
     if (a_->prob < b_->prob) return 1;
-    return 0;
+    // equally likely tokens in the order of their ids, however select_* left them
+    return a_->index - b_->index;
 }
 
-int sample_topp(float* probabilities, int n, float topp, ProbIndex* probindex, float coin) {
-    // top-p sampling (or "nucleus sampling") samples from the smallest set of
-    // tokens that exceed probability topp. This way we never sample tokens that
-    // have very low probabilities and are less likely to go "off the rails".
-    // coin is a random number in [0, 1), usually from random_f32()
+void partition3(ProbIndex* a, int n, float pivot, int* n_gt, int* n_eq) {
+    // reorder a into the entries more likely than pivot, as likely, then less likely
+    int lo = 0, i = 0, hi = n;
+    while (i < hi) {
+        ProbIndex tmp = a[i];
+        if (tmp.prob > pivot) {
+            a[i++] = a[lo];
+            a[lo++] = tmp;
+        } else if (tmp.prob < pivot) {
+            a[i] = a[--hi];
+            a[hi] = tmp;
+        } else {
+            i++;
+        }
+    }
+    *n_gt = lo;
+    *n_eq = hi - lo;
+}
+
+void select_topk(ProbIndex* a, int n, int k) {
+    // quickselect: move the k most likely entries of a to its front, in no particular order
+    int lo = 0, hi = n;
+    while (hi - lo > 1) {
+        int n_gt, n_eq;
+        partition3(a + lo, hi - lo, a[lo + (hi - lo) / 2].prob, &n_gt, &n_eq);
+        if (k < lo + n_gt) {
+            hi = lo + n_gt;
+        } else if (k <= lo + n_gt + n_eq) {
+            return;
+        } else {
+            lo += n_gt + n_eq;
+        }
+    }
+}
+
+#define NUCLEUS_SORT 64 // the last stretch of select_nucleus is left to the sort
+#define NUCLEUS_SLACK 1e-3f // allowance for the rounding of its partial sums
+
+int select_nucleus(ProbIndex* a, int n, float topp) {
+    // quickselect on the probability mass: move the most likely entries of a to its front
+    // until they hold more than topp, returns how many that is. they are not sorted, and
+    // their mass is summed in another order than the exact cut in sampler_candidates
+    // will be, so a little more than topp is kept
+    int lo = 0, hi = n;
+    float mass = 0.0f; // of a[0..lo), each of which is at least as likely as a[lo..n)
+    while (hi - lo > NUCLEUS_SORT) {
+        int n_gt, n_eq;
+        float pivot = a[lo + (hi - lo) / 2].prob;
+        partition3(a + lo, hi - lo, pivot, &n_gt, &n_eq);
+        float mass_gt = 0.0f;
+        for (int i = lo; i < lo + n_gt; i++) { mass_gt += a[i].prob; }
+        if (mass + mass_gt > topp + NUCLEUS_SLACK) {
+            hi = lo + n_gt;
+            continue;
+        }
+        mass += mass_gt + n_eq * pivot;
+        lo += n_gt + n_eq;
+        if (mass > topp + NUCLEUS_SLACK) { return lo; }
+    }
+    return hi;
+}
+
+float sampler_temperature(Sampler* sampler, float* logits) {
+    // apply the temperature to the logits, returns the max value (for numerical stability)
+    float max_val = -INFINITY;
+    for (int i = 0; i < sampler->vocab_size; i++) {
+        logits[i] /= sampler->temperature;
+        if (logits[i] > max_val) { max_val = logits[i]; }
+    }
+    return max_val;
+}
+
+int sampler_truncates(Sampler* sampler) {
+    // whether any of top-k, min-p and top-p is on
+    return (sampler->topk > 0 && sampler->topk < sampler->vocab_size) || sampler->minp > 0.0f
+        || (sampler->topp > 0.0f && sampler->topp < 1.0f);
+}
 
+int sampler_candidates(Sampler* sampler, float* exps, float sum) {
+    // the tokens sample() draws from when it truncates the distribution exps / sum, into
+    // probindex in descending order of probability, returns how many. top-k and top-p
+    // select by quickselect, so only the kept tokens are sorted, not the vocabulary
+    int n = sampler->vocab_size;
+    ProbIndex* probindex = sampler->probindex;
+    int topp = sampler->topp > 0.0f && sampler->topp < 1.0f;
+    // values smaller than (1 - topp) / (n - 1) cannot be part of the nucleus, min-p drops
+    // the ones below minp times the largest probability, 1 / sum. so for efficiency we
+    // crop these out as candidates right away, while normalizing
+    float cutoff = topp ? (1.0f - sampler->topp) / (n - 1) : 0.0f;
+    if (sampler->minp * (1.0f / sum) > cutoff) { cutoff = sampler->minp * (1.0f / sum); }
     int n0 = 0;
-    // quicksort indices in descending order of probabilities
-    // values smaller than (1 - topp) / (n - 1) cannot be part of the result
-    // so for efficiency we crop these out as candidates before sorting
-    const float cutoff = (1.0f - topp) / (n - 1);
     for (int i = 0; i < n; i++) {
-        if (probabilities[i] >= cutoff) {
+        float prob = exps[i] / sum;
+        if (prob >= cutoff) {
             probindex[n0].index = i;
-            probindex[n0].prob = probabilities[i];
+            probindex[n0].prob = prob;
             n0++;
         }
     }
+    if (sampler->topk > 0 && sampler->topk < n0) {
+        select_topk(probindex, n0, sampler->topk);
+        n0 = sampler->topk;
+    }
+    if (topp) {
+        n0 = select_nucleus(probindex, n0, sampler->topp);
+    }
     qsort(probindex, n0, sizeof(ProbIndex), compare);
+    if (!topp) { return n0; }
 
     // truncate the list where cumulative probability exceeds topp
     float cumulative_prob = 0.0f;
-    int last_idx = n0 - 1; // in case of rounding errors consider all elements
     for (int i = 0; i < n0; i++) {
         cumulative_prob += probindex[i].prob;
-        if (cumulative_prob > topp) {
-            last_idx = i;
-            break; // we've exceeded topp by including last_idx
+        if (cumulative_prob > sampler->topp) {
+            return i + 1; // we've exceeded topp by including i
         }
     }
+    return n0; // in case of rounding errors consider all elements
+}
 
-    // sample from the truncated list
-    float r = coin * cumulative_prob;
+int sample_candidates(ProbIndex* probindex, int n0, float coin) {
+    // sample from the truncated list of sampler_candidates
+    // coin is a random number in [0, 1), usually from random_f32()
+    float mass = 0.0f;
+    for (int i = 0; i < n0; i++) { mass += probindex[i].prob; }
+    float r = coin * mass;
     float cdf = 0.0f;
-    for (int i = 0; i <= last_idx; i++) {
+    for (int i = 0; i < n0; i++) {
         cdf += probindex[i].prob;
         if (r < cdf) {
             return probindex[i].index;
         }
     }
-    return probindex[last_idx].index; // in case of rounding errors
+    return probindex[n0 - 1].index; // in case of rounding errors
 }
 
-void build_sampler(Sampler* sampler, int vocab_size, float temperature, float topp, unsigned long long rng_seed) {
+void build_sampler(Sampler* sampler, int vocab_size, float temperature, float topp, int topk, float minp,
+                   unsigned long long rng_seed) {
     sampler->vocab_size = vocab_size;
     sampler->temperature = temperature;
     sampler->topp = topp;
+    sampler->topk = topk;
+    sampler->minp = minp;
     sampler->rng_state = rng_seed;
-    // buffer only used with nucleus sampling; may not need but it's ~small
+    // buffer only used with top-k, min-p and top-p sampling; may not need but it's ~small
     sampler->probindex = malloc(sampler->vocab_size * sizeof(ProbIndex));
 }
 
@@ -693,98 +2543,515 @@ float random_f32(unsigned long long *state) { // random float32 in [0,1)
     return (random_u32(state) >> 8) / 16777216.0f;
 }
 
-int sample(Sampler* sampler, float* logits) {
-    // sample the token given the logits and some hyperparameters
-    int next;
-    if (sampler->temperature == 0.0f) {
-        // greedy argmax sampling: take the token with the highest probability
-        next = sample_argmax(logits, sampler->vocab_size);
-    } else {
-        // apply the temperature to the logits
-        for (int q=0; q<sampler->vocab_size; q++) { logits[q] /= sampler->temperature; }
-        // apply softmax to the logits to get the probabilities for next token
-        softmax(logits, sampler->vocab_size);
-        // flip a (float) coin (this is our source of entropy for sampling)
-        float coin = random_f32(&sampler->rng_state);
-        // we sample from this distribution to get the next token
-        if (sampler->topp <= 0 || sampler->topp >= 1) {
-            // simply sample from the predicted probability distribution
-            next = sample_mult(logits, sampler->vocab_size, coin);
-        } else {
-            // top-p (nucleus) sampling, clamping the least likely tokens to zero
-            next = sample_topp(logits, sampler->vocab_size, sampler->topp, sampler->probindex, coin);
+int sample(Sampler* sampler, float* logits) {
+    // sample the token given the logits and some hyperparameters
+    int next;
+    if (sampler->temperature == 0.0f) {
+        // greedy argmax sampling: take the token with the highest probability
+        next = sample_argmax(logits, sampler->vocab_size);
+    } else {
+        // apply the temperature to the logits, then exp and sum for the softmax
+        float max_val = sampler_temperature(sampler, logits);
+        float sum = kernels.sum_exp(logits, max_val, sampler->vocab_size);
+        // flip a (float) coin (this is our source of entropy for sampling)
+        float coin = random_f32(&sampler->rng_state);
+        // we sample from this distribution to get the next token
+        if (!sampler_truncates(sampler)) {
+            // simply sample from the predicted probability distribution
+            for (int i = 0; i < sampler->vocab_size; i++) { logits[i] /= sum; }
+            next = sample_mult(logits, sampler->vocab_size, coin);
+        } else {
+            // top-k, min-p and top-p sampling, clamping the least likely tokens to zero
+            int n0 = sampler_candidates(sampler, logits, sum);
+            next = sample_candidates(sampler->probindex, n0, coin);
+        }
+    }
+    return next;
+}
+
+void sampler_probs(Sampler* sampler, float* logits) {
+    // turn the logits into the distribution that sample() draws from, in place: one-hot
+    // on the argmax when greedy, otherwise the softmax with temperature in which the
+    // tokens cut by top-k, min-p and top-p have probability zero
+    int n = sampler->vocab_size;
+    if (sampler->temperature == 0.0f) {
+        int max_i = sample_argmax(logits, n);
+        memset(logits, 0, n * sizeof(float));
+        logits[max_i] = 1.0f;
+        return;
+    }
+    float max_val = sampler_temperature(sampler, logits);
+    float sum = kernels.sum_exp(logits, max_val, n);
+    if (!sampler_truncates(sampler)) {
+        for (int i = 0; i < n; i++) { logits[i] /= sum; }
+        return;
+    }
+    // the same candidates as in sample(), renormalized
+    ProbIndex* probindex = sampler->probindex;
+    int n0 = sampler_candidates(sampler, logits, sum);
+    float cumulative_prob = 0.0f;
+    for (int i = 0; i < n0; i++) { cumulative_prob += probindex[i].prob; }
+    memset(logits, 0, n * sizeof(float));
+    for (int i = 0; i < n0; i++) {
+        logits[probindex[i].index] = probindex[i].prob / cumulative_prob;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// utilities: time
+
+long time_in_ms() {
+    // return time in milliseconds, for benchmarking the model speed
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+// ----------------------------------------------------------------------------
+// session files: the kv cache of a sequence together with its tokens, so that it can
+// be resumed later without running the model over it again. the same format is used
+// by run_gpu.c: a header, the tokens, then the keys and the values (layer, n_pos,
+// kv_dim) of the n_pos positions in the kv cache. n_tokens is n_pos + 1 when the token
+// to feed at position n_pos is known already
+
+#define SESSION_MAGIC 0x6e736573 // "sesn" in ASCII
+#define SESSION_VERSION 2
+#define SESSION_HEADER_SIZE 64
+
+typedef struct {
+    uint32_t magic;
+    int version;
+    Config config;
+    int n_pos; // positions in the kv cache
+    int n_tokens; // tokens that follow the header
+    int64_t checkpoint_size; // the checkpoint the kv cache was computed with
+    uint64_t checkpoint_hash;
+} SessionHeader;
+
+int load_session(Transformer* t, char* path, int** tokens, int* n_tokens) {
+    // restore the kv cache of slot 0 from path and return its positions, the tokens
+    // come back in a malloced array. returns -1 when there is no session in path yet
+    FILE* file = fopen(path, "rb");
+    if (!file) { return -1; }
+    SessionHeader header;
+    int valid = fread(&header, sizeof(header), 1, file) == 1;
+    fseek(file, 0, SEEK_END);
+    size_t file_size = ftell(file);
+    fclose(file);
+    Config* p = &t->config;
+    if (!valid || header.magic != SESSION_MAGIC || header.version != SESSION_VERSION) {
+        fprintf(stderr, "%s is not a session file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(&header.config, p, sizeof(Config)) != 0 || header.checkpoint_size != t->file_size
+        || header.checkpoint_hash != checkpoint_hash((char*)t->data, t->file_size)) {
+        fprintf(stderr, "%s was made with another model\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // the header is a session of this model, its sizes can be checked against the file
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t kv_size = (size_t)2 * p->n_layers * header.n_pos * kv_dim * sizeof(float);
+    if (header.n_pos < 0 || header.n_pos > p->seq_len || header.n_tokens < header.n_pos
+        || header.n_tokens > header.n_pos + 1
+        || file_size != SESSION_HEADER_SIZE + header.n_tokens * sizeof(int) + kv_size) {
+        fprintf(stderr, "%s is corrupted\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // memory map the session and copy it into the pages of the kv cache
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { fprintf(stderr, "open failed!\n"); exit(EXIT_FAILURE); }
+    char* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
+    *n_tokens = header.n_tokens;
+    *tokens = malloc((header.n_tokens + 1) * sizeof(int));
+    if (!*tokens) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    memcpy(*tokens, data + SESSION_HEADER_SIZE, header.n_tokens * sizeof(int));
+    float* keys = (float*)(data + SESSION_HEADER_SIZE + header.n_tokens * sizeof(int));
+    float* values = keys + (size_t)p->n_layers * header.n_pos * kv_dim;
+    RunState* s = &t->state;
+    kv_reserve(s, p, 0, header.n_pos);
+    for (int l = 0; l < p->n_layers; l++) {
+        for (int pos = 0; pos < header.n_pos; pos++) {
+            size_t row = (size_t)l * header.n_pos + pos;
+            kv_put(s, p, 0, l, pos, 0, keys + row * kv_dim);
+            kv_put(s, p, 0, l, pos, 1, values + row * kv_dim);
+        }
+    }
+    munmap(data, file_size);
+    close(fd);
+    return header.n_pos;
+}
+
+void save_session(Transformer* t, char* path, int* tokens, int n_tokens, int n_pos) {
+    // write positions 0..n_pos of the kv cache of slot 0 and tokens[0..n_tokens) to path
+    Config* p = &t->config;
+    RunState* s = &t->state;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    SessionHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SESSION_MAGIC;
+    header.version = SESSION_VERSION;
+    header.config = *p;
+    header.n_pos = n_pos;
+    header.n_tokens = n_tokens;
+    header.checkpoint_size = t->file_size;
+    header.checkpoint_hash = checkpoint_hash((char*)t->data, t->file_size);
+    char* tmp_path = malloc(strlen(path) + 8);
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "wb");
+    char header_block[SESSION_HEADER_SIZE] = { 0 }; // the header, zero padded
+    memcpy(header_block, &header, sizeof(header));
+    int ok = file != NULL && fwrite(header_block, SESSION_HEADER_SIZE, 1, file) == 1
+             && fwrite(tokens, sizeof(int), n_tokens, file) == (size_t)n_tokens;
+    // the file always holds fp32 rows, an int8 kv cache is widened on the way out
+    for (int v = 0; v < 2; v++) {
+        for (int l = 0; l < p->n_layers; l++) {
+            for (int pos = 0; pos < n_pos && ok; pos++) {
+                kv_get(s, p, 0, l, pos, v, s->k);
+                ok = fwrite(s->k, sizeof(float), kv_dim, file) == (size_t)kv_dim;
+            }
+        }
+    }
+    if (file) { ok = fclose(file) == 0 && ok; }
+    if (ok) {
+        remove(path); // rename does not replace an existing file on windows
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "couldn't write %s\n", path);
+        remove(tmp_path);
+    }
+    free(tmp_path);
+}
+
+// ----------------------------------------------------------------------------
+// generation loop
+
+void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, char *session_path) {
+    char *empty_prompt = "";
+    if (prompt == NULL) { prompt = empty_prompt; }
+
+    // resume the session, if there is one: its kv cache is restored, the prompt continues
+    // its tokens and the steps count from where it stopped
+    int pos = 0;     // position in the sequence
+    int n_history = 0;
+    int* history = NULL;
+    if (session_path != NULL) { pos = load_session(transformer, session_path, &history, &n_history); }
+    if (pos < 0) { pos = 0; }
+    int max_pos = kv_max_pos(&transformer->state, &transformer->config);
+    steps = steps < max_pos - pos ? pos + steps : max_pos;
+
+    // encode the (string) prompt into tokens sequence, after the tokens of the session.
+    // the sampled tokens are appended too, so that the session can be saved at the end
+    int num_prompt_tokens = 0;
+    int* prompt_tokens = (int*)malloc((n_history + strlen(prompt) + 3 + steps + 1) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
+    if (n_history > 0) { memcpy(prompt_tokens, history, n_history * sizeof(int)); }
+    encode(tokenizer, prompt, n_history == 0, 0, prompt_tokens + n_history, &num_prompt_tokens);
+    num_prompt_tokens += n_history;
+    if (num_prompt_tokens < pos + 1) {
+        if (pos > 0) { fprintf(stderr, "%s needs a prompt to continue with\n", session_path); exit(EXIT_FAILURE); }
+        fprintf(stderr, "something is wrong, expected at least 1 prompt token\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // prefill: all prompt tokens but the last go through the model in batches, their
+    // logits are not needed because the next token is forced anyway
+    int num_prefill = num_prompt_tokens - 1 < steps - 1 ? num_prompt_tokens - 1 : steps - 1;
+    if (num_prefill > pos) {
+        forward_prefill(transformer, prompt_tokens + pos, num_prefill - pos, pos, 0);
+        for (; pos < num_prefill; pos++) {
+            safe_printf(decode(tokenizer, prompt_tokens[pos], prompt_tokens[pos + 1]));
+        }
+        fflush(stdout);
+    }
+
+    // start the main loop
+    long start = 0;  // used to time our code, only initialized after first iteration
+    int start_pos = 0; // position at which the timer was started
+    int next;        // will store the next token in the sequence
+    int token = prompt_tokens[pos]; // kick off with the first token not yet in the kv cache
+    while (pos < steps) {
+
+        // forward the transformer to get logits for the next token
+        float* logits = forward(transformer, token, pos);
+
+        // advance the state state machine
+        if (pos < num_prompt_tokens - 1) {
+            // if we are still processing the input prompt, force the next prompt token
+            next = prompt_tokens[pos + 1];
+        } else {
+            // otherwise sample the next token from the logits
+            next = sample(sampler, logits);
+        }
+        prompt_tokens[pos + 1] = next;
+        pos++;
+
+        // data-dependent terminating condition: the BOS (=1) token delimits sequences
+        if (next == 1) { break; }
+
+        // print the token as string, decode it with the Tokenizer object
+        char* piece = decode(tokenizer, token, next);
+        safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
+        fflush(stdout);
+        token = next;
+
+        // init the timer here because the first iteration can be slower
+        if (start == 0) { start = time_in_ms(); start_pos = pos; }
+    }
+    printf("\n");
+
+    // report achieved tok/s (the timer starts after the first forward() iteration)
+    if (start != 0 && pos > start_pos) {
+        long end = time_in_ms();
+        fprintf(stderr, "achieved tok/s: %f\n", (pos-start_pos) / (double)(end-start)*1000);
+    }
+
+    // the kv cache holds positions 0..pos, the token at pos is the one to feed next
+    if (session_path != NULL) { save_session(transformer, session_path, prompt_tokens, pos + 1, pos); }
+
+    free(history);
+    free(prompt_tokens);
+}
+
+void generate_batch(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, int n_seqs) {
+    // like generate, but samples n_seqs continuations of the prompt together with
+    // forward_batch, one kv slot each. the prompt is prefilled once and its kv cache
+    // copied to the other slots. sequence i samples with seed + i, so the first one
+    // matches generate. the sequences are printed once they are all done
+    char *empty_prompt = "";
+    if (prompt == NULL) { prompt = empty_prompt; }
+    Config* p = &transformer->config;
+
+    // encode the (string) prompt into tokens sequence
+    int num_prompt_tokens = 0;
+    int* prompt_tokens = (int*)malloc((strlen(prompt)+3) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
+    encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
+    if (num_prompt_tokens < 1) {
+        fprintf(stderr, "something is wrong, expected at least 1 prompt token\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // prefill the prompt but its last token into slot 0, then share it with the others
+    int pos = num_prompt_tokens - 1 < steps - 1 ? num_prompt_tokens - 1 : steps - 1;
+    if (pos > 0) {
+        forward_prefill(transformer, prompt_tokens, pos, 0, 0);
+        for (int i = 1; i < n_seqs; i++) { copy_kv_slot(&transformer->state, p, i, 0, pos); }
+    }
+
+    // the tokens of every sequence so far, and the state of every sequence
+    int* seqs = malloc((size_t)n_seqs * (steps + 1) * sizeof(int));
+    int* lens = malloc(n_seqs * sizeof(int)); // tokens in seqs of each sequence
+    Sampler* samplers = malloc(n_seqs * sizeof(Sampler));
+    int* active = malloc(n_seqs * sizeof(int)); // the sequences still being sampled
+    int* tokens = malloc(n_seqs * sizeof(int)); // forward_batch arguments
+    int* positions = malloc(n_seqs * sizeof(int));
+    if (!seqs || !lens || !samplers || !active || !tokens || !positions) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n_seqs; i++) {
+        memcpy(seqs + (size_t)i * (steps + 1), prompt_tokens, (pos + 1) * sizeof(int));
+        lens[i] = pos + 1;
+        build_sampler(&samplers[i], p->vocab_size, sampler->temperature, sampler->topp, sampler->topk, sampler->minp,
+                      sampler->rng_state + i);
+        active[i] = i;
+    }
+
+    // start the main loop, all the sequences advance together until they end
+    long start = 0;  // used to time our code, only initialized after first iteration
+    long generated = 0; // tokens sampled after the timer started
+    int n_active = n_seqs;
+    while (pos < steps && n_active > 0) {
+
+        // forward the transformer to get logits for the next token of every sequence
+        for (int j = 0; j < n_active; j++) {
+            tokens[j] = seqs[(size_t)active[j] * (steps + 1) + pos];
+            positions[j] = pos;
+        }
+        float* logits = forward_batch(transformer, tokens, positions, active, n_active);
+
+        // advance the state machine of each sequence, drop the ones that ended
+        int kept = 0;
+        for (int j = 0; j < n_active; j++) {
+            int i = active[j];
+            int next;
+            if (pos < num_prompt_tokens - 1) {
+                // if we are still processing the input prompt, force the next prompt token
+                next = prompt_tokens[pos + 1];
+            } else {
+                // otherwise sample the next token from the logits of this sequence
+                next = sample(&samplers[i], logits + (size_t)j * p->vocab_size);
+            }
+            // data-dependent terminating condition: the BOS (=1) token delimits sequences,
+            // the pages of a finished sequence go back to the pool
+            if (next == 1) { kv_release(&transformer->state, i); continue; }
+            seqs[(size_t)i * (steps + 1) + pos + 1] = next;
+            lens[i] = pos + 2;
+            active[kept++] = i;
+            if (start != 0) { generated++; }
+        }
+        n_active = kept;
+        pos++;
+
+        // init the timer here because the first iteration can be slower
+        if (start == 0) { start = time_in_ms(); }
+    }
+
+    // print the sequences, decode them with the Tokenizer object
+    for (int i = 0; i < n_seqs; i++) {
+        int* seq = seqs + (size_t)i * (steps + 1);
+        printf("--- sequence %d ---\n", i);
+        for (int t = 0; t < lens[i] - 1; t++) {
+            safe_printf(decode(tokenizer, seq[t], seq[t + 1]));
         }
+        printf("\n");
     }
-    return next;
-}
 
-// ----------------------------------------------------------------------------
-// utilities: time
+    // report achieved tok/s over all the sequences (the timer starts after the first step)
+    long end = time_in_ms();
+    if (start != 0 && end > start && generated > 0) {
+        fprintf(stderr, "achieved tok/s: %f\n", generated / (double)(end-start)*1000);
+    }
 
-long time_in_ms() {
-    // return time in milliseconds, for benchmarking the model speed
-    struct timespec time;
-    clock_gettime(CLOCK_REALTIME, &time);
-    return time.tv_sec * 1000 + time.tv_nsec / 1000000;
+    for (int i = 0; i < n_seqs; i++) { free_sampler(&samplers[i]); }
+    free(samplers);
+    free(seqs);
+    free(lens);
+    free(active);
+    free(tokens);
+    free(positions);
+    free(prompt_tokens);
 }
 
-// ----------------------------------------------------------------------------
-// generation loop
-
-void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps) {
+void generate_speculative(Transformer *transformer, Transformer *draft, Tokenizer *tokenizer, Sampler *sampler,
+                          char *prompt, int steps, int n_draft) {
+    // like generate, but a small draft model that shares the tokenizer proposes n_draft
+    // tokens at a time, and the model verifies them all in one forward_tokens pass. a
+    // draft token x is kept with probability min(1, p(x) / q(x)), p and q the
+    // distributions of the model and the draft, and the first one that is not is
+    // resampled from max(0, p - q). the tokens then follow the distribution of the model
+    // alone (speculative sampling), greedy decoding gives the same text as generate
     char *empty_prompt = "";
     if (prompt == NULL) { prompt = empty_prompt; }
+    int vocab_size = transformer->config.vocab_size;
+    if (draft->config.vocab_size != vocab_size) {
+        fprintf(stderr, "the draft model has a vocab of %d tokens, the model %d\n", draft->config.vocab_size, vocab_size);
+        exit(EXIT_FAILURE);
+    }
+    if (steps > draft->config.seq_len) { steps = draft->config.seq_len; }
 
-    // encode the (string) prompt into tokens sequence
+    // encode the (string) prompt into tokens sequence, the sampled tokens are appended
     int num_prompt_tokens = 0;
-    int* prompt_tokens = (int*)malloc((strlen(prompt)+3) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
-    encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
+    int* tokens = (int*)malloc((strlen(prompt) + 3 + steps + 1) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
+    encode(tokenizer, prompt, 1, 0, tokens, &num_prompt_tokens);
     if (num_prompt_tokens < 1) {
         fprintf(stderr, "something is wrong, expected at least 1 prompt token\n");
         exit(EXIT_FAILURE);
     }
+    // the logits of the model at every verified position, the distributions of the draft
+    float* logits = malloc((size_t)(n_draft + 1) * vocab_size * sizeof(float));
+    float* draft_probs = malloc((size_t)n_draft * vocab_size * sizeof(float));
+    if (!tokens || !logits || !draft_probs) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // start the main loop
-    long start = 0;  // used to time our code, only initialized after first iteration
-    int next;        // will store the next token in the sequence
-    int token = prompt_tokens[0]; // kick off with the first token in the prompt
+    // prefill both models with all prompt tokens but the last
     int pos = 0;     // position in the sequence
+    int num_prefill = num_prompt_tokens - 1 < steps - 1 ? num_prompt_tokens - 1 : steps - 1;
+    if (num_prefill > 0) {
+        forward_prefill(transformer, tokens, num_prefill, 0, 0);
+        forward_prefill(draft, tokens, num_prefill, 0, 0);
+        for (; pos < num_prefill; pos++) {
+            safe_printf(decode(tokenizer, tokens[pos], tokens[pos + 1]));
+        }
+    }
+    if (pos < num_prompt_tokens - 1) {
+        // the prompt does not fit in steps, its next token is the last one
+        safe_printf(decode(tokenizer, tokens[pos], tokens[pos + 1]));
+        pos = steps;
+    }
+    fflush(stdout);
+
+    // start the main loop, tokens[pos] is always the token to feed next
+    long start = 0;  // used to time our code, only initialized after first iteration
+    int start_pos = 0; // position at which the timer was started
+    int draft_pos = pos; // positions in the kv cache of the draft
+    int n_proposed = 0;
+    int n_accepted = 0;
     while (pos < steps) {
 
-        // forward the transformer to get logits for the next token
-        float* logits = forward(transformer, token, pos);
+        // catch the draft up on the tokens it did not see, when all of its tokens were kept
+        for (; draft_pos < pos; draft_pos++) { forward(draft, tokens[draft_pos], draft_pos); }
 
-        // advance the state state machine
-        if (pos < num_prompt_tokens - 1) {
-            // if we are still processing the input prompt, force the next prompt token
-            next = prompt_tokens[pos + 1];
-        } else {
-            // otherwise sample the next token from the logits
-            next = sample(sampler, logits);
+        // the draft proposes up to n_draft tokens, as many as still fit in steps
+        int k = n_draft < steps - 1 - pos ? n_draft : steps - 1 - pos;
+        for (int i = 0; i < k; i++) {
+            float* q = draft_probs + (size_t)i * vocab_size;
+            memcpy(q, forward(draft, tokens[pos + i], pos + i), vocab_size * sizeof(float));
+            sampler_probs(sampler, q);
+            tokens[pos + i + 1] = sample_mult(q, vocab_size, random_f32(&sampler->rng_state));
         }
-        pos++;
+        draft_pos = pos + k;
 
-        // data-dependent terminating condition: the BOS (=1) token delimits sequences
-        if (next == 1) { break; }
+        // the model scores the token to feed and all the draft tokens in one pass
+        forward_tokens(transformer, tokens + pos, k + 1, pos, 0, logits);
 
-        // print the token as string, decode it with the Tokenizer object
-        char* piece = decode(tokenizer, token, next);
-        safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
+        // keep the draft tokens that pass, resample the first one that does not, or add
+        // one more token from the model when they all pass
+        int n_kept = 0;
+        int next;
+        for (int i = 0; ; i++) {
+            float* p = logits + (size_t)i * vocab_size;
+            sampler_probs(sampler, p);
+            if (i == k) {
+                next = sample_mult(p, vocab_size, random_f32(&sampler->rng_state));
+                break;
+            }
+            float* q = draft_probs + (size_t)i * vocab_size;
+            int x = tokens[pos + i + 1];
+            if (random_f32(&sampler->rng_state) * q[x] < p[x]) { n_kept++; continue; }
+            // the residual distribution max(0, p - q), sample_mult normalizes it via the coin
+            float sum = 0.0f;
+            for (int j = 0; j < vocab_size; j++) {
+                p[j] = p[j] > q[j] ? p[j] - q[j] : 0.0f;
+                sum += p[j];
+            }
+            next = sample_mult(p, vocab_size, random_f32(&sampler->rng_state) * sum);
+            break;
+        }
+        tokens[pos + n_kept + 1] = next;
+        n_proposed += k;
+        n_accepted += n_kept;
+
+        // print the new tokens, the kv cache of the model is valid up to them. the rows
+        // of the rejected draft tokens get overwritten before they are ever attended to
+        int end = pos + n_kept + 1;
+        for (; pos < end; pos++) {
+            // data-dependent terminating condition: the BOS (=1) token delimits sequences
+            if (tokens[pos + 1] == 1) { steps = pos; break; }
+            safe_printf(decode(tokenizer, tokens[pos], tokens[pos + 1]));
+        }
         fflush(stdout);
-        token = next;
 
         // init the timer here because the first iteration can be slower
-        if (start == 0) { start = time_in_ms(); }
+        if (start == 0) { start = time_in_ms(); start_pos = pos; }
     }
     printf("\n");
 
-    // report achieved tok/s (pos-1 because the timer starts after first iteration)
-    if (pos > 1) {
+    // report achieved tok/s (the timer starts after the first round) and how many of the
+    // draft tokens were kept
+    if (start != 0 && pos > start_pos) {
         long end = time_in_ms();
-        fprintf(stderr, "achieved tok/s: %f\n", (pos-1) / (double)(end-start)*1000);
+        fprintf(stderr, "achieved tok/s: %f\n", (pos-start_pos) / (double)(end-start)*1000);
+    }
+    if (n_proposed > 0) {
+        fprintf(stderr, "draft tokens accepted: %d/%d (%.1f%%)\n", n_accepted, n_proposed, 100.0 * n_accepted / n_proposed);
     }
 
-    free(prompt_tokens);
+    free(tokens);
+    free(logits);
+    free(draft_probs);
 }
 
 void read_stdin(const char* guide, char* buffer, size_t bufsize) {
@@ -798,14 +3065,262 @@ void read_stdin(const char* guide, char* buffer, size_t bufsize) {
     }
 }
 
+// ----------------------------------------------------------------------------
+// prefix cache: the kv cache of prompts seen before, so that a new conversation only
+// runs the model over the tokens after the longest prefix it shares with one of them,
+// typically the same system prompt. entries are whole kv pages, keyed by the FNV-1a
+// hash of their token ids. with a file, the cache is mapped from there at startup
+// and written back at exit if it changed
+
+#define PREFIX_MAGIC 0x78667070 // "ppfx" in ASCII
+#define PREFIX_VERSION 3
+#define PREFIX_HEADER_SIZE 64
+#define PREFIX_CACHE_ENTRIES 8
+
+typedef struct {
+    uint32_t magic;
+    int version;
+    int page_size;
+    int n_entries;
+    int kv_bits; // 32, or 8 for an int8 kv cache: the pages are stored as they are
+    Config config;
+    int64_t checkpoint_size; // the checkpoint the kv cache was computed with
+    uint64_t checkpoint_hash;
+} PrefixHeader;
+
+typedef struct {
+    uint64_t hash; // of the token ids
+    int n_tokens;
+    int n_pages;
+} PrefixRecord; // precedes the tokens and the pages of every entry in the file
+
+typedef struct {
+    PrefixRecord record;
+    int* tokens; // (n_tokens,)
+    char* pages; // (n_pages, page) in the layout of RunState.kv_pages
+    long last_used; // for the least recently used eviction
+    int owned; // 1 = malloced, 0 = points into the mapped file
+} PrefixEntry;
+
+typedef struct {
+    PrefixEntry entries[PREFIX_CACHE_ENTRIES];
+    int n_entries;
+    long clock;
+    int dirty;
+    char* path; // optional file the cache persists in
+    int fd;
+    void* map;
+    size_t map_size;
+} PrefixCache;
+
+uint64_t tokens_hash(const int* tokens, int n) {
+    // FNV-1a over the token ids
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < n; i++) {
+        uint32_t token = (uint32_t)tokens[i];
+        for (int b = 0; b < 4; b++) {
+            hash = (hash ^ ((token >> (8 * b)) & 0xff)) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+void prefix_header(PrefixHeader* header, Transformer* t, int n_entries) {
+    memset(header, 0, sizeof(*header));
+    header->magic = PREFIX_MAGIC;
+    header->version = PREFIX_VERSION;
+    header->page_size = KV_PAGE_SIZE;
+    header->n_entries = n_entries;
+    header->kv_bits = t->state.kv_int8 ? 8 : 32;
+    header->config = t->config;
+    header->checkpoint_size = t->file_size;
+    header->checkpoint_hash = checkpoint_hash((char*)t->data, t->file_size);
+}
+
+void build_prefix_cache(PrefixCache* c, Transformer* t, char* path) {
+    // an empty cache, or the one stored in path if it was made for this checkpoint
+    memset(c, 0, sizeof(*c));
+    c->path = path;
+    c->fd = -1;
+    if (path == NULL) { return; }
+    FILE* file = fopen(path, "rb");
+    if (!file) { return; } // nothing cached yet
+    PrefixHeader expected, header;
+    prefix_header(&expected, t, 0);
+    memset(&header, 0, sizeof(header));
+    int valid = fread(&header, sizeof(header), 1, file) == 1;
+    expected.n_entries = valid ? header.n_entries : 0;
+    valid = valid && memcmp(&header, &expected, sizeof(header)) == 0
+            && header.n_entries >= 0 && header.n_entries <= PREFIX_CACHE_ENTRIES;
+    fseek(file, 0, SEEK_END);
+    size_t file_size = ftell(file);
+    fclose(file);
+    if (!valid && header.magic != PREFIX_MAGIC) {
+        // not a prefix cache at all, leave the file alone
+        fprintf(stderr, "%s is not a prefix cache, not using it\n", path);
+        c->path = NULL;
+        return;
+    }
+    if (!valid) {
+        fprintf(stderr, "ignoring %s, it was made for another model\n", path);
+        return;
+    }
+    c->fd = open(path, O_RDONLY);
+    if (c->fd == -1) { fprintf(stderr, "open failed!\n"); exit(EXIT_FAILURE); }
+    c->map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, c->fd, 0);
+    if (c->map == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
+    c->map_size = file_size;
+    // walk the entries, a truncated file only keeps the complete ones
+    char* ptr = (char*)c->map + PREFIX_HEADER_SIZE;
+    char* end = (char*)c->map + file_size;
+    size_t page_bytes = kv_page_bytes(&t->state, &t->config);
+    for (int i = 0; i < header.n_entries; i++) {
+        if (ptr + sizeof(PrefixRecord) > end) { break; }
+        PrefixEntry* e = &c->entries[c->n_entries];
+        memcpy(&e->record, ptr, sizeof(PrefixRecord));
+        int n_tokens = e->record.n_tokens;
+        size_t size = sizeof(PrefixRecord) + (size_t)n_tokens * sizeof(int) + (size_t)e->record.n_pages * page_bytes;
+        if (n_tokens <= 0 || n_tokens > t->config.seq_len
+            || e->record.n_pages != (n_tokens + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE
+            || (size_t)(end - ptr) < size) { break; }
+        e->tokens = (int*)(ptr + sizeof(PrefixRecord));
+        e->pages = ptr + sizeof(PrefixRecord) + (size_t)n_tokens * sizeof(int);
+        e->owned = 0;
+        if (tokens_hash(e->tokens, n_tokens) != e->record.hash) { break; }
+        c->n_entries++;
+        ptr += size;
+    }
+}
+
+void save_prefix_cache(PrefixCache* c, Transformer* t) {
+    // write the entries to a temporary file next to path, then replace path with it
+    char* tmp_path = malloc(strlen(c->path) + 8);
+    sprintf(tmp_path, "%s.tmp", c->path);
+    FILE* file = fopen(tmp_path, "wb");
+    PrefixHeader header;
+    prefix_header(&header, t, c->n_entries);
+    char header_block[PREFIX_HEADER_SIZE] = { 0 }; // the header, zero padded
+    memcpy(header_block, &header, sizeof(header));
+    int ok = file != NULL && fwrite(header_block, PREFIX_HEADER_SIZE, 1, file) == 1;
+    size_t page_bytes = kv_page_bytes(&t->state, &t->config);
+    for (int i = 0; i < c->n_entries && ok; i++) {
+        PrefixEntry* e = &c->entries[i];
+        size_t n_bytes = (size_t)e->record.n_pages * page_bytes;
+        ok = fwrite(&e->record, sizeof(PrefixRecord), 1, file) == 1
+             && fwrite(e->tokens, sizeof(int), e->record.n_tokens, file) == (size_t)e->record.n_tokens
+             && fwrite(e->pages, 1, n_bytes, file) == n_bytes;
+    }
+    if (file) { ok = fclose(file) == 0 && ok; }
+    // the old file may still be mapped, let go of it before replacing it
+    if (c->fd != -1) {
+        munmap(c->map, c->map_size);
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (ok) {
+        remove(c->path); // rename does not replace an existing file on windows
+        ok = rename(tmp_path, c->path) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "couldn't write %s\n", c->path);
+        remove(tmp_path);
+    }
+    free(tmp_path);
+}
+
+void free_prefix_cache(PrefixCache* c, Transformer* t) {
+    // persists the cache first, if it has a file and changed
+    if (c->path != NULL && c->dirty) { save_prefix_cache(c, t); }
+    for (int i = 0; i < c->n_entries; i++) {
+        if (c->entries[i].owned) {
+            free(c->entries[i].tokens);
+            free(c->entries[i].pages);
+        }
+    }
+    if (c->fd != -1) {
+        munmap(c->map, c->map_size);
+        close(c->fd);
+    }
+}
+
+int common_prefix(const int* a, int n_a, const int* b, int n_b) {
+    int n = 0;
+    while (n < n_a && n < n_b && a[n] == b[n]) { n++; }
+    return n;
+}
+
+int prefix_lookup(PrefixCache* c, Transformer* t, int slot, int* tokens, int n_tokens) {
+    // restore the kv cache of the longest cached prefix of tokens[0..n_tokens) into
+    // positions 0.. of slot, returns how many positions that is. attention is causal,
+    // so an entry is good for the tokens it shares with the prompt, even if it goes on
+    // differently after them
+    int best = -1, best_len = 0;
+    for (int i = 0; i < c->n_entries; i++) {
+        PrefixEntry* e = &c->entries[i];
+        int len = common_prefix(e->tokens, e->record.n_tokens, tokens, n_tokens);
+        if (len > best_len) { best = i; best_len = len; }
+    }
+    if (best == -1) { return 0; }
+    PrefixEntry* e = &c->entries[best];
+    e->last_used = ++c->clock;
+    RunState* s = &t->state;
+    kv_reserve(s, &t->config, slot, best_len);
+    size_t page_bytes = kv_page_bytes(s, &t->config);
+    for (int pos = 0; pos < best_len; pos += KV_PAGE_SIZE) {
+        memcpy(kv_page(s, slot, pos), e->pages + (pos / KV_PAGE_SIZE) * page_bytes, page_bytes);
+    }
+    return best_len;
+}
+
+void prefix_insert(PrefixCache* c, Transformer* t, int slot, int* tokens, int n_tokens) {
+    // cache positions 0..n_tokens of slot, which hold the kv cache of tokens. an entry
+    // that is a prefix of these tokens is replaced, otherwise the least recently used
+    // one makes room once the cache is full
+    if (n_tokens <= 0) { return; }
+    int victim = -1;
+    for (int i = 0; i < c->n_entries; i++) {
+        PrefixEntry* e = &c->entries[i];
+        int len = common_prefix(e->tokens, e->record.n_tokens, tokens, n_tokens);
+        if (len == n_tokens) { e->last_used = ++c->clock; return; } // already covered
+        if (len == e->record.n_tokens) { victim = i; }
+    }
+    if (victim == -1 && c->n_entries < PREFIX_CACHE_ENTRIES) {
+        victim = c->n_entries++;
+    } else if (victim == -1) {
+        victim = 0;
+        for (int i = 1; i < c->n_entries; i++) {
+            if (c->entries[i].last_used < c->entries[victim].last_used) { victim = i; }
+        }
+    }
+    PrefixEntry* e = &c->entries[victim];
+    if (e->owned) {
+        free(e->tokens);
+        free(e->pages);
+    }
+    e->record.hash = tokens_hash(tokens, n_tokens);
+    e->record.n_tokens = n_tokens;
+    e->record.n_pages = (n_tokens + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE;
+    size_t page_bytes = kv_page_bytes(&t->state, &t->config);
+    e->tokens = malloc(n_tokens * sizeof(int));
+    e->pages = malloc((size_t)e->record.n_pages * page_bytes);
+    if (!e->tokens || !e->pages) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    memcpy(e->tokens, tokens, n_tokens * sizeof(int));
+    for (int pos = 0; pos < n_tokens; pos += KV_PAGE_SIZE) {
+        memcpy(e->pages + (pos / KV_PAGE_SIZE) * page_bytes, kv_page(&t->state, slot, pos), page_bytes);
+    }
+    e->last_used = ++c->clock;
+    e->owned = 1;
+    c->dirty = 1;
+}
+
 // ----------------------------------------------------------------------------
 // chat loop
 // I manually inspected the tokens for a few chat conversations compared to
 // python reference and that seemed ok, but this was not thoroughly tested and
 // is not safely implemented, it's more a proof of concept atm.
 
-void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
-          char *cli_user_prompt, char *cli_system_prompt, int steps) {
+void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, PrefixCache *prefix_cache,
+          char *cli_user_prompt, char *cli_system_prompt, int steps, char *session_path) {
 
     // buffers for reading the system prompt and user prompt from stdin
     // you'll notice they are soomewhat haphazardly and unsafely set atm
@@ -822,6 +3337,20 @@ void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
     int token;       // stores the current token to feed into the transformer
     int prev_token;
     int pos = 0;     // position in the sequence
+
+    // resume the conversation of the session, if there is one, with a user turn
+    int n_history = 0;
+    int* history = NULL;
+    if (session_path != NULL) { pos = load_session(transformer, session_path, &history, &n_history); }
+    if (pos < 0) { pos = 0; }
+    int max_pos = kv_max_pos(&transformer->state, &transformer->config);
+    steps = steps < max_pos - pos ? pos + steps : max_pos;
+    int first_pos = pos;
+    // the tokens in the kv cache, to save the session at the end
+    int* session_tokens = (int*)malloc((steps + 1) * sizeof(int));
+    if (n_history > 0) { memcpy(session_tokens, history, n_history * sizeof(int)); }
+    free(history);
+
     while (pos < steps) {
 
         // when it is the user's turn to contribute tokens to the dialog...
@@ -838,8 +3367,8 @@ void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
                 }
             }
             // get the user prompt
-            if (pos == 0 && cli_user_prompt != NULL) {
-                // user prompt for position 0 was passed in, use it
+            if (pos == first_pos && cli_user_prompt != NULL) {
+                // user prompt for the first turn was passed in, use it
                 strcpy(user_prompt, cli_user_prompt);
             } else {
                 // otherwise get user prompt from stdin
@@ -856,6 +3385,17 @@ void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
             // encode the rendered prompt into tokens
             encode(tokenizer, rendered_prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
             user_idx = 0; // reset the user index
+            // prefill all the prompt tokens but the last one, whose logits start the reply.
+            // a conversation starts from the longest prefix it shares with earlier ones
+            int num_prefill = num_prompt_tokens - 1 < steps - 1 - pos ? num_prompt_tokens - 1 : steps - 1 - pos;
+            if (num_prefill > 0) {
+                if (pos == 0) { user_idx = prefix_lookup(prefix_cache, transformer, 0, prompt_tokens, num_prefill); }
+                forward_prefill(transformer, prompt_tokens + user_idx, num_prefill - user_idx, pos + user_idx, 0);
+                if (pos == 0) { prefix_insert(prefix_cache, transformer, 0, prompt_tokens, num_prefill); }
+                memcpy(session_tokens + pos, prompt_tokens, num_prefill * sizeof(int));
+                user_idx = num_prefill;
+                pos += num_prefill;
+            }
             user_turn = 0;
             printf("Assistant: ");
         }
@@ -874,6 +3414,7 @@ void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
         // forward the transformer to get logits for the next token
         float* logits = forward(transformer, token, pos);
         next = sample(sampler, logits);
+        session_tokens[pos] = token;
         pos++;
 
         if (user_idx >= num_prompt_tokens && next != 2) {
@@ -885,10 +3426,575 @@ void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
         if (next == 2) { printf("\n"); }
     }
     printf("\n");
+
+    // the next turn is the user's again, so only the tokens in the kv cache are saved
+    if (session_path != NULL) { save_session(transformer, session_path, session_tokens, pos, pos); }
+    free(session_tokens);
     free(prompt_tokens);
 }
 
 
+// ----------------------------------------------------------------------------
+// server: -m serve loads the model once and reads requests from stdin, one JSON object
+// per line, e.g. {"id": "a", "prompt": "Once upon a time", "max_tokens": 64}. up to -b
+// requests are decoded together with forward_batch, one kv slot each, and a request
+// that comes in joins the batch at the next decode step instead of waiting for the
+// others to finish (continuous batching). the text is streamed back to stdout as it is
+// sampled, one JSON object per line. stdin can be a pipe or a socket, e.g. with socat
+
+#define SERVE_SLOTS 8 // requests decoded together by default
+#define SERVE_ID_LEN 64 // max bytes of a request id, longer ones are cut
+
+typedef struct {
+    char id[SERVE_ID_LEN];
+    char* prompt;
+    int max_tokens; // tokens to sample at most, 0 = up to seq_len
+    float temperature;
+    float topp;
+    int topk;
+    float minp;
+    unsigned long long seed;
+} ServeRequest;
+
+typedef struct {
+    ServeRequest req;
+    Sampler sampler;
+    int* tokens; // (end,) the prompt, then the sampled tokens
+    int n_prompt;
+    int n_tokens;
+    int end; // n_tokens at which the request is done
+    char* text; // the piece being streamed, after the bytes held back from the previous one
+    int n_held; // bytes of an incomplete UTF-8 character held back
+    double start; // time_in_us() when the request was admitted
+    double first; // when its first token was sampled
+} ServeSlot;
+
+char* json_space(char* c) {
+    while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') { c++; }
+    return c;
+}
+
+char* json_string(char* c, char* out, size_t size) {
+    // parse the JSON string that starts at c into out, keeping at most size - 1 of its
+    // bytes (none if out is NULL). return the end of the string, or NULL if it is malformed
+    if (*c++ != '"') { return NULL; }
+    size_t n = 0;
+    while (*c != '"') {
+        char utf8[4];
+        int len = 1;
+        if (*c == '\0') { return NULL; }
+        if (*c != '\\') {
+            utf8[0] = *c++;
+        } else {
+            c++;
+            char e = *c++;
+            if (e == '"' || e == '\\' || e == '/') { utf8[0] = e; }
+            else if (e == 'b') { utf8[0] = '\b'; }
+            else if (e == 'f') { utf8[0] = '\f'; }
+            else if (e == 'n') { utf8[0] = '\n'; }
+            else if (e == 'r') { utf8[0] = '\r'; }
+            else if (e == 't') { utf8[0] = '\t'; }
+            else if (e == 'u') {
+                // \uXXXX, a character outside the BMP is a surrogate pair of them
+                unsigned int cp;
+                if (sscanf(c, "%4x", &cp) != 1 || strlen(c) < 4) { return NULL; }
+                c += 4;
+                if (cp >= 0xD800 && cp < 0xDC00 && c[0] == '\\' && c[1] == 'u') {
+                    unsigned int lo;
+                    if (sscanf(c + 2, "%4x", &lo) == 1 && lo >= 0xDC00 && lo < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        c += 6;
+                    }
+                }
+                if (cp < 0x80) { utf8[0] = cp; }
+                else if (cp < 0x800) { utf8[0] = 0xC0 | (cp >> 6); utf8[1] = 0x80 | (cp & 0x3F); len = 2; }
+                else if (cp < 0x10000) {
+                    utf8[0] = 0xE0 | (cp >> 12); utf8[1] = 0x80 | ((cp >> 6) & 0x3F); utf8[2] = 0x80 | (cp & 0x3F);
+                    len = 3;
+                } else {
+                    utf8[0] = 0xF0 | (cp >> 18); utf8[1] = 0x80 | ((cp >> 12) & 0x3F);
+                    utf8[2] = 0x80 | ((cp >> 6) & 0x3F); utf8[3] = 0x80 | (cp & 0x3F);
+                    len = 4;
+                }
+            } else {
+                return NULL;
+            }
+        }
+        for (int i = 0; i < len; i++) {
+            if (out != NULL && n + 1 < size) { out[n++] = utf8[i]; }
+        }
+    }
+    if (out != NULL) { out[n] = '\0'; }
+    return c + 1;
+}
+
+char* json_skip(char* c) {
+    // skip the JSON value that starts at c, return its end or NULL if it is malformed
+    if (*c == '"') { return json_string(c, NULL, 0); }
+    if (*c == '{' || *c == '[') {
+        int depth = 0;
+        do {
+            if (*c == '"') {
+                c = json_string(c, NULL, 0);
+                if (c == NULL) { return NULL; }
+                continue;
+            }
+            if (*c == '\0') { return NULL; }
+            if (*c == '{' || *c == '[') { depth++; }
+            if (*c == '}' || *c == ']') { depth--; }
+            c++;
+        } while (depth > 0);
+        return c;
+    }
+    char* start = c;
+    while (*c != '\0' && *c != ',' && *c != '}' && *c != ']' && *c != ' ' && *c != '\t') { c++; }
+    return c > start ? c : NULL;
+}
+
+const char* parse_request(char* line, ServeRequest* req) {
+    // parse a request line into req, whose fields hold the defaults. the prompt is
+    // malloced. return NULL, or what is wrong with the request
+    char* c = json_space(line);
+    if (*c++ != '{') { return "a request is a JSON object"; }
+    c = json_space(c);
+    while (*c != '}') {
+        char key[32];
+        c = json_string(c, key, sizeof(key));
+        if (c == NULL) { return "malformed JSON"; }
+        c = json_space(c);
+        if (*c++ != ':') { return "malformed JSON"; }
+        c = json_space(c);
+        char* end;
+        if (strcmp(key, "prompt") == 0 && *c == '"') {
+            free(req->prompt);
+            req->prompt = malloc(strlen(c) + 1); // never longer than its JSON
+            if (!req->prompt) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+            end = json_string(c, req->prompt, strlen(c) + 1);
+        } else if (strcmp(key, "id") == 0 && *c == '"') {
+            end = json_string(c, req->id, sizeof(req->id));
+        } else if (strcmp(key, "id") == 0) {
+            end = json_skip(c);
+            if (end != NULL) {
+                int len = end - c < SERVE_ID_LEN - 1 ? end - c : SERVE_ID_LEN - 1;
+                memcpy(req->id, c, len);
+                req->id[len] = '\0';
+            }
+        } else if (strcmp(key, "max_tokens") == 0) { req->max_tokens = strtol(c, &end, 10); }
+        else if (strcmp(key, "temperature") == 0) { req->temperature = strtof(c, &end); }
+        else if (strcmp(key, "top_p") == 0) { req->topp = strtof(c, &end); }
+        else if (strcmp(key, "top_k") == 0) { req->topk = strtol(c, &end, 10); }
+        else if (strcmp(key, "min_p") == 0) { req->minp = strtof(c, &end); }
+        else if (strcmp(key, "seed") == 0) { req->seed = strtoull(c, &end, 10); }
+        else { end = json_skip(c); } // unknown keys are ignored
+        if (end == NULL || end == c) { return "malformed JSON"; }
+        c = json_space(end);
+        if (*c == ',') { c = json_space(c + 1); }
+        else if (*c != '}') { return "malformed JSON"; }
+    }
+    if (req->prompt == NULL) { return "the request has no prompt"; }
+    if (req->temperature < 0.0f) { req->temperature = 0.0f; }
+    if (req->topp < 0.0f || 1.0f < req->topp) { return "top_p is not in [0,1]"; }
+    if (req->topk < 0) { req->topk = 0; }
+    if (req->minp < 0.0f || 1.0f < req->minp) { return "min_p is not in [0,1]"; }
+    if (req->seed == 0) { return "seed 0 can not be used"; }
+    return NULL;
+}
+
+void print_json_text(const char* text, int len) {
+    // print text as a JSON string. it should be UTF-8, a byte that does not start a valid
+    // character (a model can sample any byte token) becomes U+FFFD
+    putchar('"');
+    for (int i = 0; i < len; ) {
+        unsigned char ch = text[i];
+        int n = ch < 0x80 ? 1 : (ch & 0xE0) == 0xC0 ? 2 : (ch & 0xF0) == 0xE0 ? 3 : (ch & 0xF8) == 0xF0 ? 4 : 0;
+        for (int j = 1; j < n; j++) {
+            if (i + j >= len || (text[i + j] & 0xC0) != 0x80) { n = 0; break; }
+        }
+        if (n == 0) { printf("\\ufffd"); i++; continue; }
+        if (ch == '"' || ch == '\\') { printf("\\%c", ch); }
+        else if (ch < 0x20) { printf("\\u%04x", ch); }
+        else { fwrite(text + i, 1, n, stdout); }
+        i += n;
+    }
+    putchar('"');
+}
+
+void serve_error(const char* id, const char* error) {
+    printf("{\"id\": ");
+    print_json_text(id, strlen(id));
+    printf(", \"error\": \"%s\"}\n", error);
+}
+
+void serve_text(ServeSlot* r, char* piece) {
+    // stream piece, but hold back the bytes at its end of a UTF-8 character that only
+    // the next piece completes: byte fallback tokens spell such characters a byte at a time
+    int len = strlen(piece);
+    memcpy(r->text + r->n_held, piece, len);
+    len += r->n_held;
+    int keep = len;
+    for (int back = 1; back <= 3 && back <= len; back++) {
+        unsigned char ch = r->text[len - back];
+        if ((ch & 0xC0) == 0x80) { continue; } // a continuation byte, the lead is before it
+        int need = (ch & 0xE0) == 0xC0 ? 2 : (ch & 0xF0) == 0xE0 ? 3 : (ch & 0xF8) == 0xF0 ? 4 : 1;
+        if (need > back) { keep = len - back; }
+        break;
+    }
+    if (keep > 0) {
+        printf("{\"id\": ");
+        print_json_text(r->req.id, strlen(r->req.id));
+        printf(", \"text\": ");
+        print_json_text(r->text, keep);
+        printf("}\n");
+    }
+    memmove(r->text, r->text + keep, len - keep);
+    r->n_held = len - keep;
+}
+
+void serve_done(ServeSlot* r, const char* finish_reason) {
+    double now = time_in_us();
+    int n_sampled = r->n_tokens - r->n_prompt;
+    if (r->n_held > 0) {
+        // bytes of a character that never got completed
+        printf("{\"id\": ");
+        print_json_text(r->req.id, strlen(r->req.id));
+        printf(", \"text\": ");
+        print_json_text(r->text, r->n_held);
+        printf("}\n");
+    }
+    printf("{\"id\": ");
+    print_json_text(r->req.id, strlen(r->req.id));
+    printf(", \"done\": true, \"finish_reason\": \"%s\", \"prompt_tokens\": %d, \"completion_tokens\": %d, "
+           "\"ttft_ms\": %.2f, \"tokens_per_s\": %.2f}\n", finish_reason, r->n_prompt, n_sampled,
+           (r->first - r->start) / 1000.0, n_sampled > 1 ? (n_sampled - 1) / (now - r->first) * 1e6 : 0.0);
+    free(r->req.prompt);
+    r->req.prompt = NULL;
+}
+
+int serve_read(char** buffer, size_t* len, size_t* cap, int block) {
+    // append what there is on stdin to buffer, waiting for it if block. return 0 at the end
+    // of the input
+    if (*cap - *len < 4096) {
+        *cap = *cap * 2 + 4096;
+        *buffer = realloc(*buffer, *cap + 1);
+        if (!*buffer) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    }
+#if defined _WIN32
+    // no poll() for pipes and consoles: a line is only read when there is nothing else
+    // to do, so the requests join once the batch is empty
+    if (!block) { return 1; }
+    if (fgets(*buffer + *len, *cap - *len, stdin) == NULL) { return 0; }
+    *len += strlen(*buffer + *len);
+#else
+    struct pollfd in = { .fd = 0, .events = POLLIN };
+    while (poll(&in, 1, block ? -1 : 0) > 0) {
+        ssize_t n = read(0, *buffer + *len, *cap - *len);
+        if (n <= 0) { return 0; }
+        *len += n;
+        if (*cap - *len < 4096) {
+            *cap = *cap * 2 + 4096;
+            *buffer = realloc(*buffer, *cap + 1);
+            if (!*buffer) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        }
+        block = 0; // take the rest that is there already, but don't wait for more
+    }
+#endif
+    return 1;
+}
+
+void serve(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, int steps) {
+    Config* p = &transformer->config;
+    RunState* s = &transformer->state;
+    int n_slots = s->n_slots;
+    ServeSlot* slots = calloc(n_slots, sizeof(ServeSlot));
+    int* active = malloc(n_slots * sizeof(int)); // the slots being decoded
+    int* idle = malloc(n_slots * sizeof(int)); // the free slots
+    int* tokens = malloc(n_slots * sizeof(int)); // forward_batch arguments
+    int* positions = malloc(n_slots * sizeof(int));
+    if (!slots || !active || !idle || !tokens || !positions) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < n_slots; i++) {
+        build_sampler(&slots[i].sampler, p->vocab_size, 0.0f, 0.0f, 0, 0.0f, 1);
+        slots[i].tokens = NULL;
+        slots[i].text = malloc(tokenizer->max_token_length + 4 + 1);
+        if (!slots[i].text) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        idle[i] = n_slots - 1 - i;
+    }
+    int n_active = 0;
+    int n_idle = n_slots;
+    // the requests read but not admitted yet, in order
+    ServeRequest* queue = NULL;
+    int n_queued = 0;
+    int cap_queued = 0;
+    char* input = NULL; // stdin up to its last complete line
+    size_t input_len = 0;
+    size_t input_cap = 0;
+    int open = 1; // stdin has not ended
+    long n_requests = 0;
+    int max_pos = kv_max_pos(s, p);
+    fprintf(stderr, "serving %d sequences at a time, one JSON request per line on stdin\n", n_slots);
+
+    while (open || n_queued > 0 || n_active > 0) {
+        // read the requests that came in, wait for one when there is nothing else to do
+        if (open) {
+            open = serve_read(&input, &input_len, &input_cap, n_queued == 0 && n_active == 0);
+            char* line = input;
+            char* newline;
+            while (input_len > 0 && ((newline = memchr(line, '\n', input_len - (line - input))) != NULL
+                                     || (!open && line < input + input_len))) {
+                if (newline == NULL) { newline = input + input_len; } // the last line, without a newline
+                *newline = '\0';
+                if (json_space(line) != newline) {
+                    ServeRequest req = { .prompt = NULL, .max_tokens = steps, .temperature = sampler->temperature,
+                                         .topp = sampler->topp, .topk = sampler->topk, .minp = sampler->minp,
+                                         .seed = sampler->rng_state + n_requests };
+                    snprintf(req.id, sizeof(req.id), "%ld", n_requests);
+                    n_requests++;
+                    const char* error = parse_request(line, &req);
+                    if (error != NULL) {
+                        serve_error(req.id, error);
+                        free(req.prompt);
+                    } else {
+                        if (n_queued == cap_queued) {
+                            cap_queued = cap_queued ? cap_queued * 2 : 16;
+                            queue = realloc(queue, cap_queued * sizeof(ServeRequest));
+                            if (!queue) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+                        }
+                        queue[n_queued++] = req;
+                    }
+                }
+                line = newline + 1;
+                if (line > input + input_len) { line = input + input_len; }
+            }
+            if (input_len > 0) {
+                input_len -= line - input;
+                memmove(input, line, input_len);
+            }
+        }
+
+        // admit the queued requests while there are free slots: encode and prefill the
+        // prompt but its last token, which the next decode step feeds
+        int admitted = 0;
+        while (admitted < n_queued && n_idle > 0) {
+            ServeRequest* req = &queue[admitted++];
+            int* prompt_tokens = malloc((strlen(req->prompt) + 3) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
+            if (!prompt_tokens) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+            int n_prompt = 0;
+            encode(tokenizer, req->prompt, 1, 0, prompt_tokens, &n_prompt);
+            if (n_prompt >= max_pos) {
+                serve_error(req->id, "the prompt does not fit in seq_len");
+                free(prompt_tokens);
+                free(req->prompt);
+                continue;
+            }
+            int i = idle[--n_idle];
+            ServeSlot* r = &slots[i];
+            r->req = *req;
+            r->sampler.temperature = req->temperature;
+            r->sampler.topp = req->topp;
+            r->sampler.topk = req->topk;
+            r->sampler.minp = req->minp;
+            r->sampler.rng_state = req->seed;
+            int max_tokens = req->max_tokens > 0 ? req->max_tokens : p->seq_len;
+            r->end = max_tokens < max_pos - n_prompt ? n_prompt + max_tokens : max_pos;
+            r->tokens = realloc(r->tokens, r->end * sizeof(int));
+            if (!r->tokens) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+            memcpy(r->tokens, prompt_tokens, n_prompt * sizeof(int));
+            free(prompt_tokens);
+            r->n_prompt = n_prompt;
+            r->n_tokens = n_prompt;
+            r->n_held = 0;
+            r->start = time_in_us();
+            if (n_prompt > 1) { forward_prefill(transformer, r->tokens, n_prompt - 1, 0, i); }
+            active[n_active++] = i;
+        }
+        n_queued -= admitted;
+        memmove(queue, queue + admitted, n_queued * sizeof(ServeRequest));
+        if (n_active == 0) { fflush(stdout); continue; }
+
+        // one decode step of all the active requests: each feeds its last token
+        for (int j = 0; j < n_active; j++) {
+            ServeSlot* r = &slots[active[j]];
+            tokens[j] = r->tokens[r->n_tokens - 1];
+            positions[j] = r->n_tokens - 1;
+        }
+        float* logits = forward_batch(transformer, tokens, positions, active, n_active);
+
+        // sample and stream the next token of each, the finished ones give their slot back
+        int kept = 0;
+        for (int j = 0; j < n_active; j++) {
+            int i = active[j];
+            ServeSlot* r = &slots[i];
+            int next = sample(&r->sampler, logits + (size_t)j * p->vocab_size);
+            if (r->n_tokens == r->n_prompt) { r->first = time_in_us(); }
+            // data-dependent terminating condition: the BOS (=1) token delimits sequences
+            const char* finish_reason = NULL;
+            if (next == 1) {
+                finish_reason = "stop";
+            } else {
+                serve_text(r, decode(tokenizer, r->tokens[r->n_tokens - 1], next));
+                r->tokens[r->n_tokens++] = next;
+                if (r->n_tokens >= r->end) { finish_reason = "length"; }
+            }
+            if (finish_reason != NULL) {
+                serve_done(r, finish_reason);
+                kv_release(s, i);
+                idle[n_idle++] = i;
+            } else {
+                active[kept++] = i;
+            }
+        }
+        n_active = kept;
+        fflush(stdout);
+    }
+
+    for (int i = 0; i < n_slots; i++) {
+        free_sampler(&slots[i].sampler);
+        free(slots[i].tokens);
+        free(slots[i].text);
+    }
+    free(slots);
+    free(active);
+    free(idle);
+    free(tokens);
+    free(positions);
+    free(queue);
+    free(input);
+}
+
+// ----------------------------------------------------------------------------
+// benchmark: -m bench times prefill and decode apart, on the same synthetic tokens in
+// every run so that builds and machines can be compared. after the warmup iterations, a
+// prompt of each -l length gives the time to first token, and -n decode steps from each
+// -o position (the attention cost grows with it) the per token latency. the results go
+// to stdout as JSON
+
+#define BENCH_RUNS 5 // measured runs of every prompt length, the median is reported
+#define BENCH_MAX_POINTS 16 // max prompt lengths and decode positions
+
+int parse_list(char* str, int* values, int max_values) {
+    // parse a comma separated list of non-negative ints, return their number or -1
+    int n = 0;
+    char* c = str;
+    while (*c != '\0') {
+        char* end;
+        long v = strtol(c, &end, 10);
+        if (end == c || v < 0 || n == max_values || (*end != ',' && *end != '\0')) { return -1; }
+        values[n++] = (int)v;
+        c = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+long peak_rss_kb() {
+    // peak resident set size of the process, 0 where it is not known
+#if defined _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) { return 0; }
+#if defined __APPLE__
+    return usage.ru_maxrss / 1024; // in bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+double bench_prefill(Transformer* transformer, Sampler* sampler, int* tokens, int n_tokens) {
+    // time to first token of a prompt of n_tokens, in us: the prefill of all but the
+    // last, then the forward pass and the sample of the last, as in generate
+    double start = time_in_us();
+    if (n_tokens > 1) { forward_prefill(transformer, tokens, n_tokens - 1, 0, 0); }
+    float* logits = forward(transformer, tokens[n_tokens - 1], n_tokens - 1);
+    sample(sampler, logits);
+    return time_in_us() - start;
+}
+
+void bench_decode(Transformer* transformer, Sampler* sampler, int* tokens, int pos, int steps, double* latency) {
+    // fill the kv cache up to pos, then time each of steps decode steps from there, in us
+    if (pos > 0) { forward_prefill(transformer, tokens, pos, 0, 0); }
+    int token = tokens[pos];
+    for (int i = 0; i < steps; i++) {
+        double start = time_in_us();
+        float* logits = forward(transformer, token, pos + i);
+        token = sample(sampler, logits);
+        latency[i] = time_in_us() - start;
+    }
+}
+
+void bench(Transformer* transformer, Sampler* sampler, char* checkpoint_path, char* lengths_str,
+           char* positions_str, int steps, int warmup) {
+    Config* p = &transformer->config;
+    int lengths[BENCH_MAX_POINTS];
+    int positions[BENCH_MAX_POINTS];
+    int n_lengths = parse_list(lengths_str, lengths, BENCH_MAX_POINTS);
+    int n_positions = parse_list(positions_str, positions, BENCH_MAX_POINTS);
+    if (n_lengths < 0 || n_positions < 0) {
+        fprintf(stderr, "-l and -o take up to %d comma separated numbers\n", BENCH_MAX_POINTS);
+        exit(EXIT_FAILURE);
+    }
+    // the prompt: BOS, then a fixed pseudo-random sequence of the regular tokens
+    int* tokens = malloc(p->seq_len * sizeof(int));
+    double* latency = malloc((p->seq_len > BENCH_RUNS ? p->seq_len : BENCH_RUNS) * sizeof(double));
+    if (!tokens || !latency) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    tokens[0] = 1;
+    for (int i = 1; i < p->seq_len; i++) { tokens[i] = 3 + (int)((i * 7919LL) % (p->vocab_size - 3)); }
+
+    // warmup: fault in the weights, start the threads and grow the kv cache
+    int warmup_len = n_lengths > 0 && lengths[0] > 0 ? (lengths[0] < p->seq_len ? lengths[0] : p->seq_len) : 1;
+    int warmup_steps = p->seq_len < 8 ? p->seq_len : 8;
+    for (int i = 0; i < warmup; i++) {
+        bench_prefill(transformer, sampler, tokens, warmup_len);
+        bench_decode(transformer, sampler, tokens, 0, warmup_steps, latency);
+    }
+
+#if defined _OPENMP
+    int threads = omp_get_max_threads();
+#else
+    int threads = 1;
+#endif
+    printf("{\n  \"backend\": \"cpu\",\n  \"variant\": \"%s\",\n  \"threads\": %d,\n", kernels.name, threads);
+    printf("  \"checkpoint\": \"");
+    for (char* c = checkpoint_path; *c != '\0'; c++) { printf(*c == '"' || *c == '\\' ? "\\%c" : "%c", *c); }
+    printf("\",\n  \"dim\": %d,\n  \"n_layers\": %d,\n  \"seq_len\": %d,\n  \"warmup\": %d,\n",
+           p->dim, p->n_layers, p->seq_len, warmup);
+
+    // prefill, the median of BENCH_RUNS runs of each prompt length
+    printf("  \"prefill\": [");
+    for (int i = 0; i < n_lengths; i++) {
+        int len = lengths[i] < 1 ? 1 : (lengths[i] > p->seq_len ? p->seq_len : lengths[i]);
+        for (int r = 0; r < BENCH_RUNS; r++) { latency[r] = bench_prefill(transformer, sampler, tokens, len); }
+        qsort(latency, BENCH_RUNS, sizeof(double), compare_doubles);
+        double ttft = percentile(latency, BENCH_RUNS, 0.5);
+        printf("%s\n    {\"prompt_tokens\": %d, \"ttft_ms\": %.4f, \"tokens_per_s\": %.2f}",
+               i > 0 ? "," : "", len, ttft / 1000.0, len / ttft * 1e6);
+    }
+    printf("\n  ],\n");
+
+    // decode, every step from each position separately
+    printf("  \"decode\": [");
+    int n_printed = 0;
+    for (int i = 0; i < n_positions; i++) {
+        int pos = positions[i];
+        int n = pos + steps < p->seq_len ? steps : p->seq_len - pos;
+        if (n <= 0) {
+            fprintf(stderr, "skipping decode at position %d, seq_len is %d\n", pos, p->seq_len);
+            continue;
+        }
+        bench_decode(transformer, sampler, tokens, pos, n, latency);
+        double total = 0.0;
+        for (int j = 0; j < n; j++) { total += latency[j]; }
+        qsort(latency, n, sizeof(double), compare_doubles);
+        printf("%s\n    {\"pos\": %d, \"tokens\": %d, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p99_ms\": %.4f, "
+               "\"max_ms\": %.4f, \"tokens_per_s\": %.2f}", n_printed++ > 0 ? "," : "", pos, n,
+               total / n / 1000.0, percentile(latency, n, 0.5) / 1000.0, percentile(latency, n, 0.99) / 1000.0,
+               latency[n - 1] / 1000.0, n / total * 1e6);
+    }
+    printf("\n  ],\n  \"peak_rss_mb\": %.1f\n}\n", peak_rss_kb() / 1024.0);
+
+    free(tokens);
+    free(latency);
+}
+
 // ----------------------------------------------------------------------------
 // CLI, include only if not testing
 #ifndef TESTING
@@ -899,12 +4005,29 @@ void error_usage() {
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -t <float>  temperature in [0,inf], default 1.0\n");
     fprintf(stderr, "  -p <float>  p value in top-p (nucleus) sampling in [0,1] default 0.9\n");
+    fprintf(stderr, "  -j <int>    k value in top-k sampling, default 0 = off\n");
+    fprintf(stderr, "  -u <float>  p value in min-p sampling in [0,1], default 0 = off\n");
     fprintf(stderr, "  -s <int>    random seed, default time(NULL)\n");
     fprintf(stderr, "  -n <int>    number of steps to run for, default 256. 0 = max_seq_len\n");
     fprintf(stderr, "  -i <string> input prompt\n");
     fprintf(stderr, "  -z <string> optional path to custom tokenizer\n");
-    fprintf(stderr, "  -m <string> mode: generate|chat, default: generate\n");
+    fprintf(stderr, "  -m <string> mode: generate|chat|serve|bench, default: generate\n");
     fprintf(stderr, "  -y <string> (optional) system prompt in chat mode\n");
+    fprintf(stderr, "  -c <string> (optional) file to keep the kv cache of chat prompts in, reused across runs\n");
+    fprintf(stderr, "  -r <int>    1 = repack the weights into cache friendly panels, cached in <checkpoint>.panels, default 0\n");
+    fprintf(stderr, "  -b <int>    number of sequences to sample together in generate mode, default 1,\n");
+    fprintf(stderr, "              or of requests to decode together in serve mode, default 8\n");
+    fprintf(stderr, "  -k <string> (optional) session file, the kv cache is resumed from it and saved to it at exit\n");
+    fprintf(stderr, "  -d <string> (optional) draft checkpoint for speculative decoding in generate mode\n");
+    fprintf(stderr, "  -g <int>    number of tokens the draft model proposes at a time, default 4\n");
+    fprintf(stderr, "  -x <int>    sliding window: attend to the last <int> positions only and run past seq_len, default 0 = off\n");
+    fprintf(stderr, "  -a <int>    attention sinks: first positions the sliding window keeps, default 4\n");
+    fprintf(stderr, "  -q <int>    kv cache precision, 8 (int8 with a scale per head) or 32, default 32\n");
+    fprintf(stderr, "  -e <float>  RoPE theta, the base of the rotation frequencies, default 10000\n");
+    fprintf(stderr, "  -f <float>  RoPE scaling factor, positions are divided by it, default 1.0\n");
+    fprintf(stderr, "  -l <string> prompt lengths to time in bench mode, comma separated, default 16,64,256\n");
+    fprintf(stderr, "  -o <string> positions to time -n decode steps from in bench mode, default 0,64,192\n");
+    fprintf(stderr, "  -w <int>    warmup iterations in bench mode, default 2\n");
     exit(EXIT_FAILURE);
 }
 
@@ -915,11 +4038,27 @@ int main(int argc, char *argv[]) {
     char *tokenizer_path = "tokenizer.bin";
     float temperature = 1.0f;   // 0.0 = greedy deterministic. 1.0 = original. don't set higher
     float topp = 0.9f;          // top-p in nucleus sampling. 1.0 = off. 0.9 works well, but slower
+    int topk = 0;               // top-k sampling, 0 = off
+    float minp = 0.0f;          // min-p sampling, 0 = off
     int steps = 256;            // number of steps to run for
     char *prompt = NULL;        // prompt string
     unsigned long long rng_seed = 0; // seed rng with time by default
-    char *mode = "generate";    // generate|chat
+    char *mode = "generate";    // generate|chat|serve|bench
     char *system_prompt = NULL; // the (optional) system prompt to use in chat mode
+    char *prefix_path = NULL;   // the (optional) file of the chat prefix cache
+    int repack = 0;             // repack the weights into panels (see repack_weights)
+    int n_seqs = 0;             // sequences sampled at once by generate_batch or serve, 0 = the default
+    char *session_path = NULL;  // the (optional) file the session is resumed from and saved to
+    char *draft_path = NULL;    // the (optional) draft model of generate_speculative
+    int n_draft = 4;            // tokens proposed by the draft model at a time
+    float rope_theta = 10000.0f; // base of the RoPE frequencies, larger in long context checkpoints
+    float rope_scale = 1.0f;    // linear RoPE scaling, positions are divided by it
+    int kv_window = 0;          // sliding window of the kv cache, 0 = off
+    int kv_sinks = 4;           // first positions the sliding window keeps (attention sinks)
+    int kv_bits = 32;           // kv cache precision, 8 = int8
+    char *bench_lengths = "16,64,256"; // prompt lengths timed by bench
+    char *bench_positions = "0,64,192"; // positions bench times the decode steps from
+    int warmup = 2;             // warmup iterations of bench
 
     // poor man's C argparse so we can override the defaults above from the command line
     if (argc >= 2) { checkpoint_path = argv[1]; } else { error_usage(); }
@@ -931,12 +4070,28 @@ int main(int argc, char *argv[]) {
         // read in the args
         if (argv[i][1] == 't') { temperature = atof(argv[i + 1]); }
         else if (argv[i][1] == 'p') { topp = atof(argv[i + 1]); }
+        else if (argv[i][1] == 'j') { topk = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'u') { minp = atof(argv[i + 1]); }
         else if (argv[i][1] == 's') { rng_seed = atoi(argv[i + 1]); }
         else if (argv[i][1] == 'n') { steps = atoi(argv[i + 1]); }
         else if (argv[i][1] == 'i') { prompt = argv[i + 1]; }
         else if (argv[i][1] == 'z') { tokenizer_path = argv[i + 1]; }
         else if (argv[i][1] == 'm') { mode = argv[i + 1]; }
         else if (argv[i][1] == 'y') { system_prompt = argv[i + 1]; }
+        else if (argv[i][1] == 'c') { prefix_path = argv[i + 1]; }
+        else if (argv[i][1] == 'r') { repack = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'b') { n_seqs = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'k') { session_path = argv[i + 1]; }
+        else if (argv[i][1] == 'd') { draft_path = argv[i + 1]; }
+        else if (argv[i][1] == 'g') { n_draft = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'e') { rope_theta = atof(argv[i + 1]); }
+        else if (argv[i][1] == 'f') { rope_scale = atof(argv[i + 1]); }
+        else if (argv[i][1] == 'x') { kv_window = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'a') { kv_sinks = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'q') { kv_bits = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'l') { bench_lengths = argv[i + 1]; }
+        else if (argv[i][1] == 'o') { bench_positions = argv[i + 1]; }
+        else if (argv[i][1] == 'w') { warmup = atoi(argv[i + 1]); }
         else { error_usage(); }
     }
 
@@ -944,12 +4099,72 @@ int main(int argc, char *argv[]) {
     if (rng_seed <= 0) rng_seed = (unsigned int)time(NULL);
     if (temperature < 0.0) temperature = 0.0;
     if (topp < 0.0 || 1.0 < topp) topp = 0.9;
+    if (topk < 0) topk = 0;
+    if (minp < 0.0 || 1.0 < minp) minp = 0.0;
     if (steps < 0) steps = 0;
+    if (n_seqs < 1) n_seqs = strcmp(mode, "serve") == 0 ? SERVE_SLOTS : 1;
+    if (n_seqs > 1 && strcmp(mode, "generate") != 0 && strcmp(mode, "serve") != 0) {
+        fprintf(stderr, "-b is only supported in generate and serve mode\n");
+        error_usage();
+    }
+    if (session_path != NULL && (strcmp(mode, "serve") == 0 || strcmp(mode, "bench") == 0)) {
+        fprintf(stderr, "-k is not supported in serve and bench mode\n");
+        error_usage();
+    }
+    if (n_seqs > 1 && session_path != NULL) {
+        fprintf(stderr, "-k is not supported together with -b\n");
+        error_usage();
+    }
+    if (n_draft < 1) n_draft = 1;
+    if (warmup < 0) warmup = 0;
+    if (rope_theta <= 0.0f || rope_scale <= 0.0f) {
+        fprintf(stderr, "-e and -f have to be positive\n");
+        error_usage();
+    }
+    if (draft_path != NULL && (strcmp(mode, "generate") != 0 || n_seqs > 1 || session_path != NULL)) {
+        fprintf(stderr, "-d is only supported in generate mode, without -b and -k\n");
+        error_usage();
+    }
+    if (kv_bits != 8 && kv_bits != 32) {
+        fprintf(stderr, "-q has to be 8 or 32\n");
+        error_usage();
+    }
+    if (kv_window < 0) kv_window = 0;
+    if (kv_sinks < 0) kv_sinks = 0;
+    if (kv_window > 0 && (session_path != NULL || prefix_path != NULL || draft_path != NULL)) {
+        fprintf(stderr, "-x is not supported together with -k, -c and -d\n");
+        error_usage();
+    }
 
     // build the Transformer via the model .bin file
     Transformer transformer;
-    build_transformer(&transformer, checkpoint_path);
-    if (steps == 0 || steps > transformer.config.seq_len) steps = transformer.config.seq_len; // ovrerride to ~max length
+    build_transformer(&transformer, checkpoint_path, n_seqs);
+    if (repack) { repack_weights(&transformer, checkpoint_path); }
+    Transformer draft; // the (optional) draft model
+    if (draft_path != NULL) {
+        build_transformer(&draft, draft_path, 1);
+        if (repack) { repack_weights(&draft, draft_path); }
+    }
+    // the checkpoints do not record the RoPE parameters, the draft model shares the positions
+    transformer.state.rope_theta = rope_theta;
+    transformer.state.rope_scale = rope_scale;
+    if (draft_path != NULL) {
+        draft.state.rope_theta = rope_theta;
+        draft.state.rope_scale = rope_scale;
+    }
+    // before the kv cache gets its first page
+    transformer.state.kv_int8 = kv_bits == 8;
+    if (draft_path != NULL) { draft.state.kv_int8 = kv_bits == 8; }
+    if (kv_window > 0) {
+        if (kv_window > transformer.config.seq_len || kv_sinks >= kv_window) {
+            fprintf(stderr, "-x has to be at most seq_len %d, and more than -a\n", transformer.config.seq_len);
+            error_usage();
+        }
+        set_kv_window(&transformer.state, kv_window, kv_sinks);
+    }
+    init_profiler(); // per-stage timing, if LLAMA2_PROFILE or LLAMA2_TRACE ask for it
+    if (steps == 0) steps = transformer.config.seq_len; // ovrerride to ~max length
+    if (steps > kv_max_pos(&transformer.state, &transformer.config)) steps = transformer.config.seq_len;
 
     // build the Tokenizer via the tokenizer .bin file
     Tokenizer tokenizer;
@@ -957,22 +4172,39 @@ int main(int argc, char *argv[]) {
 
     // build the Sampler
     Sampler sampler;
-    build_sampler(&sampler, transformer.config.vocab_size, temperature, topp, rng_seed);
+    build_sampler(&sampler, transformer.config.vocab_size, temperature, topp, topk, minp, rng_seed);
 
     // run!
     if (strcmp(mode, "generate") == 0) {
-        generate(&transformer, &tokenizer, &sampler, prompt, steps);
+        if (n_seqs > 1) {
+            generate_batch(&transformer, &tokenizer, &sampler, prompt, steps, n_seqs);
+        } else if (draft_path != NULL) {
+            generate_speculative(&transformer, &draft, &tokenizer, &sampler, prompt, steps, n_draft);
+        } else {
+            generate(&transformer, &tokenizer, &sampler, prompt, steps, session_path);
+        }
     } else if (strcmp(mode, "chat") == 0) {
-        chat(&transformer, &tokenizer, &sampler, prompt, system_prompt, steps);
+        PrefixCache prefix_cache;
+        build_prefix_cache(&prefix_cache, &transformer, prefix_path);
+        chat(&transformer, &tokenizer, &sampler, &prefix_cache, prompt, system_prompt, steps, session_path);
+        free_prefix_cache(&prefix_cache, &transformer);
+    } else if (strcmp(mode, "serve") == 0) {
+        serve(&transformer, &tokenizer, &sampler, steps);
+    } else if (strcmp(mode, "bench") == 0) {
+        bench(&transformer, &sampler, checkpoint_path, bench_lengths, bench_positions, steps, warmup);
     } else {
         fprintf(stderr, "unknown mode: %s\n", mode);
         error_usage();
     }
 
+    // write out the per-stage timings, if profiling
+    write_profile("cpu", kernels.name);
+
     // memory and file handles cleanup
     free_sampler(&sampler);
     free_tokenizer(&tokenizer);
     free_transformer(&transformer);
+    if (draft_path != NULL) { free_transformer(&draft); }
     return 0;
 }
 #endif
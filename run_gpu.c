@@ -14,21 +14,30 @@ $ ./run
 #include <GLES3/gl32.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #if defined _WIN32
+#include <direct.h>
 #include "win.h"
 #else
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #endif
+#include "tokenizer.h"
 // ----------------------------------------------------------------------------
 // Transformer and RunState structs, and related memory management
 
 #define DEBUG
 
+#define PREFILL_BATCH 32     // max prompt tokens pushed through transformer_prefill at once
+#define BATCH_TILE 4         // tokens sharing the weight loads of one workgroup in the matmuls
+#define MATMUL_ROW_ITEMS 16  // weights each invocation of shader_matmul sums at least
+
 void checkGPUError(int line) {
     GLenum err = glGetError();
     if (err != GL_NO_ERROR) {
@@ -53,75 +62,92 @@ typedef struct {
     int seq_len;     // max sequence length
 } Config;
 
+typedef struct {
+    float* f;     // fp32 values (version 0 and 1 checkpoints), NULL when quantized
+    int8_t* q;    // Q8_0 values (version 2 checkpoints): symmetric int8 in [-127, 127]
+    float* s;     // Q8_0 scaling factors, one per group_size values
+    uint16_t* h;  // fp16 values (version 3 checkpoints)
+} Tensor;
+
 typedef struct {
     // token embedding table
-    float* token_embedding_table;  // (vocab_size, dim)
+    Tensor token_embedding_table;  // (vocab_size, dim)
     // weights for rmsnorms
     float* rms_att_weight;  // (layer, dim) rmsnorm weights
     float* rms_ffn_weight;  // (layer, dim)
     // weights for matmuls
-    float* wq;  // (layer, dim, dim)
-    float* wk;  // (layer, dim, dim)
-    float* wv;  // (layer, dim, dim)
-    float* wo;  // (layer, dim, dim)
+    Tensor wq;  // (layer, dim, dim)
+    Tensor wk;  // (layer, dim, kv_dim)
+    Tensor wv;  // (layer, dim, kv_dim)
+    Tensor wo;  // (layer, dim, dim)
     // weights for ffn
-    float* w1;  // (layer, hidden_dim, dim)
-    float* w2;  // (layer, dim, hidden_dim)
-    float* w3;  // (layer, hidden_dim, dim)
+    Tensor w1;  // (layer, hidden_dim, dim)
+    Tensor w2;  // (layer, dim, hidden_dim)
+    Tensor w3;  // (layer, hidden_dim, dim)
     // final rmsnorm
     float* rms_final_weight;  // (dim,)
     // freq_cis for RoPE relatively positional embeddings
     float* freq_cis_real;  // (seq_len, head_size/2)
     float* freq_cis_imag;  // (seq_len, head_size/2)
+    float* freq_cis_alloc;  // freq_cis computed on the host, version 1 and 2 checkpoints do not store it
     // (optional) classifier weights for the logits, on the last layer
-    float* wcls;
+    Tensor wcls;
+    int group_size;  // 0 = fp32 or fp16 weights, otherwise the Q8_0 group size
+    int f16;         // 1 = fp16 matmul weights (version 3 checkpoints)
 } TransformerWeights_local;
 
 typedef struct {
-    // token embedding table
-    float* token_embedding_table;  // (vocab_size, dim)
+    // token embedding table, gathered from on the GPU by shader_embedding
+    GLuint token_embedding_table;  // (vocab_size, dim), the classifier buffer when they are shared
+    GLuint token_embedding_table_len;
+    GLuint token_embedding_table_s;  // Q8_0 scaling factors, 0 for fp32 weights
     // weights for rmsnorms
     GLuint rms_att_weight;  // (layer, dim) rmsnorm weights
     GLuint rms_att_weight_len;
     GLuint rms_ffn_weight;  // (layer, dim)
     GLuint rms_ffn_weight_len;
     // weights for matmuls
-    GLuint wq;  // (layer, dim, dim)
-    GLuint wq_len;
-    GLuint wk;  // (layer, dim, dim)
-    GLuint wk_len;
-    GLuint wv;  // (layer, dim, dim)
-    GLuint wv_len;
+    GLuint wqkv;  // (layer, dim, dim + 2 * kv_dim) wq, wk and wv side by side
+    GLuint wqkv_len;
+    GLuint wqkv_s;  // Q8_0 scaling factors, 0 for fp32 weights
     GLuint wo;  // (layer, dim, dim)
     GLuint wo_len;
+    GLuint wo_s;  // Q8_0 scaling factors, 0 for fp32 weights
     // weights for ffn
-    GLuint w1;  // (layer, hidden_dim, dim)
-    GLuint w1_len;
+    GLuint w13;  // (layer, dim, 2 * hidden_dim) w1 and w3 side by side
+    GLuint w13_len;
+    GLuint w13_s;  // Q8_0 scaling factors, 0 for fp32 weights
     GLuint w2;  // (layer, dim, hidden_dim)
     GLuint w2_len;
-    GLuint w3;  // (layer, hidden_dim, dim)
-    GLuint w3_len;
+    GLuint w2_s;  // Q8_0 scaling factors, 0 for fp32 weights
     // final rmsnorm
     GLuint rms_final_weight;  // (dim,)
     GLuint rms_final_weight_len;
     // freq_cis for RoPE relatively positional embeddings
-    GLuint freq_cis_real;  // (seq_len, head_size/2)
+    GLuint freq_cis_real;  // (seq_len + PREFILL_BATCH, head_size/2)
     GLuint freq_cis_real_len;
-    GLuint freq_cis_imag;  // (seq_len, head_size/2)
+    GLuint freq_cis_imag;  // (seq_len + PREFILL_BATCH, head_size/2)
     GLuint freq_cis_imag_len;
     // (optional) classifier weights for the logits, on the last layer
     GLuint wcls;
     GLuint wcls_len;
+    GLuint wcls_s;  // Q8_0 scaling factors, 0 for fp32 weights
 
     int dim_vec4;
+    int kv_dim_vec4;
     int hidden_dim_vec4;
+    int group_size;  // 0 = fp32 or fp16 weights, otherwise the Q8_0 group size
+    int f16;         // 1 = the matmul weights are fp16, packed two per uint
+    // the transposed matrices are uploaded a layer at a time by the first forward pass
+    TransformerWeights_local* local;
+    Config* config;
+    int layers_uploaded;
+    char* layout;  // (optional) mapped <checkpoint>.gpu with the layers transposed already
+    size_t layout_layer_size;
+    size_t layout_size;
+    int layout_fd;
 } TransformerWeights_gpu;
 
-typedef struct {
-    float prob;
-    int index;
-} ProbIndex;  // struct used when sorting probabilities during top-p sampling
-
 typedef struct {
     EGLContext context;
     EGLDisplay display;
@@ -129,87 +155,294 @@ typedef struct {
 
 static const char* shader_matmul =
     "#version 320 es\n"
-    "uniform int n;\n"
-    "uniform int x_offset;\n"
-    "uniform int w_offset;\n"
-    "layout(local_size_x = 1) in;\n"
+    "uniform int batch;\n"
+    "uniform int row_threads;\n"
+    "layout(std140, binding = 0) uniform Params{\n"
+    "    int n;\n"
+    "    int d;\n"
+    "    int x_offset;\n"
+    "    int w_offset;\n"
+    "    int x_stride;\n"
+    "    int out_stride;\n"
+    "    int s_offset;\n"
+    "    int group_size;\n"
+    "};\n"
+    "layout(local_size_x = LOCAL_SIZE) in;\n"
     "layout(binding = 0) readonly buffer Input0{\n"
     "    float data[];\n"
     "} x;\n"
 
+    // with Q8_0 weights w holds 4 packed int8 per int, and w_s one scale per group_size of them.
+    // with F16 weights every uint of w packs 2 halves
+    "#ifdef Q8_0\n"
+    "layout(binding = 1) readonly buffer Input1{\n"
+    "    int data[];\n"
+    "} w;\n"
+    "layout(binding = 3) readonly buffer Input2{\n"
+    "    float data[];\n"
+    "} w_s;\n"
+    "#elif defined(F16)\n"
+    "layout(std430, binding = 1) readonly buffer Input1{\n"
+    "    uint data[];\n"
+    "} w;\n"
+    "#else\n"
     "layout(binding = 1) readonly buffer Input1{\n"
     "    float data[];\n"
     "} w;\n"
+    "#endif\n"
 
     "layout(binding = 2) writeonly buffer Output0{\n"
     "    float data[];\n"
     "} xout;\n"
 
+    "shared float partial[LOCAL_SIZE];\n"
+
     "void main(){\n"
-    "    int i = int(gl_GlobalInvocationID.x);\n"
-    "    float val = 0.0;\n"
-    "    for (int j = 0; j < n; j++) {\n"
-    "        val += w.data[i * n + j + w_offset] * x.data[j + x_offset];\n"
+    // a workgroup covers LOCAL_SIZE / row_threads output rows and BATCH_TILE rows of x, the
+    // row_threads invocations of an output row stride over it. short rows such as those of the
+    // classifier get few invocations each, instead of leaving most of a workgroup idle
+    "    int lid = int(gl_LocalInvocationID.x);\n"
+    "    int tid = lid & (row_threads - 1);\n"
+    "    int i = int(gl_WorkGroupID.x) * (LOCAL_SIZE / row_threads) + lid / row_threads;\n"
+    "    int b0 = int(gl_WorkGroupID.y) * BATCH_TILE;\n"
+    "    int count = min(BATCH_TILE, batch - b0);\n"
+    "    int row = i * n + w_offset;\n"
+    "    float val[BATCH_TILE];\n"
+    "    for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "        val[b] = 0.0;\n"
+    "    }\n"
+    "    for (int j = i < d ? tid : n; j < n; j += row_threads) {\n"
+    "#ifdef Q8_0\n"
+    "        int idx = row + j;\n"
+    "        float wv = float(bitfieldExtract(w.data[idx >> 2], (idx & 3) * 8, 8)) * w_s.data[idx / group_size + s_offset];\n"
+    "#elif defined(F16)\n"
+    "        int idx = row + j;\n"
+    "        float wv = unpackHalf2x16(w.data[idx >> 1])[idx & 1];\n"
+    "#else\n"
+    "        float wv = w.data[row + j];\n"
+    "#endif\n"
+    "        for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "            val[b] += b < count ? wv * x.data[(b0 + b) * x_stride + j + x_offset] : 0.0;\n"
+    "        }\n"
+    "    }\n"
+    // tree reduction of the partial sums of every output row in shared memory
+    "    for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "        partial[lid] = val[b];\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "        for (int s = row_threads / 2; s > 0; s >>= 1) {\n"
+    "            if (tid < s) {\n"
+    "                partial[lid] += partial[lid + s];\n"
+    "            }\n"
+    "            memoryBarrierShared();\n"
+    "            barrier();\n"
+    "        }\n"
+    "        if (tid == 0 && i < d && b < count) {\n"
+    "            xout.data[(b0 + b) * out_stride + i] = partial[lid];\n"
+    "        }\n"
+    "        barrier();\n"
     "    }\n"
-    "    xout.data[i] = val;\n"
     "}\n";
 
 static const char* shader_matmul_trans_vec4 =
     "#version 320 es\n"
-    "uniform int n;\n"
-    "uniform int d;\n"
-    "uniform int x_offset;\n"
-    "uniform int w_offset;\n"
-    "layout(local_size_x = 1) in;\n"
+    "uniform int batch;\n"
+    "layout(std140, binding = 0) uniform Params{\n"
+    "    int n;\n"
+    "    int d;\n"
+    "    int x_offset;\n"
+    "    int w_offset;\n"
+    "    int x_stride;\n"
+    "    int out_stride;\n"
+    "    int s_offset;\n"
+    "    int group_size;\n"
+    "};\n"
+    "layout(local_size_x = TILE_X, local_size_y = TILE_Y) in;\n"
     "layout(binding = 0) readonly buffer Input0{\n"
     "    float data[];\n"
     "} x;\n"
 
+    // with Q8_0 weights every int of w packs the 4 int8 of one vec4, w_s is laid out like w
+    // with one row of scales per group_size rows. with F16 weights a uvec2 holds the 4 halves of one vec4
+    "#ifdef Q8_0\n"
+    "layout(binding = 1) readonly buffer Input1{\n"
+    "    int data[];\n"
+    "} w;\n"
+    "layout(binding = 3) readonly buffer Input2{\n"
+    "    vec4 data[];\n"
+    "} w_s;\n"
+    "#elif defined(F16)\n"
+    "layout(std430, binding = 1) readonly buffer Input1{\n"
+    "    uvec2 data[];\n"
+    "} w;\n"
+    "#else\n"
     "layout(binding = 1) readonly buffer Input1{\n"
     "    vec4 data[];\n"
     "} w;\n"
+    "#endif\n"
 
     "layout(binding = 2) writeonly buffer Output0{\n"
     "    vec4 data[];\n"
     "} xout;\n"
 
+    "shared float x_tile[BATCH_TILE * LOCAL_SIZE];\n"
+    "shared vec4 partial[LOCAL_SIZE];\n"
+    // SWIGLU: the rows of w are w1|w3, both halves go through the same x tile and the
+    // result is silu(x @ w1) * (x @ w3), n is the width of one half
+    "#ifdef SWIGLU\n"
+    "shared vec4 partial3[LOCAL_SIZE];\n"
+    "#endif\n"
+
+    "#ifdef Q8_0\n"
+    "vec4 load_w(int idx, int s_idx){\n"
+    "    int wq = w.data[idx];\n"
+    "    return vec4(bitfieldExtract(wq, 0, 8), bitfieldExtract(wq, 8, 8),\n"
+    "                bitfieldExtract(wq, 16, 8), bitfieldExtract(wq, 24, 8)) * w_s.data[s_idx];\n"
+    "}\n"
+    "#elif defined(F16)\n"
+    "vec4 load_w(int idx, int s_idx){\n"
+    "    uvec2 wh = w.data[idx];\n"
+    "    return vec4(unpackHalf2x16(wh.x), unpackHalf2x16(wh.y));\n"
+    "}\n"
+    "#else\n"
+    "vec4 load_w(int idx, int s_idx){\n"
+    "    return w.data[idx];\n"
+    "}\n"
+    "#endif\n"
+
     "void main(){\n"
+    // x: TILE_X output vec4s per workgroup, y: the input dimension is split TILE_Y ways.
+    // each workgroup also covers BATCH_TILE rows of x, so every weight load is reused for them
     "    int i = int(gl_GlobalInvocationID.x);\n"
-    "    vec4 val = vec4(0.0 , 0.0 , 0.0 , 0.0);\n"
-    "    for (int j = 0; j < n; j++) {\n"
-    "        val += w.data[i  + j* n / 4 + w_offset / 4] * x.data[j + x_offset];\n"
+    "    int tx = int(gl_LocalInvocationID.x);\n"
+    "    int ty = int(gl_LocalInvocationID.y);\n"
+    "    int lid = ty * TILE_X + tx;\n"
+    "    int b0 = int(gl_WorkGroupID.y) * BATCH_TILE;\n"
+    "    int count = min(BATCH_TILE, batch - b0);\n"
+    "    int stride = n / 4;\n"
+    "#ifdef SWIGLU\n"
+    "    int w_stride = 2 * stride;\n"
+    "    vec4 val3[BATCH_TILE];\n"
+    "    for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "        val3[b] = vec4(0.0, 0.0, 0.0, 0.0);\n"
+    "    }\n"
+    "#else\n"
+    "    int w_stride = stride;\n"
+    "#endif\n"
+    "    int w_base = i + w_offset / 4;\n"
+    "    int s_base = i + s_offset / 4;\n"
+    "    vec4 val[BATCH_TILE];\n"
+    "    for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "        val[b] = vec4(0.0, 0.0, 0.0, 0.0);\n"
+    "    }\n"
+    "    for (int base = 0; base < d; base += LOCAL_SIZE) {\n"
+    // stage a tile of x in shared memory, it is reused by every column of the workgroup
+    "        for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "            x_tile[b * LOCAL_SIZE + lid] = b < count && base + lid < d ? x.data[(b0 + b) * x_stride + base + lid + x_offset] : 0.0;\n"
+    "        }\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "        if (i < stride) {\n"
+    "            int end = min(LOCAL_SIZE, d - base);\n"
+    "            for (int k = ty; k < end; k += TILE_Y) {\n"
+    "                int row = (base + k) * w_stride;\n"
+    "                int s_row = ((base + k) / group_size) * w_stride;\n"
+    "                vec4 wv = load_w(w_base + row, s_base + s_row);\n"
+    "                for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "                    val[b] += wv * x_tile[b * LOCAL_SIZE + k];\n"
+    "                }\n"
+    "#ifdef SWIGLU\n"
+    "                vec4 wv3 = load_w(w_base + stride + row, s_base + stride + s_row);\n"
+    "                for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "                    val3[b] += wv3 * x_tile[b * LOCAL_SIZE + k];\n"
+    "                }\n"
+    "#endif\n"
+    "            }\n"
+    "        }\n"
+    "        barrier();\n"
+    "    }\n"
+    // reduce the TILE_Y partial sums of every column
+    "    for (int b = 0; b < BATCH_TILE; b++) {\n"
+    "        partial[lid] = val[b];\n"
+    "#ifdef SWIGLU\n"
+    "        partial3[lid] = val3[b];\n"
+    "#endif\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "        for (int s = TILE_Y / 2; s > 0; s >>= 1) {\n"
+    "            if (ty < s) {\n"
+    "                partial[lid] += partial[lid + s * TILE_X];\n"
+    "#ifdef SWIGLU\n"
+    "                partial3[lid] += partial3[lid + s * TILE_X];\n"
+    "#endif\n"
+    "            }\n"
+    "            memoryBarrierShared();\n"
+    "            barrier();\n"
+    "        }\n"
+    "        if (ty == 0 && i < stride && b < count) {\n"
+    "#ifdef SWIGLU\n"
+    // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid, times w3(x)
+    "            vec4 v = partial[tx];\n"
+    "            xout.data[(b0 + b) * (out_stride / 4) + i] = v * (1.0 / (1.0 + exp(-v))) * partial3[tx];\n"
+    "#else\n"
+    "            xout.data[(b0 + b) * (out_stride / 4) + i] = partial[tx];\n"
+    "#endif\n"
+    "        }\n"
+    "        barrier();\n"
     "    }\n"
-    "    xout.data[i] = val;\n"
     "}\n";
 
-static const char* shader_rmsnorm_squares_and_sum =
+static const char* shader_rmsnorm =
     "#version 320 es\n"
-    "uniform int insize;\n"
-    "uniform int shape0;\n"
-    "layout(local_size_x = 1) in;\n"
+    "layout(std140, binding = 0) uniform Params{\n"
+    "    int size;\n"
+    "    int weight_offset;\n"
+    "    int stride;\n"
+    "};\n"
+    "layout(local_size_x = LOCAL_SIZE) in;\n"
 
     "layout(binding = 0) readonly buffer Input0{\n"
     "    float data[];\n"
-    "} a;\n"
+    "} weight;\n"
 
-    "layout(binding = 1) writeonly buffer Output0{\n"
+    "layout(binding = 1) buffer Input1{\n"
     "    float data[];\n"
-    "} b;\n"
+    "} x;\n"
 
+    "layout(binding = 2) buffer Output0{\n"
+    "    float data[];\n"
+    "} o;\n"
+
+    "shared float partial[LOCAL_SIZE];\n"
+
+    // one workgroup per row: sum of squares, then normalize and scale. o may alias x
     "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    if(idx*2 >= insize){\n"
-    "        b.data[idx] = 0.;\n"
-    "        return;\n"
+    "    int lid = int(gl_LocalInvocationID.x);\n"
+    "    int base = int(gl_WorkGroupID.x) * stride;\n"
+    "    float ss = 0.0;\n"
+    "    for (int j = lid; j < size; j += LOCAL_SIZE) {\n"
+    "        float v = x.data[base + j];\n"
+    "        ss += v * v;\n"
+    "    }\n"
+    "    partial[lid] = ss;\n"
+    "    memoryBarrierShared();\n"
+    "    barrier();\n"
+    "    for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {\n"
+    "        if (lid < s) {\n"
+    "            partial[lid] += partial[lid + s];\n"
+    "        }\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
     "    }\n"
-    "    float res = a.data[idx*2]*a.data[idx*2];\n"
-    "    if(idx*2+1 < insize){\n"
-    "       res += a.data[idx*2+1]*a.data[idx*2+1];\n"
+    "    ss = partial[0] / float(size);\n"
+    "    ss += 0.00001;\n"
+    "    ss = 1.0f / sqrt(ss);\n"
+    "    for (int j = lid; j < size; j += LOCAL_SIZE) {\n"
+    "        o.data[base + j] = weight.data[j + weight_offset] * (ss * x.data[base + j]);\n"
     "    }\n"
-    "    b.data[idx] = res;\n"
     "}\n";
 
-static const char* shader_softmax_exp =
+static const char* shader_accum =
     "#version 320 es\n"
     "layout(local_size_x = 1) in;\n"
 
@@ -219,470 +452,684 @@ static const char* shader_softmax_exp =
 
     "layout(binding = 1) readonly buffer Input1{\n"
     "    float data[];\n"
-    "} maxVal_arr;\n"
+    "} b;\n"
 
     "void main(){\n"
     "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    float max_val = maxVal_arr.data[0];\n"
-    "    float res0 = exp(a.data[idx] - max_val);\n"
-    "    a.data[idx] = res0;\n"
+    "    a.data[idx] = a.data[idx]+b.data[idx];\n"
     "}\n";
 
-static const char* shader_softmax_normalize =
+static const char* shader_positionalEncoding =
     "#version 320 es\n"
-    "uniform int shape0;\n"
-    "layout(local_size_x = 1 , local_size_y = 1) in;\n"
+    "uniform int pos;\n"
+    "layout(std140, binding = 0) uniform Params{\n"
+    "    int seq_len;\n"
+    "    int head_size;\n"
+    "    int dim;\n"
+    "    int layer_idx;\n"
+    "    int kv_dim;\n"
+    "    int kv_mul;\n"
+    "    int q_stride;\n"
+    "    int k_offset;\n"
+    "    int n_layers;\n"
+    "    int page_size;\n"
+    "    int out_stride;\n"
+    "    int kv_window;\n"
+    "    int kv_sinks;\n"
+    "    int kv_capacity;\n"
+    "};\n"
+
+    "layout(local_size_x = 1) in;\n"
 
     "layout(binding = 0) readonly buffer Input0{\n"
     "    float data[];\n"
-    "} sum_arr;\n"
+    "} freq_cis_real;\n"
 
     "layout(binding = 1) readonly buffer Input1{\n"
     "    float data[];\n"
-    "} maxVal_arr;\n"
+    "} freq_cis_imag;\n"
 
     "layout(binding = 2) buffer Input2{\n"
     "    float data[];\n"
-    "} x;\n"
-
-    "void main(){\n"
-    "    float max_val = maxVal_arr.data[0];\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    int idy = int(gl_GlobalInvocationID.y);\n"
-    "    x.data[idx + shape0*idy] = x.data[idx + shape0*idy]/sum_arr.data[idy];\n"
-    "}\n";
-
-static const char* shader_sum =
-    "#version 320 es\n"
-    "uniform int insize;\n"
-    "uniform int shape0;\n"
-    "layout(local_size_x = 1 , local_size_y = 1) in;\n"
-
-    "layout(binding = 0) readonly buffer Input0{\n"
-    "    float data[];\n"
-    "} a;\n"
-
-    "layout(binding = 1) writeonly buffer Output0{\n"
-    "    float data[];\n"
-    "} b;\n"
+    "} qkv;\n"
 
     "void main(){\n"
     "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    int idy = int(gl_GlobalInvocationID.y);\n"
-    "    if(idx*2 >= insize){\n"
-    "        b.data[idx + shape0*idy] = 0.;\n"
-    "        return;\n"
-    "    }\n"
-    "    float res = a.data[insize*idy + idx*2];\n"
-    "    if(idx*2+1 < insize){\n"
-    "        res += a.data[insize*idy + idx*2 + 1];\n"
+    "    int b = int(gl_GlobalInvocationID.y);\n"  // row of the batch, at position pos + b
+    "    int i = idx*2;\n"
+    // pluck out the "pos" row of freq_cis_real and freq_cis_imag. past seq_len, with a
+    // sliding window, the row of b is among the spare rows after the table, see rope_far_rows
+    "    int row = pos + b < seq_len ? pos + b : seq_len + b;\n"
+    "    int freq_cis_idx_delta = row * head_size / 2;\n"
+    "    int qi = b * q_stride + i;\n"
+    "    int ki = b * q_stride + k_offset + i;\n"
+    "    float q0 = qkv.data[qi];\n"
+    "    float q1 = qkv.data[qi+1];\n"
+    "    float fcr = freq_cis_real.data[freq_cis_idx_delta+(i % head_size) / 2];\n"
+    "    float fci = freq_cis_imag.data[freq_cis_idx_delta+(i % head_size) / 2];\n"
+    "    qkv.data[qi]   = q0 * fcr - q1 * fci;\n"
+    "    qkv.data[qi+1] = q0 * fci + q1 * fcr;\n"
+    // k only has kv_dim entries when the key/value heads are shared
+    "    if (i < kv_dim) {\n"
+    "        float k0 = qkv.data[ki];\n"
+    "        float k1 = qkv.data[ki+1];\n"
+    "        qkv.data[ki]   = k0 * fcr - k1 * fci;\n"
+    "        qkv.data[ki+1] = k0 * fci + k1 * fcr;\n"
     "    }\n"
-    "    b.data[idx + shape0*idy] = res;\n"
     "}\n";
 
-static const char* shader_sum_vec4 =
+static const char* shader_transformer_attention =
     "#version 320 es\n"
-    "uniform int insize;\n"
-    "uniform int shape0;\n"
-    "layout(local_size_x = 1 , local_size_y = 1) in;\n"
+    "uniform int pos;\n"
+    "layout(std140, binding = 0) uniform Params{\n"
+    "    int seq_len;\n"
+    "    int head_size;\n"
+    "    int dim;\n"
+    "    int layer_idx;\n"
+    "    int kv_dim;\n"
+    "    int kv_mul;\n"
+    "    int q_stride;\n"
+    "    int k_offset;\n"
+    "    int n_layers;\n"
+    "    int page_size;\n"
+    "    int out_stride;\n"
+    "    int kv_window;\n"
+    "    int kv_sinks;\n"
+    "    int kv_capacity;\n"
+    "};\n"
+
+    "layout(local_size_x = LOCAL_SIZE) in;\n"
+    // the kv cache is paged: (page, layer, page_size, kv_dim), see kv_reserve. with a sliding
+    // window, the positions past kv_capacity go round the rows after the sinks
+    "int kv_row(int t){\n"
+    "    int row = t < kv_capacity ? t : kv_sinks + (t - kv_sinks) % (kv_capacity - kv_sinks);\n"
+    "    return ((row / page_size) * n_layers + layer_idx) * page_size * kv_dim + (row % page_size) * kv_dim;\n"
+    "}\n"
 
     "layout(binding = 0) readonly buffer Input0{\n"
-    "    vec4 data[];\n"
-    "} a;\n"
-
-    "layout(binding = 1) writeonly buffer Output0{\n"
     "    float data[];\n"
-    "} b;\n"
-
-    "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    int idy = int(gl_GlobalInvocationID.y);\n"
-    "    if(idx>=insize){\n"
-    "        b.data[idx + shape0*idy] = 0.;\n"
-    "        return;\n"
-    "    }\n"
-    "    vec4 va = a.data[insize*idy + idx];\n"
-
-    "    float res0 = va.x + va.y;\n"  //step0-0
-    "    float res1 = va.z + va.w;\n"  //step0-1
+    "} q;\n"
 
-    "    b.data[idx + shape0*idy] = res0 + res1;\n"
-    "}\n";
+    "layout(binding = 1) readonly buffer Input1{\n"
+    "    KV_TYPE data[];\n"
+    "} key_cache;\n"
 
-static const char* shader_max =
-    "#version 320 es\n"
-    "uniform int insize;\n"
-    "uniform int shape0;\n"
-    "layout(local_size_x = 1 , local_size_y = 1) in;\n"
+    "layout(binding = 2) readonly buffer Input2{\n"
+    "    KV_TYPE data[];\n"
+    "} value_cache;\n"
 
-    "layout(binding = 0) readonly buffer Input0{\n"
+    "layout(binding = 3) writeonly buffer Output0{\n"
     "    float data[];\n"
-    "} a;\n"
+    "} xb;\n"
 
-    "layout(binding = 1) writeonly buffer Output0{\n"
-    "    float data[];\n"
-    "} b;\n"
+    // head dimensions of the weighted sum per invocation
+    "#define HEAD_ITEMS ((HEAD_SIZE + LOCAL_SIZE - 1) / LOCAL_SIZE)\n"
+
+    "shared float q_tile[HEAD_SIZE];\n"
+    "shared float p_tile[LOCAL_SIZE];\n"
+    "shared float partial[LOCAL_SIZE];\n"
 
     "const float infinity = 1. / 0.;\n"
 
+    // one workgroup per head and row of the batch, row b is at position pos + b and attends
+    // to timesteps 0..pos + b (causal), or once the sliding window is full to the kv_sinks
+    // first ones and the kv_window - kv_sinks last ones. the kv cache is streamed in tiles of LOCAL_SIZE
+    // timesteps with an online softmax: each invocation scores one timestep of the tile,
+    // the weights are exponentiated against the running max, and the weighted sum of the
+    // values and the softmax sum are rescaled whenever that max grows. nothing but the
+    // output row goes back to memory
     "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    int idy = int(gl_GlobalInvocationID.y);\n"
-    "    if(idx*2 >= insize){\n"
-    "        b.data[idx + shape0*idy] = -infinity;\n"
-    "        return;\n"
+    "    int h = int(gl_WorkGroupID.x);\n"
+    "    int b = int(gl_WorkGroupID.y);\n"
+    "    int lid = int(gl_LocalInvocationID.x);\n"
+    "    int n_pos = pos + b + 1;\n"
+    // the timesteps attended go 0..n_pos - skip, those from n_sinks on are skip further
+    "    int n_sinks = 0;\n"
+    "    int skip = 0;\n"
+    "    if (kv_window > 0 && n_pos > kv_window) {\n"
+    "        n_sinks = kv_sinks;\n"
+    "        skip = n_pos - kv_window;\n"
+    "    }\n"
+    "    int n_att = n_pos - skip;\n"
+    "    int q_offset = b * q_stride + h * head_size;\n"
+    // query head h reads the key/value head it shares with kv_mul - 1 other query heads
+    "    int kv_offset = (h / kv_mul) * head_size;\n"
+    "    for (int i = lid; i < head_size; i += LOCAL_SIZE) {\n"
+    "        q_tile[i] = q.data[q_offset + i];\n"
+    "    }\n"
+    "    float max_val = -infinity;\n"
+    "    float sum = 0.0;\n"
+    "    float acc[HEAD_ITEMS];\n"
+    "    for (int j = 0; j < HEAD_ITEMS; j++) {\n"
+    "        acc[j] = 0.0;\n"
     "    }\n"
-    "    if(idx*2+1 < insize){\n"
-    "        b.data[idx + shape0*idy] = max(a.data[insize*idy + idx*2] , a.data[insize*idy + idx*2+1]);\n"
-    "    }else{\n"
-    "        b.data[idx + shape0*idy] = a.data[insize*idy + idx*2];\n"
+    "    memoryBarrierShared();\n"
+    "    barrier();\n"
+    "    for (int t0 = 0; t0 < n_att; t0 += LOCAL_SIZE) {\n"
+    "        int n = min(LOCAL_SIZE, n_att - t0);\n"
+    "        float score = -infinity;\n"
+    "        if (lid < n) {\n"
+    "            int t = t0 + lid;\n"
+    "            int k_row = kv_row(t < n_sinks ? t : t + skip) + kv_offset;\n"
+    "            score = 0.0;\n"
+    "            for (int i = 0; i < head_size; i++) {\n"
+    "                score += q_tile[i] * KV_LOAD(key_cache, i+k_row);\n"
+    "            }\n"
+    "            score /= sqrt(float(head_size));\n"
+    "        }\n"
+    // max of the tile
+    "        partial[lid] = score;\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "        for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {\n"
+    "            if (lid < s) {\n"
+    "                partial[lid] = max(partial[lid], partial[lid + s]);\n"
+    "            }\n"
+    "            memoryBarrierShared();\n"
+    "            barrier();\n"
+    "        }\n"
+    "        float new_max = max(max_val, partial[0]);\n"
+    "        barrier();\n"
+    // exp against the running max, exp(-inf) = 0 for the first tile and the idle invocations
+    "        float correction = exp(max_val - new_max);\n"
+    "        float e = exp(score - new_max);\n"
+    "        p_tile[lid] = e;\n"
+    "        partial[lid] = e;\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "        for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {\n"
+    "            if (lid < s) {\n"
+    "                partial[lid] += partial[lid + s];\n"
+    "            }\n"
+    "            memoryBarrierShared();\n"
+    "            barrier();\n"
+    "        }\n"
+    "        sum = sum * correction + partial[0];\n"
+    "        max_val = new_max;\n"
+    // accumulate the values of the tile, weighted by p_tile
+    "        for (int j = 0; j < HEAD_ITEMS; j++) {\n"
+    "            int i = lid + j * LOCAL_SIZE;\n"
+    "            if (i < head_size) {\n"
+    "                float val = acc[j] * correction;\n"
+    "                for (int t = 0; t < n; t++) {\n"
+    "                    int v_t = t0 + t < n_sinks ? t0 + t : t0 + t + skip;\n"
+    "                    val += p_tile[t] * KV_LOAD(value_cache, i+kv_offset+kv_row(v_t));\n"
+    "                }\n"
+    "                acc[j] = val;\n"
+    "            }\n"
+    "        }\n"
+    "        barrier();\n"
+    "    }\n"
+    "    for (int j = 0; j < HEAD_ITEMS; j++) {\n"
+    "        int i = lid + j * LOCAL_SIZE;\n"
+    "        if (i < head_size) {\n"
+    "            xb.data[b * out_stride + h * head_size + i] = acc[j] / sum;\n"
+    "        }\n"
     "    }\n"
     "}\n";
 
-static const char* shader_max_vec4 =
+static const char* shader_argmax =
     "#version 320 es\n"
-    "uniform int insize;\n"
-    "uniform int shape0;\n"
-    "layout(local_size_x = 1 , local_size_y = 1) in;\n"
+    "uniform int n;\n"
+    "layout(local_size_x = LOCAL_SIZE) in;\n"
 
     "layout(binding = 0) readonly buffer Input0{\n"
-    "    vec4 data[];\n"
-    "} a;\n"
+    "    float data[];\n"
+    "} logits;\n"
 
     "layout(binding = 1) writeonly buffer Output0{\n"
-    "    float data[];\n"
-    "} b;\n"
+    "    int token;\n"
+    "} result;\n"
+
+    "shared float best_val[LOCAL_SIZE];\n"
+    "shared int best_idx[LOCAL_SIZE];\n"
 
     "const float infinity = 1. / 0.;\n"
 
+    // a single workgroup, ties resolve to the lowest index like the CPU version
     "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    int idy = int(gl_GlobalInvocationID.y);\n"
-    "    if(idx>=insize){\n"
-    "        b.data[idx + shape0*idy] = -infinity;\n"
-    "        return;\n"
+    "    int lid = int(gl_LocalInvocationID.x);\n"
+    "    float max_p = -infinity;\n"
+    "    int max_i = n;\n"
+    "    for (int j = lid; j < n; j += LOCAL_SIZE) {\n"
+    "        float p = logits.data[j];\n"
+    "        if (p > max_p) {\n"
+    "            max_p = p;\n"
+    "            max_i = j;\n"
+    "        }\n"
+    "    }\n"
+    "    best_val[lid] = max_p;\n"
+    "    best_idx[lid] = max_i;\n"
+    "    memoryBarrierShared();\n"
+    "    barrier();\n"
+    "    for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {\n"
+    "        if (lid < s) {\n"
+    "            float p = best_val[lid + s];\n"
+    "            int i = best_idx[lid + s];\n"
+    "            if (p > best_val[lid] || (p == best_val[lid] && i < best_idx[lid])) {\n"
+    "                best_val[lid] = p;\n"
+    "                best_idx[lid] = i;\n"
+    "            }\n"
+    "        }\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "    }\n"
+    "    if (lid == 0) {\n"
+    "        result.token = min(best_idx[0], n - 1);\n"
     "    }\n"
-    "    vec4 va = a.data[insize*idy + idx];\n"
-
-    "    float res0 = max(va.x , va.y);\n"  //step0-0
-    "    float res1 = max(va.z , va.w);\n"  //step0-1
-
-    "    b.data[idx + shape0*idy] = max(res0 , res1);\n"
     "}\n";
 
-static const char* shader_rmsnorm_normalize_and_scale =
+static const char* shader_sample =
     "#version 320 es\n"
-    "uniform int size;\n"
-    "uniform int weight_offset;\n"
-    "layout(local_size_x = 1) in;\n"
-
-    "layout(binding = 0) readonly buffer Input0{\n"
-    "    float data[];\n"
-    "} ss_arr;\n"
-
-    "layout(binding = 1) readonly buffer Input1{\n"
-    "    float data[];\n"
-    "} weight;\n"
+    "uniform int n;\n"
+    "uniform float temperature;\n"
+    "uniform float topp;\n"
+    "uniform int topk;\n"
+    "uniform float minp;\n"
+    "uniform float coin;\n"
+    "layout(local_size_x = LOCAL_SIZE) in;\n"
 
-    "layout(binding = 2) readonly buffer Input2{\n"
+    "layout(binding = 0) coherent buffer Input0{\n"
     "    float data[];\n"
     "} x;\n"
 
-    "layout(binding = 3) writeonly buffer Output0{\n"
-    "    float data[];\n"
-    "} o;\n"
-
-    "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    float ss = ss_arr.data[0];\n"
-    "    ss /= float(size);\n"
-    "    ss += 0.00001;\n"
-    "    ss = 1.0f / sqrt(ss);\n"
-    "    o.data[idx] = weight.data[idx+weight_offset] * (ss * x.data[idx]);\n"
-    "}\n";
-
-static const char* shader_rmsnorm_normalize_and_scale_currentPos =
-    "#version 320 es\n"
-    "uniform int size;\n"
-    "uniform int weight_offset;\n"
-    "layout(local_size_x = 1) in;\n"
-
-    "layout(binding = 0) readonly buffer Input0{\n"
-    "    float data[];\n"
-    "} ss_arr;\n"
-
-    "layout(binding = 1) readonly buffer Input1{\n"
-    "    float data[];\n"
-    "} weight;\n"
-
-    "layout(binding = 2) buffer Output0{\n"
-    "    float data[];\n"
-    "} o;\n"
-
-    "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    float ss = ss_arr.data[0];\n"
-    "    ss /= float(size);\n"
-    "    ss += 0.00001;\n"
-    "    ss = 1.0f / sqrt(ss);\n"
-    "    o.data[idx] = weight.data[idx+weight_offset] * (ss * o.data[idx]);\n"
-    "}\n";
-
-static const char* shader_accum =
-    "#version 320 es\n"
-    "layout(local_size_x = 1) in;\n"
+    "layout(binding = 1) writeonly buffer Output0{\n"
+    "    int token;\n"
+    "} result;\n"
 
-    "layout(binding = 0) buffer Input0{\n"
-    "    float data[];\n"
-    "} a;\n"
+    "shared float partial[LOCAL_SIZE];\n"
+    "shared int found;\n"
 
-    "layout(binding = 1) readonly buffer Input1{\n"
-    "    float data[];\n"
-    "} b;\n"
+    "const float infinity = 1. / 0.;\n"
 
+    // a single workgroup: temperature, softmax, top-p threshold and the draw itself
     "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    a.data[idx] = a.data[idx]+b.data[idx];\n"
+    "    int lid = int(gl_LocalInvocationID.x);\n"
+    "    if (lid == 0) {\n"
+    "        found = n - 1;\n"  // in case of rounding errors
+    "    }\n"
+    // apply the temperature and find max value (for numerical stability)
+    "    float max_val = -infinity;\n"
+    "    for (int j = lid; j < n; j += LOCAL_SIZE) {\n"
+    "        float v = x.data[j] / temperature;\n"
+    "        x.data[j] = v;\n"
+    "        max_val = max(max_val, v);\n"
+    "    }\n"
+    "    partial[lid] = max_val;\n"
+    "    memoryBarrierShared();\n"
+    "    barrier();\n"
+    "    for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {\n"
+    "        if (lid < s) {\n"
+    "            partial[lid] = max(partial[lid], partial[lid + s]);\n"
+    "        }\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "    }\n"
+    "    max_val = partial[0];\n"
+    "    barrier();\n"
+    // exp and sum
+    "    float sum = 0.0;\n"
+    "    for (int j = lid; j < n; j += LOCAL_SIZE) {\n"
+    "        float e = exp(x.data[j] - max_val);\n"
+    "        x.data[j] = e;\n"
+    "        sum += e;\n"
+    "    }\n"
+    "    partial[lid] = sum;\n"
+    "    memoryBarrierShared();\n"
+    "    barrier();\n"
+    "    for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {\n"
+    "        if (lid < s) {\n"
+    "            partial[lid] += partial[lid + s];\n"
+    "        }\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "    }\n"
+    "    sum = partial[0];\n"
+    "    barrier();\n"
+    // normalize
+    "    for (int j = lid; j < n; j += LOCAL_SIZE) {\n"
+    "        x.data[j] /= sum;\n"
+    "    }\n"
+    "    memoryBarrierBuffer();\n"
+    "    barrier();\n"
+    // every filter keeps the tokens with probability >= its threshold and the strictest
+    // one wins. min-p is relative to the most likely token, whose probability is 1 / sum
+    "    float threshold = minp > 0.0 ? minp / sum : 0.0;\n"
+    // top-k: the largest value that still keeps at least topk tokens. probabilities are
+    // non-negative, so their bit patterns order like the values and the threshold can be
+    // selected one bit at a time instead of sorting
+    "    if (topk > 0 && topk < n) {\n"
+    "        uint bits = 0u;\n"
+    "        for (int b = 29; b >= 0; b--) {\n"
+    "            uint candidate = bits | (1u << uint(b));\n"
+    "            float t = uintBitsToFloat(candidate);\n"
+    "            float count = 0.0;\n"
+    "            for (int j = lid; j < n; j += LOCAL_SIZE) {\n"
+    "                count += x.data[j] >= t ? 1.0 : 0.0;\n"
+    "            }\n"
+    "            partial[lid] = count;\n"
+    "            memoryBarrierShared();\n"
+    "            barrier();\n"
+    "            for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {\n"
+    "                if (lid < s) {\n"
+    "                    partial[lid] += partial[lid + s];\n"
+    "                }\n"
+    "                memoryBarrierShared();\n"
+    "                barrier();\n"
+    "            }\n"
+    "            if (partial[0] >= float(topk)) {\n"
+    "                bits = candidate;\n"
+    "            }\n"
+    "            barrier();\n"
+    "        }\n"
+    "        threshold = max(threshold, uintBitsToFloat(bits));\n"
+    "    }\n"
+    // top-p (nucleus): the largest value whose kept mass still exceeds topp
+    "    if (topp > 0.0 && topp < 1.0) {\n"
+    "        uint bits = 0u;\n"
+    "        for (int b = 29; b >= 0; b--) {\n"  // 1.0 is 0x3F800000, bit 30 is never set
+    "            uint candidate = bits | (1u << uint(b));\n"
+    "            float t = uintBitsToFloat(candidate);\n"
+    "            float mass = 0.0;\n"
+    "            for (int j = lid; j < n; j += LOCAL_SIZE) {\n"
+    "                float p = x.data[j];\n"
+    "                mass += p >= t ? p : 0.0;\n"
+    "            }\n"
+    "            partial[lid] = mass;\n"
+    "            memoryBarrierShared();\n"
+    "            barrier();\n"
+    "            for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {\n"
+    "                if (lid < s) {\n"
+    "                    partial[lid] += partial[lid + s];\n"
+    "                }\n"
+    "                memoryBarrierShared();\n"
+    "                barrier();\n"
+    "            }\n"
+    "            if (partial[0] > topp) {\n"
+    "                bits = candidate;\n"
+    "            }\n"
+    "            barrier();\n"
+    "        }\n"
+    "        threshold = max(threshold, uintBitsToFloat(bits));\n"
+    "    }\n"
+    // sample from the kept tokens: every invocation owns a contiguous chunk, an
+    // inclusive scan of the chunk sums finds the chunk the coin lands in
+    "    int chunk = (n + LOCAL_SIZE - 1) / LOCAL_SIZE;\n"
+    "    int start = min(lid * chunk, n);\n"
+    "    int end = min(start + chunk, n);\n"
+    "    float chunk_sum = 0.0;\n"
+    "    for (int j = start; j < end; j++) {\n"
+    "        float p = x.data[j];\n"
+    "        chunk_sum += p >= threshold ? p : 0.0;\n"
+    "    }\n"
+    "    partial[lid] = chunk_sum;\n"
+    "    memoryBarrierShared();\n"
+    "    barrier();\n"
+    "    for (int s = 1; s < LOCAL_SIZE; s <<= 1) {\n"
+    "        float v = lid >= s ? partial[lid - s] : 0.0;\n"
+    "        barrier();\n"
+    "        partial[lid] += v;\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "    }\n"
+    "    float r = coin * partial[LOCAL_SIZE - 1];\n"
+    "    float cdf = partial[lid] - chunk_sum;\n"
+    "    if (r >= cdf && r < partial[lid]) {\n"
+    "        int last = start;\n"
+    "        for (int j = start; j < end; j++) {\n"
+    "            float p = x.data[j];\n"
+    "            if (p >= threshold) {\n"
+    "                last = j;\n"
+    "                cdf += p;\n"
+    "                if (r < cdf) {\n"
+    "                    break;\n"
+    "                }\n"
+    "            }\n"
+    "        }\n"
+    "        found = last;\n"
+    "    }\n"
+    "    memoryBarrierShared();\n"
+    "    barrier();\n"
+    "    if (lid == 0) {\n"
+    "        result.token = found;\n"
+    "    }\n"
     "}\n";
 
-static const char* shader_positionalEncoding =
+static const char* shader_copyBuffer =
     "#version 320 es\n"
     "uniform int pos;\n"
-    "uniform int dim;\n"
-    "uniform int hidden_dim;\n"
-    "uniform int freq_cis_idx_delta;\n"
-    "uniform int head_size;\n"
+    "layout(std140, binding = 0) uniform Params{\n"
+    "    int src_offset;\n"
+    "    int dst_offset;\n"
+    "    int row_size;\n"
+    "    int src_stride;\n"
+    "    int page_size;\n"
+    "    int page_stride;\n"
+    "    int kv_sinks;\n"
+    "    int kv_capacity;\n"
+    "};\n"
 
     "layout(local_size_x = 1) in;\n"
 
     "layout(binding = 0) readonly buffer Input0{\n"
     "    float data[];\n"
-    "} freq_cis_real;\n"
-
-    "layout(binding = 1) readonly buffer Input1{\n"
-    "    float data[];\n"
-    "} freq_cis_imag;\n"
-
-    "layout(binding = 2) buffer Input2{\n"
-    "    float data[];\n"
-    "} q;\n"
-
-    "layout(binding = 3) buffer Input3{\n"
-    "    float data[];\n"
-    "} k;\n"
-
-    "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    int i = idx*2;\n"
-    "    float q0 = q.data[i];\n"
-    "    float q1 = q.data[i+1];\n"
-    "    float k0 = k.data[i];\n"
-    "    float k1 = k.data[i+1];\n"
-    "    float fcr = freq_cis_real.data[freq_cis_idx_delta+(i % head_size) / 2];\n"
-    "    float fci = freq_cis_imag.data[freq_cis_idx_delta+(i % head_size) / 2];\n"
-    "    q.data[i]   = q0 * fcr - q1 * fci;\n"
-    "    q.data[i+1] = q0 * fci + q1 * fcr;\n"
-    "    k.data[i]   = k0 * fcr - k1 * fci;\n"
-    "    k.data[i+1] = k0 * fci + k1 * fcr;\n"
-    "}\n";
-
-static const char* shader_transformer_silu_and_mulW3 =
-    "#version 320 es\n"
-    "layout(local_size_x = 1) in;\n"
-
-    "layout(binding = 0) buffer Input0{\n"
-    "    float data[];\n"
-    "} hb;\n"
+    "} src;\n"
 
-    "layout(binding = 1) readonly buffer Input1{\n"
-    "    float data[];\n"
-    "} hb2;\n"
+    "layout(binding = 1) writeonly buffer Output0{\n"
+    "    KV_TYPE data[];\n"
+    "} dst;\n"
 
     "void main(){\n"
-    "    int idx = int(gl_GlobalInvocationID.x);\n"
-    "    float v = hb.data[idx];\n"
-    "    float res = v * (1.0 / (1.0 + exp(-v))) * hb2.data[idx];\n"
-    "    hb.data[idx] = res;\n"
+    "#ifdef KV_F16\n"
+    "    int index = 2 * int(gl_GlobalInvocationID.x);\n"  // a pair of values per uint of dst
+    "#else\n"
+    "    int index = int(gl_GlobalInvocationID.x);\n"
+    "#endif\n"
+    "    int b = int(gl_GlobalInvocationID.y);\n"  // row b of src goes to row pos + b of dst
+    // the rows of dst come in pages of page_size rows, page_stride values apart. with a
+    // sliding window, the positions past kv_capacity go round the rows after the sinks
+    "    int row = pos + b;\n"
+    "    if (row >= kv_capacity) {\n"
+    "        row = kv_sinks + (row - kv_sinks) % (kv_capacity - kv_sinks);\n"
+    "    }\n"
+    "    int dst_index = dst_offset + (row / page_size) * page_stride + (row % page_size) * row_size;\n"
+    "    int src_index = index + src_offset + b * src_stride;\n"
+    "#ifdef KV_F16\n"
+    "    dst.data[(index + dst_index) >> 1] = packHalf2x16(vec2(src.data[src_index], src.data[src_index + 1]));\n"
+    "#else\n"
+    "    dst.data[index + dst_index] = src.data[src_index];\n"
+    "#endif\n"
     "}\n";
 
-static const char* shader_transformer_get_query_vector =
+static const char* shader_embedding =
     "#version 320 es\n"
-    "uniform int seq_len;\n"
-    "uniform int pos;\n"
-    "uniform int head_size;\n"
     "uniform int dim;\n"
-    "uniform int layer_idx;\n"
-
-    "layout(local_size_x = 1 , local_size_y = 1) in;\n"
+    "uniform int group_size;\n"
+    "uniform int x_stride;\n"
+    "layout(local_size_x = LOCAL_SIZE) in;\n"
 
+    // the token ids come from the host, or straight from shader_argmax / shader_sample
     "layout(binding = 0) readonly buffer Input0{\n"
-    "    float data[];\n"
-    "} q;\n"
+    "    int data[];\n"
+    "} tokens;\n"
 
+    "#ifdef Q8_0\n"
     "layout(binding = 1) readonly buffer Input1{\n"
+    "    int data[];\n"
+    "} table;\n"
+    "layout(binding = 3) readonly buffer Input2{\n"
     "    float data[];\n"
-    "} k;\n"
+    "} table_s;\n"
+    "#elif defined(F16)\n"
+    "layout(std430, binding = 1) readonly buffer Input1{\n"
+    "    uint data[];\n"
+    "} table;\n"
+    "#else\n"
+    "layout(binding = 1) readonly buffer Input1{\n"
+    "    float data[];\n"
+    "} table;\n"
+    "#endif\n"
 
     "layout(binding = 2) writeonly buffer Output0{\n"
     "    float data[];\n"
-    "} att;\n"
+    "} x;\n"
 
     "void main(){\n"
-    "    int h = int(gl_GlobalInvocationID.x);\n"
-    "    int t = int(gl_GlobalInvocationID.y);\n"
-    "    int loff = layer_idx * seq_len * dim;\n"
-    "    int q_offset = h * head_size;\n"
-    "    int att_offset = h * seq_len;\n"
-    "    int k_offset = loff + t * dim + h * head_size;\n"
-    "    float score = 0.0;\n"
-    "    for (int i = 0; i < head_size; i++) {\n"
-    "        score += q.data[i+q_offset] * k.data[i+k_offset];\n"
+    "    int i = int(gl_GlobalInvocationID.x);\n"
+    "    int b = int(gl_GlobalInvocationID.y);\n"  // row b of x is the embedding of tokens[b]
+    "    if (i >= dim) {\n"
+    "        return;\n"
     "    }\n"
-    "    score /= sqrt(float(head_size));\n"
-    "    att.data[t+att_offset] = score;\n"
+    "    int idx = tokens.data[b] * dim + i;\n"
+    "#ifdef Q8_0\n"
+    "    x.data[b * x_stride + i] = float(bitfieldExtract(table.data[idx >> 2], (idx & 3) * 8, 8)) * table_s.data[idx / group_size];\n"
+    "#elif defined(F16)\n"
+    "    x.data[b * x_stride + i] = unpackHalf2x16(table.data[idx >> 1])[idx & 1];\n"
+    "#else\n"
+    "    x.data[b * x_stride + i] = table.data[idx];\n"
+    "#endif\n"
     "}\n";
 
-static const char* shader_transformer_build_attMat =
-    "#version 320 es\n"
-    "uniform int seq_len;\n"
-    "uniform int pos;\n"
-    "uniform int head_size;\n"
-    "uniform int dim;\n"
-    "uniform int layer_idx;\n"
+typedef struct {
+    GLuint shader_matmul;
+    GLuint shader_rmsnorm;
+    GLuint shader_accum;
+    GLuint shader_positionalEncoding;
+    GLuint shader_transformer_attention;
+    GLuint shader_argmax;
+    GLuint shader_sample;
+    GLuint shader_copyBuffer;
+    GLuint shader_embedding;
+    GLuint shader_matmul_trans_vec4;
+    GLuint shader_matmul_batch;  // the matmuls again with BATCH_TILE rows of x per workgroup
+    GLuint shader_matmul_trans_vec4_batch;
+    GLuint shader_matmul_swiglu;  // matmul_trans_vec4 of w1|w3 with the SwiGLU applied to the result
+    GLuint shader_matmul_swiglu_batch;
+    // uniform locations of the per-token values, resolved once in compile_GPUProgram
+    GLint positionalEncoding_pos;
+    GLint transformer_attention_pos;
+    GLint matmul_batch;
+    GLint matmul_trans_vec4_batch;
+    GLint matmul_batch_batch;
+    GLint matmul_trans_vec4_batch_batch;
+    GLint matmul_row_threads;
+    GLint matmul_batch_row_threads;
+    GLint matmul_swiglu_batch;
+    GLint matmul_swiglu_batch_batch;
+    GLint copyBuffer_pos;
+    GLint embedding_dim;
+    GLint embedding_group_size;
+    GLint embedding_x_stride;
+    GLint argmax_n;
+    GLint sample_n;
+    GLint sample_temperature;
+    GLint sample_topp;
+    GLint sample_topk;
+    GLint sample_minp;
+    GLint sample_coin;
+    // workgroup size of the tiled kernels, picked per device in compile_GPUProgram
+    int local_size;  // invocations per workgroup (LOCAL_SIZE = TILE_X * TILE_Y)
+    int tile_x;      // output vec4s per workgroup in matmul_trans_vec4
+    int tile_y;      // ways the input dimension is split in matmul_trans_vec4
+} GPUProgram;
 
-    "layout(local_size_x = 1 , local_size_y = 1, local_size_z = 1) in;\n"
+// static dispatch parameters, mirrors of the std140 Params blocks in the shaders.
+// they are recorded once per call site by record_dispatch_params, so the per-token
+// loop only binds a range of the uniform buffer and sets pos
+typedef struct {
+    int n;
+    int d;
+    int x_offset;
+    int w_offset;
+    int x_stride;    // floats between the rows of x in a batch
+    int out_stride;  // floats between the rows of xout in a batch
+    int s_offset;    // first Q8_0 scale of the layer
+    int group_size;  // Q8_0 group size, unused for fp32 weights
+} MatmulParams;
 
-    "layout(binding = 0) readonly buffer Input0{\n"
-    "    float data[];\n"
-    "} value_cache;\n"
+typedef struct {
+    int size;
+    int weight_offset;
+    int stride;  // floats between the rows in a batch
+} RmsnormParams;
 
-    "layout(binding = 1) readonly buffer Input1{\n"
-    "    float data[];\n"
-    "} att;\n"
+typedef struct {
+    int src_offset;
+    int dst_offset;
+    int row_size;
+    int src_stride;   // floats between the rows of src in a batch
+    int page_size;    // rows of dst per page
+    int page_stride;  // values between the pages of dst
+    int kv_sinks;     // rows kept at the start of dst by a sliding window
+    int kv_capacity;  // rows of dst, past them the positions go round the rows after the sinks
+} CopyParams;
 
-    "layout(binding = 2) writeonly buffer Output0{\n"
-    "    float data[];\n"
-    "} attMat;\n"
+typedef struct {
+    int seq_len;
+    int head_size;
+    int dim;
+    int layer_idx;
+    int kv_dim;
+    int kv_mul;  // integer multiplier of the kv sharing in multiquery
+    int q_stride;  // floats between the rows of qkv in a batch
+    int k_offset;  // floats from the start of a row of qkv to its k
+    int n_layers;
+    int page_size;  // positions per page of the kv cache
+    int out_stride;  // floats between the rows of the attention output in a batch
+    int kv_window;   // positions attended by the sliding window, 0 = off
+    int kv_sinks;    // first positions the sliding window always attends
+    int kv_capacity;  // rows of the kv cache, see set_kv_window
+} LayerParams;
+
+#define DISPATCH_PARAMS_SIZE 64  // bytes reserved per record, enough for every Params block
+#define KV_PAGE_SIZE 16          // positions per page of the kv cache
 
-    "void main(){\n"
-    "    int h = int(gl_GlobalInvocationID.x);\n"
-    "    int i = int(gl_GlobalInvocationID.y);\n"
-    "    int t = int(gl_GlobalInvocationID.z);\n"
-    "    int xb_offset = h * head_size;\n"
-    "    int loff = layer_idx * seq_len * dim;\n"
-    "    int att_offset = h * seq_len;\n"
-    "    int v_offset = loff + t * dim + h * head_size;\n"
-    "    float a = att.data[t+att_offset];\n"
-    "    float attMatVal = a * value_cache.data[i+v_offset];\n"
-    "    attMat.data[h*(pos+1)*head_size + i*(pos+1) + t] = attMatVal;\n"
-    "}\n";
+typedef struct {
+    GLuint buffer;  // uniform buffer holding all records
+    int stride;     // bytes between records, honours GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+    int count;
+    int capacity;
+    char* records;  // host copy, also used to size the dispatches
+} DispatchParams;
 
-static const char* shader_transformer_softmax_input =
-    "#version 320 es\n"
-    "uniform int seq_len;\n"
-    "uniform int pos;\n"
+typedef struct {
+    // record indices into DispatchParams for every dispatch of one layer
+    int rms_att;
+    int wqkv;
+    int layer;
+    int key_cache;
+    int value_cache;
+    int wo;
+    int rms_ffn;
+    int w13;
+    int w2;
+} LayerDispatch;
 
-    "layout(local_size_x = 1, local_size_y = 1) in;\n"
-
-    "layout(binding = 0) readonly buffer Input0{\n"
-    "    float data[];\n"
-    "} src;\n"
-
-    "layout(binding = 1) writeonly buffer Output0{\n"
-    "    float data[];\n"
-    "} dst;\n"
-
-    "void main(){\n"
-    "    int h = int(gl_GlobalInvocationID.x);\n"
-    "    int t = int(gl_GlobalInvocationID.y);\n"
-    "    int srcIdx = h * seq_len + t;\n"
-    "    int dstIdx = h * (pos+1) + t;\n"
-    "    dst.data[dstIdx] = src.data[srcIdx];\n"
-    "}\n";
-
-static const char* shader_transformer_softmax_output =
-    "#version 320 es\n"
-    "uniform int seq_len;\n"
-    "uniform int pos;\n"
-
-    "layout(local_size_x = 1, local_size_y = 1) in;\n"
-
-    "layout(binding = 0) readonly buffer Input0{\n"
-    "    float data[];\n"
-    "} src;\n"
-
-    "layout(binding = 1) writeonly buffer Output0{\n"
-    "    float data[];\n"
-    "} dst;\n"
-
-    "void main(){\n"
-    "    int h = int(gl_GlobalInvocationID.x);\n"
-    "    int t = int(gl_GlobalInvocationID.y);\n"
-    "    int dstIdx = h * seq_len + t;\n"
-    "    int srcIdx = h * (pos+1) + t;\n"
-    "    dst.data[dstIdx] = src.data[srcIdx];\n"
-    "}\n";
-
-static const char* shader_temperature =
-    "#version 320 es\n"
-    "uniform float temperature;\n"
-
-    "layout(local_size_x = 1) in;\n"
-
-    "layout(binding = 0) buffer Input0{\n"
-    "    float data[];\n"
-    "} logit;\n"
-
-    "void main(){\n"
-    "    int index = int(gl_GlobalInvocationID.x);\n"
-    "    logit.data[index] /= temperature;\n"
-    "}\n";
-
-static const char* shader_copyBuffer =
-    "#version 320 es\n"
-    "uniform int src_offset;\n"
-    "uniform int dst_offset;\n"
-
-    "layout(local_size_x = 1) in;\n"
-
-    "layout(binding = 0) readonly buffer Input0{\n"
-    "    float data[];\n"
-    "} src;\n"
-
-    "layout(binding = 1) writeonly buffer Output0{\n"
-    "    float data[];\n"
-    "} dst;\n"
-
-    "void main(){\n"
-    "    int index = int(gl_GlobalInvocationID.x);\n"
-    "    dst.data[index+dst_offset] = src.data[index+src_offset];\n"
-    "}\n";
+typedef struct {
+    // the layers from first on run on the host, over the weights of the mapped checkpoint,
+    // when the model does not fit on the GPU. x comes back from the GPU after its layers
+    // and goes up again for the classifier, see host_forward
+    int first;  // first layer on the host
+    TransformerWeights_local* w;
+    Config* p;
+    float* x;            // (PREFILL_BATCH, dim)
+    float* xb;           // (PREFILL_BATCH, dim)
+    float* xb2;          // (PREFILL_BATCH, dim)
+    float* q;            // (PREFILL_BATCH, dim)
+    float* k;            // (PREFILL_BATCH, kv_dim)
+    float* v;            // (PREFILL_BATCH, kv_dim)
+    float* hb;           // (PREFILL_BATCH, hidden_dim)
+    float* hb2;          // (PREFILL_BATCH, hidden_dim)
+    float* att;          // (n_heads, kv_capacity)
+    float* key_cache;    // (layer - first, kv_capacity, kv_dim)
+    float* value_cache;  // (layer - first, kv_capacity, kv_dim)
+    float* f16_table;    // (65536,) fp16 to fp32 for version 3 checkpoints, NULL otherwise
+} HostLayers;
 
 typedef struct {
-    GLuint shader_matmul;
-    GLuint shader_rmsnorm_squares_and_sum;
-    GLuint shader_sum;
-    GLuint shader_sum_vec4;
-    GLuint shader_rmsnorm_normalize_and_scale;
-    GLuint shader_rmsnorm_normalize_and_scale_currentPos;
-    GLuint shader_accum;
-    GLuint shader_positionalEncoding;
-    GLuint shader_max;
-    GLuint shader_max_vec4;
-    GLuint shader_softmax_exp;
-    GLuint shader_softmax_normalize;
-    GLuint shader_transformer_silu_and_mulW3;
-    GLuint shader_transformer_get_query_vector;
-    GLuint shader_transformer_build_attMat;
-    GLuint shader_transformer_softmax_input;
-    GLuint shader_transformer_softmax_output;
-    GLuint shader_temperature;
-    GLuint shader_copyBuffer;
-    GLuint shader_matmul_trans_vec4;
-} GPUProgram;
-
-typedef struct {
-    // current wave of activations
+    // current wave of activations. every buffer has PREFILL_BATCH rows for
+    // transformer_prefill, rows are padded to a multiple of 4 floats and the
+    // padding stays 0. transformer() only uses the first row
     GLuint x;  // activation at current time stamp (dim,)
     GLuint x_len;
     GLuint xb;  // same, but inside a residual branch (dim,)
@@ -691,30 +1138,35 @@ typedef struct {
     GLuint xb2_len;
     GLuint hb;  // buffer for hidden dimension in the ffn (hidden_dim,)
     GLuint hb_len;
-    GLuint hb2;  // buffer for hidden dimension in the ffn (hidden_dim,)
-    GLuint hb2_len;
-    GLuint q;  // query (dim,)
-    GLuint q_len;
-    GLuint k;  // key (dim,)
-    GLuint k_len;
-    GLuint v;  // value (dim,)
-    GLuint v_len;
-    GLuint att;  // buffer for scores/attention values (n_heads, seq_len)
-    GLuint att_len;
+    GLuint qkv;  // query, key and value side by side (dim + 2 * kv_dim,)
+    GLuint qkv_len;
     GLuint logits;  // output logits
     GLuint logits_len;
-    ProbIndex* probindex;  // buffer used in top-p sampling
-    // kv cache
-    GLuint key_cache;  // (layer, seq_len, dim)
+    GLuint tokens;          // (PREFILL_BATCH,) token ids from the host for shader_embedding
+    GLuint sample_result;   // the sampled token id, shader_embedding can read it in place
+    GLuint sample_readback; // copy of sample_result, the only thing read back per token
+    // paged kv cache, grown a page at a time by kv_reserve. there is a single sequence,
+    // so the pages are in position order and need no page table
+    GLuint key_cache;  // (page, layer, KV_PAGE_SIZE, kv_dim)
     GLuint key_cache_len;
-    GLuint value_cache;  // (layer, seq_len, dim)
+    GLuint value_cache;  // (page, layer, KV_PAGE_SIZE, kv_dim)
     GLuint value_cache_len;
-    GLuint transformer_softmax_cache;  // mulBuffer 4
-    GLuint mulBuffer_1;                // mulBuffer 1
-    GLuint mulBuffer_2;                // mulBuffer 2
-    GLuint mulBuffer_3;                // mulBuffer 3
-    GLuint mulBuffer_4;                // mulBuffer 4
-    GLuint mulBuffer_len;
+    int kv_pages;  // pages the kv buffers have room for
+    int kv_f16;    // 1 = the kv cache holds fp16, packed two per uint
+    int kv_bytes;  // bytes per value of the kv cache
+    // sliding window: the kv_sinks first positions stay, the recent ones go round the rest
+    // of the kv_capacity rows. without one, kv_capacity = seq_len and kv_window = 0
+    int kv_window;
+    int kv_sinks;
+    int kv_capacity;
+    // the first n_layers layers run on the GPU, host runs the rest (NULL when there are none)
+    int n_layers;
+    HostLayers* host;
+    // pre-recorded dispatch state
+    DispatchParams params;
+    LayerDispatch* layers;  // (n_layers,)
+    int rms_final;
+    int cls;
 } RunState;
 
 void create_GPUContext(GPUContext* ctx) {
@@ -734,10 +1186,13 @@ void create_GPUContext(GPUContext* ctx) {
 
     EGLConfig cfg;
     EGLint count;
+    // there is no window, so ask for a pbuffer config: the default EGL_WINDOW_BIT matches
+    // nothing on a surfaceless display
     EGLint s_configAttribs[] = {
         EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR,
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
         EGL_NONE};
-    if (eglChooseConfig(ctx->display, s_configAttribs, &cfg, 1, &count) == EGL_FALSE) {
+    if (eglChooseConfig(ctx->display, s_configAttribs, &cfg, 1, &count) == EGL_FALSE || count == 0) {
         printf("eglChooseConfig failed\n");
         return;
     }
@@ -776,10 +1231,14 @@ void dumpGPUArray(GLuint data_gpu, int offset, int n) {
     printf("\n");
 }
 
-GLuint loadShader(GLenum shaderType, const char* pSource) {
+GLuint loadShader(GLenum shaderType, const char* pSource, const char* pDefines) {
     GLuint shader = glCreateShader(shaderType);
     if (shader) {
-        glShaderSource(shader, 1, &pSource, NULL);
+        // the #define block has to come right after the #version line
+        const char* versionEnd = strchr(pSource, '\n') + 1;
+        const char* sources[3] = {pSource, pDefines, versionEnd};
+        GLint lengths[3] = {(GLint)(versionEnd - pSource), -1, -1};
+        glShaderSource(shader, 3, sources, lengths);
         glCompileShader(shader);
         GLint compiled = 0;
         glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
@@ -803,8 +1262,8 @@ GLuint loadShader(GLenum shaderType, const char* pSource) {
     return shader;
 }
 
-GLuint createComputeProgram(const char* pComputeSource) {
-    GLuint computeShader = loadShader(GL_COMPUTE_SHADER, pComputeSource);
+GLuint createComputeProgram(const char* pComputeSource, const char* pDefines) {
+    GLuint computeShader = loadShader(GL_COMPUTE_SHADER, pComputeSource, pDefines);
     if (!computeShader) {
         return 0;
     }
@@ -812,6 +1271,8 @@ GLuint createComputeProgram(const char* pComputeSource) {
     GLuint program = glCreateProgram();
     if (program) {
         glAttachShader(program, computeShader);
+        // lets the shader cache read the linked program back with glGetProgramBinary
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         glLinkProgram(program);
         GLint linkStatus = GL_FALSE;
         glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
@@ -831,112 +1292,429 @@ GLuint createComputeProgram(const char* pComputeSource) {
             program = 0;
         }
     }
+    glDeleteShader(computeShader);  // stays alive as long as it is attached
     return program;
 }
 
-void compile_GPUProgram(GPUProgram* program) {
-    program->shader_matmul = createComputeProgram(shader_matmul);
-    GPU_CHECK();
-    program->shader_rmsnorm_squares_and_sum = createComputeProgram(shader_rmsnorm_squares_and_sum);
-    GPU_CHECK();
-    program->shader_sum = createComputeProgram(shader_sum);
+// ----------------------------------------------------------------------------
+// shader binary cache. compiling and linking all the programs from source takes seconds
+// on some mobile drivers, so the linked programs are saved with glGetProgramBinary and
+// loaded with glProgramBinary on the next start. every program is a file in the cache
+// directory named after a hash of the driver strings, its source and its defines. a file
+// that is damaged, or that the driver does not take any more (e.g. after an update),
+// is compiled from source again and replaced
+
+#define SHADER_CACHE_MAGIC 0x63687367  // "gshc" in ASCII
+#define SHADER_CACHE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    int version;
+    uint64_t key;  // the hash the file is named after
+    uint64_t binary_hash;
+    GLenum format;
+    GLint length;
+} ShaderCacheHeader;
+
+typedef struct {
+    char* dir;  // NULL when the cache is off
+    uint64_t driver_hash;
+} ShaderCache;
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ ((const unsigned char*)data)[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int make_dir(const char* path) {
+#if defined _WIN32
+    return _mkdir(path);
+#else
+    return mkdir(path, 0755);
+#endif
+}
+
+void init_shader_cache(ShaderCache* cache) {
+    // LLAMA2_SHADER_CACHE picks the directory, and turns the cache off when it is empty.
+    // the default is the user's cache directory
+    cache->dir = NULL;
+    GLint n_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
     GPU_CHECK();
-    program->shader_sum_vec4 = createComputeProgram(shader_sum_vec4);
+    char* dir = getenv("LLAMA2_SHADER_CACHE");
+    if (n_formats == 0 || (dir != NULL && dir[0] == '\0')) {
+        return;
+    }
+    char* base = NULL;
+    const char* sub = "";
+    if (dir == NULL) {
+#if defined _WIN32
+        base = getenv("LOCALAPPDATA");
+#else
+        base = getenv("XDG_CACHE_HOME");
+        if (base == NULL || base[0] == '\0') {
+            base = getenv("HOME");
+            sub = "/.cache";
+        }
+#endif
+        if (base == NULL || base[0] == '\0') {
+            return;
+        }
+    }
+    size_t len = dir ? strlen(dir) + 1 : strlen(base) + strlen(sub) + 16;
+    cache->dir = (char*)malloc(len);
+    if (!cache->dir) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (dir) {
+        strcpy(cache->dir, dir);
+    } else {
+        // the parent may not exist yet either, e.g. a fresh ~/.cache
+        sprintf(cache->dir, "%s%s", base, sub);
+        make_dir(cache->dir);
+        strcat(cache->dir, "/llama2.c");
+    }
+    make_dir(cache->dir);  // a failure shows up when the files are written
+    const GLenum names[4] = {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION};
+    cache->driver_hash = 14695981039346656037ULL;
+    for (int i = 0; i < 4; i++) {
+        const char* value = (const char*)glGetString(names[i]);
+        if (value) {
+            cache->driver_hash = fnv1a(cache->driver_hash, value, strlen(value) + 1);
+        }
+    }
     GPU_CHECK();
-    program->shader_rmsnorm_normalize_and_scale = createComputeProgram(shader_rmsnorm_normalize_and_scale);
+}
+
+GLuint load_program_binary(const char* path, uint64_t key) {
+    // the cached program, or 0 when there is none the driver accepts
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+    ShaderCacheHeader header;
+    GLuint program = 0;
+    void* binary = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == SHADER_CACHE_MAGIC &&
+        header.version == SHADER_CACHE_VERSION && header.key == key && header.length > 0) {
+        binary = malloc(header.length);
+    }
+    if (binary && fread(binary, header.length, 1, file) == 1 &&
+        fnv1a(14695981039346656037ULL, binary, header.length) == header.binary_hash) {
+        program = glCreateProgram();
+        glProgramBinary(program, header.format, binary, header.length);
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE) {
+            glDeleteProgram(program);
+            program = 0;
+        }
+        // a format the driver no longer knows is a GL error, not a failed link
+        while (glGetError() != GL_NO_ERROR) {
+        }
+    }
+    free(binary);
+    fclose(file);
+    return program;
+}
+
+void save_program_binary(const char* path, uint64_t key, GLuint program) {
+    // best effort: when the cache can't be written, the next start compiles again
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    void* binary = length > 0 ? malloc(length) : NULL;
+    ShaderCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    if (binary) {
+        glGetProgramBinary(program, length, &header.length, &header.format, binary);
+    }
+    while (glGetError() != GL_NO_ERROR) {
+    }
+    if (header.length <= 0) {
+        free(binary);
+        return;
+    }
+    header.magic = SHADER_CACHE_MAGIC;
+    header.version = SHADER_CACHE_VERSION;
+    header.key = key;
+    header.binary_hash = fnv1a(14695981039346656037ULL, binary, header.length);
+    // written to a temporary file first, so a reader never sees half a binary
+    char* tmp_path = (char*)malloc(strlen(path) + 8);
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "wb");
+    int ok = file != NULL && fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(binary, header.length, 1, file) == 1;
+    if (file) {
+        ok = fclose(file) == 0 && ok;
+    }
+    if (ok) {
+        remove(path);  // rename does not replace an existing file on windows
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        remove(tmp_path);
+    }
+    free(tmp_path);
+    free(binary);
+}
+
+GLuint createCachedProgram(ShaderCache* cache, const char* pComputeSource, const char* pDefines) {
+    if (!cache->dir) {
+        return createComputeProgram(pComputeSource, pDefines);
+    }
+    uint64_t key = fnv1a(cache->driver_hash, pComputeSource, strlen(pComputeSource) + 1);
+    key = fnv1a(key, pDefines, strlen(pDefines) + 1);
+    char* path = (char*)malloc(strlen(cache->dir) + 32);
+    sprintf(path, "%s/%016llx.bin", cache->dir, (unsigned long long)key);
+    GLuint program = load_program_binary(path, key);
+    if (!program) {
+        program = createComputeProgram(pComputeSource, pDefines);
+        save_program_binary(path, key, program);
+    }
+    free(path);
+    return program;
+}
+
+void select_workgroup_size(GPUProgram* program) {
+    // use as many invocations per workgroup as the device allows, up to 256,
+    // rounded down to a power of two so the shared memory reductions stay simple
+    GLint max_size_x = 0;
+    GLint max_invocations = 0;
+    glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &max_size_x);
+    glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
     GPU_CHECK();
-    program->shader_rmsnorm_normalize_and_scale_currentPos = createComputeProgram(shader_rmsnorm_normalize_and_scale_currentPos);
+    int limit = max_size_x < max_invocations ? max_size_x : max_invocations;
+    int local_size = 256;
+    while (local_size > limit && local_size > 1) {
+        local_size /= 2;
+    }
+    program->local_size = local_size;
+    program->tile_x = local_size < 16 ? local_size : 16;
+    program->tile_y = local_size / program->tile_x;
+}
+
+void compile_GPUProgram(GPUProgram* program, int group_size, int f16, int kv_f16, int head_size) {
+    select_workgroup_size(program);
+    // the single token kernels are built with a batch tile of 1, so transformer() does not
+    // pay for the extra accumulators of the batched ones. Q8_0 and F16 switch the matmuls to
+    // int8 and fp16 weights, KV_F16 the kv cache to fp16. they all accumulate in fp32
+    const char* weight_type = group_size > 0 ? "#define Q8_0\n" : f16 ? "#define F16\n" : "";
+    const char* kv_type = kv_f16 ? "#define KV_F16\n"
+                                   "#define KV_TYPE uint\n"
+                                   "#define KV_LOAD(buf, idx) unpackHalf2x16(buf.data[(idx) >> 1])[(idx) & 1]\n"
+                                 : "#define KV_TYPE float\n"
+                                   "#define KV_LOAD(buf, idx) buf.data[idx]\n";
+    char defines[384];
+    char batch_defines[384];
+    snprintf(defines, sizeof(defines), "#define LOCAL_SIZE %d\n#define TILE_X %d\n#define TILE_Y %d\n#define BATCH_TILE 1\n%s%s",
+             program->local_size, program->tile_x, program->tile_y, weight_type, kv_type);
+    snprintf(batch_defines, sizeof(batch_defines), "#define LOCAL_SIZE %d\n#define TILE_X %d\n#define TILE_Y %d\n#define BATCH_TILE %d\n%s%s",
+             program->local_size, program->tile_x, program->tile_y, BATCH_TILE, weight_type, kv_type);
+    char swiglu_defines[416];
+    char swiglu_batch_defines[416];
+    snprintf(swiglu_defines, sizeof(swiglu_defines), "%s#define SWIGLU\n", defines);
+    snprintf(swiglu_batch_defines, sizeof(swiglu_batch_defines), "%s#define SWIGLU\n", batch_defines);
+    // the attention keeps q and its share of the output row of a head in registers
+    char attention_defines[416];
+    snprintf(attention_defines, sizeof(attention_defines), "%s#define HEAD_SIZE %d\n", defines, head_size);
+
+    ShaderCache cache;
+    init_shader_cache(&cache);
+    program->shader_matmul = createCachedProgram(&cache, shader_matmul, defines);
     GPU_CHECK();
-    program->shader_accum = createComputeProgram(shader_accum);
+    program->shader_rmsnorm = createCachedProgram(&cache, shader_rmsnorm, defines);
     GPU_CHECK();
-    program->shader_positionalEncoding = createComputeProgram(shader_positionalEncoding);
+    program->shader_accum = createCachedProgram(&cache, shader_accum, defines);
     GPU_CHECK();
-    program->shader_max = createComputeProgram(shader_max);
+    program->shader_positionalEncoding = createCachedProgram(&cache, shader_positionalEncoding, defines);
     GPU_CHECK();
-    program->shader_max_vec4 = createComputeProgram(shader_max_vec4);
+    program->shader_transformer_attention = createCachedProgram(&cache, shader_transformer_attention, attention_defines);
     GPU_CHECK();
-    program->shader_softmax_exp = createComputeProgram(shader_softmax_exp);
+    program->shader_argmax = createCachedProgram(&cache, shader_argmax, defines);
     GPU_CHECK();
-    program->shader_softmax_normalize = createComputeProgram(shader_softmax_normalize);
+    program->shader_sample = createCachedProgram(&cache, shader_sample, defines);
     GPU_CHECK();
-    program->shader_transformer_get_query_vector = createComputeProgram(shader_transformer_get_query_vector);
+    program->shader_copyBuffer = createCachedProgram(&cache, shader_copyBuffer, defines);
     GPU_CHECK();
-    program->shader_transformer_silu_and_mulW3 = createComputeProgram(shader_transformer_silu_and_mulW3);
+    program->shader_embedding = createCachedProgram(&cache, shader_embedding, defines);
     GPU_CHECK();
-    program->shader_transformer_build_attMat = createComputeProgram(shader_transformer_build_attMat);
+    program->shader_matmul_trans_vec4 = createCachedProgram(&cache, shader_matmul_trans_vec4, defines);
     GPU_CHECK();
-    program->shader_transformer_softmax_input = createComputeProgram(shader_transformer_softmax_input);
+    program->shader_matmul_batch = createCachedProgram(&cache, shader_matmul, batch_defines);
     GPU_CHECK();
-    program->shader_transformer_softmax_output = createComputeProgram(shader_transformer_softmax_output);
+    program->shader_matmul_trans_vec4_batch = createCachedProgram(&cache, shader_matmul_trans_vec4, batch_defines);
     GPU_CHECK();
-    program->shader_temperature = createComputeProgram(shader_temperature);
+    program->shader_matmul_swiglu = createCachedProgram(&cache, shader_matmul_trans_vec4, swiglu_defines);
     GPU_CHECK();
-    program->shader_copyBuffer = createComputeProgram(shader_copyBuffer);
+    program->shader_matmul_swiglu_batch = createCachedProgram(&cache, shader_matmul_trans_vec4, swiglu_batch_defines);
     GPU_CHECK();
-    program->shader_matmul_trans_vec4 = createComputeProgram(shader_matmul_trans_vec4);
+    free(cache.dir);
+
+    program->positionalEncoding_pos = glGetUniformLocation(program->shader_positionalEncoding, "pos");
+    program->transformer_attention_pos = glGetUniformLocation(program->shader_transformer_attention, "pos");
+    program->matmul_batch = glGetUniformLocation(program->shader_matmul, "batch");
+    program->matmul_trans_vec4_batch = glGetUniformLocation(program->shader_matmul_trans_vec4, "batch");
+    program->matmul_batch_batch = glGetUniformLocation(program->shader_matmul_batch, "batch");
+    program->matmul_trans_vec4_batch_batch = glGetUniformLocation(program->shader_matmul_trans_vec4_batch, "batch");
+    program->matmul_row_threads = glGetUniformLocation(program->shader_matmul, "row_threads");
+    program->matmul_batch_row_threads = glGetUniformLocation(program->shader_matmul_batch, "row_threads");
+    program->matmul_swiglu_batch = glGetUniformLocation(program->shader_matmul_swiglu, "batch");
+    program->matmul_swiglu_batch_batch = glGetUniformLocation(program->shader_matmul_swiglu_batch, "batch");
+    program->copyBuffer_pos = glGetUniformLocation(program->shader_copyBuffer, "pos");
+    program->embedding_dim = glGetUniformLocation(program->shader_embedding, "dim");
+    program->embedding_group_size = glGetUniformLocation(program->shader_embedding, "group_size");
+    program->embedding_x_stride = glGetUniformLocation(program->shader_embedding, "x_stride");
+    program->argmax_n = glGetUniformLocation(program->shader_argmax, "n");
+    program->sample_n = glGetUniformLocation(program->shader_sample, "n");
+    program->sample_temperature = glGetUniformLocation(program->shader_sample, "temperature");
+    program->sample_topp = glGetUniformLocation(program->shader_sample, "topp");
+    program->sample_topk = glGetUniformLocation(program->shader_sample, "topk");
+    program->sample_minp = glGetUniformLocation(program->shader_sample, "minp");
+    program->sample_coin = glGetUniformLocation(program->shader_sample, "coin");
     GPU_CHECK();
 }
 
-#define create_GPU_buffer(ptr, size, usage, data) \
-    glGenBuffers(1, &ptr);                        \
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ptr);  \
-    glBufferData(GL_SHADER_STORAGE_BUFFER,        \
-                 size,                            \
-                 data, usage);                    \
+// bytes in the buffers allocated so far, and the peak of that, for the benchmark
+struct {
+    size_t current;
+    size_t peak;
+} gpu_memory;
+
+#define create_GPU_buffer(ptr, size, usage, data)   \
+    glGenBuffers(1, &ptr);                          \
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ptr);    \
+    glBufferData(GL_SHADER_STORAGE_BUFFER,          \
+                 size,                              \
+                 data, usage);                      \
+    gpu_memory.current += (size);                   \
+    if (gpu_memory.current > gpu_memory.peak) {     \
+        gpu_memory.peak = gpu_memory.current;       \
+    }                                               \
     GPU_CHECK();
 
-void malloc_run_state(RunState* s, Config* p) {
+void malloc_run_state(RunState* s, Config* p, int kv_f16, int n_layers) {
     int dim_vec4 = ((p->dim / 4) + 1) * 4;
+    int kv_dim_vec4 = (((p->dim * p->n_kv_heads) / p->n_heads / 4) + 1) * 4;
     int hidden_dim_vec4 = ((p->hidden_dim / 4) + 1) * 4;
+    int qkv_dim_vec4 = dim_vec4 + 2 * kv_dim_vec4;
+
+    // zeros to initialize the activations with, the padding of every row has to stay 0
+    size_t zeros_len = sizeof(float) * PREFILL_BATCH * (hidden_dim_vec4 > qkv_dim_vec4 ? hidden_dim_vec4 : qkv_dim_vec4);
+    float* zeros = (float*)calloc(1, zeros_len);
+    if (!zeros) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
 
-    s->x_len = sizeof(float) * p->dim;
-    create_GPU_buffer(s->x, s->x_len, GL_DYNAMIC_DRAW, NULL);
-
-    s->xb_len = sizeof(float) * dim_vec4;
-    create_GPU_buffer(s->xb, s->xb_len, GL_DYNAMIC_DRAW, NULL);
-
-    s->xb2_len = sizeof(float) * dim_vec4;
-    create_GPU_buffer(s->xb2, s->xb2_len, GL_DYNAMIC_DRAW, NULL);
-
-    s->hb_len = sizeof(float) * hidden_dim_vec4;
-    create_GPU_buffer(s->hb, s->hb_len, GL_DYNAMIC_DRAW, NULL);
-
-    s->hb2_len = sizeof(float) * hidden_dim_vec4;
-    create_GPU_buffer(s->hb2, s->hb2_len, GL_DYNAMIC_DRAW, NULL);
+    s->x_len = sizeof(float) * PREFILL_BATCH * dim_vec4;
+    create_GPU_buffer(s->x, s->x_len, GL_DYNAMIC_DRAW, zeros);
 
-    s->q_len = sizeof(float) * dim_vec4;
-    create_GPU_buffer(s->q, s->q_len, GL_DYNAMIC_DRAW, NULL);
+    s->xb_len = sizeof(float) * PREFILL_BATCH * dim_vec4;
+    create_GPU_buffer(s->xb, s->xb_len, GL_DYNAMIC_DRAW, zeros);
 
-    s->k_len = sizeof(float) * dim_vec4;
-    create_GPU_buffer(s->k, s->k_len, GL_DYNAMIC_DRAW, NULL);
+    s->xb2_len = sizeof(float) * PREFILL_BATCH * dim_vec4;
+    create_GPU_buffer(s->xb2, s->xb2_len, GL_DYNAMIC_DRAW, zeros);
 
-    s->v_len = sizeof(float) * dim_vec4;
-    create_GPU_buffer(s->v, s->v_len, GL_DYNAMIC_DRAW, NULL);
+    s->hb_len = sizeof(float) * PREFILL_BATCH * hidden_dim_vec4;
+    create_GPU_buffer(s->hb, s->hb_len, GL_DYNAMIC_DRAW, zeros);
 
-    s->att_len = sizeof(float) * p->n_heads * p->seq_len;
-    create_GPU_buffer(s->att, s->att_len, GL_DYNAMIC_DRAW, NULL);
+    s->qkv_len = sizeof(float) * PREFILL_BATCH * qkv_dim_vec4;
+    create_GPU_buffer(s->qkv, s->qkv_len, GL_DYNAMIC_DRAW, zeros);
+    free(zeros);
 
     s->logits_len = sizeof(float) * p->vocab_size;
     create_GPU_buffer(s->logits, s->logits_len, GL_DYNAMIC_DRAW, NULL);
 
-    s->probindex = (ProbIndex*)calloc(p->vocab_size, sizeof(ProbIndex));
-
-    s->key_cache_len = sizeof(float) * p->n_layers * p->seq_len * p->dim;
+    create_GPU_buffer(s->tokens, sizeof(int) * PREFILL_BATCH, GL_DYNAMIC_DRAW, NULL);
+    create_GPU_buffer(s->sample_result, sizeof(int), GL_DYNAMIC_COPY, NULL);
+    create_GPU_buffer(s->sample_readback, sizeof(int), GL_DYNAMIC_READ, NULL);
+
+    // the kv cache starts with a single page, kv_reserve grows it with the sequence
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    s->kv_pages = 1;
+    s->kv_f16 = kv_f16;
+    s->kv_bytes = kv_f16 ? sizeof(uint16_t) : sizeof(float);
+    s->kv_window = 0;
+    s->kv_sinks = 0;
+    s->kv_capacity = p->seq_len;
+    s->n_layers = n_layers;
+    s->host = NULL;
+    s->key_cache_len = s->kv_bytes * s->n_layers * KV_PAGE_SIZE * kv_dim;
     create_GPU_buffer(s->key_cache, s->key_cache_len, GL_DYNAMIC_DRAW, NULL);
 
-    s->value_cache_len = sizeof(float) * p->n_layers * p->seq_len * p->dim;
+    s->value_cache_len = s->kv_bytes * s->n_layers * KV_PAGE_SIZE * kv_dim;
     create_GPU_buffer(s->value_cache, s->value_cache_len, GL_DYNAMIC_DRAW, NULL);
+}
+
+void grow_buffer(GLuint* buffer, GLuint* len, GLuint new_len) {
+    // replace buffer with a larger one that starts with the same contents
+    GLuint grown;
+    create_GPU_buffer(grown, new_len, GL_DYNAMIC_DRAW, NULL);
+    // make the shader writes to the old buffer visible to the copy
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, *buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, *len);
+    glDeleteBuffers(1, buffer);
+    gpu_memory.current -= *len;
+    GPU_CHECK();
+    *buffer = grown;
+    *len = new_len;
+}
 
-    //max(config.seq_len , config.vocab_size , config.dim)
-    s->mulBuffer_len = p->dim * p->seq_len * sizeof(float);
-    if (p->vocab_size > s->mulBuffer_len) {
-        s->mulBuffer_len = p->vocab_size;
+void set_kv_window(RunState* s, int window, int sinks) {
+    // attend to the sinks first positions and the window - sinks last ones only, so the
+    // sequence can run past seq_len. the kv cache becomes a ring of window rows after the
+    // sinks, plus PREFILL_BATCH - 1 so that a batch does not overwrite rows the tokens
+    // before it in the same batch still attend to. call before record_dispatch_params
+    s->kv_window = window;
+    s->kv_sinks = sinks;
+    s->kv_capacity = window + PREFILL_BATCH - 1;
+}
+
+void kv_reserve(RunState* s, Config* p, int n_pos) {
+    // make room for positions 0..n_pos in the kv cache. the buffers double in pages, up
+    // to the pages of kv_capacity, and the pages are laid out (page, layer, ...) so the
+    // contents so far stay where they are
+    if (n_pos > s->kv_capacity) { n_pos = s->kv_capacity; }
+    int needed = (n_pos + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE;
+    if (needed <= s->kv_pages) { return; }
+    int max_pages = (s->kv_capacity + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE;
+    int pages = s->kv_pages;
+    while (pages < needed) { pages *= 2; }
+    if (pages > max_pages) { pages = max_pages; }
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    GLuint len = s->kv_bytes * pages * s->n_layers * KV_PAGE_SIZE * kv_dim;
+    grow_buffer(&s->key_cache, &s->key_cache_len, len);
+    grow_buffer(&s->value_cache, &s->value_cache_len, len);
+    s->kv_pages = pages;
+}
+
+void rope_far_rows(TransformerWeights_gpu* w, Config* p, int pos, int batch) {
+    // the freq_cis tables end at seq_len, a sliding window does not. the rows of the
+    // positions of the batch past it are computed here, row b into the spare row
+    // seq_len + b that shader_positionalEncoding reads instead
+    if (pos + batch <= p->seq_len) { return; }
+    int half = p->dim / p->n_heads / 2;
+    float* rows = (float*)malloc(sizeof(float) * 2 * half);
+    for (int b = 0; b < batch; b++) {
+        if (pos + b < p->seq_len) { continue; }
+        for (int i = 0; i < half; i++) {
+            float freq = 1.0f / powf(10000.0f, (2 * i) / (float)(2 * half));
+            float val = (pos + b) * freq;
+            rows[i] = cosf(val);
+            rows[half + i] = sinf(val);
+        }
+        GLintptr offset = sizeof(float) * (GLintptr)(p->seq_len + b) * half;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, w->freq_cis_real);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, sizeof(float) * half, rows);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, w->freq_cis_imag);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, sizeof(float) * half, rows + half);
     }
-    create_GPU_buffer(s->transformer_softmax_cache, s->mulBuffer_len, GL_DYNAMIC_DRAW, NULL);
-    create_GPU_buffer(s->mulBuffer_1, s->mulBuffer_len, GL_DYNAMIC_DRAW, NULL);
-    create_GPU_buffer(s->mulBuffer_2, s->mulBuffer_len, GL_DYNAMIC_DRAW, NULL);
-    create_GPU_buffer(s->mulBuffer_3, s->mulBuffer_len, GL_DYNAMIC_DRAW, NULL);
-    create_GPU_buffer(s->mulBuffer_4, s->mulBuffer_len, GL_DYNAMIC_DRAW, NULL);
+    free(rows);
 }
 
 void free_run_state(RunState* s) {
@@ -944,261 +1722,1043 @@ void free_run_state(RunState* s) {
     glDeleteBuffers(1, &s->xb);
     glDeleteBuffers(1, &s->xb2);
     glDeleteBuffers(1, &s->hb);
-    glDeleteBuffers(1, &s->hb2);
-    glDeleteBuffers(1, &s->q);
-    glDeleteBuffers(1, &s->k);
-    glDeleteBuffers(1, &s->v);
-    glDeleteBuffers(1, &s->att);
+    glDeleteBuffers(1, &s->qkv);
     glDeleteBuffers(1, &s->logits);
     glDeleteBuffers(1, &s->key_cache);
     glDeleteBuffers(1, &s->value_cache);
-    glDeleteBuffers(1, &s->transformer_softmax_cache);
-    glDeleteBuffers(1, &s->mulBuffer_1);
-    glDeleteBuffers(1, &s->mulBuffer_2);
-    glDeleteBuffers(1, &s->mulBuffer_3);
-    glDeleteBuffers(1, &s->mulBuffer_4);
-    free(s->probindex);
-}
-
-void copyLocalMat(float* out, float* src, int n_layers, int dim_i, int dim_j, int rdim) {
-    int i, j, l;
-    for (l = 0; l < n_layers; ++l) {
-        for (i = 0; i < dim_i; ++i) {
-            for (j = 0; j < dim_j; ++j) {
-                float val = src[l * dim_i * dim_j + j * dim_i + i];
-                out[l * rdim * dim_i + i * rdim + j] = val;
+    glDeleteBuffers(1, &s->tokens);
+    glDeleteBuffers(1, &s->sample_result);
+    glDeleteBuffers(1, &s->sample_readback);
+    glDeleteBuffers(1, &s->params.buffer);
+    free(s->params.records);
+    free(s->layers);
+}
+
+int push_params(DispatchParams* dp, const void* params, int size) {
+    // append a record to the host copy, returns its index
+    if (dp->count == dp->capacity) {
+        dp->capacity = dp->capacity ? dp->capacity * 2 : 64;
+        dp->records = (char*)realloc(dp->records, (size_t)dp->capacity * dp->stride);
+        if (!dp->records) {
+            fprintf(stderr, "malloc failed!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char* record = dp->records + (size_t)dp->count * dp->stride;
+    memset(record, 0, dp->stride);
+    memcpy(record, params, size);
+    return dp->count++;
+}
+
+void* get_params(DispatchParams* dp, int index) {
+    return dp->records + (size_t)index * dp->stride;
+}
+
+void bind_params(DispatchParams* dp, int index) {
+    glBindBufferRange(GL_UNIFORM_BUFFER, 0, dp->buffer, (GLintptr)index * dp->stride, DISPATCH_PARAMS_SIZE);
+}
+
+int push_matmul(DispatchParams* dp, int n, int d, int w_offset, int x_stride, int out_stride, int s_offset, int group_size) {
+    MatmulParams mp = {n, d, 0, w_offset, x_stride, out_stride, s_offset, group_size};
+    return push_params(dp, &mp, sizeof(mp));
+}
+
+int push_rmsnorm(DispatchParams* dp, int size, int weight_offset, int stride) {
+    RmsnormParams rp = {size, weight_offset, stride};
+    return push_params(dp, &rp, sizeof(rp));
+}
+
+int push_copy(DispatchParams* dp, RunState* s, int src_offset, int dst_offset, int row_size, int src_stride, int page_size, int page_stride) {
+    CopyParams cp = {src_offset, dst_offset, row_size, src_stride, page_size, page_stride, s->kv_sinks, s->kv_capacity};
+    return push_params(dp, &cp, sizeof(cp));
+}
+
+void record_dispatch_params(RunState* s, Config* p, TransformerWeights_gpu* w) {
+    // everything static about the forward pass is recorded here once and uploaded
+    // into a single uniform buffer; transformer() only binds ranges of it
+    DispatchParams* dp = &s->params;
+    GLint alignment = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    dp->stride = ((DISPATCH_PARAMS_SIZE + alignment - 1) / alignment) * alignment;
+    dp->count = 0;
+    dp->capacity = 0;
+    dp->records = NULL;
+
+    int dim = p->dim;
+    int hidden_dim = p->hidden_dim;
+    int kv_dim = (dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads;
+    int head_size = dim / p->n_heads;
+    int dim_vec4 = w->dim_vec4;
+    int kv_dim_vec4 = w->kv_dim_vec4;
+    int hidden_dim_vec4 = w->hidden_dim_vec4;
+    int qkv_dim_vec4 = dim_vec4 + 2 * kv_dim_vec4;  // a row of qkv: q, then k at dim_vec4, then v
+    // the transposed matrices keep one padded row of scales per group of input rows, the
+    // row-major w2 and wcls index theirs by element (the w_offset is added in the shader)
+    int gs = w->group_size > 0 ? w->group_size : 1;
+    int dim_groups = dim / gs;
+    s->layers = (LayerDispatch*)malloc(s->n_layers * sizeof(LayerDispatch));
+    for (int l = 0; l < s->n_layers; l++) {
+        LayerDispatch* ld = &s->layers[l];
+        ld->rms_att = push_rmsnorm(dp, dim, l * dim, dim_vec4);
+        ld->wqkv = push_matmul(dp, qkv_dim_vec4, dim, l * qkv_dim_vec4 * dim, dim_vec4, qkv_dim_vec4, l * qkv_dim_vec4 * dim_groups, gs);
+        LayerParams lp = {p->seq_len, head_size, dim, l, kv_dim, kv_mul, qkv_dim_vec4, dim_vec4, s->n_layers, KV_PAGE_SIZE, dim_vec4, s->kv_window, s->kv_sinks, s->kv_capacity};
+        ld->layer = push_params(dp, &lp, sizeof(lp));
+        int loff = l * KV_PAGE_SIZE * kv_dim;  // kv cache layer offset in a page
+        int page_stride = s->n_layers * KV_PAGE_SIZE * kv_dim;
+        ld->key_cache = push_copy(dp, s, dim_vec4, loff, kv_dim, qkv_dim_vec4, KV_PAGE_SIZE, page_stride);
+        ld->value_cache = push_copy(dp, s, dim_vec4 + kv_dim_vec4, loff, kv_dim, qkv_dim_vec4, KV_PAGE_SIZE, page_stride);
+        // the attention writes its output rows to xb, wo reads them from there
+        ld->wo = push_matmul(dp, dim_vec4, dim, l * dim_vec4 * dim, dim_vec4, dim_vec4, l * dim_vec4 * dim_groups, gs);
+        ld->rms_ffn = push_rmsnorm(dp, dim, l * dim, dim_vec4);
+        // n is the width of one of w1 and w3, the rows of w13 are twice that
+        ld->w13 = push_matmul(dp, hidden_dim_vec4, dim, l * dim * 2 * hidden_dim_vec4, dim_vec4, hidden_dim_vec4, l * 2 * hidden_dim_vec4 * dim_groups, gs);
+        ld->w2 = push_matmul(dp, hidden_dim, dim, l * dim * hidden_dim, hidden_dim_vec4, dim_vec4, 0, gs);
+    }
+    s->rms_final = push_rmsnorm(dp, dim, 0, dim_vec4);
+    s->cls = push_matmul(dp, dim, p->vocab_size, 0, dim_vec4, p->vocab_size, 0, gs);
+
+    create_GPU_buffer(dp->buffer, (size_t)dp->count * dp->stride, GL_STATIC_DRAW, dp->records);
+}
+
+// ----------------------------------------------------------------------------
+// weight upload. the matrices of matmul_trans_vec4 are transposed and padded to vec4
+// rows on the host. upload_weights only creates their buffers, and upload_layer fills
+// in layer l when the first forward pass gets to it: the GPU runs the layers that are
+// there already while the host transposes the next one. with -r the transposed layout
+// is kept in <checkpoint>.gpu and later runs upload it from there as it is
+
+#define TRANSPOSE_BLOCK 32
+#define HASH_CHUNK (1 << 20)  // bytes of the checkpoint hashed by one thread at a time
+#define LAYOUT_MAGIC 0x6c757067  // "gpul" in ASCII
+#define LAYOUT_VERSION 3
+#define LAYOUT_HEADER_SIZE 64
+
+typedef struct {
+    uint32_t magic;
+    int version;
+    int group_size;
+    int n_mats;
+    Config config;
+    int64_t checkpoint_size;  // the checkpoint the layout was built from
+    uint64_t checkpoint_hash;
+} LayoutHeader;
+
+typedef struct {
+    Tensor* src;  // (layer, dim_j, dim_i) in the checkpoint
+    int dim_j;
+    int rdim;  // dim_j padded to vec4
+} MatPart;
+
+typedef struct {
+    GLuint buffer;  // (layer, dim_i, rdim)
+    GLuint scales;  // (layer, dim_i / group_size, rdim) Q8_0 scaling factors, 0 for fp32 and fp16 weights
+    // the matrices of the same input side by side in every row, e.g. wq|wk|wv, so that
+    // a single matmul_trans_vec4 reads x once for all of them
+    MatPart parts[3];
+    int n_parts;
+    int dim_i;
+    int rdim;  // sum of the rdim of the parts
+} LayerMat;
+
+uint64_t checkpoint_hash(const char* data, size_t size) {
+    // FNV-1a over the whole checkpoint in HASH_CHUNK chunks, folded in file order, the same
+    // as run.c
+    int n_chunks = (int)((size + HASH_CHUNK - 1) / HASH_CHUNK);
+    uint64_t* chunks = (uint64_t*)malloc((n_chunks + 1) * sizeof(uint64_t));
+    if (!chunks) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    int c;
+    #pragma omp parallel for private(c)
+    for (c = 0; c < n_chunks; c++) {
+        const char* chunk = data + (size_t)c * HASH_CHUNK;
+        size_t len = size - (size_t)c * HASH_CHUNK < HASH_CHUNK ? size - (size_t)c * HASH_CHUNK : HASH_CHUNK;
+        uint64_t hash = 14695981039346656037ULL;
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t word;
+            memcpy(&word, chunk + i, 8);
+            hash = (hash ^ word) * 1099511628211ULL;
+        }
+        for (; i < len; i++) {
+            hash = (hash ^ (unsigned char)chunk[i]) * 1099511628211ULL;
+        }
+        chunks[c] = hash;
+    }
+    uint64_t hash = (14695981039346656037ULL ^ size) * 1099511628211ULL;
+    for (c = 0; c < n_chunks; c++) {
+        hash = (hash ^ chunks[c]) * 1099511628211ULL;
+    }
+    free(chunks);
+    return hash;
+}
+
+void transpose_f32(float* out, const float* src, int dim_i, int dim_j, int rdim, int stride) {
+    // out (dim_i, rdim) = src (dim_j, dim_i) transposed, the rows zero padded from dim_j
+    // to rdim and stride floats apart. square tiles of TRANSPOSE_BLOCK keep both sides of
+    // a tile in cache
+    int bi;
+    #pragma omp parallel for private(bi)
+    for (bi = 0; bi < dim_i; bi += TRANSPOSE_BLOCK) {
+        int i_end = bi + TRANSPOSE_BLOCK < dim_i ? bi + TRANSPOSE_BLOCK : dim_i;
+        for (int bj = 0; bj < dim_j; bj += TRANSPOSE_BLOCK) {
+            int j_end = bj + TRANSPOSE_BLOCK < dim_j ? bj + TRANSPOSE_BLOCK : dim_j;
+            for (int i = bi; i < i_end; i++) {
+                for (int j = bj; j < j_end; j++) {
+                    out[(size_t)i * stride + j] = src[(size_t)j * dim_i + i];
+                }
             }
-            for (; j < rdim; ++j) {
-                out[l * rdim * dim_i + i * rdim + j] = 0;
+        }
+        for (int i = bi; i < i_end; i++) {
+            memset(out + (size_t)i * stride + dim_j, 0, (rdim - dim_j) * sizeof(float));
+        }
+    }
+}
+
+void transpose_f16(uint16_t* out, const uint16_t* src, int dim_i, int dim_j, int rdim, int stride) {
+    // transpose_f32 for the values of fp16 tensors
+    int bi;
+    #pragma omp parallel for private(bi)
+    for (bi = 0; bi < dim_i; bi += TRANSPOSE_BLOCK) {
+        int i_end = bi + TRANSPOSE_BLOCK < dim_i ? bi + TRANSPOSE_BLOCK : dim_i;
+        for (int bj = 0; bj < dim_j; bj += TRANSPOSE_BLOCK) {
+            int j_end = bj + TRANSPOSE_BLOCK < dim_j ? bj + TRANSPOSE_BLOCK : dim_j;
+            for (int i = bi; i < i_end; i++) {
+                for (int j = bj; j < j_end; j++) {
+                    out[(size_t)i * stride + j] = src[(size_t)j * dim_i + i];
+                }
             }
         }
+        for (int i = bi; i < i_end; i++) {
+            memset(out + (size_t)i * stride + dim_j, 0, (rdim - dim_j) * sizeof(uint16_t));
+        }
     }
 }
 
-void upload_weights(TransformerWeights_local* local, TransformerWeights_gpu* remote, Config* p) {
-    remote->dim_vec4 = ((p->dim / 4) + 1) * 4;
-    remote->hidden_dim_vec4 = ((p->hidden_dim / 4) + 1) * 4;
+void transpose_q8(int8_t* out, const int8_t* src, int dim_i, int dim_j, int rdim, int stride) {
+    // transpose_f32 for the int8 values of Q8_0 tensors
+    int bi;
+    #pragma omp parallel for private(bi)
+    for (bi = 0; bi < dim_i; bi += TRANSPOSE_BLOCK) {
+        int i_end = bi + TRANSPOSE_BLOCK < dim_i ? bi + TRANSPOSE_BLOCK : dim_i;
+        for (int bj = 0; bj < dim_j; bj += TRANSPOSE_BLOCK) {
+            int j_end = bj + TRANSPOSE_BLOCK < dim_j ? bj + TRANSPOSE_BLOCK : dim_j;
+            for (int i = bi; i < i_end; i++) {
+                for (int j = bj; j < j_end; j++) {
+                    out[(size_t)i * stride + j] = src[(size_t)j * dim_i + i];
+                }
+            }
+        }
+        for (int i = bi; i < i_end; i++) {
+            memset(out + (size_t)i * stride + dim_j, 0, rdim - dim_j);
+        }
+    }
+}
 
-    remote->token_embedding_table = local->token_embedding_table;
+int collect_layer_mats(TransformerWeights_gpu* w, LayerMat* list) {
+    // the transposed matrices, in the order a layer is stored in <checkpoint>.gpu
+    Config* p = w->config;
+    TransformerWeights_local* local = w->local;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    LayerMat all[] = {
+        {w->wqkv, w->wqkv_s, {{&local->wq, p->dim, w->dim_vec4}, {&local->wk, kv_dim, w->kv_dim_vec4}, {&local->wv, kv_dim, w->kv_dim_vec4}}, 3, p->dim, 0},
+        {w->wo, w->wo_s, {{&local->wo, p->dim, w->dim_vec4}}, 1, p->dim, 0},
+        {w->w13, w->w13_s, {{&local->w1, p->hidden_dim, w->hidden_dim_vec4}, {&local->w3, p->hidden_dim, w->hidden_dim_vec4}}, 2, p->dim, 0},
+    };
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < all[i].n_parts; k++) {
+            all[i].rdim += all[i].parts[k].rdim;
+        }
+    }
+    memcpy(list, all, sizeof(all));
+    return 3;
+}
 
-    remote->rms_att_weight_len = sizeof(float) * p->n_layers * p->dim;
-    create_GPU_buffer(remote->rms_att_weight, remote->rms_att_weight_len, GL_STATIC_DRAW, local->rms_att_weight);
+size_t weight_value_size(TransformerWeights_gpu* w) {
+    // bytes per value of the matmul weights
+    return w->group_size > 0 ? sizeof(int8_t) : w->f16 ? sizeof(uint16_t) : sizeof(float);
+}
 
-    float* tmp = (float*)malloc(sizeof(float) * p->n_layers * remote->dim_vec4 * p->dim);
+size_t layer_values_size(LayerMat* m, TransformerWeights_gpu* w) {
+    // bytes of the values of one layer of m in its buffer
+    return (size_t)m->dim_i * m->rdim * weight_value_size(w);
+}
 
-    copyLocalMat(tmp, local->wq, p->n_layers, p->dim, p->dim, remote->dim_vec4);
-    remote->wq_len = sizeof(float) * p->n_layers * remote->dim_vec4 * p->dim;
-    create_GPU_buffer(remote->wq, remote->wq_len, GL_STATIC_DRAW, tmp);
+size_t layer_scales_size(LayerMat* m, int group_size) {
+    // bytes of the scales of one layer of m, 0 for fp32 and fp16 weights
+    return group_size == 0 ? 0 : (size_t)m->dim_i / group_size * m->rdim * sizeof(float);
+}
 
-    copyLocalMat(tmp, local->wk, p->n_layers, p->dim, p->dim, remote->dim_vec4);
-    remote->wk_len = sizeof(float) * p->n_layers * remote->dim_vec4 * p->dim;
-    create_GPU_buffer(remote->wk, remote->wk_len, GL_STATIC_DRAW, tmp);
+void transpose_values(void* out, LayerMat* m, int l, TransformerWeights_gpu* w) {
+    // the values of layer l of m, as they go into its buffer
+    int col = 0;  // first column of the part in the rows of m
+    for (int k = 0; k < m->n_parts; k++) {
+        MatPart* part = &m->parts[k];
+        size_t n = (size_t)m->dim_i * part->dim_j;  // per layer in the checkpoint
+        if (w->f16) {
+            transpose_f16((uint16_t*)out + col, part->src->h + l * n, m->dim_i, part->dim_j, part->rdim, m->rdim);
+        } else if (w->group_size == 0) {
+            transpose_f32((float*)out + col, part->src->f + l * n, m->dim_i, part->dim_j, part->rdim, m->rdim);
+        } else {
+            transpose_q8((int8_t*)out + col, part->src->q + l * n, m->dim_i, part->dim_j, part->rdim, m->rdim);
+        }
+        col += part->rdim;
+    }
+}
 
-    copyLocalMat(tmp, local->wv, p->n_layers, p->dim, p->dim, remote->dim_vec4);
-    remote->wv_len = sizeof(float) * p->n_layers * remote->dim_vec4 * p->dim;
-    create_GPU_buffer(remote->wv, remote->wv_len, GL_STATIC_DRAW, tmp);
+void transpose_scales(float* out, LayerMat* m, int l, int group_size) {
+    // the scales of layer l of m: every part is a (dim_j, dim_i / group_size) matrix in the checkpoint
+    int col = 0;
+    for (int k = 0; k < m->n_parts; k++) {
+        MatPart* part = &m->parts[k];
+        size_t n = (size_t)m->dim_i * part->dim_j;
+        transpose_f32(out + col, part->src->s + l * n / group_size, m->dim_i / group_size, part->dim_j, part->rdim, m->rdim);
+        col += part->rdim;
+    }
+}
 
-    copyLocalMat(tmp, local->wo, p->n_layers, p->dim, p->dim, remote->dim_vec4);
-    remote->wo_len = sizeof(float) * p->n_layers * remote->dim_vec4 * p->dim;
-    create_GPU_buffer(remote->wo, remote->wo_len, GL_STATIC_DRAW, tmp);
+void* map_layer(GLuint buffer, size_t offset, size_t size) {
+    // write-only mapping of one layer of a weight buffer. unsynchronized, the GPU does not
+    // use this range before it is uploaded, while it may still run the layers before it
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    void* ptr = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, offset, size,
+                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    GPU_CHECK();
+    if (ptr == NULL) {
+        fprintf(stderr, "glMapBufferRange failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
 
-    free(tmp);
+void upload_layer(TransformerWeights_gpu* w, int l) {
+    // upload layer l of the transposed matrices, the layers go up in order
+    LayerMat list[3];
+    int n_mats = collect_layer_mats(w, list);
+    int gs = w->group_size;
+    char* cached = w->layout != NULL ? w->layout + LAYOUT_HEADER_SIZE + l * w->layout_layer_size : NULL;
+    for (int i = 0; i < n_mats; i++) {
+        LayerMat* m = &list[i];
+        size_t values = layer_values_size(m, w);
+        size_t scales = layer_scales_size(m, gs);
+        if (cached != NULL) {
+            // already transposed, straight from the mapped file
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m->buffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, l * values, values, cached);
+            if (scales > 0) {
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, m->scales);
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, l * scales, scales, cached + values);
+            }
+            cached += values + scales;
+            continue;
+        }
+        // transpose straight into the mapped buffers
+        transpose_values(map_layer(m->buffer, l * values, values), m, l, w);
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+        if (scales > 0) {
+            transpose_scales((float*)map_layer(m->scales, l * scales, scales), m, l, gs);
+            glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+        }
+    }
+    GPU_CHECK();
+    w->layers_uploaded = l + 1;
+}
 
-    remote->rms_ffn_weight_len = sizeof(float) * p->n_layers * p->dim;
-    create_GPU_buffer(remote->rms_ffn_weight, remote->rms_ffn_weight_len, GL_STATIC_DRAW, local->rms_ffn_weight);
+void map_layout(TransformerWeights_gpu* w, char* checkpoint_path, char* data, size_t size) {
+    // upload the layers from <checkpoint>.gpu if it matches this checkpoint, otherwise
+    // transpose all the layers now and write them there for next time
+    LayerMat list[3];
+    int n_mats = collect_layer_mats(w, list);
+    Config* p = w->config;
+    w->layout_layer_size = 0;
+    for (int i = 0; i < n_mats; i++) {
+        w->layout_layer_size += layer_values_size(&list[i], w) + layer_scales_size(&list[i], w->group_size);
+    }
+    LayoutHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = LAYOUT_MAGIC;
+    header.version = LAYOUT_VERSION;
+    header.group_size = w->group_size;
+    header.n_mats = n_mats;
+    header.config = *p;
+    header.checkpoint_size = size;
+    header.checkpoint_hash = checkpoint_hash(data, size);
+    size_t file_size = LAYOUT_HEADER_SIZE + p->n_layers * w->layout_layer_size;
+
+    char* layout_path = (char*)malloc(strlen(checkpoint_path) + 16);
+    sprintf(layout_path, "%s.gpu", checkpoint_path);
+    FILE* file = fopen(layout_path, "rb");
+    LayoutHeader cached;
+    int valid = 0;
+    if (file) {
+        valid = fread(&cached, sizeof(cached), 1, file) == 1 && memcmp(&cached, &header, sizeof(header)) == 0;
+        fseek(file, 0, SEEK_END);
+        valid = valid && (size_t)ftell(file) == file_size;
+        fclose(file);
+    }
+    if (!valid) {
+        // transpose layer by layer, straight into a temporary file
+        char* tmp_path = (char*)malloc(strlen(layout_path) + 8);
+        sprintf(tmp_path, "%s.tmp", layout_path);
+        file = fopen(tmp_path, "wb");
+        char header_block[LAYOUT_HEADER_SIZE] = {0};  // the header, zero padded
+        memcpy(header_block, &header, sizeof(header));
+        int ok = file != NULL && fwrite(header_block, LAYOUT_HEADER_SIZE, 1, file) == 1;
+        char* buffer = ok ? (char*)malloc(w->layout_layer_size) : NULL;
+        if (ok && !buffer) {
+            fprintf(stderr, "malloc failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int l = 0; l < p->n_layers && ok; l++) {
+            char* ptr = buffer;
+            for (int i = 0; i < n_mats; i++) {
+                transpose_values(ptr, &list[i], l, w);
+                ptr += layer_values_size(&list[i], w);
+                if (w->group_size > 0) {
+                    transpose_scales((float*)ptr, &list[i], l, w->group_size);
+                    ptr += layer_scales_size(&list[i], w->group_size);
+                }
+            }
+            ok = fwrite(buffer, w->layout_layer_size, 1, file) == 1;
+        }
+        free(buffer);
+        if (file) {
+            ok = fclose(file) == 0 && ok;
+        }
+        if (ok) {
+            remove(layout_path);  // rename does not replace an existing file on windows
+            ok = rename(tmp_path, layout_path) == 0;
+        }
+        if (!ok) {
+            // could not write next to the checkpoint, keep transposing at load time
+            fprintf(stderr, "couldn't write %s, transposing the weights as they are uploaded\n", layout_path);
+            remove(tmp_path);
+            free(tmp_path);
+            free(layout_path);
+            return;
+        }
+        free(tmp_path);
+    }
+    // memory map the layout, just like the checkpoint
+    w->layout_fd = open(layout_path, O_RDONLY);
+    if (w->layout_fd == -1) {
+        fprintf(stderr, "open failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    w->layout_size = file_size;
+    w->layout = (char*)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, w->layout_fd, 0);
+    if (w->layout == MAP_FAILED) {
+        fprintf(stderr, "mmap failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    free(layout_path);
+}
+
+void create_mat(TransformerWeights_gpu* remote, GLuint* w, GLuint* w_len, GLuint* w_s, int n_layers, int dim_i, int rdim) {
+    // the buffers of a matrix of matmul_trans_vec4, transposed and padded, upload_layer fills them in
+    size_t size = (size_t)n_layers * rdim * dim_i;
+    int group_size = remote->group_size;
+    *w_len = weight_value_size(remote) * size;
+    create_GPU_buffer(*w, *w_len, GL_STATIC_DRAW, NULL);
+    if (group_size == 0) {
+        *w_s = 0;
+        return;
+    }
+    create_GPU_buffer(*w_s, sizeof(float) * (size / group_size), GL_STATIC_DRAW, NULL);
+}
+
+void upload_rows(TransformerWeights_gpu* remote, GLuint* w, GLuint* w_len, GLuint* w_s, Tensor* src, size_t size) {
+    // upload a row-major matrix of matmul as it is stored in the checkpoint
+    int group_size = remote->group_size;
+    if (remote->f16) {
+        // the shader loads the halves 2 at a time, round the buffer up to whole uints
+        *w_len = (sizeof(uint16_t) * size + 3) / 4 * 4;
+        *w_s = 0;
+        create_GPU_buffer(*w, *w_len, GL_STATIC_DRAW, NULL);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(uint16_t) * size, src->h);
+        return;
+    }
+    if (group_size == 0) {
+        *w_len = sizeof(float) * size;
+        *w_s = 0;
+        create_GPU_buffer(*w, *w_len, GL_STATIC_DRAW, src->f);
+        return;
+    }
+    // the shader loads the int8 values 4 at a time, round the buffer up to whole ints
+    *w_len = (size + 3) / 4 * 4;
+    create_GPU_buffer(*w, *w_len, GL_STATIC_DRAW, NULL);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, src->q);
+    create_GPU_buffer(*w_s, sizeof(float) * (size / group_size), GL_STATIC_DRAW, src->s);
+}
+
+void upload_weights(TransformerWeights_local* local, TransformerWeights_gpu* remote, Config* p, int n_layers) {
+    // the matrices of the first n_layers layers only, the others run on the host
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    remote->dim_vec4 = ((p->dim / 4) + 1) * 4;
+    remote->kv_dim_vec4 = ((kv_dim / 4) + 1) * 4;
+    remote->hidden_dim_vec4 = ((p->hidden_dim / 4) + 1) * 4;
+
+    remote->group_size = local->group_size;
+    remote->f16 = local->f16;
+
+    remote->rms_att_weight_len = sizeof(float) * p->n_layers * p->dim;
+    create_GPU_buffer(remote->rms_att_weight, remote->rms_att_weight_len, GL_STATIC_DRAW, local->rms_att_weight);
 
-    tmp = (float*)malloc(sizeof(float) * p->n_layers * p->dim * remote->hidden_dim_vec4);
+    int qkv_dim_vec4 = remote->dim_vec4 + 2 * remote->kv_dim_vec4;
+    create_mat(remote, &remote->wqkv, &remote->wqkv_len, &remote->wqkv_s, n_layers, p->dim, qkv_dim_vec4);
+    create_mat(remote, &remote->wo, &remote->wo_len, &remote->wo_s, n_layers, p->dim, remote->dim_vec4);
 
-    copyLocalMat(tmp, local->w1, p->n_layers, p->dim, p->hidden_dim, remote->hidden_dim_vec4);
-    remote->w1_len = sizeof(float) * p->n_layers * p->dim * remote->hidden_dim_vec4;
-    create_GPU_buffer(remote->w1, remote->w1_len, GL_STATIC_DRAW, tmp);
+    remote->rms_ffn_weight_len = sizeof(float) * p->n_layers * p->dim;
+    create_GPU_buffer(remote->rms_ffn_weight, remote->rms_ffn_weight_len, GL_STATIC_DRAW, local->rms_ffn_weight);
 
-    copyLocalMat(tmp, local->w3, p->n_layers, p->dim, p->hidden_dim, remote->hidden_dim_vec4);
-    remote->w3_len = sizeof(float) * p->n_layers * p->dim * remote->hidden_dim_vec4;
-    create_GPU_buffer(remote->w3, remote->w3_len, GL_STATIC_DRAW, tmp);
+    create_mat(remote, &remote->w13, &remote->w13_len, &remote->w13_s, n_layers, p->dim, 2 * remote->hidden_dim_vec4);
 
-    free(tmp);
+    // their layers come from the checkpoint as the first forward pass needs them
+    remote->local = local;
+    remote->config = p;
+    remote->layers_uploaded = 0;
+    remote->layout = NULL;
+    remote->layout_size = 0;
+    remote->layout_fd = -1;
 
-    remote->w2_len = sizeof(float) * p->n_layers * p->hidden_dim * p->dim;
-    create_GPU_buffer(remote->w2, remote->w2_len, GL_STATIC_DRAW, local->w2);
+    upload_rows(remote, &remote->w2, &remote->w2_len, &remote->w2_s, &local->w2, (size_t)n_layers * p->hidden_dim * p->dim);
 
     remote->rms_final_weight_len = sizeof(float) * p->dim;
     create_GPU_buffer(remote->rms_final_weight, remote->rms_final_weight_len, GL_STATIC_DRAW, local->rms_final_weight);
 
     int head_size = p->dim / p->n_heads;
 
-    remote->freq_cis_real_len = sizeof(float) * p->seq_len * head_size / 2;
-    create_GPU_buffer(remote->freq_cis_real, remote->freq_cis_real_len, GL_STATIC_DRAW, local->freq_cis_real);
+    // PREFILL_BATCH spare rows after the tables, for the positions past seq_len of a
+    // sliding window (see rope_far_rows)
+    GLuint freq_cis_table_len = sizeof(float) * p->seq_len * head_size / 2;
+    remote->freq_cis_real_len = sizeof(float) * (p->seq_len + PREFILL_BATCH) * head_size / 2;
+    create_GPU_buffer(remote->freq_cis_real, remote->freq_cis_real_len, GL_STATIC_DRAW, NULL);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, freq_cis_table_len, local->freq_cis_real);
+
+    remote->freq_cis_imag_len = sizeof(float) * (p->seq_len + PREFILL_BATCH) * head_size / 2;
+    create_GPU_buffer(remote->freq_cis_imag, remote->freq_cis_imag_len, GL_STATIC_DRAW, NULL);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, freq_cis_table_len, local->freq_cis_imag);
+
+    upload_rows(remote, &remote->wcls, &remote->wcls_len, &remote->wcls_s, &local->wcls, (size_t)p->dim * p->vocab_size);
+
+    // the embedding table is row-major like wcls, and is the same buffer when they are shared
+    if (local->token_embedding_table.f == local->wcls.f && local->token_embedding_table.q == local->wcls.q &&
+        local->token_embedding_table.h == local->wcls.h) {
+        remote->token_embedding_table = remote->wcls;
+        remote->token_embedding_table_len = remote->wcls_len;
+        remote->token_embedding_table_s = remote->wcls_s;
+    } else {
+        upload_rows(remote, &remote->token_embedding_table, &remote->token_embedding_table_len,
+                    &remote->token_embedding_table_s, &local->token_embedding_table, (size_t)p->vocab_size * p->dim);
+    }
+}
 
-    remote->freq_cis_imag_len = sizeof(float) * p->seq_len * head_size / 2;
-    create_GPU_buffer(remote->freq_cis_imag, remote->freq_cis_imag_len, GL_STATIC_DRAW, local->freq_cis_imag);
+// ----------------------------------------------------------------------------
+// fp16 on the host, for the kv cache of the sessions: the files hold fp32 either way
+
+float fp16_to_fp32(uint16_t h) {
+    // exact, every half is a float
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);  // inf and nan
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // subnormal, normalize the mantissa
+        exp = 113;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
 
-    remote->wcls_len = sizeof(float) * p->dim * p->vocab_size;
-    create_GPU_buffer(remote->wcls, remote->wcls_len, GL_STATIC_DRAW, local->wcls);
+uint16_t fp32_to_fp16(float f) {
+    // round to nearest even, like packHalf2x16 on the GPUs that round
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if (((x >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mant ? 0x200 : 0);  // inf and nan
+    }
+    if (exp >= 0x1f) {
+        return sign | 0x7c00;  // too large, inf
+    }
+    int shift = 13;
+    uint32_t h;
+    if (exp <= 0) {
+        // subnormal, or zero below half of the smallest one
+        if (exp < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        shift = 14 - exp;
+        h = mant >> shift;
+    } else {
+        h = ((uint32_t)exp << 10) | (mant >> shift);
+    }
+    uint32_t rem = mant & ((1u << shift) - 1);
+    uint32_t half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1))) {
+        h++;  // a carry out of the mantissa rounds up to the next exponent, or inf
+    }
+    return sign | h;
 }
 
 // ----------------------------------------------------------------------------
 // initialization: read from checkpoint
+float* map_fp32(Tensor* t, float* ptr, size_t n) {
+    // point t at the next n fp32 values, returns the pointer past them
+    t->f = ptr;
+    t->q = NULL;
+    t->s = NULL;
+    t->h = NULL;
+    return ptr + n;
+}
+
 void checkpoint_init_weights(TransformerWeights_local* w, Config* p, float* f, int shared_weights) {
+    // legacy version 0 layout, everything in fp32
+    int head_size = p->dim / p->n_heads;
     float* ptr = f;
-    w->token_embedding_table = ptr;
-    ptr += p->vocab_size * p->dim;
+    w->group_size = 0;
+    w->f16 = 0;
+    w->freq_cis_alloc = NULL;
+    ptr = map_fp32(&w->token_embedding_table, ptr, (size_t)p->vocab_size * p->dim);
     w->rms_att_weight = ptr;
     ptr += p->n_layers * p->dim;
-    w->wq = ptr;
-    ptr += p->n_layers * p->dim * p->dim;
-    w->wk = ptr;
-    ptr += p->n_layers * p->dim * p->dim;
-    w->wv = ptr;
-    ptr += p->n_layers * p->dim * p->dim;
-    w->wo = ptr;
-    ptr += p->n_layers * p->dim * p->dim;
+    ptr = map_fp32(&w->wq, ptr, (size_t)p->n_layers * p->dim * p->dim);
+    ptr = map_fp32(&w->wk, ptr, (size_t)p->n_layers * p->dim * (p->n_kv_heads * head_size));
+    ptr = map_fp32(&w->wv, ptr, (size_t)p->n_layers * p->dim * (p->n_kv_heads * head_size));
+    ptr = map_fp32(&w->wo, ptr, (size_t)p->n_layers * p->dim * p->dim);
     w->rms_ffn_weight = ptr;
     ptr += p->n_layers * p->dim;
-    w->w1 = ptr;
-    ptr += p->n_layers * p->dim * p->hidden_dim;
-    w->w2 = ptr;
-    ptr += p->n_layers * p->hidden_dim * p->dim;
-    w->w3 = ptr;
-    ptr += p->n_layers * p->dim * p->hidden_dim;
+    ptr = map_fp32(&w->w1, ptr, (size_t)p->n_layers * p->dim * p->hidden_dim);
+    ptr = map_fp32(&w->w2, ptr, (size_t)p->n_layers * p->hidden_dim * p->dim);
+    ptr = map_fp32(&w->w3, ptr, (size_t)p->n_layers * p->dim * p->hidden_dim);
     w->rms_final_weight = ptr;
     ptr += p->dim;
     w->freq_cis_real = ptr;
-    int head_size = p->dim / p->n_heads;
     ptr += p->seq_len * head_size / 2;
     w->freq_cis_imag = ptr;
     ptr += p->seq_len * head_size / 2;
-    w->wcls = shared_weights ? w->token_embedding_table : ptr;
+    if (shared_weights) {
+        w->wcls = w->token_embedding_table;
+    } else {
+        map_fp32(&w->wcls, ptr, 0);
+    }
+}
+
+void checkpoint_init_weights_v1(TransformerWeights_local* w, Config* p, void* data, int shared_weights, int group_size,
+                                int f16) {
+    // version 1 (fp32), version 2 (Q8_0) and version 3 (fp16) layout, see version1_export,
+    // version2_export and version3_export in export.py: the rmsnorm weights are first and always
+    // fp32, then all the matmul weights. in version 2 those are the int8 values of every tensor,
+    // followed by all of their scales
+    int head_size = p->dim / p->n_heads;
+    float* fptr = (float*)data;
+    w->group_size = group_size;
+    w->f16 = f16;
+    w->rms_att_weight = fptr;
+    fptr += p->n_layers * p->dim;
+    w->rms_ffn_weight = fptr;
+    fptr += p->n_layers * p->dim;
+    w->rms_final_weight = fptr;
+    fptr += p->dim;
+    Tensor* tensors[] = {&w->token_embedding_table, &w->wq, &w->wk, &w->wv, &w->wo,
+                         &w->w1, &w->w2, &w->w3, &w->wcls};
+    size_t sizes[] = {
+        (size_t)p->vocab_size * p->dim,
+        (size_t)p->n_layers * p->dim * p->dim,
+        (size_t)p->n_layers * p->dim * (p->n_kv_heads * head_size),
+        (size_t)p->n_layers * p->dim * (p->n_kv_heads * head_size),
+        (size_t)p->n_layers * p->dim * p->dim,
+        (size_t)p->n_layers * p->dim * p->hidden_dim,
+        (size_t)p->n_layers * p->hidden_dim * p->dim,
+        (size_t)p->n_layers * p->dim * p->hidden_dim,
+        (size_t)p->vocab_size * p->dim,
+    };
+    int n_tensors = shared_weights ? 8 : 9;  // the classifier is only stored when not shared
+    if (f16) {
+        uint16_t* hptr = (uint16_t*)fptr;
+        for (int i = 0; i < n_tensors; i++) {
+            tensors[i]->f = NULL;
+            tensors[i]->q = NULL;
+            tensors[i]->s = NULL;
+            tensors[i]->h = hptr;
+            hptr += sizes[i];
+        }
+    } else if (group_size == 0) {
+        for (int i = 0; i < n_tensors; i++) {
+            fptr = map_fp32(tensors[i], fptr, sizes[i]);
+        }
+    } else {
+        int8_t* qptr = (int8_t*)fptr;
+        for (int i = 0; i < n_tensors; i++) {
+            tensors[i]->f = NULL;
+            tensors[i]->q = qptr;
+            tensors[i]->h = NULL;
+            qptr += sizes[i];
+        }
+        float* sptr = (float*)qptr;
+        for (int i = 0; i < n_tensors; i++) {
+            tensors[i]->s = sptr;
+            sptr += sizes[i] / group_size;
+        }
+    }
+    if (shared_weights) {
+        w->wcls = w->token_embedding_table;
+    }
+    // the RoPE tables are not in the file anymore, compute them the same way as model.py
+    int half = head_size / 2;
+    w->freq_cis_alloc = (float*)malloc(sizeof(float) * p->seq_len * head_size);
+    w->freq_cis_real = w->freq_cis_alloc;
+    w->freq_cis_imag = w->freq_cis_alloc + p->seq_len * half;
+    for (int pos = 0; pos < p->seq_len; pos++) {
+        for (int i = 0; i < half; i++) {
+            float freq = 1.0f / powf(10000.0f, (2 * i) / (float)head_size);
+            float val = pos * freq;
+            w->freq_cis_real[pos * half + i] = cosf(val);
+            w->freq_cis_imag[pos * half + i] = sinf(val);
+        }
+    }
 }
 
 void free_gpu_weight(TransformerWeights_gpu* gpu) {
     glDeleteBuffers(1, &gpu->rms_att_weight);
     glDeleteBuffers(1, &gpu->rms_ffn_weight);
-    glDeleteBuffers(1, &gpu->wq);
-    glDeleteBuffers(1, &gpu->wk);
-    glDeleteBuffers(1, &gpu->wv);
+    glDeleteBuffers(1, &gpu->wqkv);
     glDeleteBuffers(1, &gpu->wo);
-    glDeleteBuffers(1, &gpu->w1);
+    glDeleteBuffers(1, &gpu->w13);
     glDeleteBuffers(1, &gpu->w2);
-    glDeleteBuffers(1, &gpu->w3);
     glDeleteBuffers(1, &gpu->rms_final_weight);
     glDeleteBuffers(1, &gpu->freq_cis_real);
     glDeleteBuffers(1, &gpu->freq_cis_imag);
     glDeleteBuffers(1, &gpu->wcls);
+    GLuint scales[] = {gpu->wqkv_s, gpu->wo_s, gpu->w13_s, gpu->w2_s, gpu->wcls_s};
+    for (int i = 0; i < 5; i++) {
+        if (scales[i] != 0) {
+            glDeleteBuffers(1, &scales[i]);
+        }
+    }
+    if (gpu->token_embedding_table != gpu->wcls) {
+        glDeleteBuffers(1, &gpu->token_embedding_table);
+        if (gpu->token_embedding_table_s != 0) {
+            glDeleteBuffers(1, &gpu->token_embedding_table_s);
+        }
+    }
+    if (gpu->layout != NULL) {
+        munmap(gpu->layout, gpu->layout_size);
+        close(gpu->layout_fd);
+    }
 }
 
 void free_gpu_program(GPUProgram* prog) {
     glDeleteProgram(prog->shader_matmul);
-    glDeleteProgram(prog->shader_rmsnorm_squares_and_sum);
-    glDeleteProgram(prog->shader_sum);
-    glDeleteProgram(prog->shader_sum_vec4);
-    glDeleteProgram(prog->shader_rmsnorm_normalize_and_scale);
-    glDeleteProgram(prog->shader_rmsnorm_normalize_and_scale_currentPos);
+    glDeleteProgram(prog->shader_rmsnorm);
     glDeleteProgram(prog->shader_accum);
     glDeleteProgram(prog->shader_positionalEncoding);
-    glDeleteProgram(prog->shader_max);
-    glDeleteProgram(prog->shader_max_vec4);
-    glDeleteProgram(prog->shader_softmax_exp);
-    glDeleteProgram(prog->shader_softmax_normalize);
-    glDeleteProgram(prog->shader_transformer_silu_and_mulW3);
-    glDeleteProgram(prog->shader_transformer_get_query_vector);
-    glDeleteProgram(prog->shader_transformer_build_attMat);
-    glDeleteProgram(prog->shader_transformer_softmax_input);
-    glDeleteProgram(prog->shader_transformer_softmax_output);
-    glDeleteProgram(prog->shader_temperature);
+    glDeleteProgram(prog->shader_transformer_attention);
+    glDeleteProgram(prog->shader_argmax);
+    glDeleteProgram(prog->shader_sample);
     glDeleteProgram(prog->shader_copyBuffer);
+    glDeleteProgram(prog->shader_embedding);
     glDeleteProgram(prog->shader_matmul_trans_vec4);
+    glDeleteProgram(prog->shader_matmul_batch);
+    glDeleteProgram(prog->shader_matmul_trans_vec4_batch);
+    glDeleteProgram(prog->shader_matmul_swiglu);
+    glDeleteProgram(prog->shader_matmul_swiglu_batch);
 }
 
-void reduce_step(GLuint kernel, GLuint inBuffer, int insize, GLuint outBuffer, int outsize, int numSeq) {
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, inBuffer);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, outBuffer);
-    glUseProgram(kernel);
+// ----------------------------------------------------------------------------
+// profiling: opt-in timing of every stage of the forward pass, same output as run.c.
+// LLAMA2_PROFILE=<file> writes a summary when the program is done: JSON, or CSV with
+// one row per generated token if the file name ends in .csv. LLAMA2_TRACE=<file>
+// also records every stage of every layer as a Chrome trace (chrome://tracing, Perfetto).
+// the stages are timed on the gpu with GL_EXT_disjoint_timer_query, one query around
+// the dispatches of each stage, read back at the end of the token. without the
+// extension, or with LLAMA2_PROFILE_TIMER=finish for drivers whose timer queries do
+// not cover compute work (llvmpipe reports ~0), every stage ends with a glFinish and
+// is timed on the cpu instead
+
+#ifndef GL_TIME_ELAPSED_EXT
+#define GL_TIME_ELAPSED_EXT 0x88BF
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
 
-    int insize_gpu = glGetUniformLocation(kernel, "insize");
-    glUniform1i(insize_gpu, insize);
+typedef enum {
+    STAGE_RMSNORM, STAGE_QKV, STAGE_ROPE, STAGE_ATTENTION, STAGE_WO, STAGE_FFN, STAGE_CLASSIFIER, N_STAGES
+} Stage;
 
-    int shape0_gpu = glGetUniformLocation(kernel, "shape0");
-    glUniform1i(shape0_gpu, outsize);
+static const char* stage_names[N_STAGES] = { "rmsnorm", "qkv", "rope", "attention", "wo", "ffn", "classifier" };
 
-    glDispatchCompute(outsize, numSeq, 1);
-    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-    GPU_CHECK();
-}
-
-GLuint reduce_iteration(GLuint kernel_step, GLuint kernel_step_v4, GLuint data, GLuint cache_1, int insize, int numSeq, GLuint* otherBuffer, GLuint* outputAt) {
-    int currentStepSize = 0;
-    int nextStepSize = insize;
-
-    GLuint currentBuffer = cache_1;
-    GLuint nextBuffer = data;
-    GLuint tmp;
+typedef struct {
+    double ts; // start, in us since init_profiler
+    double dur; // in us
+    int stage;
+    int layer; // -1 for the stages after the last layer
+    int pos; // position of the (first) token
+    int batch; // tokens processed together, > 1 in prefill
+    GLuint query; // timer query of the stage while the token is in flight
+} ProfileEvent;
 
-    while (nextStepSize >= 8) {
-        tmp = currentBuffer;
-        currentBuffer = nextBuffer;
-        nextBuffer = tmp;
+typedef struct {
+    int enabled;
+    char* summary_path;
+    char* trace_path;
+    double start; // time_in_us() at init_profiler
+    double total[N_STAGES]; // cumulative us, decode and prefill
+    long calls[N_STAGES];
+    double current[N_STAGES]; // us of the token (or prefill batch) in flight
+    double* steps; // (n_steps, N_STAGES) us of every decode step
+    int n_steps;
+    int cap_steps;
+    int n_tokens; // decoded tokens, more than n_steps when several sequences are batched
+    int n_prefill; // tokens that went through prefill instead
+    ProfileEvent* events; // all stages, the ones of the token in flight start at `pending`
+    int n_events;
+    int cap_events;
+    int pending;
+    int open; // a stage is being timed
+    int timer_query; // GL_EXT_disjoint_timer_query is available
+    GLuint* queries; // pool of timer queries, reused every token
+    int n_queries;
+    double token_start; // time_in_us() when the first stage of the token in flight began
+} Profiler;
+
+static Profiler profiler;
+
+double time_in_us() {
+    // monotonic time in microseconds, fine grained enough for a single stage
+#if defined _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1e6 / (double)freq.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e6 + time.tv_nsec * 1e-3;
+#endif
+}
 
-        currentStepSize = nextStepSize;
-        if (currentStepSize % 4 != 0) {
-            break;
+void init_profiler() {
+    // needs the gl context, call after create_GPUContext
+    memset(&profiler, 0, sizeof(profiler));
+    char* summary = getenv("LLAMA2_PROFILE");
+    char* trace = getenv("LLAMA2_TRACE");
+    profiler.summary_path = summary != NULL && summary[0] != '\0' ? summary : NULL;
+    profiler.trace_path = trace != NULL && trace[0] != '\0' ? trace : NULL;
+    profiler.enabled = profiler.summary_path != NULL || profiler.trace_path != NULL;
+    profiler.start = time_in_us();
+    if (!profiler.enabled) { return; }
+    char* timer = getenv("LLAMA2_PROFILE_TIMER");
+    if (timer != NULL && strcmp(timer, "finish") == 0) { return; }
+    GLint n_ext = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &n_ext);
+    for (GLint i = 0; i < n_ext; i++) {
+        const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (ext != NULL && strcmp(ext, "GL_EXT_disjoint_timer_query") == 0) {
+            profiler.timer_query = 1;
         }
-        nextStepSize = currentStepSize / 4;
-        if (nextStepSize % 4 != 0 &&                      //currentStepSize一定是4的倍数，让nextStepSize也是4的倍数，保证迭代能进行
-            nextStepSize > 2) {                           //nextStepSize为2时，此次迭代后将结束循环
-            nextStepSize = ((nextStepSize / 4) + 1) * 4;  //补全到4的倍数
-        }
-        reduce_step(kernel_step_v4, currentBuffer, currentStepSize / 4, nextBuffer, nextStepSize, numSeq);
     }
+}
 
-    while (nextStepSize != 1) {
-        //swap current and next
-        tmp = currentBuffer;
-        currentBuffer = nextBuffer;
-        nextBuffer = tmp;
+ProfileEvent* profile_event() {
+    if (profiler.n_events == profiler.cap_events) {
+        profiler.cap_events = profiler.cap_events ? profiler.cap_events * 2 : 4096;
+        profiler.events = realloc(profiler.events, profiler.cap_events * sizeof(ProfileEvent));
+        if (!profiler.events) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    }
+    return &profiler.events[profiler.n_events++];
+}
+
+void profile_close() {
+    // end the stage being timed, if any
+    if (!profiler.open) { return; }
+    ProfileEvent* e = &profiler.events[profiler.n_events - 1];
+    if (profiler.timer_query) {
+        glEndQuery(GL_TIME_ELAPSED_EXT);
+    } else {
+        glFinish();
+        e->dur = time_in_us() - profiler.start - e->ts;
+    }
+    profiler.open = 0;
+}
 
-        currentStepSize = nextStepSize;
-        nextStepSize = currentStepSize / 2;
-        if (currentStepSize % 2 == 1) {
-            nextStepSize += 1;
+void profile_stage(Stage stage, int layer, int pos, int batch) {
+    // the dispatches issued from here until the next profile_stage / profile_token
+    // are charged to stage
+    if (!profiler.enabled) { return; }
+    profile_close();
+    if (profiler.n_events == profiler.pending) {
+        // first stage of a token, whatever was queued before it is not ours
+        glFinish();
+        profiler.token_start = time_in_us();
+    }
+    int index = profiler.n_events - profiler.pending;
+    ProfileEvent* e = profile_event();
+    e->ts = time_in_us() - profiler.start;
+    e->dur = 0.0;
+    e->stage = stage;
+    e->layer = layer;
+    e->pos = pos;
+    e->batch = batch;
+    e->query = 0;
+    if (profiler.timer_query) {
+        if (index == profiler.n_queries) {
+            int n = profiler.n_queries ? profiler.n_queries * 2 : 256;
+            profiler.queries = realloc(profiler.queries, n * sizeof(GLuint));
+            if (!profiler.queries) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+            glGenQueries(n - profiler.n_queries, profiler.queries + profiler.n_queries);
+            profiler.n_queries = n;
         }
+        e->query = profiler.queries[index];
+        glBeginQuery(GL_TIME_ELAPSED_EXT, e->query);
+    }
+    profiler.open = 1;
+}
 
-        if (nextStepSize == 1 && outputAt != NULL) {
-            nextBuffer = *outputAt;
+void profile_token(int batch, int prefill) {
+    // close the forward pass in flight: every decode step (the next token of each of
+    // the batch sequences) gets a row of its own, prefill batches only count in the totals
+    if (!profiler.enabled) { return; }
+    profile_close();
+    if (profiler.timer_query) {
+        // a disjoint operation (e.g. a clock change) invalidates every query in flight,
+        // those stages are then counted as 0
+        GLint disjoint = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        // gpu durations of back to back stages, laid out from the start of the token
+        double ts = profiler.token_start - profiler.start;
+        for (int i = profiler.pending; i < profiler.n_events; i++) {
+            ProfileEvent* e = &profiler.events[i];
+            GLuint ns = 0;
+            glGetQueryObjectuiv(e->query, GL_QUERY_RESULT, &ns);
+            e->ts = ts;
+            e->dur = disjoint ? 0.0 : ns * 1e-3;
+            ts += e->dur;
         }
-        reduce_step(kernel_step, currentBuffer, currentStepSize, nextBuffer, nextStepSize, numSeq);
+        GPU_CHECK();
     }
-    if (otherBuffer != NULL) {
-        *otherBuffer = currentBuffer;
+    for (int i = profiler.pending; i < profiler.n_events; i++) {
+        ProfileEvent* e = &profiler.events[i];
+        profiler.total[e->stage] += e->dur;
+        profiler.calls[e->stage]++;
+        profiler.current[e->stage] += e->dur;
     }
-    return nextBuffer;
+    // the events are only kept around for the trace
+    if (profiler.trace_path == NULL) { profiler.n_events = 0; }
+    profiler.pending = profiler.n_events;
+    if (!prefill) {
+        if (profiler.n_steps == profiler.cap_steps) {
+            profiler.cap_steps = profiler.cap_steps ? profiler.cap_steps * 2 : 256;
+            profiler.steps = realloc(profiler.steps, profiler.cap_steps * N_STAGES * sizeof(double));
+            if (!profiler.steps) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        }
+        memcpy(profiler.steps + profiler.n_steps * N_STAGES, profiler.current, sizeof(profiler.current));
+        profiler.n_steps++;
+        profiler.n_tokens += batch;
+    } else {
+        profiler.n_prefill += batch;
+    }
+    memset(profiler.current, 0, sizeof(profiler.current));
 }
 
-GLuint reduce_iteration_input(GLuint kernel_step, GLuint kernel_step_v4, GLuint kernel_step_input, GLuint data, GLuint cache_1, GLuint cache_2, int insize, int numSeq, GLuint* otherBuffer, GLuint* outputAt) {
-    int currentStepSize = insize;
-    int nextStepSize = currentStepSize / 2;
-    if (currentStepSize % 2 == 1) {
-        nextStepSize += 1;
-    }
+int compare_doubles(const void* a, const void* b) {
+    double da = *(const double*)a, db = *(const double*)b;
+    return (da > db) - (da < db);
+}
 
-    if (nextStepSize == 1) {
-        GLuint outBuffer = cache_1;
-        if (outputAt != NULL) {
-            outBuffer = *outputAt;
-        }
-        reduce_step(kernel_step, data, currentStepSize, outBuffer, nextStepSize, numSeq);
-        if (otherBuffer != NULL) {
-            *otherBuffer = cache_2;
+double percentile(double* sorted, int n, double q) {
+    // nearest rank percentile of n sorted values
+    if (n == 0) { return 0.0; }
+    int i = (int)ceil(q * n) - 1;
+    return sorted[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+void write_profile(const char* backend) {
+    // write the summary and the trace requested by the env vars, see init_profiler
+    if (!profiler.enabled) { return; }
+    int n = profiler.n_steps;
+    if (profiler.summary_path != NULL) {
+        FILE* f = fopen(profiler.summary_path, "w");
+        if (!f) { fprintf(stderr, "couldn't write %s\n", profiler.summary_path); exit(EXIT_FAILURE); }
+        size_t len = strlen(profiler.summary_path);
+        if (len >= 4 && strcmp(profiler.summary_path + len - 4, ".csv") == 0) {
+            // one row per decode step, in ms
+            fprintf(f, "step");
+            for (int s = 0; s < N_STAGES; s++) { fprintf(f, ",%s", stage_names[s]); }
+            fprintf(f, ",total\n");
+            for (int i = 0; i < n; i++) {
+                double sum = 0.0;
+                fprintf(f, "%d", i);
+                for (int s = 0; s < N_STAGES; s++) {
+                    fprintf(f, ",%.4f", profiler.steps[i * N_STAGES + s] / 1000.0);
+                    sum += profiler.steps[i * N_STAGES + s];
+                }
+                fprintf(f, ",%.4f\n", sum / 1000.0);
+            }
+        } else {
+            // cumulative time and the per step distribution of every stage, in ms
+            double* column = malloc((n > 0 ? n : 1) * sizeof(double));
+            fprintf(f, "{\n  \"backend\": \"%s\",\n  \"variant\": \"%s\",\n", backend,
+                    profiler.timer_query ? "timer_query" : "glFinish");
+            fprintf(f, "  \"steps\": %d,\n  \"tokens\": %d,\n  \"prefill_tokens\": %d,\n  \"stages\": [\n",
+                    n, profiler.n_tokens, profiler.n_prefill);
+            for (int s = 0; s < N_STAGES; s++) {
+                double sum = 0.0;
+                for (int i = 0; i < n; i++) {
+                    column[i] = profiler.steps[i * N_STAGES + s];
+                    sum += column[i];
+                }
+                qsort(column, n, sizeof(double), compare_doubles);
+                fprintf(f, "    {\"name\": \"%s\", \"calls\": %ld, \"total_ms\": %.4f, \"token_mean_ms\": %.4f, "
+                        "\"token_p50_ms\": %.4f, \"token_p99_ms\": %.4f, \"token_max_ms\": %.4f}%s\n",
+                        stage_names[s], profiler.calls[s], profiler.total[s] / 1000.0,
+                        n > 0 ? sum / n / 1000.0 : 0.0, percentile(column, n, 0.5) / 1000.0,
+                        percentile(column, n, 0.99) / 1000.0, n > 0 ? column[n - 1] / 1000.0 : 0.0,
+                        s < N_STAGES - 1 ? "," : "");
+            }
+            fprintf(f, "  ]\n}\n");
+            free(column);
         }
-        return outBuffer;
-    } else {
-        int nextStepSize_v4 = nextStepSize;
-        if (nextStepSize_v4 % 4 != 0 && nextStepSize > 8) {
-            nextStepSize_v4 = ((nextStepSize_v4 / 4) + 1) * 4;  //补全到4的倍数
+        fclose(f);
+    }
+    if (profiler.trace_path != NULL) {
+        // chrome trace event format, complete ("X") events with timestamps in us
+        FILE* f = fopen(profiler.trace_path, "w");
+        if (!f) { fprintf(stderr, "couldn't write %s\n", profiler.trace_path); exit(EXIT_FAILURE); }
+        fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for (int i = 0; i < profiler.n_events; i++) {
+            ProfileEvent* e = &profiler.events[i];
+            fprintf(f, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": %d, \"pos\": %d, \"batch\": %d}}%s\n",
+                    stage_names[e->stage], e->batch > 1 ? "prefill" : "decode", e->ts, e->dur,
+                    e->layer, e->pos, e->batch, i < profiler.n_events - 1 ? "," : "");
         }
-        reduce_step(kernel_step_input, data, currentStepSize, cache_1, nextStepSize_v4, numSeq);
-        return reduce_iteration(kernel_step, kernel_step_v4, cache_1, cache_2, nextStepSize_v4, numSeq, otherBuffer, outputAt);
+        fprintf(f, "]}\n");
+        fclose(f);
     }
+    if (profiler.n_queries > 0) { glDeleteQueries(profiler.n_queries, profiler.queries); }
+    free(profiler.queries);
+    free(profiler.steps);
+    free(profiler.events);
+    profiler.enabled = 0;
 }
 
 // ----------------------------------------------------------------------------
@@ -1214,430 +2774,820 @@ void accum(GPUProgram* prog, RunState* state, GLuint a, GLuint b, int size) {
     GPU_CHECK();
 }
 
-void rmsnorm(GPUProgram* prog, RunState* state, GLuint o, GLuint x, GLuint weight, int size, int weight_offset) {
-    int currentStepSize = size;
-    int nextStepSize = currentStepSize / 2;
-
-    GLuint currentBuffer = state->mulBuffer_1;
-    GLuint nextBuffer = state->mulBuffer_2;
-    GLuint tmp;
-
-    if (currentStepSize % 2 == 1) {
-        nextStepSize += 1;
-    }
-
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, x);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, nextBuffer);
-    glUseProgram(prog->shader_rmsnorm_squares_and_sum);
-
-    int insize = glGetUniformLocation(prog->shader_rmsnorm_squares_and_sum, "insize");
-    glUniform1i(insize, currentStepSize);
-
-    int shape0_gpu = glGetUniformLocation(prog->shader_rmsnorm_squares_and_sum, "shape0");
-    glUniform1i(shape0_gpu, nextStepSize);
-
-    if (nextStepSize % 4 != 0 && nextStepSize > 8) {
-        nextStepSize = ((nextStepSize / 4) + 1) * 4;  //补全到4的倍数
-    }
+void rmsnorm(GPUProgram* prog, RunState* state, GLuint o, GLuint x, GLuint weight, int params, int batch) {
+    // one workgroup per row
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, weight);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, x);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, o);
+    bind_params(&state->params, params);
+    glUseProgram(prog->shader_rmsnorm);
 
-    glDispatchCompute(nextStepSize, 1, 1);
+    glDispatchCompute(batch, 1, 1);
     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
     GPU_CHECK();
+}
 
-    nextBuffer = reduce_iteration(
-        prog->shader_sum, prog->shader_sum_vec4,
-        nextBuffer, currentBuffer, nextStepSize, 1, &currentBuffer, NULL);
-
-    if (o == x) {
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, nextBuffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, weight);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, x);
-        glUseProgram(prog->shader_rmsnorm_normalize_and_scale_currentPos);
-
-        int size_p = glGetUniformLocation(prog->shader_rmsnorm_normalize_and_scale_currentPos, "size");
-        glUniform1i(size_p, size);
-        int weight_offset_p = glGetUniformLocation(prog->shader_rmsnorm_normalize_and_scale_currentPos, "weight_offset");
-        glUniform1i(weight_offset_p, weight_offset);
-
-        glDispatchCompute(size, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-        GPU_CHECK();
+void attention(GPUProgram* prog, RunState* state, GLuint xout, int params, int pos, int n_heads, int batch) {
+    // causal multihead attention of the rows of qkv at positions pos..pos + batch - 1 over
+    // the kv cache, one workgroup per head and row. xout gets a row of dim per row of qkv
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, state->qkv);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, state->key_cache);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, state->value_cache);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, xout);
+    bind_params(&state->params, params);
+    glUseProgram(prog->shader_transformer_attention);
+    glUniform1i(prog->transformer_attention_pos, pos);
+
+    glDispatchCompute(n_heads, batch, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    GPU_CHECK();
+}
 
-    } else {
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, nextBuffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, weight);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, x);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, o);
-        glUseProgram(prog->shader_rmsnorm_normalize_and_scale);
-
-        int size_p = glGetUniformLocation(prog->shader_rmsnorm_normalize_and_scale, "size");
-        glUniform1i(size_p, size);
-        int weight_offset_p = glGetUniformLocation(prog->shader_rmsnorm_normalize_and_scale, "weight_offset");
-        glUniform1i(weight_offset_p, weight_offset);
-
-        glDispatchCompute(size, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-        GPU_CHECK();
+int matmul_row_threads(int n, int local_size) {
+    // invocations per output row of shader_matmul: enough for MATMUL_ROW_ITEMS weights
+    // each, as a power of two up to the whole workgroup
+    int threads = 1;
+    while (threads < local_size && threads * MATMUL_ROW_ITEMS < n) {
+        threads *= 2;
     }
+    return threads;
 }
 
-void softmax(GPUProgram* prog, RunState* state, GLuint x, int size_x, int size_y) {
-    // find max value (for numerical stability)
-    GLuint currentBuffer = state->mulBuffer_1;
-    GLuint nextBuffer = state->mulBuffer_2;
-    GLuint resBuffer_max;
-    GLuint resBuffer_sum;
-
-    resBuffer_max = reduce_iteration_input(
-        prog->shader_max, prog->shader_max_vec4, prog->shader_max,
-        x, state->mulBuffer_1, state->mulBuffer_2, size_x, size_y, &currentBuffer, NULL);
-
-    // exp
+void matmul(GPUProgram* prog, RunState* state, GLuint xout, GLuint x, GLuint w, GLuint w_s, int params, int batch) {
+    // W (d,n) @ x (batch,n) -> xout (batch,d), w_s are the scales of Q8_0 weights
+    // by far the most amount of time is spent inside this little function
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, x);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, resBuffer_max);
-    glUseProgram(prog->shader_softmax_exp);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, w);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, xout);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, w_s);
+    bind_params(&state->params, params);
+    MatmulParams* mp = (MatmulParams*)get_params(&state->params, params);
+    int threads = matmul_row_threads(mp->n, prog->local_size);
+    if (batch == 1) {
+        glUseProgram(prog->shader_matmul);
+        glUniform1i(prog->matmul_batch, batch);
+        glUniform1i(prog->matmul_row_threads, threads);
+    } else {
+        glUseProgram(prog->shader_matmul_batch);
+        glUniform1i(prog->matmul_batch_batch, batch);
+        glUniform1i(prog->matmul_batch_row_threads, threads);
+    }
 
-    glDispatchCompute(size_x * size_y, 1, 1);
+    // a workgroup per local_size / threads output rows and BATCH_TILE rows of x
+    int rows = prog->local_size / threads;
+    int tile = batch == 1 ? 1 : BATCH_TILE;
+    glDispatchCompute((mp->d + rows - 1) / rows, (batch + tile - 1) / tile, 1);
     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
     GPU_CHECK();
+}
 
-    // sum
-    resBuffer_sum = reduce_iteration_input(
-        prog->shader_sum, prog->shader_sum_vec4, prog->shader_sum,
-        x, state->mulBuffer_3, state->mulBuffer_4, size_x, size_y, &currentBuffer, NULL);
-
-    // normalize
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, resBuffer_sum);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, resBuffer_max);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, x);
-    glUseProgram(prog->shader_softmax_normalize);
-
-    GLuint shape0 = glGetUniformLocation(prog->shader_softmax_normalize, "shape0");
-    glUniform1i(shape0, size_x);
+void matmul_trans_vec4(GPUProgram* prog, RunState* state, GLuint xout, GLuint x, GLuint w, GLuint w_s, int params, int batch) {
+    // W is stored transposed and padded by upload_weights: (d, n) with n a multiple of 4
+    // x (batch,d) @ W -> xout (batch,n), w_s are the scales of Q8_0 weights
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, x);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, w);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, xout);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, w_s);
+    bind_params(&state->params, params);
+    if (batch == 1) {
+        glUseProgram(prog->shader_matmul_trans_vec4);
+        glUniform1i(prog->matmul_trans_vec4_batch, batch);
+    } else {
+        glUseProgram(prog->shader_matmul_trans_vec4_batch);
+        glUniform1i(prog->matmul_trans_vec4_batch_batch, batch);
+    }
 
-    glDispatchCompute(size_x, size_y, 1);
+    // each workgroup produces tile_x vec4s of the output for BATCH_TILE rows of x
+    MatmulParams* mp = (MatmulParams*)get_params(&state->params, params);
+    int tile = batch == 1 ? 1 : BATCH_TILE;
+    glDispatchCompute((mp->n / 4 + prog->tile_x - 1) / prog->tile_x, (batch + tile - 1) / tile, 1);
     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
     GPU_CHECK();
 }
 
-void transformer_softmax(GPUProgram* prog, RunState* state, GLuint x, int pos, int seq_len, int n_heads) {
-    int uniformVar;
+void matmul_swiglu(GPUProgram* prog, RunState* state, GLuint xout, GLuint x, GLuint w, GLuint w_s, int params, int batch) {
+    // matmul_trans_vec4 of x against w1|w3 (d, 2n) -> xout (batch,n) = silu(x @ w1) * (x @ w3)
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, x);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, state->transformer_softmax_cache);
-    glUseProgram(prog->shader_transformer_softmax_input);
-
-    uniformVar = glGetUniformLocation(prog->shader_transformer_softmax_input, "seq_len");
-    glUniform1i(uniformVar, seq_len);
-
-    uniformVar = glGetUniformLocation(prog->shader_transformer_softmax_input, "pos");
-    glUniform1i(uniformVar, pos);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, w);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, xout);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, w_s);
+    bind_params(&state->params, params);
+    if (batch == 1) {
+        glUseProgram(prog->shader_matmul_swiglu);
+        glUniform1i(prog->matmul_swiglu_batch, batch);
+    } else {
+        glUseProgram(prog->shader_matmul_swiglu_batch);
+        glUniform1i(prog->matmul_swiglu_batch_batch, batch);
+    }
 
-    glDispatchCompute(n_heads, pos + 1, 1);
+    MatmulParams* mp = (MatmulParams*)get_params(&state->params, params);
+    int tile = batch == 1 ? 1 : BATCH_TILE;
+    glDispatchCompute((mp->n / 4 + prog->tile_x - 1) / prog->tile_x, (batch + tile - 1) / tile, 1);
     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
     GPU_CHECK();
+}
 
-    softmax(prog, state, state->transformer_softmax_cache, pos + 1, n_heads);
+void copyBuffer(GPUProgram* prog, RunState* state, GLuint src, GLuint dst, int params, int pos, int size, int batch) {
+    // copy size floats of each of the batch rows of src into rows pos.. of the kv cache dst,
+    // a pair of them per invocation when it is fp16 (size is even, like head_size)
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, src);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, dst);
+    bind_params(&state->params, params);
+    glUseProgram(prog->shader_copyBuffer);
+    glUniform1i(prog->copyBuffer_pos, pos);
 
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, state->transformer_softmax_cache);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, x);
-    glUseProgram(prog->shader_transformer_softmax_output);
+    glDispatchCompute(state->kv_f16 ? size / 2 : size, batch, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    GPU_CHECK();
+}
 
-    uniformVar = glGetUniformLocation(prog->shader_transformer_softmax_output, "seq_len");
-    glUniform1i(uniformVar, seq_len);
+void embed(GPUProgram* prog, TransformerWeights_gpu* w, GLuint tokens, GLuint x, int dim, int batch) {
+    // rows 0..batch of x (dim_vec4 floats apart) = embeddings of the token ids in tokens
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, tokens);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, w->token_embedding_table);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, x);
+    if (w->token_embedding_table_s != 0) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, w->token_embedding_table_s);
+    }
 
-    uniformVar = glGetUniformLocation(prog->shader_transformer_softmax_output, "pos");
-    glUniform1i(uniformVar, pos);
+    glUseProgram(prog->shader_embedding);
+    glUniform1i(prog->embedding_dim, dim);
+    glUniform1i(prog->embedding_group_size, w->group_size);
+    glUniform1i(prog->embedding_x_stride, w->dim_vec4);
 
-    glDispatchCompute(n_heads, pos + 1, 1);
+    glDispatchCompute((dim + prog->local_size - 1) / prog->local_size, batch, 1);
     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
     GPU_CHECK();
 }
-void transformer_sum(GPUProgram* prog, RunState* state, GLuint outMat, GLuint inMat, int size_x, int size_y) {
-    //prog, s, s->xb, s->mulBuffer_4, pos + 1, head_size, p->n_heads
-    GLuint res = outMat;
-    reduce_iteration_input(
-        prog->shader_sum, prog->shader_sum_vec4, prog->shader_sum,
-        inMat, state->mulBuffer_1, state->mulBuffer_2, size_x, size_y, NULL, &res);
+
+// ----------------------------------------------------------------------------
+// host layers: when the model does not fit in GPU memory, the layers from
+// HostLayers.first on run on the CPU like in run.c, straight from the mapped
+// checkpoint. x is read back after the GPU layers and goes up again for the final
+// rmsnorm and the classifier, so the embedding, the classifier and the sampler stay
+// on the GPU
+
+void build_host_layers(RunState* s, Config* p, TransformerWeights_local* w, int first) {
+    // the buffers and the kv cache of layers first.. on the host, after set_kv_window
+    HostLayers* h = (HostLayers*)calloc(1, sizeof(HostLayers));
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t kv_len = (size_t)(p->n_layers - first) * s->kv_capacity * kv_dim;
+    if (h != NULL) {
+        h->first = first;
+        h->w = w;
+        h->p = p;
+        h->x = (float*)calloc(PREFILL_BATCH * p->dim, sizeof(float));
+        h->xb = (float*)calloc(PREFILL_BATCH * p->dim, sizeof(float));
+        h->xb2 = (float*)calloc(PREFILL_BATCH * p->dim, sizeof(float));
+        h->q = (float*)calloc(PREFILL_BATCH * p->dim, sizeof(float));
+        h->k = (float*)calloc(PREFILL_BATCH * kv_dim, sizeof(float));
+        h->v = (float*)calloc(PREFILL_BATCH * kv_dim, sizeof(float));
+        h->hb = (float*)calloc(PREFILL_BATCH * p->hidden_dim, sizeof(float));
+        h->hb2 = (float*)calloc(PREFILL_BATCH * p->hidden_dim, sizeof(float));
+        h->att = (float*)calloc((size_t)p->n_heads * s->kv_capacity, sizeof(float));
+        h->key_cache = (float*)calloc(kv_len, sizeof(float));
+        h->value_cache = (float*)calloc(kv_len, sizeof(float));
+        h->f16_table = w->f16 ? (float*)malloc(65536 * sizeof(float)) : NULL;
+    }
+    if (h == NULL || !h->x || !h->xb || !h->xb2 || !h->q || !h->k || !h->v || !h->hb || !h->hb2 || !h->att ||
+        !h->key_cache || !h->value_cache || (w->f16 && !h->f16_table)) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (h->f16_table != NULL) {
+        for (int i = 0; i < 65536; i++) {
+            h->f16_table[i] = fp16_to_fp32((uint16_t)i);
+        }
+    }
+    s->host = h;
 }
 
-void matmul(GPUProgram* prog, RunState* state, GLuint xout, GLuint x, GLuint w, int n, int d, int x_offset, int w_offset) {
-    // W (d,n) @ x (n,) -> xout (d,)
-    // by far the most amount of time is spent inside this little function
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, x);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, w);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, xout);
-    glUseProgram(prog->shader_matmul);
+void free_host_layers(HostLayers* h) {
+    if (h == NULL) {
+        return;
+    }
+    free(h->x);
+    free(h->xb);
+    free(h->xb2);
+    free(h->q);
+    free(h->k);
+    free(h->v);
+    free(h->hb);
+    free(h->hb2);
+    free(h->att);
+    free(h->key_cache);
+    free(h->value_cache);
+    free(h->f16_table);
+    free(h);
+}
 
-    int n_gpu = glGetUniformLocation(prog->shader_matmul, "n");
-    glUniform1i(n_gpu, n);
+void host_rmsnorm(float* o, float* x, float* weight, int size, int batch) {
+    for (int b = 0; b < batch; b++) {
+        float ss = 0.0f;
+        for (int j = 0; j < size; j++) {
+            ss += x[b * size + j] * x[b * size + j];
+        }
+        ss = 1.0f / sqrtf(ss / size + 1e-5f);
+        for (int j = 0; j < size; j++) {
+            o[b * size + j] = weight[j] * (ss * x[b * size + j]);
+        }
+    }
+}
 
-    int x_offset_gpu = glGetUniformLocation(prog->shader_matmul, "x_offset");
-    glUniform1i(x_offset_gpu, x_offset);
+void host_matmul(HostLayers* h, float* xout, float* x, Tensor* w, int l, int n, int d, int batch) {
+    // W (d,n) @ x (batch,n) -> xout (batch,d), W is layer l of a matrix of the checkpoint in
+    // whichever format it has. every row of W is read once for the whole batch
+    size_t offset = (size_t)l * n * d;
+    int gs = h->w->group_size;
+    int i;
+#pragma omp parallel for private(i)
+    for (i = 0; i < d; i++) {
+        size_t row = offset + (size_t)i * n;
+        for (int b = 0; b < batch; b++) {
+            float* xb = x + b * n;
+            float val = 0.0f;
+            if (gs > 0) {
+                // Q8_0: the products of a group are summed, then scaled once
+                for (int j = 0; j < n; j += gs) {
+                    float gval = 0.0f;
+                    for (int k = 0; k < gs; k++) {
+                        gval += w->q[row + j + k] * xb[j + k];
+                    }
+                    val += gval * w->s[(row + j) / gs];
+                }
+            } else if (h->f16_table != NULL) {
+                for (int j = 0; j < n; j++) {
+                    val += h->f16_table[w->h[row + j]] * xb[j];
+                }
+            } else {
+                for (int j = 0; j < n; j++) {
+                    val += w->f[row + j] * xb[j];
+                }
+            }
+            xout[b * d + i] = val;
+        }
+    }
+}
+
+void host_rope(HostLayers* h, float* vec, int n, int pos) {
+    // rotate the pairs of the heads in vec (n,) by position pos, from the freq_cis tables or
+    // past their end (sliding window) computed the same way as them
+    Config* p = h->p;
+    int head_size = p->dim / p->n_heads;
+    int half = head_size / 2;
+    for (int i = 0; i < n; i += 2) {
+        int pair = (i % head_size) / 2;
+        float fcr, fci;
+        if (pos < p->seq_len) {
+            fcr = h->w->freq_cis_real[pos * half + pair];
+            fci = h->w->freq_cis_imag[pos * half + pair];
+        } else {
+            float val = pos * (1.0f / powf(10000.0f, (2 * pair) / (float)head_size));
+            fcr = cosf(val);
+            fci = sinf(val);
+        }
+        float v0 = vec[i];
+        float v1 = vec[i + 1];
+        vec[i] = v0 * fcr - v1 * fci;
+        vec[i + 1] = v0 * fci + v1 * fcr;
+    }
+}
 
-    int w_offset_gpu = glGetUniformLocation(prog->shader_matmul, "w_offset");
-    glUniform1i(w_offset_gpu, w_offset);
+int host_kv_row(RunState* s, int t) {
+    // the row of the host kv cache that holds position t, the same as kv_row in the shaders
+    return t < s->kv_capacity ? t : s->kv_sinks + (t - s->kv_sinks) % (s->kv_capacity - s->kv_sinks);
+}
 
-    glDispatchCompute(d, 1, 1);
-    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-    GPU_CHECK();
+void host_attention(HostLayers* h, RunState* s, int l, int pos, int batch) {
+    // causal multihead attention of the batch rows of q at positions pos.. into xb. with a
+    // full sliding window a row attends to the kv_sinks first positions and the last
+    // kv_window - kv_sinks ones, like shader_transformer_attention
+    Config* p = h->p;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads;
+    int head_size = dim / p->n_heads;
+    size_t loff = (size_t)(l - h->first) * s->kv_capacity * kv_dim;
+    for (int b = 0; b < batch; b++) {
+        int n_pos = pos + b + 1;
+        int n_sinks = 0;
+        int skip = 0;
+        if (s->kv_window > 0 && n_pos > s->kv_window) {
+            n_sinks = s->kv_sinks;
+            skip = n_pos - s->kv_window;
+        }
+        int n_att = n_pos - skip;
+        int hd;
+#pragma omp parallel for private(hd)
+        for (hd = 0; hd < p->n_heads; hd++) {
+            float* q = h->q + b * dim + hd * head_size;
+            float* att = h->att + (size_t)hd * s->kv_capacity;
+            int kv_off = (hd / kv_mul) * head_size;
+            float max_val = -INFINITY;
+            for (int j = 0; j < n_att; j++) {
+                int t = j < n_sinks ? j : j + skip;
+                float* k = h->key_cache + loff + (size_t)host_kv_row(s, t) * kv_dim + kv_off;
+                float score = 0.0f;
+                for (int i = 0; i < head_size; i++) {
+                    score += q[i] * k[i];
+                }
+                att[j] = score / sqrtf(head_size);
+                if (att[j] > max_val) {
+                    max_val = att[j];
+                }
+            }
+            float sum = 0.0f;
+            for (int j = 0; j < n_att; j++) {
+                att[j] = expf(att[j] - max_val);
+                sum += att[j];
+            }
+            float* xb = h->xb + b * dim + hd * head_size;
+            memset(xb, 0, head_size * sizeof(float));
+            for (int j = 0; j < n_att; j++) {
+                int t = j < n_sinks ? j : j + skip;
+                float* v = h->value_cache + loff + (size_t)host_kv_row(s, t) * kv_dim + kv_off;
+                float a = att[j] / sum;
+                for (int i = 0; i < head_size; i++) {
+                    xb[i] += a * v[i];
+                }
+            }
+        }
+    }
 }
 
-void matmul_trans_vec4(GPUProgram* prog, RunState* state, GLuint xout, GLuint x, GLuint w, int n, int d, int x_offset, int w_offset) {
-    // W (d,n) @ x (n,) -> xout (d,)
-    // by far the most amount of time is spent inside this little function
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, x);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, w);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, xout);
-    glUseProgram(prog->shader_matmul_trans_vec4);
+void host_forward(RunState* s, TransformerWeights_gpu* gw, int pos, int batch, int upload) {
+    // run the host layers over the batch rows of x at positions pos.., with upload the
+    // first row goes back into x on the GPU for the classifier
+    HostLayers* h = s->host;
+    Config* p = h->p;
+    TransformerWeights_local* w = h->w;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int hidden_dim = p->hidden_dim;
 
-    int n_gpu = glGetUniformLocation(prog->shader_matmul_trans_vec4, "n");
-    glUniform1i(n_gpu, n);
+    // read back the rows of x, the GPU layers have to be done with them
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, s->x);
+    float* mapped = (float*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, sizeof(float) * batch * gw->dim_vec4,
+                                             GL_MAP_READ_BIT);
+    GPU_CHECK();
+    if (mapped == NULL) {
+        fprintf(stderr, "glMapBufferRange failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int b = 0; b < batch; b++) {
+        memcpy(h->x + b * dim, mapped + b * gw->dim_vec4, dim * sizeof(float));
+    }
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
 
-    int d_gpu = glGetUniformLocation(prog->shader_matmul_trans_vec4, "d");
-    glUniform1i(d_gpu, d);
+    for (int l = h->first; l < p->n_layers; l++) {
+        // attention rmsnorm, then qkv matmuls for the whole batch
+        host_rmsnorm(h->xb, h->x, w->rms_att_weight + l * dim, dim, batch);
+        host_matmul(h, h->q, h->xb, &w->wq, l, dim, dim, batch);
+        host_matmul(h, h->k, h->xb, &w->wk, l, dim, kv_dim, batch);
+        host_matmul(h, h->v, h->xb, &w->wv, l, dim, kv_dim, batch);
+
+        // RoPE, and the keys and values of the batch into the kv cache before they attend
+        size_t loff = (size_t)(l - h->first) * s->kv_capacity * kv_dim;
+        for (int b = 0; b < batch; b++) {
+            host_rope(h, h->q + b * dim, dim, pos + b);
+            host_rope(h, h->k + b * kv_dim, kv_dim, pos + b);
+            size_t row = loff + (size_t)host_kv_row(s, pos + b) * kv_dim;
+            memcpy(h->key_cache + row, h->k + b * kv_dim, kv_dim * sizeof(float));
+            memcpy(h->value_cache + row, h->v + b * kv_dim, kv_dim * sizeof(float));
+        }
+        host_attention(h, s, l, pos, batch);
 
-    int x_offset_gpu = glGetUniformLocation(prog->shader_matmul_trans_vec4, "x_offset");
-    glUniform1i(x_offset_gpu, x_offset);
+        // final matmul to get the output of the attention, residual connection back into x
+        host_matmul(h, h->xb2, h->xb, &w->wo, l, dim, dim, batch);
+        for (int i = 0; i < batch * dim; i++) {
+            h->x[i] += h->xb2[i];
+        }
 
-    int w_offset_gpu = glGetUniformLocation(prog->shader_matmul_trans_vec4, "w_offset");
-    glUniform1i(w_offset_gpu, w_offset);
+        // ffn: self.w2(F.silu(self.w1(x)) * self.w3(x)), and its residual connection
+        host_rmsnorm(h->xb, h->x, w->rms_ffn_weight + l * dim, dim, batch);
+        host_matmul(h, h->hb, h->xb, &w->w1, l, dim, hidden_dim, batch);
+        host_matmul(h, h->hb2, h->xb, &w->w3, l, dim, hidden_dim, batch);
+        for (int i = 0; i < batch * hidden_dim; i++) {
+            float val = h->hb[i];
+            h->hb[i] = val * (1.0f / (1.0f + expf(-val))) * h->hb2[i];
+        }
+        host_matmul(h, h->xb, h->hb, &w->w2, l, hidden_dim, dim, batch);
+        for (int i = 0; i < batch * dim; i++) {
+            h->x[i] += h->xb[i];
+        }
+    }
 
-    glDispatchCompute(n / 4, 1, 1);
-    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-    GPU_CHECK();
+    if (upload) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, s->x);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, dim * sizeof(float), h->x);
+    }
 }
 
-void copyBuffer(GPUProgram* prog, GLuint src, GLuint dst, int src_offset, int dst_offset, int size) {
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, src);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, dst);
-    glUseProgram(prog->shader_copyBuffer);
-
-    int uniformVar = glGetUniformLocation(prog->shader_copyBuffer, "src_offset");
-    glUniform1i(uniformVar, src_offset);
-
-    uniformVar = glGetUniformLocation(prog->shader_copyBuffer, "dst_offset");
-    glUniform1i(uniformVar, dst_offset);
+size_t gpu_memory_available() {
+    // free GPU memory in bytes: LLAMA2_GPU_MEMORY (MB) if set, otherwise what the
+    // driver reports through GL_NVX_gpu_memory_info or GL_ATI_meminfo. 0 = unknown
+    char* env = getenv("LLAMA2_GPU_MEMORY");
+    if (env != NULL && env[0] != '\0') {
+        return (size_t)atoll(env) * 1024 * 1024;
+    }
+    GLint n_ext = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &n_ext);
+    for (GLint i = 0; i < n_ext; i++) {
+        const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        GLint kb[4] = {0};
+        if (ext != NULL && strcmp(ext, "GL_NVX_gpu_memory_info") == 0) {
+            glGetIntegerv(0x9049, kb);  // GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX
+        } else if (ext != NULL && strcmp(ext, "GL_ATI_meminfo") == 0) {
+            glGetIntegerv(0x87FB, kb);  // VBO_FREE_MEMORY_ATI, the total free is the first value
+        }
+        glGetError();  // not every driver exposing them takes the query in a GLES context
+        if (kb[0] > 0) {
+            return (size_t)kb[0] * 1024;
+        }
+    }
+    return 0;
+}
 
-    glDispatchCompute(size, 1, 1);
-    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-    GPU_CHECK();
+int choose_gpu_layers(Config* p, TransformerWeights_local* w, int kv_f16, int kv_window) {
+    // as many layers as fit in the free GPU memory after the buffers every split has:
+    // the embedding, the classifier, freq_cis and the activations. all of them when
+    // the free memory is not known
+    size_t budget = gpu_memory_available();
+    if (budget == 0) {
+        return p->n_layers;
+    }
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int head_size = p->dim / p->n_heads;
+    size_t kv_capacity = kv_window > 0 ? kv_window + PREFILL_BATCH - 1 : p->seq_len;
+    // bytes per weight, with the scales of Q8_0
+    double weight = w->group_size > 0 ? 1.0 + 4.0 / w->group_size : w->f16 ? 2.0 : 4.0;
+    size_t mats = (size_t)p->dim * (p->dim + 2 * kv_dim) + (size_t)p->dim * p->dim + 3 * (size_t)p->dim * p->hidden_dim;
+    size_t per_layer = (size_t)(mats * weight) + 2 * kv_capacity * kv_dim * (kv_f16 ? 2 : 4);
+    size_t classifier = (size_t)p->vocab_size * p->dim;
+    int shared = w->wcls.f == w->token_embedding_table.f && w->wcls.q == w->token_embedding_table.q &&
+                 w->wcls.h == w->token_embedding_table.h;
+    size_t fixed = (size_t)(classifier * weight) * (shared ? 1 : 2) +
+                   2 * sizeof(float) * (p->seq_len + PREFILL_BATCH) * (head_size / 2) +
+                   sizeof(float) * PREFILL_BATCH * (4 * p->dim + 2 * kv_dim + 2 * p->hidden_dim + p->vocab_size);
+    if (budget <= fixed) {
+        return 0;
+    }
+    size_t n = (budget - fixed) / per_layer;
+    return n < (size_t)p->n_layers ? (int)n : p->n_layers;
 }
 
+// transformer() takes the token sample() left on the GPU, not a token id from the host
+#define SAMPLED_TOKEN -1
+
 void transformer(int token, int pos, Config* p, GPUProgram* prog, RunState* s, TransformerWeights_gpu* w) {
     // a few convenience variables
     GLuint x = s->x;
     int dim = p->dim;
-    int hidden_dim = p->hidden_dim;
-    int head_size = dim / p->n_heads;
-    int uniformVar;
+    int kv_dim = (dim * p->n_kv_heads) / p->n_heads;
+
+    // gather the token embedding into x, make room for it in the kv cache. only the
+    // token id crosses over from the host, and not even that for a SAMPLED_TOKEN
+    kv_reserve(s, p, pos + 1);
+    rope_far_rows(w, p, pos, 1);
+    GLuint token_buffer = s->sample_result;
+    if (token != SAMPLED_TOKEN) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, s->tokens);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(int), &token);
+        token_buffer = s->tokens;
+    }
+    embed(prog, w, token_buffer, x, dim, 1);
 
-    // copy the token embedding into x
-    float* content_row = &(w->token_embedding_table[token * dim]);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, x);
-    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, dim * sizeof(float), content_row);
+    // forward the layers on the GPU
+    for (int l = 0; l < s->n_layers; l++) {
+        LayerDispatch* ld = &s->layers[l];
 
-    // pluck out the "pos" row of freq_cis_real and freq_cis_imag
-    int freq_cis_idx_delta = pos * head_size / 2;
+        // the first pass over the layers uploads them on the way
+        if (l >= w->layers_uploaded) {
+            upload_layer(w, l);
+        }
 
-    // forward all the layers
-    for (int l = 0; l < p->n_layers; l++) {
         // attention rmsnorm
-        rmsnorm(prog, s, s->xb, x, w->rms_att_weight, dim, l * dim);
+        profile_stage(STAGE_RMSNORM, l, pos, 1);
+        rmsnorm(prog, s, s->xb, x, w->rms_att_weight, ld->rms_att, 1);
 
-        // qkv matmuls for this position
-        matmul_trans_vec4(prog, s, s->q, s->xb, w->wq, w->dim_vec4, dim, 0, l * w->dim_vec4 * dim);
-        matmul_trans_vec4(prog, s, s->k, s->xb, w->wk, w->dim_vec4, dim, 0, l * w->dim_vec4 * dim);
-        matmul_trans_vec4(prog, s, s->v, s->xb, w->wv, w->dim_vec4, dim, 0, l * w->dim_vec4 * dim);
+        // qkv matmuls for this position, as one over wq|wk|wv
+        profile_stage(STAGE_QKV, l, pos, 1);
+        matmul_trans_vec4(prog, s, s->qkv, s->xb, w->wqkv, w->wqkv_s, ld->wqkv, 1);
 
         // RoPE relative positional encoding: complex-valued rotate q and k by freq_cis in each head
-
+        profile_stage(STAGE_ROPE, l, pos, 1);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, w->freq_cis_real);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, w->freq_cis_imag);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, s->q);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, s->k);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, s->qkv);
+        bind_params(&s->params, ld->layer);
         glUseProgram(prog->shader_positionalEncoding);
-
-        uniformVar = glGetUniformLocation(prog->shader_positionalEncoding, "pos");
-        glUniform1i(uniformVar, pos);
-
-        uniformVar = glGetUniformLocation(prog->shader_positionalEncoding, "dim");
-        glUniform1i(uniformVar, dim);
-
-        uniformVar = glGetUniformLocation(prog->shader_positionalEncoding, "hidden_dim");
-        glUniform1i(uniformVar, hidden_dim);
-
-        uniformVar = glGetUniformLocation(prog->shader_positionalEncoding, "freq_cis_idx_delta");
-        glUniform1i(uniformVar, freq_cis_idx_delta);
-
-        uniformVar = glGetUniformLocation(prog->shader_positionalEncoding, "head_size");
-        glUniform1i(uniformVar, head_size);
+        glUniform1i(prog->positionalEncoding_pos, pos);
 
         glDispatchCompute(dim / 2, 1, 1);
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
         GPU_CHECK();
 
         // save key,value at this time step (pos) to our kv cache
-        int loff = l * p->seq_len * dim;  // kv cache layer offset for convenience
-        int key_offset = loff + pos * dim;
-        int value_offset = loff + pos * dim;
-        copyBuffer(prog, s->k, s->key_cache, 0, key_offset, dim);
-        copyBuffer(prog, s->v, s->value_cache, 0, value_offset, dim);
-
-        // multihead attention. iterate over all heads
+        profile_stage(STAGE_ATTENTION, l, pos, 1);
+        copyBuffer(prog, s, s->qkv, s->key_cache, ld->key_cache, pos, kv_dim, 1);
+        copyBuffer(prog, s, s->qkv, s->value_cache, ld->value_cache, pos, kv_dim, 1);
 
-        // get the query vector for this head
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, s->q);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, s->key_cache);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, s->att);
-        glUseProgram(prog->shader_transformer_get_query_vector);
+        // multihead attention over the kv cache, the heads side by side in xb
+        attention(prog, s, s->xb, ld->layer, pos, p->n_heads, 1);
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_get_query_vector, "seq_len");
-        glUniform1i(uniformVar, p->seq_len);
+        // final matmul to get the output of the attention
+        profile_stage(STAGE_WO, l, pos, 1);
+        matmul_trans_vec4(prog, s, s->xb2, s->xb, w->wo, w->wo_s, ld->wo, 1);
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_get_query_vector, "pos");
-        glUniform1i(uniformVar, pos);
+        // residual connection back into x
+        accum(prog, s, x, s->xb2, dim);
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_get_query_vector, "head_size");
-        glUniform1i(uniformVar, head_size);
+        // ffn rmsnorm
+        profile_stage(STAGE_RMSNORM, l, pos, 1);
+        rmsnorm(prog, s, s->xb, x, w->rms_ffn_weight, ld->rms_ffn, 1);
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_get_query_vector, "dim");
-        glUniform1i(uniformVar, dim);
+        // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+        // self.w1(x) and self.w3(x) in one matmul over w1|w3, which applies the SwiGLU too
+        profile_stage(STAGE_FFN, l, pos, 1);
+        matmul_swiglu(prog, s, s->hb, s->xb, w->w13, w->w13_s, ld->w13, 1);
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_get_query_vector, "layer_idx");
-        glUniform1i(uniformVar, l);
+        // final matmul to get the output of the ffn
+        matmul(prog, s, s->xb, s->hb, w->w2, w->w2_s, ld->w2, 1);
 
-        glDispatchCompute(p->n_heads, head_size, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-        GPU_CHECK();
+        // residual connection
+        accum(prog, s, x, s->xb, dim);
+    }
 
-        transformer_softmax(prog, s, s->att, pos, p->seq_len, p->n_heads);
+    // the rest of the layers on the host, x goes back up for the classifier
+    if (s->host != NULL) {
+        host_forward(s, w, pos, 1, 1);
+    }
 
-        // weighted sum of the values, store back into xb
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, s->value_cache);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, s->att);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, s->mulBuffer_4);
-        glUseProgram(prog->shader_transformer_build_attMat);
+    // final rmsnorm
+    profile_stage(STAGE_RMSNORM, -1, pos, 1);
+    rmsnorm(prog, s, x, x, w->rms_final_weight, s->rms_final, 1);
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_build_attMat, "seq_len");
-        glUniform1i(uniformVar, p->seq_len);
+    // classifier into logits
+    profile_stage(STAGE_CLASSIFIER, -1, pos, 1);
+    matmul(prog, s, s->logits, x, w->wcls, w->wcls_s, s->cls, 1);
+    profile_token(1, 0);
+}
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_build_attMat, "pos");
-        glUniform1i(uniformVar, pos);
+void transformer_prefill(int* tokens, int n_tokens, int pos, Config* p, GPUProgram* prog, RunState* s, TransformerWeights_gpu* w) {
+    // push tokens[0..n_tokens) at positions pos.. through the model, PREFILL_BATCH at a
+    // time, every matmul sees the whole batch. only the kv cache is filled, no logits
+    GLuint x = s->x;
+    int dim = p->dim;
+    int kv_dim = (dim * p->n_kv_heads) / p->n_heads;
+
+    for (int start = 0; start < n_tokens; start += PREFILL_BATCH) {
+        int batch = n_tokens - start < PREFILL_BATCH ? n_tokens - start : PREFILL_BATCH;
+        int bpos = pos + start;  // position of the first token of this batch
+
+        // gather the token embeddings into the rows of x, make room for them in the kv cache
+        kv_reserve(s, p, bpos + batch);
+        rope_far_rows(w, p, bpos, batch);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, s->tokens);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, batch * sizeof(int), tokens + start);
+        embed(prog, w, s->tokens, x, dim, batch);
+
+        // forward the layers on the GPU
+        for (int l = 0; l < s->n_layers; l++) {
+            LayerDispatch* ld = &s->layers[l];
+
+            // the first pass over the layers uploads them on the way
+            if (l >= w->layers_uploaded) {
+                upload_layer(w, l);
+            }
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_build_attMat, "head_size");
-        glUniform1i(uniformVar, head_size);
+            // attention rmsnorm
+            profile_stage(STAGE_RMSNORM, l, bpos, batch);
+            rmsnorm(prog, s, s->xb, x, w->rms_att_weight, ld->rms_att, batch);
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_build_attMat, "dim");
-        glUniform1i(uniformVar, dim);
+            // qkv matmuls for the whole batch, as one over wq|wk|wv
+            profile_stage(STAGE_QKV, l, bpos, batch);
+            matmul_trans_vec4(prog, s, s->qkv, s->xb, w->wqkv, w->wqkv_s, ld->wqkv, batch);
 
-        uniformVar = glGetUniformLocation(prog->shader_transformer_build_attMat, "layer_idx");
-        glUniform1i(uniformVar, l);
+            // RoPE relative positional encoding, row b of the batch is at position bpos + b
+            profile_stage(STAGE_ROPE, l, bpos, batch);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, w->freq_cis_real);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, w->freq_cis_imag);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, s->qkv);
+            bind_params(&s->params, ld->layer);
+            glUseProgram(prog->shader_positionalEncoding);
+            glUniform1i(prog->positionalEncoding_pos, bpos);
 
-        glDispatchCompute(p->n_heads, head_size, pos + 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-        GPU_CHECK();
+            glDispatchCompute(dim / 2, batch, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            GPU_CHECK();
 
-        transformer_sum(prog, s, s->xb, s->mulBuffer_4, pos + 1, head_size * p->n_heads);
+            // save key,value of the whole batch to our kv cache
+            profile_stage(STAGE_ATTENTION, l, bpos, batch);
+            copyBuffer(prog, s, s->qkv, s->key_cache, ld->key_cache, bpos, kv_dim, batch);
+            copyBuffer(prog, s, s->qkv, s->value_cache, ld->value_cache, bpos, kv_dim, batch);
 
-        // final matmul to get the output of the attention
-        matmul_trans_vec4(prog, s, s->xb2, s->xb, w->wo, w->dim_vec4, dim, 0, l * w->dim_vec4 * dim);
+            // causal multihead attention, row b of the batch attends to 0..bpos + b.
+            // xb is free again after the qkv matmul
+            attention(prog, s, s->xb, ld->layer, bpos, p->n_heads, batch);
 
-        // residual connection back into x
-        accum(prog, s, x, s->xb2, dim);
+            // final matmul to get the output of the attention
+            profile_stage(STAGE_WO, l, bpos, batch);
+            matmul_trans_vec4(prog, s, s->xb2, s->xb, w->wo, w->wo_s, ld->wo, batch);
 
-        // ffn rmsnorm
-        rmsnorm(prog, s, s->xb, x, w->rms_ffn_weight, dim, l * dim);
+            // residual connection back into x, the padding of the rows is 0 on both sides
+            accum(prog, s, x, s->xb2, batch * w->dim_vec4);
 
-        // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
-        // first calculate self.w1(x) and self.w3(x)
-        matmul_trans_vec4(prog, s, s->hb, s->xb, w->w1, w->hidden_dim_vec4, dim, 0, l * dim * w->hidden_dim_vec4);
-        matmul_trans_vec4(prog, s, s->hb2, s->xb, w->w3, w->hidden_dim_vec4, dim, 0, l * dim * w->hidden_dim_vec4);
-
-        // 1. F.silu; silu(x)=x*σ(x),where σ(x) is the logistic sigmoid
-        // 2. elementwise multiply with w3(x)
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, s->hb);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, s->hb2);
-        glUseProgram(prog->shader_transformer_silu_and_mulW3);
-        glDispatchCompute(hidden_dim, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-        GPU_CHECK();
+            // ffn rmsnorm
+            profile_stage(STAGE_RMSNORM, l, bpos, batch);
+            rmsnorm(prog, s, s->xb, x, w->rms_ffn_weight, ld->rms_ffn, batch);
 
-        // final matmul to get the output of the ffn
-        matmul(prog, s, s->xb, s->hb, w->w2, hidden_dim, dim, 0, l * dim * hidden_dim);
+            // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+            profile_stage(STAGE_FFN, l, bpos, batch);
+            matmul_swiglu(prog, s, s->hb, s->xb, w->w13, w->w13_s, ld->w13, batch);
 
-        // residual connection
-        accum(prog, s, x, s->xb, dim);
-    }
+            // final matmul to get the output of the ffn
+            matmul(prog, s, s->xb, s->hb, w->w2, w->w2_s, ld->w2, batch);
 
-    // final rmsnorm
-    rmsnorm(prog, s, x, x, w->rms_final_weight, dim, 0);
+            // residual connection
+            accum(prog, s, x, s->xb, batch * w->dim_vec4);
+        }
 
-    // classifier into logits
-    matmul(prog, s, s->logits, x, w->wcls, p->dim, p->vocab_size, 0, 0);
+        // the rest of the layers on the host, only their kv cache is needed
+        if (s->host != NULL) {
+            host_forward(s, w, bpos, batch, 0);
+        }
+        profile_token(batch, 1);
+    }
 }
 
 // ----------------------------------------------------------------------------
-// byte pair encoding (BPE) tokenizer, encodes strings into tokens so we can prompt
+// session files: the kv cache of the sequence together with its tokens, in the format
+// of run.c so that a session can be resumed by either of them. a header, the tokens,
+// then the keys and the values (layer, n_pos, kv_dim) of the n_pos positions in the
+// kv cache
+
+#define SESSION_MAGIC 0x6e736573  // "sesn" in ASCII
+#define SESSION_VERSION 2
+#define SESSION_HEADER_SIZE 64
+
+typedef struct {
+    uint32_t magic;
+    int version;
+    Config config;
+    int n_pos;     // positions in the kv cache
+    int n_tokens;  // tokens that follow the header
+    int64_t checkpoint_size;  // the checkpoint the kv cache was computed with
+    uint64_t checkpoint_hash;
+} SessionHeader;
+
+size_t kv_cache_offset(Config* p, int l, int pos) {
+    // offset in values of position pos of layer l in the (page, layer, KV_PAGE_SIZE, kv_dim) kv cache
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    return (((size_t)(pos / KV_PAGE_SIZE) * p->n_layers + l) * KV_PAGE_SIZE + pos % KV_PAGE_SIZE) * kv_dim;
+}
 
-int str_lookup(char* str, char** vocab, int vocab_size) {
-    // find the first perfect match for str in vocab, return its index or -1 if not found
-    for (int i = 0; i < vocab_size; i++) {
-        if (strcmp(str, vocab[i]) == 0) {
-            return i;
+void upload_kv_rows(RunState* s, GLuint cache, size_t offset, const float* rows, size_t n, uint16_t* scratch) {
+    // write n values of a session at value offset of a kv cache, rounded to fp16 in scratch for an fp16 one
+    const void* data = rows;
+    if (s->kv_f16) {
+        for (size_t i = 0; i < n; i++) {
+            scratch[i] = fp32_to_fp16(rows[i]);
         }
+        data = scratch;
     }
-    return -1;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cache);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset * s->kv_bytes, n * s->kv_bytes, data);
 }
 
-void bpe_encode(char* text, char** vocab, float* vocab_scores, int vocab_size, unsigned int max_token_length, int* tokens, int* n_tokens) {
-    // a temporary buffer to merge two consecutive tokens
-    char* str_buffer = (char*)malloc((max_token_length * 2 + 1) * sizeof(char));  // *2 for concat, +1 for null terminator
-
-    // first encode every individual byte in the input string
-    *n_tokens = 0;  // the number of tokens
-    for (char* c = text; *c != '\0'; c++) {
-        sprintf(str_buffer, "%c", *c);
-        int id = str_lookup(str_buffer, vocab, vocab_size);
-        if (id == -1) {
-            fprintf(stderr, "not good\n");
-            exit(EXIT_FAILURE);
-        }
-        tokens[*n_tokens] = id;
-        (*n_tokens)++;
-    }
-
-    // merge the best consecutive pair each iteration, according the scores in vocab_scores
-    while (1) {
-        float best_score = -1e10;
-        int best_id = -1;
-        int best_idx = -1;
-
-        for (int i = 0; i < (*n_tokens - 1); i++) {
-            // check if we can merge the pair (tokens[i], tokens[i+1])
-            sprintf(str_buffer, "%s%s", vocab[tokens[i]], vocab[tokens[i + 1]]);
-            int id = str_lookup(str_buffer, vocab, vocab_size);
-            if (id != -1 && vocab_scores[id] > best_score) {
-                // this merge pair exists in vocab! record its score and position
-                best_score = vocab_scores[id];
-                best_id = id;
-                best_idx = i;
-            }
+int load_session(char* path, Config* p, RunState* s, char* checkpoint, size_t checkpoint_size, int** tokens,
+                 int* n_tokens) {
+    // upload the kv cache in path and return its positions, the tokens come back in a
+    // malloced array. returns -1 when there is no session in path yet
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+    SessionHeader header;
+    int valid = fread(&header, sizeof(header), 1, file) == 1;
+    fseek(file, 0, SEEK_END);
+    size_t file_size = ftell(file);
+    fclose(file);
+    if (!valid || header.magic != SESSION_MAGIC || header.version != SESSION_VERSION) {
+        fprintf(stderr, "%s is not a session file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(&header.config, p, sizeof(Config)) != 0 || header.checkpoint_size != (int64_t)checkpoint_size ||
+        header.checkpoint_hash != checkpoint_hash(checkpoint, checkpoint_size)) {
+        fprintf(stderr, "%s was made with another model\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // the header is a session of this model, its sizes can be checked against the file
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t kv_size = (size_t)2 * p->n_layers * header.n_pos * kv_dim * sizeof(float);
+    if (header.n_pos < 0 || header.n_pos > p->seq_len || header.n_tokens < header.n_pos ||
+        header.n_tokens > header.n_pos + 1 ||
+        file_size != SESSION_HEADER_SIZE + header.n_tokens * sizeof(int) + kv_size) {
+        fprintf(stderr, "%s is corrupted\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // memory map the session and upload it a page of a layer at a time
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "open failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    char* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "mmap failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    *n_tokens = header.n_tokens;
+    *tokens = (int*)malloc((header.n_tokens + 1) * sizeof(int));
+    memcpy(*tokens, data + SESSION_HEADER_SIZE, header.n_tokens * sizeof(int));
+    float* keys = (float*)(data + SESSION_HEADER_SIZE + header.n_tokens * sizeof(int));
+    float* values = keys + (size_t)p->n_layers * header.n_pos * kv_dim;
+    kv_reserve(s, p, header.n_pos);
+    uint16_t* scratch = (uint16_t*)malloc(sizeof(uint16_t) * KV_PAGE_SIZE * kv_dim);
+    for (int l = 0; l < p->n_layers; l++) {
+        for (int pos = 0; pos < header.n_pos; pos += KV_PAGE_SIZE) {
+            int rows = header.n_pos - pos < KV_PAGE_SIZE ? header.n_pos - pos : KV_PAGE_SIZE;
+            size_t row = (size_t)l * header.n_pos + pos;
+            size_t offset = kv_cache_offset(p, l, pos);
+            size_t n = (size_t)rows * kv_dim;
+            upload_kv_rows(s, s->key_cache, offset, keys + row * kv_dim, n, scratch);
+            upload_kv_rows(s, s->value_cache, offset, values + row * kv_dim, n, scratch);
         }
+    }
+    GPU_CHECK();
+    free(scratch);
+    munmap(data, file_size);
+    close(fd);
+    return header.n_pos;
+}
 
-        if (best_idx == -1) {
-            break;  // we couldn't find any more pairs to merge, so we're done
+void save_session(char* path, Config* p, RunState* s, char* checkpoint, size_t checkpoint_size, int* tokens,
+                  int n_tokens, int n_pos) {
+    // read back positions 0..n_pos of the kv cache and write them to path with tokens[0..n_tokens)
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    SessionHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SESSION_MAGIC;
+    header.version = SESSION_VERSION;
+    header.config = *p;
+    header.n_pos = n_pos;
+    header.n_tokens = n_tokens;
+    header.checkpoint_size = checkpoint_size;
+    header.checkpoint_hash = checkpoint_hash(checkpoint, checkpoint_size);
+    char* tmp_path = (char*)malloc(strlen(path) + 8);
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "wb");
+    char header_block[SESSION_HEADER_SIZE] = {0};  // the header, zero padded
+    memcpy(header_block, &header, sizeof(header));
+    int ok = file != NULL && fwrite(header_block, SESSION_HEADER_SIZE, 1, file) == 1 &&
+             fwrite(tokens, sizeof(int), n_tokens, file) == (size_t)n_tokens;
+    // make the shader writes to the kv cache visible to the mapping
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    GLuint caches[2] = {s->key_cache, s->value_cache};
+    GLuint lens[2] = {s->key_cache_len, s->value_cache_len};
+    float* scratch = (float*)malloc(sizeof(float) * KV_PAGE_SIZE * kv_dim);  // a page of an fp16 cache in fp32
+    for (int v = 0; v < 2 && ok; v++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, caches[v]);
+        char* cache = (char*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, lens[v], GL_MAP_READ_BIT);
+        GPU_CHECK();
+        ok = cache != NULL;
+        for (int l = 0; l < p->n_layers && ok; l++) {
+            for (int pos = 0; pos < n_pos && ok; pos += KV_PAGE_SIZE) {
+                int rows = n_pos - pos < KV_PAGE_SIZE ? n_pos - pos : KV_PAGE_SIZE;
+                size_t n = (size_t)rows * kv_dim;
+                char* ptr = cache + kv_cache_offset(p, l, pos) * s->kv_bytes;
+                const float* values = (const float*)ptr;
+                if (s->kv_f16) {
+                    const uint16_t* halves = (const uint16_t*)ptr;
+                    for (size_t i = 0; i < n; i++) {
+                        scratch[i] = fp16_to_fp32(halves[i]);
+                    }
+                    values = scratch;
+                }
+                ok = fwrite(values, sizeof(float), n, file) == n;
+            }
         }
-
-        // merge the consecutive pair (best_idx, best_idx+1) into new token best_id
-        tokens[best_idx] = best_id;
-        // delete token at position best_idx+1, shift the entire sequence back 1
-        for (int i = best_idx + 1; i < (*n_tokens - 1); i++) {
-            tokens[i] = tokens[i + 1];
+        if (cache != NULL) {
+            glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
         }
-        (*n_tokens)--;  // token length decreased
     }
-
-    free(str_buffer);
+    free(scratch);
+    if (file) {
+        ok = fclose(file) == 0 && ok;
+    }
+    if (ok) {
+        remove(path);  // rename does not replace an existing file on windows
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "couldn't write %s\n", path);
+        remove(tmp_path);
+    }
+    free(tmp_path);
 }
 
 // ----------------------------------------------------------------------------
@@ -1663,109 +3613,226 @@ float random_f32() {  // random float32 in [0,1)
 }
 
 // ----------------------------------------------------------------------------
-// sampling can be done in a few ways: greedy argmax, sampling, top-p sampling
-
-int argmax(GPUProgram* prog, RunState* state, GLuint probabilities_gpu, int n) {
-    // return the index that has the highest probability
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, probabilities_gpu);
-    float* probabilities = (float*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0,
-                                                    n * sizeof(float), GL_MAP_READ_BIT);
-    GPU_CHECK();
-    int max_i = 0;
-    float max_p;
-    if (probabilities) {
-        max_p = probabilities[0];
-        for (int i = 1; i < n; i++) {
-            if (probabilities[i] > max_p) {
-                max_i = i;
-                max_p = probabilities[i];
-            }
-        }
+// sampling can be done in a few ways: greedy argmax, sampling, top-k, min-p and top-p
+// sampling. all of them run on the GPU, see shader_argmax and shader_sample
+
+void sample(GPUProgram* prog, RunState* state, int n, float temperature, float topp, int topk,
+            float minp) {
+    // sample the next token from the logits on the GPU into sample_result. it stays there
+    // for transformer(SAMPLED_TOKEN, ...), read_sample() brings the token id back
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, state->logits);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, state->sample_result);
+    if (temperature == 0.0f) {
+        // greedy argmax sampling: take the token with the highest probability
+        glUseProgram(prog->shader_argmax);
+        glUniform1i(prog->argmax_n, n);
+    } else {
+        // temperature, softmax, top-k, min-p and top-p (nucleus) sampling in a single
+        // dispatch, topk = 0, minp = 0 and topp <= 0 turn the filters off
+        glUseProgram(prog->shader_sample);
+        glUniform1i(prog->sample_n, n);
+        glUniform1f(prog->sample_temperature, temperature);
+        glUniform1f(prog->sample_topp, topp);
+        glUniform1i(prog->sample_topk, topk);
+        glUniform1f(prog->sample_minp, minp);
+        glUniform1f(prog->sample_coin, random_f32());
     }
-    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
     GPU_CHECK();
 
-    //printf("max_i=%d,max_p=%f\n", max_i, max_p);
-    return max_i;
+    // read back from a copy, so that mapping it waits for the sampler only and not for
+    // the forward pass queued behind it on sample_result
+    glBindBuffer(GL_COPY_READ_BUFFER, state->sample_result);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, state->sample_readback);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(int));
+    GPU_CHECK();
 }
 
-int sample(GPUProgram* prog, RunState* state, GLuint probabilities_gpu, int n) {
-    // sample index from probabilities (they must sum to 1!)
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, probabilities_gpu);
-    float* probabilities = (float*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0,
-                                                    n * sizeof(float), GL_MAP_READ_BIT);
+int read_sample(RunState* state, int n) {
+    // the token id of the last sample()
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, state->sample_readback);
+    int* token = (int*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, sizeof(int), GL_MAP_READ_BIT);
     GPU_CHECK();
-    int res = n - 1;
-    if (probabilities) {
-        float r = random_f32();
-        float cdf = 0.0f;
-        for (int i = 0; i < n; i++) {
-            cdf += probabilities[i];
-            if (r < cdf) {
-                res = i;
-                break;
-            }
-        }
-    }
+    int res = token ? *token : n - 1;
     glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-
     return res;
 }
 
-int compare(const void* a, const void* b) {
-    ProbIndex* a_ = (ProbIndex*)a;
-    ProbIndex* b_ = (ProbIndex*)b;
-    if (a_->prob > b_->prob)
-        return -1;
-    if (a_->prob < b_->prob)
-        return 1;
+// ----------------------------------------------------------------------------
+// benchmark: -m bench times prefill and decode apart, on the same synthetic tokens in
+// every run, with the same report as run.c so that the engines can be compared. the
+// decode steps are pipelined like in the main loop, a step is the time between two
+// tokens coming back. GLES can't query the memory in use, the peak of the buffers
+// allocated through create_GPU_buffer is reported instead
+
+#define BENCH_RUNS 5         // measured runs of every prompt length, the median is reported
+#define BENCH_MAX_POINTS 16  // max prompt lengths and decode positions
+
+typedef struct {
+    float temperature;
+    float topp;
+    int topk;
+    float minp;
+} SamplerParams;
+
+int parse_list(char* str, int* values, int max_values) {
+    // parse a comma separated list of non-negative ints, return their number or -1
+    int n = 0;
+    char* c = str;
+    while (*c != '\0') {
+        char* end;
+        long v = strtol(c, &end, 10);
+        if (end == c || v < 0 || n == max_values || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        values[n++] = (int)v;
+        c = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+long peak_rss_kb() {
+    // peak resident set size of the process, 0 where it is not known
+#if defined _WIN32
     return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined __APPLE__
+    return usage.ru_maxrss / 1024;  // in bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+void print_json_string(const char* str) {
+    printf("\"");
+    for (const char* c = str; *c != '\0'; c++) {
+        printf(*c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    }
+    printf("\"");
 }
 
-int sample_topp(GPUProgram* prog, RunState* state, GLuint probabilities_gpu, int n, float topp, ProbIndex* probindex) {
-    // top-p sampling (or "nucleus sampling") samples from the smallest set of
-    // tokens that exceed probability topp. This way we never sample tokens that
-    // have very low probabilities and are less likely to go "off the rails".
+double bench_prefill(int* tokens, int n_tokens, Config* p, GPUProgram* prog, RunState* s,
+                     TransformerWeights_gpu* w, SamplerParams* sp) {
+    // time to first token of a prompt of n_tokens, in us: the prefill of all but the
+    // last, then the forward pass and the sample of the last, until the token is back
+    glFinish();
+    double start = time_in_us();
+    if (n_tokens > 1) {
+        transformer_prefill(tokens, n_tokens - 1, 0, p, prog, s, w);
+    }
+    transformer(tokens[n_tokens - 1], n_tokens - 1, p, prog, s, w);
+    sample(prog, s, p->vocab_size, sp->temperature, sp->topp, sp->topk, sp->minp);
+    read_sample(s, p->vocab_size);
+    return time_in_us() - start;
+}
 
-    // quicksort indices in descending order of probabilities
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, probabilities_gpu);
-    float* probabilities = (float*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0,
-                                                    n * sizeof(float), GL_MAP_READ_BIT);
-    GPU_CHECK();
-    int res = n - 1;
-    if (probabilities) {
-        for (int i = 0; i < n; i++) {
-            probindex[i].index = i;
-            probindex[i].prob = probabilities[i];
+void bench_decode(int* tokens, int pos, int steps, double* latency, Config* p, GPUProgram* prog, RunState* s,
+                  TransformerWeights_gpu* w, SamplerParams* sp) {
+    // fill the kv cache up to pos, then time each of steps decode steps from there, in us
+    if (pos > 0) {
+        transformer_prefill(tokens, pos, 0, p, prog, s, w);
+    }
+    glFinish();
+    double last = time_in_us();
+    transformer(tokens[pos], pos, p, prog, s, w);
+    for (int i = 0; i < steps; i++) {
+        sample(prog, s, p->vocab_size, sp->temperature, sp->topp, sp->topk, sp->minp);
+        if (i + 1 < steps) {
+            transformer(SAMPLED_TOKEN, pos + i + 1, p, prog, s, w);
         }
-        qsort(probindex, n, sizeof(ProbIndex), compare);
+        read_sample(s, p->vocab_size);
+        double now = time_in_us();
+        latency[i] = now - last;
+        last = now;
+    }
+}
 
-        // truncate the list where cumulative probability exceeds topp
-        float cumulative_prob = 0.0f;
-        int last_idx = 0;
-        for (int i = 0; i < n; i++) {
-            cumulative_prob += probindex[i].prob;
-            if (cumulative_prob > topp) {
-                last_idx = i;
-                break;  // we've exceeded topp by including last_idx
-            }
-        }
+void bench(char* checkpoint_path, char* lengths_str, char* positions_str, int steps, int warmup, Config* p,
+           GPUProgram* prog, RunState* s, TransformerWeights_gpu* w, SamplerParams* sp) {
+    int lengths[BENCH_MAX_POINTS];
+    int positions[BENCH_MAX_POINTS];
+    int n_lengths = parse_list(lengths_str, lengths, BENCH_MAX_POINTS);
+    int n_positions = parse_list(positions_str, positions, BENCH_MAX_POINTS);
+    if (n_lengths < 0 || n_positions < 0) {
+        fprintf(stderr, "-l and -o take up to %d comma separated numbers\n", BENCH_MAX_POINTS);
+        exit(EXIT_FAILURE);
+    }
+    // the prompt: BOS, then a fixed pseudo-random sequence of the regular tokens
+    int* tokens = (int*)malloc(p->seq_len * sizeof(int));
+    double* latency = (double*)malloc((p->seq_len > BENCH_RUNS ? p->seq_len : BENCH_RUNS) * sizeof(double));
+    if (!tokens || !latency) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    tokens[0] = 1;
+    for (int i = 1; i < p->seq_len; i++) {
+        tokens[i] = 3 + (int)((i * 7919LL) % (p->vocab_size - 3));
+    }
 
-        // sample from the truncated list
-        float r = random_f32() * cumulative_prob;
-        float cdf = 0.0f;
-        for (int i = 0; i <= last_idx; i++) {
-            cdf += probindex[i].prob;
-            if (r < cdf) {
-                res = probindex[i].index;
-                break;
-            }
+    // warmup: upload the weights, compile the shaders in the driver and grow the kv cache
+    int warmup_len = 1;
+    if (n_lengths > 0 && lengths[0] > 0) {
+        warmup_len = lengths[0] < p->seq_len ? lengths[0] : p->seq_len;
+    }
+    int warmup_steps = p->seq_len < 8 ? p->seq_len : 8;
+    for (int i = 0; i < warmup; i++) {
+        bench_prefill(tokens, warmup_len, p, prog, s, w, sp);
+        bench_decode(tokens, 0, warmup_steps, latency, p, prog, s, w, sp);
+    }
+
+    printf("{\n  \"backend\": \"gpu\",\n  \"variant\": ");
+    print_json_string((const char*)glGetString(GL_RENDERER));
+    printf(",\n  \"threads\": 1,\n  \"checkpoint\": ");
+    print_json_string(checkpoint_path);
+    printf(",\n  \"dim\": %d,\n  \"n_layers\": %d,\n  \"gpu_layers\": %d,\n  \"seq_len\": %d,\n  \"warmup\": %d,\n",
+           p->dim, p->n_layers, s->n_layers, p->seq_len, warmup);
+
+    // prefill, the median of BENCH_RUNS runs of each prompt length
+    printf("  \"prefill\": [");
+    for (int i = 0; i < n_lengths; i++) {
+        int len = lengths[i] < 1 ? 1 : (lengths[i] > p->seq_len ? p->seq_len : lengths[i]);
+        for (int r = 0; r < BENCH_RUNS; r++) {
+            latency[r] = bench_prefill(tokens, len, p, prog, s, w, sp);
         }
-        res = probindex[last_idx].index;  // in case of rounding errors
+        qsort(latency, BENCH_RUNS, sizeof(double), compare_doubles);
+        double ttft = percentile(latency, BENCH_RUNS, 0.5);
+        printf("%s\n    {\"prompt_tokens\": %d, \"ttft_ms\": %.4f, \"tokens_per_s\": %.2f}", i > 0 ? "," : "", len,
+               ttft / 1000.0, len / ttft * 1e6);
     }
-    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    printf("\n  ],\n");
+
+    // decode, every step from each position separately
+    printf("  \"decode\": [");
+    int n_printed = 0;
+    for (int i = 0; i < n_positions; i++) {
+        int pos = positions[i];
+        int n = pos + steps < p->seq_len ? steps : p->seq_len - pos;
+        if (n <= 0) {
+            fprintf(stderr, "skipping decode at position %d, seq_len is %d\n", pos, p->seq_len);
+            continue;
+        }
+        bench_decode(tokens, pos, n, latency, p, prog, s, w, sp);
+        double total = 0.0;
+        for (int j = 0; j < n; j++) {
+            total += latency[j];
+        }
+        qsort(latency, n, sizeof(double), compare_doubles);
+        printf("%s\n    {\"pos\": %d, \"tokens\": %d, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p99_ms\": %.4f, "
+               "\"max_ms\": %.4f, \"tokens_per_s\": %.2f}",
+               n_printed++ > 0 ? "," : "", pos, n, total / n / 1000.0, percentile(latency, n, 0.5) / 1000.0,
+               percentile(latency, n, 0.99) / 1000.0, latency[n - 1] / 1000.0, n / total * 1e6);
+    }
+    printf("\n  ],\n  \"peak_rss_mb\": %.1f,\n  \"peak_gpu_mb\": %.1f\n}\n", peak_rss_kb() / 1024.0,
+           gpu_memory.peak / (1024.0 * 1024.0));
 
-    return res;
+    free(tokens);
+    free(latency);
 }
 
 // ----------------------------------------------------------------------------
@@ -1777,9 +3844,21 @@ void error_usage() {
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -t <float>  temperature, default 1.0\n");
     fprintf(stderr, "  -p <float>  p value in top-p (nucleus) sampling. default 0.9, 0 = off\n");
+    fprintf(stderr, "  -j <int>    k value in top-k sampling, default 0 = off\n");
+    fprintf(stderr, "  -u <float>  p value in min-p sampling in [0,1], default 0 = off\n");
     fprintf(stderr, "  -s <int>    random seed, default time(NULL)\n");
     fprintf(stderr, "  -n <int>    number of steps to run for, default 256. 0 = max_seq_len\n");
     fprintf(stderr, "  -i <string> input prompt\n");
+    fprintf(stderr, "  -k <string> (optional) session file, the kv cache is resumed from it and saved to it at exit\n");
+    fprintf(stderr, "  -x <int>    sliding window: attend to the last <int> positions only and run past seq_len, default 0 = off\n");
+    fprintf(stderr, "  -a <int>    attention sinks: first positions the sliding window keeps, default 4\n");
+    fprintf(stderr, "  -v <int>    layers kept in GPU memory, the rest run on the CPU, default -1 = as many as fit\n");
+    fprintf(stderr, "  -r <int>    1 = keep the transposed weights in <checkpoint>.gpu and upload them from there, default 0\n");
+    fprintf(stderr, "  -q <int>    kv cache precision, 16 (fp16) or 32, default 16 for fp16 checkpoints, 32 otherwise\n");
+    fprintf(stderr, "  -m <string> mode: generate|bench, default: generate\n");
+    fprintf(stderr, "  -l <string> prompt lengths to time in bench mode, comma separated, default 16,64,256\n");
+    fprintf(stderr, "  -o <string> positions to time -n decode steps from in bench mode, default 0,64,192\n");
+    fprintf(stderr, "  -w <int>    warmup iterations in bench mode, default 2\n");
     exit(EXIT_FAILURE);
 }
 
@@ -1788,9 +3867,21 @@ int main(int argc, char* argv[]) {
     char* checkpoint = NULL;              // e.g. out/model.bin
     float temperature = 1.0f;             // 0.0 = greedy deterministic. 1.0 = original. don't set higher
     float topp = 0.9f;                    // top-p in nucleus sampling
+    int topk = 0;                         // top-k sampling, 0 = off
+    float minp = 0.0f;                    // min-p sampling, 0 = off
     rng_seed = (unsigned int)time(NULL);  // seed rng with time by default
     int steps = 256;                      // number of steps to run for
     char* prompt = NULL;                  // prompt string
+    char* session_path = NULL;            // the (optional) file the session is resumed from and saved to
+    int keep_layout = 0;                  // keep the transposed weights in <checkpoint>.gpu (see map_layout)
+    int kv_bits = 0;                      // kv cache precision, 0 = that of the weights
+    char* mode = "generate";              // generate|bench
+    char* bench_lengths = "16,64,256";    // prompt lengths timed by bench
+    char* bench_positions = "0,64,192";   // positions bench times the decode steps from
+    int warmup = 2;                       // warmup iterations of bench
+    int kv_window = 0;                    // sliding window of attended positions, 0 = off
+    int kv_sinks = 4;                     // first positions the sliding window keeps
+    int gpu_layers = -1;                  // layers on the GPU, the rest on the host. -1 = as many as fit
 
     // poor man's C argparse so we can override the defaults above from the command line
     if (argc >= 2) {
@@ -1814,12 +3905,44 @@ int main(int argc, char* argv[]) {
             temperature = atof(argv[i + 1]);
         } else if (argv[i][1] == 'p') {
             topp = atof(argv[i + 1]);
+        } else if (argv[i][1] == 'j') {
+            topk = atoi(argv[i + 1]);
+        } else if (argv[i][1] == 'u') {
+            minp = atof(argv[i + 1]);
         } else if (argv[i][1] == 's') {
             rng_seed = atoi(argv[i + 1]);
         } else if (argv[i][1] == 'n') {
             steps = atoi(argv[i + 1]);
         } else if (argv[i][1] == 'i') {
             prompt = argv[i + 1];
+        } else if (argv[i][1] == 'k') {
+            session_path = argv[i + 1];
+        } else if (argv[i][1] == 'x') {
+            kv_window = atoi(argv[i + 1]);
+        } else if (argv[i][1] == 'a') {
+            kv_sinks = atoi(argv[i + 1]);
+        } else if (argv[i][1] == 'v') {
+            gpu_layers = atoi(argv[i + 1]);
+        } else if (argv[i][1] == 'r') {
+            keep_layout = atoi(argv[i + 1]);
+        } else if (argv[i][1] == 'q') {
+            kv_bits = atoi(argv[i + 1]);
+            if (kv_bits != 16 && kv_bits != 32) {
+                fprintf(stderr, "-q has to be 16 or 32\n");
+                error_usage();
+            }
+        } else if (argv[i][1] == 'm') {
+            mode = argv[i + 1];
+            if (strcmp(mode, "generate") != 0 && strcmp(mode, "bench") != 0) {
+                fprintf(stderr, "unknown mode: %s\n", mode);
+                error_usage();
+            }
+        } else if (argv[i][1] == 'l') {
+            bench_lengths = argv[i + 1];
+        } else if (argv[i][1] == 'o') {
+            bench_positions = argv[i + 1];
+        } else if (argv[i][1] == 'w') {
+            warmup = atoi(argv[i + 1]);
         } else {
             error_usage();
         }
@@ -1828,6 +3951,29 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "Cannot use seed=0 because of the rng alg used\n");
         return 1;
     }
+    if (topk < 0) {
+        topk = 0;
+    }
+    if (minp < 0.0 || 1.0 < minp) {
+        minp = 0.0;
+    }
+    if (warmup < 0) {
+        warmup = 0;
+    }
+    if (kv_window < 0) {
+        kv_window = 0;
+    }
+    if (kv_sinks < 0) {
+        kv_sinks = 0;
+    }
+    if (session_path != NULL && kv_window > 0) {
+        fprintf(stderr, "-k is not supported with -x\n");
+        error_usage();
+    }
+    if (session_path != NULL && strcmp(mode, "bench") == 0) {
+        fprintf(stderr, "-k is not supported in bench mode\n");
+        error_usage();
+    }
 
     // read in the model.bin file
     GPUContext context;
@@ -1843,13 +3989,53 @@ int main(int argc, char* argv[]) {
             fprintf(stderr, "Couldn't open file %s\n", checkpoint);
             return 1;
         }
-        // read in the config header
-        if (fread(&config, sizeof(Config), 1, file) != 1) {
+        // version 1, 2 and 3 checkpoints start with a magic number, "ak42" in ASCII
+        uint32_t magic;
+        if (fread(&magic, sizeof(uint32_t), 1, file) != 1) {
             return 1;
         }
-        // negative vocab size is hacky way of signaling unshared weights. bit yikes.
-        int shared_weights = config.vocab_size > 0 ? 1 : 0;
-        config.vocab_size = abs(config.vocab_size);
+        int version = 0;
+        int shared_weights;
+        int group_size = 0;  // 0 = fp32 weights, otherwise the Q8_0 group size
+        size_t header_size;
+        if (magic == 0x616b3432) {
+            if (fread(&version, sizeof(int), 1, file) != 1) {
+                return 1;
+            }
+            if (version != 1 && version != 2 && version != 3) {
+                fprintf(stderr, "unsupported checkpoint version %d\n", version);
+                return 1;
+            }
+            if (fread(&config, sizeof(Config), 1, file) != 1) {
+                return 1;
+            }
+            uint8_t shared_classifier;
+            if (fread(&shared_classifier, sizeof(uint8_t), 1, file) != 1) {
+                return 1;
+            }
+            shared_weights = shared_classifier;
+            if (version == 2) {
+                if (fread(&group_size, sizeof(int), 1, file) != 1) {
+                    return 1;
+                }
+                // the scales of the transposed matrices are indexed per group of dim
+                if (group_size <= 0 || config.dim % group_size != 0 || config.hidden_dim % group_size != 0) {
+                    fprintf(stderr, "invalid group size %d\n", group_size);
+                    return 1;
+                }
+            }
+            header_size = 256;
+        } else {
+            // legacy version 0 checkpoint, the header is just the Config
+            rewind(file);
+            if (fread(&config, sizeof(Config), 1, file) != 1) {
+                return 1;
+            }
+            // negative vocab size is hacky way of signaling unshared weights. bit yikes.
+            shared_weights = config.vocab_size > 0 ? 1 : 0;
+            config.vocab_size = abs(config.vocab_size);
+            header_size = sizeof(Config);
+        }
         // figure out the file size
         fseek(file, 0, SEEK_END);  // move file pointer to end of file
         file_size = ftell(file);   // get the file size, in bytes
@@ -1865,104 +4051,151 @@ int main(int argc, char* argv[]) {
             fprintf(stderr, "mmap failed!\n");
             return 1;
         }
-        float* weights_ptr = data + sizeof(Config) / sizeof(float);
-        checkpoint_init_weights(&weights, &config, weights_ptr, shared_weights);
+        void* weights_ptr = (char*)data + header_size;
+        if (version == 0) {
+            checkpoint_init_weights(&weights, &config, (float*)weights_ptr, shared_weights);
+        } else {
+            checkpoint_init_weights_v1(&weights, &config, weights_ptr, shared_weights, group_size, version == 3);
+        }
+    }
+    // without a sliding window we cannot run for more than config.seq_len steps
+    if (kv_window > 0 && (kv_window > config.seq_len || kv_window <= kv_sinks)) {
+        fprintf(stderr, "-x has to be at most seq_len %d, and more than -a\n", config.seq_len);
+        return 1;
     }
-    // right now we cannot run for more than config.seq_len steps
-    if (steps <= 0 || steps > config.seq_len) {
+    if (steps <= 0 || (kv_window == 0 && steps > config.seq_len)) {
         steps = config.seq_len;
     }
 
-    // read in the tokenizer.bin file
-    char** vocab = (char**)malloc(config.vocab_size * sizeof(char*));
-    float* vocab_scores = (float*)malloc(config.vocab_size * sizeof(float));
-    unsigned int max_token_length;
-    {
-        FILE* file = fopen("tokenizer.bin", "rb");
-        if (!file) {
-            fprintf(stderr, "couldn't load tokenizer.bin\n");
-            return 1;
-        }
-        if (fread(&max_token_length, sizeof(int), 1, file) != 1) {
-            fprintf(stderr, "failed read\n");
-            return 1;
-        }
-        int len;
-        for (int i = 0; i < config.vocab_size; i++) {
-            if (fread(vocab_scores + i, sizeof(float), 1, file) != 1) {
-                fprintf(stderr, "failed read\n");
-                return 1;
-            }
-            if (fread(&len, sizeof(int), 1, file) != 1) {
-                fprintf(stderr, "failed read\n");
-                return 1;
-            }
-            vocab[i] = (char*)malloc(len + 1);
-            if (fread(vocab[i], len, 1, file) != 1) {
-                fprintf(stderr, "failed read\n");
-                return 1;
-            }
-            vocab[i][len] = '\0';  // add the string terminating token
-        }
-        fclose(file);
-    }
+    // read in the tokenizer.bin file, see tokenizer.h
+    Tokenizer tokenizer;
+    build_tokenizer(&tokenizer, "tokenizer.bin", config.vocab_size);
 
     // create and init the application RunState
     GPUProgram prog;
-    compile_GPUProgram(&prog);
+    int kv_f16 = kv_bits == 0 ? weights.f16 : kv_bits == 16;
+    compile_GPUProgram(&prog, weights.group_size, weights.f16, kv_f16, config.dim / config.n_heads);
+    init_profiler();  // per-stage timing, if LLAMA2_PROFILE or LLAMA2_TRACE ask for it
+    // only the first gpu_layers layers go up, the host runs the rest
+    if (gpu_layers < 0) {
+        gpu_layers = choose_gpu_layers(&config, &weights, kv_f16, kv_window);
+    }
+    if (gpu_layers > config.n_layers) {
+        gpu_layers = config.n_layers;
+    }
+    if (gpu_layers < config.n_layers && session_path != NULL) {
+        fprintf(stderr, "-k is not supported with layers on the CPU, see -v\n");
+        return 1;
+    }
     TransformerWeights_gpu weights_remote;
-    upload_weights(&weights, &weights_remote, &config);
+    upload_weights(&weights, &weights_remote, &config, gpu_layers);
+    if (keep_layout) {
+        map_layout(&weights_remote, checkpoint, (char*)data, file_size);
+    }
     RunState state;
-    malloc_run_state(&state, &config);
+    malloc_run_state(&state, &config, kv_f16, gpu_layers);
+    if (kv_window > 0) {
+        set_kv_window(&state, kv_window, kv_sinks);
+    }
+    if (gpu_layers < config.n_layers) {
+        build_host_layers(&state, &config, &weights, gpu_layers);
+        fprintf(stderr, "%d of %d layers on the GPU, the rest on the CPU\n", gpu_layers, config.n_layers);
+    }
+    record_dispatch_params(&state, &config, &weights_remote);
+
+    if (strcmp(mode, "bench") == 0) {
+        SamplerParams sp = {temperature, topp, topk, minp};
+        bench(checkpoint, bench_lengths, bench_positions, steps, warmup, &config, &prog, &state, &weights_remote, &sp);
+        write_profile("gpu");
+        free_host_layers(state.host);
+        free_run_state(&state);
+        free_gpu_weight(&weights_remote);
+        free_gpu_program(&prog);
+        free(weights.freq_cis_alloc);
+        free_tokenizer(&tokenizer);
+        if (data != MAP_FAILED)
+            munmap(data, file_size);
+        if (fd != -1)
+            close(fd);
+        release_GPUContext(&context);
+        return 0;
+    }
+
+    // resume the session, if there is one: its kv cache is restored and the steps count
+    // from where it stopped
+    int pos = 0;  // position in the sequence
+    int n_history = 0;
+    int* history = NULL;
+    if (session_path != NULL) {
+        pos = load_session(session_path, &config, &state, (char*)data, file_size, &history, &n_history);
+    }
+    if (pos < 0) {
+        pos = 0;
+    }
+    if (kv_window == 0) {
+        steps = pos + steps < config.seq_len ? pos + steps : config.seq_len;
+    }
 
-    // process the prompt, if any
-    int* prompt_tokens = NULL;
+    // the tokens of the sequence: those of the session, or BOS (=1) as done in Llama-2
+    // sentencepiece tokenizer, followed by the prompt and then the sampled tokens
+    size_t prompt_len = prompt != NULL ? strlen(prompt) : 0;
+    int* prompt_tokens = (int*)malloc((n_history + prompt_len + steps + 2) * sizeof(int));
     int num_prompt_tokens = 0;
+    if (n_history > 0) {
+        memcpy(prompt_tokens, history, n_history * sizeof(int));
+        num_prompt_tokens = n_history;
+    } else {
+        prompt_tokens[num_prompt_tokens++] = 1;
+    }
     if (prompt != NULL) {
-        prompt_tokens = (int*)malloc(strlen(prompt) * sizeof(int));
-        bpe_encode(prompt, vocab, vocab_scores, config.vocab_size, max_token_length, prompt_tokens, &num_prompt_tokens);
+        int n = 0;
+        encode(&tokenizer, prompt, 0, 0, prompt_tokens + num_prompt_tokens, &n);
+        num_prompt_tokens += n;
+    }
+    if (num_prompt_tokens < pos + 1) {
+        fprintf(stderr, "%s needs a prompt to continue with\n", session_path);
+        return 1;
+    }
+
+    // prefill: all tokens but the last go through the model in batches, their logits
+    // are not needed because the next token is forced anyway
+    int num_prefill = num_prompt_tokens - 1 < steps - 1 ? num_prompt_tokens - 1 : steps - 1;
+    if (num_prefill > pos) {
+        transformer_prefill(prompt_tokens + pos, num_prefill - pos, pos, &config, &prog, &state, &weights_remote);
+        for (; pos < num_prefill; pos++) {
+            safe_printf(decode(&tokenizer, prompt_tokens[pos], prompt_tokens[pos + 1]));
+        }
+        fflush(stdout);
     }
 
     // start the main loop
-    long start = 0;  // used to time our code, only initialized after first iteration
-    int next;        // will store the next token in the sequence
-    int token = 1;   // init with token 1 (=BOS), as done in Llama-2 sentencepiece tokenizer
-    int pos = 0;     // position in the sequence
+    long start = 0;     // used to time our code, only initialized after first iteration
+    int start_pos = 0;  // position at which the timer was started
+    int next;           // will store the next token in the sequence
+    int token = prompt_tokens[pos];  // kick off with the first token not yet in the kv cache
+    int queued = 0;                  // 1 = the forward pass at pos is on its way already
     while (pos < steps) {
         // forward the transformer to get logits for the next token
-        transformer(token, pos, &config, &prog, &state, &weights_remote);
+        if (!queued) {
+            transformer(token, pos, &config, &prog, &state, &weights_remote);
+        }
+        queued = 0;
 
         // advance the state state machine
-        if (pos < num_prompt_tokens) {
+        if (pos < num_prompt_tokens - 1) {
             // if we are still processing the input prompt, force the next prompt token
-            next = prompt_tokens[pos];
+            next = prompt_tokens[pos + 1];
         } else {
-            // sample the next token
-            if (temperature == 0.0f) {
-                // greedy argmax sampling: take the token with the highest probability
-                next = argmax(&prog, &state, state.logits, config.vocab_size);
-            } else {
-                // apply the temperature to the logits
-                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, state.logits);
-                glUseProgram(prog.shader_temperature);
-                int temperature_gpu = glGetUniformLocation(prog.shader_temperature, "temperature");
-                glUniform1f(temperature_gpu, temperature);
-                glDispatchCompute(config.vocab_size, 1, 1);
-                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-                GPU_CHECK();
-
-                // apply softmax to the logits to get the probabilities for next token
-                softmax(&prog, &state, state.logits, config.vocab_size, 1);
-                // we sample from this distribution to get the next token
-                if (topp <= 0) {
-                    // simply sample from the predicted probability distribution
-                    next = sample(&prog, &state, state.logits, config.vocab_size);
-                } else {
-                    // top-p (nucleus) sampling, clamping the least likely tokens to zero
-                    next = sample_topp(&prog, &state, state.logits, config.vocab_size, topp, state.probindex);
-                }
+            // sample the next token, and queue the forward pass that feeds it before its id
+            // comes back, so that the GPU is not left waiting on the host in between
+            sample(&prog, &state, config.vocab_size, temperature, topp, topk, minp);
+            if (pos + 1 < steps) {
+                transformer(SAMPLED_TOKEN, pos + 1, &config, &prog, &state, &weights_remote);
+                queued = 1;
             }
+            next = read_sample(&state, config.vocab_size);
         }
+        prompt_tokens[pos + 1] = next;
         pos++;
 
         // data-dependent terminating condition: the BOS (1) token delimits sequences
@@ -1970,36 +4203,42 @@ int main(int argc, char* argv[]) {
             break;
         }
 
-        // following BOS (1) token, sentencepiece decoder strips any leading whitespace (see PR #89)
-        char* token_str = (token == 1 && vocab[next][0] == ' ') ? vocab[next] + 1 : vocab[next];
-        printf("%s", token_str);
+        // the piece as run.c prints it: raw byte tokens become their byte, unprintable ones are skipped
+        safe_printf(decode(&tokenizer, token, next));
         fflush(stdout);
         token = next;
 
         // init the timer here because the first iteration can be slower
         if (start == 0) {
             start = time_in_ms();
+            start_pos = pos;
         }
     }
     printf("\n");
 
-    // report achieved tok/s (pos-1 because the timer starts after first iteration)
-    if (pos > 1) {
+    // report achieved tok/s (the timer starts after the first transformer() iteration)
+    if (start != 0 && pos > start_pos) {
         long end = time_in_ms();
-        fprintf(stderr, "achieved tok/s: %f\n", (pos - 1) / (double)(end - start) * 1000);
+        fprintf(stderr, "achieved tok/s: %f\n", (pos - start_pos) / (double)(end - start) * 1000);
     }
 
+    // the kv cache holds positions 0..pos, the token at pos is the one to feed next
+    if (session_path != NULL) {
+        save_session(session_path, &config, &state, (char*)data, file_size, prompt_tokens, pos + 1, pos);
+    }
+
+    // write out the per-stage timings, if profiling
+    write_profile("gpu");
+
     // memory and file handles cleanup
+    free_host_layers(state.host);
     free_run_state(&state);
     free_gpu_weight(&weights_remote);
     free_gpu_program(&prog);
-    for (int i = 0; i < config.vocab_size; i++) {
-        free(vocab[i]);
-    }
-    free(vocab);
-    free(vocab_scores);
-    if (prompt_tokens != NULL)
-        free(prompt_tokens);
+    free(weights.freq_cis_alloc);
+    free_tokenizer(&tokenizer);
+    free(prompt_tokens);
+    free(history);
     if (data != MAP_FAILED)
         munmap(data, file_size);
     if (fd != -1)
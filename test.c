@@ -1,5 +1,6 @@
 #define TESTING
 #include "run.c"
+#include <sys/wait.h>
 
 void assert_eq(int a, int b) {
     if (a != b) {
@@ -8,6 +9,560 @@ void assert_eq(int a, int b) {
     }
 }
 
+void assert_true(int ok, char* what) {
+    if (!ok) {
+        printf("Assertion failed: %s\n", what);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// the sampling filters against a full sort of the vocabulary
+
+void fill_logits(float* logits, int n, int kind, unsigned long long* seed) {
+    // kind 0: random, 1: five levels (large bands of tied tokens), 2: all tied, 3: one
+    // token far above the rest, 4 and on: 20 * kind - 40 tied tokens above the rest. the
+    // mass of such a band summed as its count times its probability rounds above or below
+    // the sum of its tokens, depending on the count
+    for (int i = 0; i < n; i++) {
+        float r = random_f32(seed);
+        logits[i] = kind == 0 ? 8.0f * r - 4.0f : kind == 1 ? floorf(5.0f * r) : kind == 2 ? 0.0f : kind == 3 ? 0.1f * r : -4.0f * r;
+    }
+    if (kind == 3) { logits[random_u32(seed) % n] += 10.0f; }
+    int band = kind >= 4 ? 20 * kind - 40 : 0;
+    for (int i = 0; i < band; i++) { logits[i * (n / band)] = 2.0f; }
+}
+
+int reference_candidates(ProbIndex* out, float* exps, float sum, int n, int topk, float topp, float minp) {
+    // the candidates by the definition: all tokens sorted by probability and then id, cut
+    // after k, before the first one below minp times the largest probability, and after
+    // the first one that takes the mass of the full distribution past topp
+    for (int i = 0; i < n; i++) {
+        out[i].prob = exps[i] / sum;
+        out[i].index = i;
+    }
+    qsort(out, n, sizeof(ProbIndex), compare);
+    int count = topk > 0 && topk < n ? topk : n;
+    if (minp > 0.0f) {
+        int kept = 0;
+        while (kept < n && out[kept].prob >= minp * out[0].prob) { kept++; }
+        if (kept < count) { count = kept; }
+    }
+    if (topp > 0.0f && topp < 1.0f) {
+        float cumulative_prob = 0.0f;
+        for (int i = 0; i < n; i++) {
+            cumulative_prob += out[i].prob;
+            if (cumulative_prob > topp) {
+                if (i + 1 < count) { count = i + 1; }
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+void check_candidates(float* logits, int n, float temperature, int topk, float topp, float minp) {
+    // sampler_candidates keeps the same tokens, in the same order, as the full sort. tokens
+    // tied with the last one kept may be other ones of the tie
+    Sampler sampler;
+    build_sampler(&sampler, n, temperature, topp, topk, minp, 1);
+    float* exps = malloc(n * sizeof(float));
+    ProbIndex* expected = malloc(n * sizeof(ProbIndex));
+    memcpy(exps, logits, n * sizeof(float));
+    float sum = kernels.sum_exp(exps, sampler_temperature(&sampler, exps), n);
+    int n_expected = reference_candidates(expected, exps, sum, n, topk, topp, minp);
+    int n0 = sampler_candidates(&sampler, exps, sum);
+    #if VERBOSITY == 1
+    printf("n %d k %d p %g min-p %g: %d candidates, expected %d\n", n, topk, topp, minp, n0, n_expected);
+    #endif
+    assert_eq(n0, n_expected);
+    float last = expected[n_expected - 1].prob;
+    char* seen = calloc(n, 1);
+    for (int i = 0; i < n0; i++) {
+        ProbIndex* c = &sampler.probindex[i];
+        assert_true(c->prob == expected[i].prob && c->prob == exps[c->index] / sum, "candidate probability");
+        if (c->prob != last) { assert_eq(c->index, expected[i].index); }
+        assert_true(!seen[c->index], "candidate twice");
+        seen[c->index] = 1;
+    }
+    free(seen);
+    free(exps);
+    free(expected);
+    free_sampler(&sampler);
+}
+
+void check_selects(float* logits, int n) {
+    // select_topk moves the k most likely to the front, select_nucleus at least the nucleus
+    ProbIndex* a = malloc(n * sizeof(ProbIndex));
+    ProbIndex* sorted = malloc(n * sizeof(ProbIndex));
+    float* exps = malloc(n * sizeof(float));
+    float max_val = -INFINITY;
+    for (int i = 0; i < n; i++) { if (logits[i] > max_val) { max_val = logits[i]; } }
+    memcpy(exps, logits, n * sizeof(float));
+    float sum = kernels.sum_exp(exps, max_val, n);
+    reference_candidates(sorted, exps, sum, n, 0, 0.0f, 0.0f);
+    int ks[] = { 1, 2, 10, n / 2, n - 1, n };
+    for (int j = 0; j < 6; j++) {
+        int k = ks[j];
+        for (int i = 0; i < n; i++) { a[i].prob = exps[i] / sum; a[i].index = i; }
+        select_topk(a, n, k);
+        qsort(a, k, sizeof(ProbIndex), compare);
+        for (int i = 0; i < k; i++) { assert_true(a[i].prob == sorted[i].prob, "select_topk front"); }
+        for (int i = k; i < n; i++) { assert_true(a[i].prob <= a[k - 1].prob, "select_topk back"); }
+    }
+    // top-p values, among them the exact mass of the tokens tied with the most likely one:
+    // only the next token takes the mass past it, so select_nucleus has to keep that one
+    // although it sums the band as its count times its probability
+    float band = 0.0f;
+    for (int i = 0; i < n && sorted[i].prob == sorted[0].prob; i++) { band += sorted[i].prob; }
+    float topps[] = { 0.1f, 0.5f, 0.9f, 0.999f, band };
+    for (int j = 0; j < 5; j++) {
+        if (topps[j] >= 1.0f) { continue; }
+        for (int i = 0; i < n; i++) { a[i].prob = exps[i] / sum; a[i].index = i; }
+        int m = select_nucleus(a, n, topps[j]);
+        int nucleus = reference_candidates(sorted, exps, sum, n, 0, topps[j], 0.0f);
+        assert_true(m >= nucleus, "select_nucleus keeps the nucleus");
+        qsort(a, m, sizeof(ProbIndex), compare);
+        for (int i = 0; i < m; i++) { assert_true(a[i].prob == sorted[i].prob, "select_nucleus front"); }
+        for (int i = m; i < n; i++) { assert_true(a[i].prob <= a[m - 1].prob, "select_nucleus back"); }
+    }
+    free(a);
+    free(sorted);
+    free(exps);
+}
+
+void test_sampler_filters() {
+    // top-k, top-p and min-p, alone and together, on random logits, on bands of tied tokens
+    // and with k at or past the vocab size
+    init_kernels();
+    unsigned long long seed = 42;
+    int sizes[] = { 1000, 32000 };
+    for (int s = 0; s < 2; s++) {
+        int n = sizes[s];
+        float* logits = malloc(n * sizeof(float));
+        for (int kind = 0; kind < 10; kind++) {
+            fill_logits(logits, n, kind, &seed);
+            check_selects(logits, n);
+            int topks[] = { 0, 1, 3, 50, n - 1, n, n + 10 };
+            float topps[] = { 0.0f, 0.3f, 0.9f, 0.999f };
+            float minps[] = { 0.0f, 0.02f, 0.5f, 1.0f }; // 1: only the tokens tied with the most likely one
+            for (int k = 0; k < 7; k++) {
+                for (int p = 0; p < 4; p++) {
+                    for (int m = 0; m < 4; m++) {
+                        check_candidates(logits, n, 0.8f, topks[k], topps[p], minps[m]);
+                    }
+                }
+            }
+        }
+        free(logits);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// tiny checkpoints with random weights, for the tests of the forward pass and the kv cache
+
+Config test_config = { 32, 64, 2, 4, 2, 64, 64 }; // dim, hidden_dim, layers, heads, kv heads, vocab, seq_len
+
+void write_checkpoint(char* path, Config* p, unsigned long long seed, float tweak) {
+    // a legacy version 0 checkpoint with a shared classifier. a nonzero tweak is added to
+    // the last weight of w2, in the middle of the file, e.g. to make a checkpoint that
+    // differs from another one in a single weight
+    int head_size = p->dim / p->n_heads;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t tail = (size_t)p->n_layers * p->dim * p->hidden_dim + p->dim + (size_t)p->seq_len * head_size; // w3 and after
+    size_t n = (size_t)p->vocab_size * p->dim + 2 * p->n_layers * p->dim + 2 * (size_t)p->n_layers * p->dim * p->dim
+               + 2 * (size_t)p->n_layers * p->dim * kv_dim + 2 * (size_t)p->n_layers * p->dim * p->hidden_dim + tail;
+    float* w = malloc(n * sizeof(float));
+    for (size_t i = 0; i < n; i++) { w[i] = random_f32(&seed) - 0.5f; }
+    w[n - tail - 1] += tweak;
+    FILE* file = fopen(path, "wb");
+    assert_true(file != NULL && fwrite(p, sizeof(Config), 1, file) == 1 && fwrite(w, sizeof(float), n, file) == n
+                && fclose(file) == 0, "write_checkpoint");
+    free(w);
+}
+
+int forward_greedy(Transformer* t, int* tokens, int pos, int end) {
+    // forward tokens[pos], ... and append the most likely next token up to position end,
+    // returns the position after the last one forwarded
+    for (; pos < end; pos++) {
+        float* logits = forward(t, tokens[pos], pos);
+        tokens[pos + 1] = sample_argmax(logits, t->config.vocab_size);
+    }
+    return pos;
+}
+
+#define REFERENCE_POSITIONS 300 // positions reference_forward keeps keys and values for
+
+void reference_matmul(double* out, float* w, double* x, int n, int d) {
+    for (int i = 0; i < d; i++) {
+        out[i] = 0.0;
+        for (int j = 0; j < n; j++) { out[i] += (double)w[(size_t)i * n + j] * x[j]; }
+    }
+}
+
+void reference_rmsnorm(double* out, double* x, float* weight, int n) {
+    double ss = 0.0;
+    for (int j = 0; j < n; j++) { ss += x[j] * x[j]; }
+    ss = 1.0 / sqrt(ss / n + 1e-5);
+    for (int j = 0; j < n; j++) { out[j] = weight[j] * ss * x[j]; }
+}
+
+int reference_attends(int t, int pos, int window, int sinks) {
+    // the positions a token at pos sees: all of 0..pos, or with a sliding window the first
+    // sinks positions and the last window - sinks ones
+    return t <= pos && (window == 0 || t < sinks || t > pos - (window - sinks));
+}
+
+void reference_forward(Transformer* tf, double* keys, double* values, int token, int pos, int window, int sinks,
+                       double* logits) {
+    // the forward pass in double precision and without a kv cache layout: keys and values
+    // (layer, position, kv_dim) hold every position so far, the window is a mask over them
+    Config* p = &tf->config;
+    TransformerWeights* w = &tf->weights;
+    int dim = p->dim, hidden_dim = p->hidden_dim, head_size = dim / p->n_heads;
+    int kv_dim = (dim * p->n_kv_heads) / p->n_heads;
+    double x[64], xb[64], q[64], att[64], h1[128], h3[128]; // enough for test_config
+    for (int i = 0; i < dim; i++) { x[i] = w->token_embedding_table.f[(size_t)token * dim + i]; }
+    for (int l = 0; l < p->n_layers; l++) {
+        size_t loff = (size_t)l * dim * dim;
+        size_t kvoff = (size_t)l * dim * kv_dim;
+        double* k = keys + ((size_t)l * REFERENCE_POSITIONS + pos) * kv_dim;
+        double* v = values + ((size_t)l * REFERENCE_POSITIONS + pos) * kv_dim;
+        reference_rmsnorm(xb, x, w->rms_att_weight + l * dim, dim);
+        reference_matmul(q, w->wq.f + loff, xb, dim, dim);
+        reference_matmul(k, w->wk.f + kvoff, xb, dim, kv_dim);
+        reference_matmul(v, w->wv.f + kvoff, xb, dim, kv_dim);
+        // RoPE at the absolute position, pair i / 2 of a head turns with 10000^(-i / head_size)
+        for (int i = 0; i < dim; i += 2) {
+            double angle = pos * pow(10000.0, -(double)(i % head_size) / head_size);
+            double c = cos(angle), s = sin(angle);
+            double q0 = q[i], q1 = q[i + 1];
+            q[i] = q0 * c - q1 * s;
+            q[i + 1] = q0 * s + q1 * c;
+            if (i < kv_dim) {
+                double k0 = k[i], k1 = k[i + 1];
+                k[i] = k0 * c - k1 * s;
+                k[i + 1] = k0 * s + k1 * c;
+            }
+        }
+        for (int h = 0; h < p->n_heads; h++) {
+            int kv_off = (h / (p->n_heads / p->n_kv_heads)) * head_size;
+            double max_score = -INFINITY, sum = 0.0;
+            double* scores = malloc((pos + 1) * sizeof(double));
+            for (int t = 0; t <= pos; t++) {
+                double* kt = keys + ((size_t)l * REFERENCE_POSITIONS + t) * kv_dim + kv_off;
+                scores[t] = 0.0;
+                for (int i = 0; i < head_size; i++) { scores[t] += q[h * head_size + i] * kt[i]; }
+                scores[t] /= sqrt(head_size);
+                if (reference_attends(t, pos, window, sinks) && scores[t] > max_score) { max_score = scores[t]; }
+            }
+            for (int i = 0; i < head_size; i++) { att[h * head_size + i] = 0.0; }
+            for (int t = 0; t <= pos; t++) {
+                if (!reference_attends(t, pos, window, sinks)) { continue; }
+                double e = exp(scores[t] - max_score);
+                sum += e;
+                double* vt = values + ((size_t)l * REFERENCE_POSITIONS + t) * kv_dim + kv_off;
+                for (int i = 0; i < head_size; i++) { att[h * head_size + i] += e * vt[i]; }
+            }
+            for (int i = 0; i < head_size; i++) { att[h * head_size + i] /= sum; }
+            free(scores);
+        }
+        reference_matmul(xb, w->wo.f + loff, att, dim, dim);
+        for (int i = 0; i < dim; i++) { x[i] += xb[i]; }
+        reference_rmsnorm(xb, x, w->rms_ffn_weight + l * dim, dim);
+        reference_matmul(h1, w->w1.f + (size_t)l * dim * hidden_dim, xb, dim, hidden_dim);
+        reference_matmul(h3, w->w3.f + (size_t)l * dim * hidden_dim, xb, dim, hidden_dim);
+        for (int i = 0; i < hidden_dim; i++) { h1[i] = h1[i] / (1.0 + exp(-h1[i])) * h3[i]; }
+        reference_matmul(xb, w->w2.f + (size_t)l * hidden_dim * dim, h1, hidden_dim, dim);
+        for (int i = 0; i < dim; i++) { x[i] += xb[i]; }
+    }
+    reference_rmsnorm(xb, x, w->rms_final_weight, dim);
+    reference_matmul(logits, w->wcls.f, xb, dim, p->vocab_size);
+}
+
+void test_sliding_window() {
+    // forward with a window of 12 positions, 3 of them sinks, runs to position 300, past
+    // seq_len (64), the ring of kv rows (43) and the RoPE table (256). its logits are those
+    // of the reference, which keeps every position and masks out the evicted ones
+    char* model = "test_model.bin";
+    write_checkpoint(model, &test_config, 7, 0.0f);
+    int window = 12, sinks = 3;
+    Transformer t;
+    build_transformer(&t, model, 1);
+    set_kv_window(&t.state, window, sinks);
+    int kv_dim = (test_config.dim * test_config.n_kv_heads) / test_config.n_heads;
+    double* keys = malloc((size_t)test_config.n_layers * REFERENCE_POSITIONS * kv_dim * sizeof(double));
+    double* values = malloc((size_t)test_config.n_layers * REFERENCE_POSITIONS * kv_dim * sizeof(double));
+    double expected[64];
+    unsigned long long seed = 5;
+    double max_err = 0.0;
+    for (int pos = 0; pos < REFERENCE_POSITIONS; pos++) {
+        int token = random_u32(&seed) % test_config.vocab_size;
+        float* logits = forward(&t, token, pos);
+        reference_forward(&t, keys, values, token, pos, window, sinks, expected);
+        for (int i = 0; i < test_config.vocab_size; i++) {
+            double err = fabs(logits[i] - expected[i]);
+            if (err > max_err) { max_err = err; }
+        }
+    }
+    #if VERBOSITY == 1
+    printf("sliding window: max logit error %g\n", max_err);
+    #endif
+    assert_true(max_err < 1e-4, "logits with a sliding window");
+    free(keys);
+    free(values);
+    free_transformer(&t);
+    remove(model);
+}
+
+void test_int8_kv() {
+    // the int8 kv cache: a row comes back within half a step of its head's scale, the
+    // attention over int8 rows is that over the rows as they come back, and it stays close
+    // to the attention over the fp32 rows
+    char* model = "test_model.bin";
+    write_checkpoint(model, &test_config, 7, 0.0f);
+    Config* p = &test_config;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int head_size = p->dim / p->n_heads;
+    int n_pos = 40;
+    Transformer t32, t8;
+    build_transformer(&t32, model, 1);
+    build_transformer(&t8, model, 1);
+    t8.state.kv_int8 = 1;
+    kv_reserve(&t32.state, p, 0, n_pos);
+    kv_reserve(&t8.state, p, 0, n_pos);
+    unsigned long long seed = 3;
+    float row[64], back[64];
+    for (int l = 0; l < p->n_layers; l++) {
+        for (int pos = 0; pos < n_pos; pos++) {
+            for (int v = 0; v < 2; v++) {
+                // a fifth of the heads are all zero, the others spread over different scales
+                for (int i = 0; i < kv_dim; i++) {
+                    int head = i / head_size;
+                    float scale = (pos + head) % 5 == 0 ? 0.0f : 0.1f * (1 + (pos + head) % 7);
+                    row[i] = scale * (2.0f * random_f32(&seed) - 1.0f);
+                }
+                kv_put(&t32.state, p, 0, l, pos, v, row);
+                kv_put(&t8.state, p, 0, l, pos, v, row);
+                kv_get(&t8.state, p, 0, l, pos, v, back);
+                for (int h = 0; h < p->n_kv_heads; h++) {
+                    float wmax = 0.0f;
+                    for (int i = h * head_size; i < (h + 1) * head_size; i++) { wmax = fmaxf(wmax, fabsf(row[i])); }
+                    for (int i = h * head_size; i < (h + 1) * head_size; i++) {
+                        assert_true(fabsf(back[i] - row[i]) <= 0.5f * wmax / 127.0f * 1.0001f, "int8 kv round trip");
+                        assert_true(wmax > 0.0f || back[i] == 0.0f, "int8 kv zero head");
+                    }
+                }
+            }
+        }
+    }
+    // attention of a query head over positions 0..pos of layer 1
+    float q[64], xb32[64], xb8[64], qs;
+    int8_t qq[64];
+    double max_err = 0.0, max_out = 0.0;
+    for (int pos = 0; pos < n_pos; pos++) {
+        for (int h = 0; h < p->n_heads; h++) {
+            int kv_off = (h / (p->n_heads / p->n_kv_heads)) * head_size;
+            for (int i = 0; i < head_size; i++) { q[i] = 4.0f * random_f32(&seed) - 2.0f; }
+            quantize(qq, &qs, q, head_size, head_size);
+            attention(xb32, q, NULL, NULL, &t32.state, p, 0, 1, kv_off, pos, kv_dim, head_size);
+            attention(xb8, q, qq, &qs, &t8.state, p, 0, 1, kv_off, pos, kv_dim, head_size);
+            // the same in double precision over the int8 rows and query as they come back
+            double scores[64], sum = 0.0, max_score = -INFINITY;
+            for (int t = 0; t <= pos; t++) {
+                kv_get(&t8.state, p, 0, 1, t, 0, back);
+                scores[t] = 0.0;
+                for (int i = 0; i < head_size; i++) { scores[t] += (double)qq[i] * qs * back[kv_off + i]; }
+                scores[t] /= sqrt(head_size);
+                if (scores[t] > max_score) { max_score = scores[t]; }
+            }
+            double expected[64] = { 0.0 };
+            for (int t = 0; t <= pos; t++) {
+                double e = exp(scores[t] - max_score);
+                sum += e;
+                kv_get(&t8.state, p, 0, 1, t, 1, back);
+                for (int i = 0; i < head_size; i++) { expected[i] += e * back[kv_off + i]; }
+            }
+            for (int i = 0; i < head_size; i++) {
+                assert_true(fabs(xb8[i] - expected[i] / sum) < 1e-5, "int8 attention");
+                max_err = fmax(max_err, fabs(xb8[i] - xb32[i]));
+                max_out = fmax(max_out, fabs(xb32[i]));
+            }
+        }
+    }
+    #if VERBOSITY == 1
+    printf("int8 attention: max error %g, max output %g\n", max_err, max_out);
+    #endif
+    assert_true(max_err < 0.02 * max_out, "int8 attention against fp32");
+    free_transformer(&t32);
+    free_transformer(&t8);
+    remove(model);
+}
+
+void test_int8_session() {
+    // a session saved from an int8 kv cache holds the rows widened to fp32. an int8 run
+    // resumes it with the same greedy tokens as an uninterrupted int8 run, and an fp32 run
+    // gets exactly the rows the int8 cache had
+    char* model = "test_model.bin";
+    char* path = "test_session.kv";
+    write_checkpoint(model, &test_config, 7, 0.0f);
+    remove(path);
+    Config* p = &test_config;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int expected[42] = { 1, 5, 9 };
+    Transformer t, resumed_t, wide;
+    build_transformer(&t, model, 1);
+    t.state.kv_int8 = 1;
+    for (int pos = 0; pos < 2; pos++) { forward(&t, expected[pos], pos); }
+    int pos = forward_greedy(&t, expected, 2, 20);
+    save_session(&t, path, expected, pos + 1, pos);
+
+    build_transformer(&wide, model, 1);
+    build_transformer(&resumed_t, model, 1);
+    resumed_t.state.kv_int8 = 1;
+    int* tokens;
+    int n_tokens;
+    assert_eq(load_session(&wide, path, &tokens, &n_tokens), 20);
+    free(tokens);
+    assert_eq(load_session(&resumed_t, path, &tokens, &n_tokens), 20);
+    float row[64], wide_row[64];
+    for (int l = 0; l < p->n_layers; l++) {
+        for (int t_pos = 0; t_pos < 20; t_pos++) {
+            for (int v = 0; v < 2; v++) {
+                kv_get(&t.state, p, 0, l, t_pos, v, row);
+                kv_get(&wide.state, p, 0, l, t_pos, v, wide_row);
+                assert_true(memcmp(row, wide_row, kv_dim * sizeof(float)) == 0, "int8 session in fp32");
+            }
+        }
+    }
+    forward_greedy(&t, expected, pos, 40);
+    int resumed[42];
+    memcpy(resumed, tokens, n_tokens * sizeof(int));
+    free(tokens);
+    forward_greedy(&resumed_t, resumed, 20, 40);
+    for (int i = 0; i <= 40; i++) { assert_eq(resumed[i], expected[i]); }
+    free_transformer(&t);
+    free_transformer(&resumed_t);
+    free_transformer(&wide);
+    remove(path);
+    remove(model);
+}
+
+void test_prefix_cache() {
+    // a prefix cache written by one run and read by the next restores the kv cache of the
+    // tokens it shares with a prompt, and the logits after it are those of an uninterrupted run
+    char* model = "test_model.bin";
+    char* other = "test_model2.bin";
+    char* path = "test_prefix.kv";
+    write_checkpoint(model, &test_config, 7, 0.0f);
+    write_checkpoint(other, &test_config, 7, 0.25f);
+    remove(path);
+    int vocab_size = test_config.vocab_size;
+    int tokens[40];
+    unsigned long long seed = 11;
+    for (int i = 0; i < 40; i++) { tokens[i] = random_u32(&seed) % vocab_size; }
+
+    Transformer t;
+    build_transformer(&t, model, 1);
+    PrefixCache cache;
+    build_prefix_cache(&cache, &t, path);
+    assert_eq(cache.n_entries, 0);
+    for (int pos = 0; pos < 30; pos++) { forward(&t, tokens[pos], pos); }
+    prefix_insert(&cache, &t, 0, tokens, 30);
+    float expected[64];
+    for (int pos = 30; pos < 40; pos++) { memcpy(expected, forward(&t, tokens[pos], pos), sizeof(expected)); }
+    free_prefix_cache(&cache, &t);
+    free_transformer(&t);
+
+    // a new run over the same tokens gets all 30 cached positions, with the same kv cache
+    build_transformer(&t, model, 1);
+    build_prefix_cache(&cache, &t, path);
+    assert_eq(cache.n_entries, 1);
+    assert_eq(prefix_lookup(&cache, &t, 0, tokens, 40), 30);
+    float* logits = NULL;
+    for (int pos = 30; pos < 40; pos++) { logits = forward(&t, tokens[pos], pos); }
+    assert_true(memcmp(logits, expected, sizeof(expected)) == 0, "logits after the cached prefix");
+    // a prompt that goes another way after 20 tokens only gets those
+    int changed[40];
+    memcpy(changed, tokens, sizeof(changed));
+    changed[20] = (changed[20] + 1) % vocab_size;
+    assert_eq(prefix_lookup(&cache, &t, 0, changed, 40), 20);
+    free_prefix_cache(&cache, &t);
+    free_transformer(&t);
+
+    // a checkpoint that differs in one weight in the middle ignores the file
+    build_transformer(&t, other, 1);
+    build_prefix_cache(&cache, &t, path);
+    assert_eq(cache.n_entries, 0);
+    free_prefix_cache(&cache, &t);
+    free_transformer(&t);
+    remove(path);
+    remove(model);
+    remove(other);
+}
+
+int session_load_fails(char* model, char* path) {
+    // whether load_session of path with checkpoint model exits with an error, in a child
+    // process since it exits
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        Transformer t;
+        build_transformer(&t, model, 1);
+        int* tokens;
+        int n_tokens;
+        load_session(&t, path, &tokens, &n_tokens);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE;
+}
+
+void test_session() {
+    // a session saved after 20 positions and resumed in a new run continues with the same
+    // greedy tokens as an uninterrupted run. it is refused with another checkpoint and
+    // when the file is cut short
+    char* model = "test_model.bin";
+    char* other = "test_model2.bin";
+    char* path = "test_session.kv";
+    write_checkpoint(model, &test_config, 7, 0.0f);
+    write_checkpoint(other, &test_config, 7, 0.25f);
+    remove(path);
+    int expected[42] = { 1, 5, 9 };
+    Transformer t;
+    build_transformer(&t, model, 1);
+    int* tokens;
+    int n_tokens;
+    assert_eq(load_session(&t, path, &tokens, &n_tokens), -1); // nothing saved yet
+    for (int pos = 0; pos < 2; pos++) { forward(&t, expected[pos], pos); }
+    int pos = forward_greedy(&t, expected, 2, 20);
+    save_session(&t, path, expected, pos + 1, pos);
+    forward_greedy(&t, expected, pos, 40);
+    free_transformer(&t);
+
+    build_transformer(&t, model, 1);
+    assert_eq(load_session(&t, path, &tokens, &n_tokens), 20);
+    assert_eq(n_tokens, 21);
+    int resumed[42];
+    memcpy(resumed, tokens, n_tokens * sizeof(int));
+    free(tokens);
+    forward_greedy(&t, resumed, 20, 40);
+    for (int i = 0; i <= 40; i++) { assert_eq(resumed[i], expected[i]); }
+    free_transformer(&t);
+
+    assert_true(session_load_fails(other, path), "session of another checkpoint");
+    FILE* file = fopen(path, "r+b");
+    assert_true(file != NULL && ftruncate(fileno(file), SESSION_HEADER_SIZE + 10) == 0 && fclose(file) == 0, "truncate");
+    assert_true(session_load_fails(model, path), "truncated session");
+    file = fopen(path, "wb");
+    assert_true(file != NULL && fwrite("sesn", 4, 1, file) == 1 && fclose(file) == 0, "short file");
+    assert_true(session_load_fails(model, path), "session shorter than its header");
+    remove(path);
+    remove(model);
+    remove(other);
+}
+
 void test_prompt_encoding(Tokenizer* tokenizer, char* prompt, int* expected_tokens, int num_expected_tokens) {
     // encode
     int* prompt_tokens = (int*)malloc((strlen(prompt)+3) * sizeof(int));
@@ -77,5 +632,11 @@ void test_prompt_encodings() {
 
 int main(int argc, char *argv[]) {
     test_prompt_encodings();
+    test_sampler_filters();
+    test_prefix_cache();
+    test_session();
+    test_sliding_window();
+    test_int8_kv();
+    test_int8_session();
     printf("ALL OK\n");
 }
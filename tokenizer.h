@@ -0,0 +1,297 @@
+// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens.
+// Shared by run.c and run_gpu.c, so that both engines tokenize a prompt the same way
+
+#ifndef _TOKENIZER_H_
+#define _TOKENIZER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdint.h>
+
+typedef struct {
+    float score; // score of the merged piece
+    int left;    // the pair of tokens it merges, as their positions in the initial tokens
+    int right;
+    int id;      // the merged piece
+} TokenMerge;
+
+typedef struct {
+    char** vocab;
+    float* vocab_scores;
+    int* vocab_lens;   // strlen of every piece
+    int* vocab_hash;   // open addressing hash table of the piece ids, -1 = empty slot
+    uint32_t hash_mask; // the table has hash_mask + 1 slots, a power of two
+    int vocab_size;
+    unsigned int max_token_length;
+    unsigned char byte_pieces[512]; // stores all single-byte strings
+    // scratch buffers of encode, grown to the longest text so far
+    int capacity;
+    int* prev; // the tokens being merged, as a linked list
+    int* next;
+    TokenMerge* merges; // max-heap of the candidate merges, 2 * capacity entries
+} Tokenizer;
+
+static inline uint32_t hash_piece(uint32_t h, const char* str, int len) {
+    // FNV-1a, can continue from the hash of a prefix of the piece
+    for (int i = 0; i < len; i++) { h = (h ^ (unsigned char)str[i]) * 16777619u; }
+    return h;
+}
+#define HASH_PIECE_INIT 2166136261u
+
+int str_lookup(Tokenizer* t, const char* a, int a_len, const char* b, int b_len) {
+    // find the piece that is the concatenation of a and b in vocab, return its index or -1 if
+    // not found. b can be empty, the pairs of merge candidates don't need to be copied together
+    uint32_t h = hash_piece(hash_piece(HASH_PIECE_INIT, a, a_len), b, b_len);
+    for (uint32_t i = h & t->hash_mask; ; i = (i + 1) & t->hash_mask) {
+        int id = t->vocab_hash[i];
+        if (id == -1) { return -1; }
+        if (t->vocab_lens[id] == a_len + b_len && memcmp(t->vocab[id], a, a_len) == 0
+            && memcmp(t->vocab[id] + a_len, b, b_len) == 0) {
+            return id;
+        }
+    }
+}
+
+void build_tokenizer(Tokenizer* t, char* tokenizer_path, int vocab_size) {
+    // i should have written the vocab_size into the tokenizer file... sigh
+    t->vocab_size = vocab_size;
+    // malloc space to hold the scores and the strings
+    t->vocab = (char**)malloc(vocab_size * sizeof(char*));
+    t->vocab_scores = (float*)malloc(vocab_size * sizeof(float));
+    t->vocab_lens = (int*)malloc(vocab_size * sizeof(int));
+    for (int i = 0; i < 256; i++) {
+        t->byte_pieces[i * 2] = (unsigned char)i;
+        t->byte_pieces[i * 2 + 1] = '\0';
+    }
+    // read in the file
+    FILE *file = fopen(tokenizer_path, "rb");
+    if (!file) { fprintf(stderr, "couldn't load %s\n", tokenizer_path); exit(EXIT_FAILURE); }
+    if (fread(&t->max_token_length, sizeof(int), 1, file) != 1) { fprintf(stderr, "failed read\n"); exit(EXIT_FAILURE); }
+    int len;
+    for (int i = 0; i < vocab_size; i++) {
+        if (fread(t->vocab_scores + i, sizeof(float), 1, file) != 1) { fprintf(stderr, "failed read\n"); exit(EXIT_FAILURE);}
+        if (fread(&len, sizeof(int), 1, file) != 1) { fprintf(stderr, "failed read\n"); exit(EXIT_FAILURE); }
+        t->vocab[i] = (char *)malloc(len + 1);
+        if (fread(t->vocab[i], len, 1, file) != 1) { fprintf(stderr, "failed read\n"); exit(EXIT_FAILURE); }
+        t->vocab[i][len] = '\0'; // add the string terminating token
+        t->vocab_lens[i] = len;
+    }
+    fclose(file);
+
+    // hash the pieces into a table at most half full, a piece that occurs twice keeps its lowest id
+    uint32_t slots = 1;
+    while (slots < 2u * vocab_size) { slots <<= 1; }
+    t->hash_mask = slots - 1;
+    t->vocab_hash = (int*)malloc(slots * sizeof(int));
+    for (uint32_t i = 0; i < slots; i++) { t->vocab_hash[i] = -1; }
+    for (int id = 0; id < vocab_size; id++) {
+        if (str_lookup(t, t->vocab[id], t->vocab_lens[id], t->vocab[id], 0) != -1) { continue; }
+        uint32_t i = hash_piece(HASH_PIECE_INIT, t->vocab[id], t->vocab_lens[id]) & t->hash_mask;
+        while (t->vocab_hash[i] != -1) { i = (i + 1) & t->hash_mask; }
+        t->vocab_hash[i] = id;
+    }
+
+    // the scratch buffers of encode are allocated by the first call
+    t->capacity = 0;
+    t->prev = NULL;
+    t->next = NULL;
+    t->merges = NULL;
+}
+
+void free_tokenizer(Tokenizer* t) {
+    for (int i = 0; i < t->vocab_size; i++) { free(t->vocab[i]); }
+    free(t->vocab);
+    free(t->vocab_scores);
+    free(t->vocab_lens);
+    free(t->vocab_hash);
+    free(t->prev);
+    free(t->next);
+    free(t->merges);
+}
+
+char* decode(Tokenizer* t, int prev_token, int token) {
+    char *piece = t->vocab[token];
+    // following BOS (1) token, sentencepiece decoder strips any leading whitespace (see PR #89)
+    if (prev_token == 1 && piece[0] == ' ') { piece++; }
+    // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
+    // parse this and convert and return the actual byte
+    unsigned char byte_val;
+    if (sscanf(piece, "<0x%02hhX>", &byte_val) == 1) {
+        piece = (char*)t->byte_pieces + byte_val * 2;
+    }
+    return piece;
+}
+
+void safe_printf(char *piece) {
+    // piece might be a raw byte token, and we only want to print printable chars or whitespace
+    // because some of the other bytes can be various control codes, backspace, etc.
+    if (piece == NULL) { return; }
+    if (piece[0] == '\0') { return; }
+    if (piece[1] == '\0') {
+        unsigned char byte_val = piece[0];
+        if (!(isprint(byte_val) || isspace(byte_val))) {
+            return; // bad byte, don't print it
+        }
+    }
+    printf("%s", piece);
+}
+
+static inline int merge_before(TokenMerge* a, TokenMerge* b) {
+    // the best scores merge first, and the leftmost pair of those, as a scan from the left would find
+    return a->score > b->score || (a->score == b->score && a->left < b->left);
+}
+
+void push_merge(Tokenizer* t, int* tokens, int left, int right, int* n_merges) {
+    // add the merge of the adjacent tokens left and right to the heap, if vocab has their pair
+    char* a = t->vocab[tokens[left]];
+    char* b = t->vocab[tokens[right]];
+    int id = str_lookup(t, a, t->vocab_lens[tokens[left]], b, t->vocab_lens[tokens[right]]);
+    if (id == -1) { return; }
+    TokenMerge m = { .score = t->vocab_scores[id], .left = left, .right = right, .id = id };
+    int i = (*n_merges)++;
+    while (i > 0 && merge_before(&m, &t->merges[(i - 1) / 2])) {
+        t->merges[i] = t->merges[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    t->merges[i] = m;
+}
+
+TokenMerge pop_merge(Tokenizer* t, int* n_merges) {
+    // remove the best merge from the heap
+    TokenMerge top = t->merges[0];
+    TokenMerge last = t->merges[--(*n_merges)];
+    int n = *n_merges;
+    int i = 0;
+    while (2 * i + 1 < n) {
+        int child = 2 * i + 1;
+        if (child + 1 < n && merge_before(&t->merges[child + 1], &t->merges[child])) { child++; }
+        if (!merge_before(&t->merges[child], &last)) { break; }
+        t->merges[i] = t->merges[child];
+        i = child;
+    }
+    t->merges[i] = last;
+    return top;
+}
+
+void encode(Tokenizer* t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens) {
+    // encode the string text (input) into an upper-bound preallocated tokens[] array
+    // bos != 0 means prepend the BOS token (=1), eos != 0 means append the EOS token (=2)
+    if (text == NULL) { fprintf(stderr, "cannot encode NULL text\n"); exit(EXIT_FAILURE); }
+
+    // every byte of the text becomes at most one token, +2 for BOS and the dummy prefix
+    size_t text_len = strlen(text);
+    if (text_len + 2 > (size_t)t->capacity) {
+        t->capacity = text_len + 2;
+        t->prev = (int*)realloc(t->prev, t->capacity * sizeof(int));
+        t->next = (int*)realloc(t->next, t->capacity * sizeof(int));
+        t->merges = (TokenMerge*)realloc(t->merges, 2 * t->capacity * sizeof(TokenMerge));
+        if (!t->prev || !t->next || !t->merges) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    }
+
+    // start at 0 tokens
+    *n_tokens = 0;
+
+    // add optional BOS (=1) token, if desired
+    if (bos) tokens[(*n_tokens)++] = 1;
+
+    // add_dummy_prefix is true by default
+    // so prepend a dummy prefix token to the input string, but only if text != ""
+    // TODO: pretty sure this isn't correct in the general case but I don't have the
+    // energy to read more of the sentencepiece code to figure out what it's doing
+    if (text[0] != '\0') {
+        int dummy_prefix = str_lookup(t, " ", 1, "", 0);
+        tokens[(*n_tokens)++] = dummy_prefix;
+    }
+
+    // Okay UTF-8 time. This will get messy. Here is the reference from Wikipedia:
+    // Code point ↔ UTF-8 conversion
+    // First code point	Last code point	Byte 1	Byte 2	Byte 3	Byte 4
+    // U+0000	U+007F	    0xxxxxxx
+    // U+0080	U+07FF	    110xxxxx	10xxxxxx
+    // U+0800	U+FFFF	    1110xxxx	10xxxxxx	10xxxxxx
+    // U+10000	U+10FFFF    11110xxx	10xxxxxx	10xxxxxx	10xxxxxx
+
+    // process the raw (UTF-8) byte sequence of the input string
+    char *str = text;  // the current codepoint is the str_len bytes at str
+    int str_len = 0;
+    for (char *c = text; *c != '\0'; c++) {
+
+        // reset buffer if the current byte is ASCII or a leading byte
+        // 0xC0 is 11000000, so (*c & 0xC0) keeps the first 2 bits and zeros the rest
+        // 0x80 is 10000000
+        // in UTF-8, all continuation bytes start with "10" in first two bits
+        // so in English this is: "if this byte is not a continuation byte"
+        if ((*c & 0xC0) != 0x80) {
+            // this byte must be either a leading byte (11...) or an ASCII char (0x...)
+            // => reset our location, as we're starting a new UTF-8 codepoint
+            str_len = 0;
+        }
+
+        // append the current byte to the codepoint
+        if (str_len == 0) { str = c; }
+        str_len++;
+
+        // while the next character is a continuation byte, continue appending
+        // but if there are too many of them, just stop at the longest codepoint
+        if ((*(c+1) & 0xC0) == 0x80 && str_len < 4) {
+            continue;
+        }
+
+        // ok c+1 is not a continuation byte, so we've read in a full codepoint
+        int id = str_lookup(t, str, str_len, str, 0);
+
+        if (id != -1) {
+            // we found this codepoint in vocab, add it as a token
+            tokens[(*n_tokens)++] = id;
+        } else {
+            // byte_fallback encoding: just encode each byte as a token
+            // +3 is here because the first 3 vocab elements are <unk>, <s>, </s>
+            // so the individual bytes only start at index 3
+            for (int i=0; i < str_len; i++) {
+                tokens[(*n_tokens)++] = (unsigned char)str[i] + 3;
+            }
+        }
+        str_len = 0; // protect against a sequence of stray UTF8 continuation bytes
+    }
+
+    // merge the best consecutive pair each time, according the scores in vocab_scores.
+    // the tokens form a linked list, and a heap holds the merges of all the adjacent pairs
+    // that vocab has. a merge replaces the two pairs around it with new ones, the heap
+    // entries it made stale are skipped when they come up. a merge is one heap operation
+    // instead of a rescan of every pair, and the heap never holds more than 2 * n_tokens
+    int n = *n_tokens;
+    int n_merges = 0;
+    for (int i = 0; i < n; i++) {
+        t->prev[i] = i - 1;
+        t->next[i] = i + 1 < n ? i + 1 : -1;
+    }
+    for (int i = 0; i + 1 < n; i++) { push_merge(t, tokens, i, i + 1, &n_merges); }
+    while (n_merges > 0) {
+        TokenMerge m = pop_merge(t, &n_merges);
+        // the left token has been merged away, or merged with its right neighbour already,
+        // or that neighbour has been merged with the one after it, i.e. it grew longer
+        if (tokens[m.left] == -1 || t->next[m.left] != m.right
+            || t->vocab_lens[tokens[m.left]] + t->vocab_lens[tokens[m.right]] != t->vocab_lens[m.id]) {
+            continue;
+        }
+        // merge the consecutive pair (left, right) into the new token id, and unlink right
+        tokens[m.left] = m.id;
+        tokens[m.right] = -1;
+        t->next[m.left] = t->next[m.right];
+        if (t->next[m.left] != -1) { t->prev[t->next[m.left]] = m.left; }
+        if (t->prev[m.left] != -1) { push_merge(t, tokens, t->prev[m.left], m.left, &n_merges); }
+        if (t->next[m.left] != -1) { push_merge(t, tokens, m.left, t->next[m.left], &n_merges); }
+    }
+    // close the gaps of the merged tokens
+    *n_tokens = 0;
+    for (int i = 0; i < n; i++) {
+        if (tokens[i] != -1) { tokens[(*n_tokens)++] = tokens[i]; }
+    }
+
+    // add optional EOS (=2) token, if desired
+    if (eos) tokens[(*n_tokens)++] = 2;
+}
+
+#endif // _TOKENIZER_H_